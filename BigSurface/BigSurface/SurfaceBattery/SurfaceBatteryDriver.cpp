@@ -15,6 +15,13 @@
 #define super IOService
 OSDefineMetaClassAndStructors(SurfaceBatteryDriver, IOService)
 
+static UInt64 getUptimeMS() {
+    UInt64 now, nsecs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &nsecs);
+    return nsecs / 1000000;
+}
+
 void SurfaceBatteryDriver::eventReceived(SurfaceBatteryNub *sender, SurfaceBatteryEventType type) {
     switch (type) {
         case SurfaceBatteryInformationChanged:
@@ -105,6 +112,8 @@ void SurfaceBatteryDriver::updateBatteryStatus(IOInterruptEventSource *sender, i
             BatteryManager::getShared()->updateBatteryTemperature(1, temp);
         BatteryManager::getShared()->informStatusChanged();
     }
+    evaluatePerformanceMode();
+    readBackPerformanceMode();
 
     if (quick_cnt) {
         if (--quick_cnt == 0)
@@ -196,6 +205,162 @@ void SurfaceBatteryDriver::pollBatteryStatus(IOTimerEventSource *sender) {
         updateBatteryStatus(nullptr, 0);
 }
 
+void SurfaceBatteryDriver::evaluatePerformanceMode() {
+    if (!awake || perf_policy == SurfacePerformancePolicyManual)
+        return;
+    
+    UInt32 level = 100;
+    IOSimpleLockLock(BatteryManager::getShared()->stateLock);
+    BatteryInfo::State &state = BatteryManager::getShared()->state.btInfo[0].state;
+    if (state.lastFullChargeCapacity)
+        level = state.remainingCapacity * 100 / state.lastFullChargeCapacity;
+    IOSimpleLockUnlock(BatteryManager::getShared()->stateLock);
+    
+    // Thresholds are split so that the mode does not flap around the boundary
+    if (low_battery ? level >= PERF_LOW_BATTERY_EXIT : level < PERF_LOW_BATTERY_ENTER)
+        low_battery = !low_battery;
+    UInt16 temp = 0;
+    if (nub->getTemperature(SSH_TEMP_SENSOR_SOC, &temp) == kIOReturnSuccess && temp) {
+        if (overheated ? temp <= PERF_HOT_EXIT : temp >= PERF_HOT_ENTER)
+            overheated = !overheated;
+    }
+    
+    UInt32 mode;
+    const char *reason;
+    if (power_connected) {
+        mode = perf_policy == SurfacePerformancePolicyBatterySaver ? PERF_MODE_RECOMMENDED : PERF_MODE_BEST;
+        reason = "AC";
+    } else {
+        switch (perf_policy) {
+            case SurfacePerformancePolicyPerformance:
+                mode = low_battery ? (level < PERF_CRITICAL_BATTERY ? PERF_MODE_BATTERY_SAVER : PERF_MODE_RECOMMENDED) : PERF_MODE_BETTER;
+                break;
+            case SurfacePerformancePolicyBatterySaver:
+                mode = PERF_MODE_BATTERY_SAVER;
+                break;
+            default:
+                mode = low_battery ? PERF_MODE_BATTERY_SAVER : PERF_MODE_RECOMMENDED;
+                break;
+        }
+        reason = low_battery ? "low battery" : "battery";
+    }
+    if (overheated && (mode == PERF_MODE_BETTER || mode == PERF_MODE_BEST)) {
+        mode = PERF_MODE_RECOMMENDED;
+        reason = "overheat";
+    }
+    
+    if (mode == perf_mode) {
+        perf_timer->cancelTimeout();
+        return;
+    }
+    UInt64 now = getUptimeMS();
+    if (last_perf_change && now - last_perf_change < PERF_RATE_LIMIT) {
+        // come back once the rate limit expires, the decision may have changed by then
+        perf_timer->setTimeoutMS(static_cast<UInt32>(PERF_RATE_LIMIT - (now - last_perf_change)));
+        return;
+    }
+    applyPerformanceMode(mode, reason);
+}
+
+void SurfaceBatteryDriver::performanceTimerFired(IOTimerEventSource *sender) {
+    evaluatePerformanceMode();
+}
+
+IOReturn SurfaceBatteryDriver::applyPerformanceMode(UInt32 mode, const char *reason) {
+    if (nub->setPerformanceMode(mode) != kIOReturnSuccess) {
+        LOG("Set performance mode failed!");
+        return kIOReturnError;
+    }
+    LOG("Performance mode %d -> %d (%s)", perf_mode, mode, reason);
+    
+    UInt64 now = getUptimeMS();
+    PerformanceTransition &entry = perf_log[perf_log_head];
+    entry.time = now;
+    entry.from = perf_mode;
+    entry.to = mode;
+    entry.reason = reason;
+    perf_log_head = (perf_log_head + 1) % PERF_LOG_SIZE;
+    if (perf_log_cnt < PERF_LOG_SIZE)
+        perf_log_cnt++;
+    
+    perf_mode = mode;
+    last_perf_change = now;
+    perf_set_pending = true;
+    setProperty("CurrentPerformanceMode", perf_mode, 32);
+    publishPerformanceLog();
+    // SET is not waited for, reading back here could still see the old mode.
+    // The status update after the next one reads it back once the command has long been acked.
+    return kIOReturnSuccess;
+}
+
+void SurfaceBatteryDriver::readBackPerformanceMode() {
+    if (perf_set_pending) {
+        perf_set_pending = false;
+        return;
+    }
+    UInt32 mode;
+    if (nub->getPerformanceMode(&mode) != kIOReturnSuccess) {
+        DBG_LOG("Failed to read back performance mode!");
+        return;
+    }
+    if (mode == actual_perf_mode)
+        return;
+    
+    if (mode != perf_mode)
+        LOG("SAM is running in performance mode %d instead of %d", mode, perf_mode);
+    actual_perf_mode = mode;
+    setProperty("ActualPerformanceMode", actual_perf_mode, 32);
+    setProperty("ActualPerformanceModeTime", getUptimeMS(), 64);
+}
+
+void SurfaceBatteryDriver::publishPerformanceLog() {
+    OSArray *log = OSArray::withCapacity(perf_log_cnt);
+    if (!log)
+        return;
+    
+    UInt8 idx = (perf_log_head + PERF_LOG_SIZE - perf_log_cnt) % PERF_LOG_SIZE;
+    for (UInt8 i = 0; i < perf_log_cnt; i++, idx = (idx + 1) % PERF_LOG_SIZE) {
+        OSDictionary *dict = OSDictionary::withCapacity(4);
+        OSNumber *time = OSNumber::withNumber(perf_log[idx].time, 64);
+        OSNumber *from = OSNumber::withNumber(perf_log[idx].from, 8);
+        OSNumber *to = OSNumber::withNumber(perf_log[idx].to, 8);
+        OSString *reason = OSString::withCString(perf_log[idx].reason);
+        if (dict && time && from && to && reason) {
+            dict->setObject("Time", time);
+            dict->setObject("From", from);
+            dict->setObject("To", to);
+            dict->setObject("Reason", reason);
+            log->setObject(dict);
+        }
+        OSSafeReleaseNULL(time);
+        OSSafeReleaseNULL(from);
+        OSSafeReleaseNULL(to);
+        OSSafeReleaseNULL(reason);
+        OSSafeReleaseNULL(dict);
+    }
+    setProperty("PerformanceModeLog", log);
+    log->release();
+}
+
+IOReturn SurfaceBatteryDriver::setPerformancePolicyGated(UInt32 *policy, UInt32 *mode) {
+    if (policy) {
+        perf_policy = *policy;
+        LOG("Set performance policy to %d", perf_policy);
+    } else {
+        // an explicit mode from the user overrides the governor
+        perf_policy = SurfacePerformancePolicyManual;
+        LOG("Set performance mode to %d", *mode);
+        setProperty("PerformanceMode", *mode, 32);
+        applyPerformanceMode(*mode, "user");
+    }
+    setProperty("PerformancePolicy", perf_policy, 32);
+    
+    perf_timer->cancelTimeout();
+    last_perf_change = 0;
+    evaluatePerformanceMode();
+    return kIOReturnSuccess;
+}
+
 IOService *SurfaceBatteryDriver::probe(IOService *provider, SInt32 *score) {
 	if (!super::probe(provider, score))
         return nullptr;
@@ -252,6 +417,20 @@ bool SurfaceBatteryDriver::start(IOService *provider) {
     }
     work_loop->addEventSource(timer);
     
+    perf_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SurfaceBatteryDriver::performanceTimerFired));
+    if (!perf_timer) {
+        LOG("Could not create timer!");
+        goto exit;
+    }
+    work_loop->addEventSource(perf_timer);
+    
+    command_gate = IOCommandGate::commandGate(this);
+    if (!command_gate) {
+        LOG("Could not create command gate!");
+        goto exit;
+    }
+    work_loop->addEventSource(command_gate);
+    
     update_bix = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &SurfaceBatteryDriver::updateBatteryInformation));
     update_bst = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &SurfaceBatteryDriver::updateBatteryStatus));
     if (!update_bix || !update_bst) {
@@ -266,6 +445,12 @@ bool SurfaceBatteryDriver::start(IOService *provider) {
         goto exit;
     }
     
+    if (OSNumber *mode = OSDynamicCast(OSNumber, getProperty("PerformanceMode")))
+        perf_mode = mode->unsigned32BitValue();
+    if (OSNumber *policy = OSDynamicCast(OSNumber, getProperty("PerformancePolicy")))
+        perf_policy = policy->unsigned32BitValue();
+    setProperty("CurrentPerformanceMode", perf_mode, 32);
+    
 	//WARNING: watch out, key addition is sorted here!
 	if (adaptCount > 0) {
 		VirtualSMCAPI::addKey(KeyACEN, vsmcPlugin.data, VirtualSMCAPI::valueWithUint8(0, new ACIN));
@@ -352,6 +537,16 @@ void SurfaceBatteryDriver::releaseResources() {
         work_loop->removeEventSource(timer);
         OSSafeReleaseNULL(timer);
     }
+    if (perf_timer) {
+        perf_timer->cancelTimeout();
+        perf_timer->disable();
+        work_loop->removeEventSource(perf_timer);
+        OSSafeReleaseNULL(perf_timer);
+    }
+    if (command_gate) {
+        work_loop->removeEventSource(command_gate);
+        OSSafeReleaseNULL(command_gate);
+    }
     if (update_bix) {
         update_bix->disable();
         work_loop->removeEventSource(update_bix);
@@ -377,9 +572,13 @@ IOReturn SurfaceBatteryDriver::setProperties(OSObject *props) {
                 OSNumber *mode = OSDynamicCast(OSNumber, dict->getObject(key));
                 if (mode) {
                     UInt32 m = mode->unsigned32BitValue();
-                    LOG("Set performance mode to %d", m);
-                    if (nub->setPerformanceMode(m) != kIOReturnSuccess)
-                        LOG("Set performance mode failed!");
+                    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceBatteryDriver::setPerformancePolicyGated), nullptr, &m);
+                }
+            } else if (key->isEqualTo("PerformancePolicy")) {
+                OSNumber *policy = OSDynamicCast(OSNumber, dict->getObject(key));
+                if (policy && policy->unsigned32BitValue() <= SurfacePerformancePolicyBatterySaver) {
+                    UInt32 p = policy->unsigned32BitValue();
+                    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceBatteryDriver::setPerformancePolicyGated), &p);
                 }
             }
         }
@@ -397,6 +596,8 @@ IOReturn SurfaceBatteryDriver::setPowerState(unsigned long whichState, IOService
             bat_missing = false;
             timer->cancelTimeout();
             timer->disable();
+            perf_timer->cancelTimeout();
+            perf_timer->disable();
             update_bix->disable();
             update_bst->disable();
             DBG_LOG("Going to sleep");
@@ -405,19 +606,18 @@ IOReturn SurfaceBatteryDriver::setPowerState(unsigned long whichState, IOService
         if (!awake) {
             awake = true;
             timer->enable();
+            perf_timer->enable();
             update_bix->enable();
             update_bst->enable();
             bix_fail = true;
             quick_cnt = BST_UPDATE_QUICK_CNT;
             clock_get_uptime(&last_update);
-            updateBatteryStatus(nullptr, 0);
             
-            OSNumber *mode = OSDynamicCast(OSNumber, getProperty("PerformanceMode"));
-            if (mode) {
-                UInt32 m = mode->unsigned32BitValue();
-                if (nub->setPerformanceMode(m) != kIOReturnSuccess)
-                    LOG("Set performance mode failed!");
-            }
+            // SAM forgets the mode across sleep, restore it before the governor looks at the new state
+            if (nub->setPerformanceMode(perf_mode) != kIOReturnSuccess)
+                LOG("Set performance mode failed!");
+            perf_set_pending = true;
+            updateBatteryStatus(nullptr, 0);
             DBG_LOG("Woke up");
         }
     }
@@ -15,6 +15,26 @@
 #define BST_UPDATE_NORMAL   30000
 #define BST_UPDATE_QUICK_CNT    5
 
+#define PERF_MODE_RECOMMENDED       0x01
+#define PERF_MODE_BATTERY_SAVER     0x02    // only valid in battery mode
+#define PERF_MODE_BETTER            0x03
+#define PERF_MODE_BEST              0x04
+
+#define PERF_RATE_LIMIT             30000   // minimal interval between two mode changes
+#define PERF_LOW_BATTERY_ENTER      20      // percent
+#define PERF_LOW_BATTERY_EXIT       25
+#define PERF_CRITICAL_BATTERY       10
+#define PERF_HOT_ENTER              3581    // 85 degree, in 0.1 Kelvin
+#define PERF_HOT_EXIT               3481    // 75 degree
+#define PERF_LOG_SIZE               16
+
+enum SurfacePerformancePolicy {
+    SurfacePerformancePolicyManual = 0,     // use PerformanceMode as is
+    SurfacePerformancePolicyBalanced,
+    SurfacePerformancePolicyPerformance,
+    SurfacePerformancePolicyBatterySaver,
+};
+
 class EXPORT SurfaceBatteryDriver : public IOService {
 	OSDeclareDefaultStructors(SurfaceBatteryDriver)
 
@@ -88,6 +108,7 @@ public:
 private:
     IOWorkLoop*             work_loop {nullptr};
     IOTimerEventSource*     timer {nullptr};
+    IOCommandGate*          command_gate {nullptr};
     IOInterruptEventSource* update_bix {nullptr};
     IOInterruptEventSource* update_bst {nullptr};
     SurfaceBatteryNub*      nub {nullptr};
@@ -99,6 +120,23 @@ private:
     bool    bat_missing {false};
     bool    sync {false};
     AbsoluteTime last_update {0};
+    
+    IOTimerEventSource*     perf_timer {nullptr};
+    UInt32  perf_policy {SurfacePerformancePolicyBalanced};
+    UInt32  perf_mode {PERF_MODE_RECOMMENDED};
+    bool    low_battery {false};
+    bool    overheated {false};
+    UInt64  last_perf_change {0};
+    bool    perf_set_pending {false};   // a SET went out since the last status update
+    UInt32  actual_perf_mode {0};
+    struct PerformanceTransition {
+        UInt64      time;
+        UInt8       from;
+        UInt8       to;
+        const char* reason;
+    } perf_log[PERF_LOG_SIZE];
+    UInt8   perf_log_head {0};
+    UInt8   perf_log_cnt {0};
 
     void eventReceived(SurfaceBatteryNub *sender, SurfaceBatteryEventType type);
     
@@ -108,6 +146,25 @@ private:
     
     void pollBatteryStatus(IOTimerEventSource* sender);
     
+    /*
+     * Decide the performance mode from AC state, battery level, SoC temperature and the user policy.
+     * Must be called on the work loop.
+     */
+    void evaluatePerformanceMode();
+    
+    void performanceTimerFired(IOTimerEventSource* sender);
+    
+    IOReturn applyPerformanceMode(UInt32 mode, const char *reason);
+    
+    IOReturn setPerformancePolicyGated(UInt32 *policy, UInt32 *mode);
+    
+    void publishPerformanceLog();
+    
+    /*
+     * Skipped on the first status update after a SET, so that the mode is read back a full status period later
+     */
+    void readBackPerformanceMode();
+    
     void releaseResources();
 };
 
@@ -0,0 +1,564 @@
+//
+//  MEIDeviceModel.cpp
+//  SurfaceTouchScreen
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "MEIDeviceModel.hpp"
+
+#ifdef MEI_DEVICE_MODEL
+
+#define MEI_MODEL_FRAGMENT_LEN  (MEI_SLOTS_TO_DATA(MEI_MODEL_ME_BUF_DEPTH - 1) & 0x1FC)    // 9 bit length field
+
+MEIDeviceModel::MEIDeviceModel() {
+    h_csr = static_cast<UInt32>(MEI_MODEL_HOST_BUF_DEPTH) << 24;
+    me_csr = (static_cast<UInt32>(MEI_MODEL_ME_BUF_DEPTH) << 24) | MEI_ME_CSR_READY;
+}
+
+MEIDeviceModel::~MEIDeviceModel() {
+    for (auto &client : clients) {
+        if (client.rx_buf)
+            delete[] client.rx_buf;
+    }
+}
+
+void MEIDeviceModel::setInterruptHandler(void *owner, InterruptHandler handler) {
+    irq_owner = owner;
+    irq_handler = handler;
+}
+
+bool MEIDeviceModel::addClient(UInt8 me_addr, const MEIClientProperty *props, MEIModelClientHandler handler, void *owner) {
+    if (!me_addr || findClient(me_addr))
+        return false;
+    for (auto &client : clients) {
+        if (client.present)
+            continue;
+        memset(&client, 0, sizeof(MEIModelClient));
+        client.present = true;
+        client.me_addr = me_addr;
+        memcpy(&client.props, props, sizeof(MEIClientProperty));
+        client.rx_buf = new UInt8[props->max_msg_length];
+        client.handler = handler;
+        client.owner = owner;
+        return true;
+    }
+    return false;
+}
+
+bool MEIDeviceModel::setClientHandler(UInt8 me_addr, MEIModelClientHandler handler, void *owner) {
+    MEIModelClient *client = findClient(me_addr);
+    if (!client)
+        return false;
+    client->handler = handler;
+    client->owner = owner;
+    return true;
+}
+
+UInt32 MEIDeviceModel::readRegister(int offset) {
+    UInt32 value = 0;
+    stats.register_reads++;
+    switch (offset) {
+        case MEI_H_CSR:
+            value = (h_csr & ~(MEI_CSR_BUF_WPOINTER | MEI_CSR_BUF_RPOINTER)) | (h_wp << 16) | (h_rp << 8);
+            break;
+        case MEI_ME_CSR:
+            value = (me_csr & ~(MEI_CSR_BUF_WPOINTER | MEI_CSR_BUF_RPOINTER)) | (me_wp << 16) | (me_rp << 8);
+            break;
+        case MEI_ME_CB_RW:
+            if (me_wp != me_rp)
+                value = me_buf[me_rp++ % MEI_MODEL_ME_BUF_DEPTH];
+            break;
+        case MEI_H_D0I3C:
+            value = d0i3c;
+            // the transition takes exactly one read to complete
+            if (cip_pending) {
+                value |= MEI_H_D0I3C_CIP;
+                cip_pending = false;
+                raiseInterrupt(MEI_H_CSR_D0I3C_INT_STA);
+            }
+            break;
+        default:
+            break;
+    }
+    return value;
+}
+
+void MEIDeviceModel::writeRegister(UInt32 value, int offset) {
+    stats.register_writes++;
+    switch (offset) {
+        case MEI_H_CB_WW:
+            if (static_cast<UInt8>(h_wp - h_rp) >= MEI_MODEL_HOST_BUF_DEPTH) {
+                stats.overruns++;
+                break;
+            }
+            h_buf[h_wp++ % MEI_MODEL_HOST_BUF_DEPTH] = value;
+            break;
+        case MEI_H_CSR:
+            writeHostCSR(value);
+            break;
+        case MEI_H_D0I3C:
+            writeD0I3C(value);
+            break;
+        default:
+            break;
+    }
+}
+
+void MEIDeviceModel::writeHostCSR(UInt32 value) {
+    UInt32 old = h_csr;
+    const UInt32 rw_bits = MEI_H_CSR_INT_ENABLE_MASK | MEI_H_CSR_READY | MEI_H_CSR_RESET;
+
+    // status bits are write 1 to clear, MEI_H_CSR_INT_GEN is not stored
+    h_csr &= ~(value & MEI_H_CSR_INT_STA_MASK);
+    h_csr = (h_csr & ~rw_bits) | (value & rw_bits);
+
+    if ((value & MEI_H_CSR_RESET) && !(old & MEI_H_CSR_RESET)) {
+        resetFirmware();
+        return;
+    }
+    if ((value & MEI_H_CSR_INT_GEN) && !(h_csr & MEI_H_CSR_RESET)) {
+        consumeHostBuffer();
+        fillMEBuffer();
+    }
+    // latched status shows up as soon as it is unmasked
+    if ((h_csr & ~old & MEI_H_CSR_INT_ENABLE_MASK) && (h_csr & MEI_H_CSR_INT_STA_MASK))
+        raiseInterrupt(0);
+}
+
+void MEIDeviceModel::writeD0I3C(UInt32 value) {
+    bool was_gated = d0i3c & MEI_H_D0I3C_I3;
+    bool gated = value & MEI_H_D0I3C_I3;
+    d0i3c = value & (MEI_H_D0I3C_I3 | MEI_H_D0I3C_IR | MEI_H_D0I3C_RR);
+    if (gated == was_gated)
+        return;
+    if (gated)
+        stats.pg_entries++;
+    else
+        stats.pg_exits++;
+    // only report the transition when the host asked for an interrupt
+    if (value & MEI_H_D0I3C_IR)
+        cip_pending = true;
+}
+
+void MEIDeviceModel::resetFirmware() {
+    stats.resets++;
+    h_wp = h_rp = 0;
+    me_wp = me_rp = 0;
+    backlog_head = backlog_tail = 0;
+    started = false;
+    dma_ring_granted = false;
+    client_dma_mapped = false;
+    cip_pending = false;
+    d0i3c &= ~MEI_H_D0I3C_I3;
+    for (auto &client : clients) {
+        client.connected = false;
+        client.host_credits = 0;
+        client.rx_len = 0;
+    }
+    // ME comes back right away and tells the host about it
+    h_csr &= ~MEI_H_CSR_READY;
+    me_csr &= ~MEI_ME_CSR_RESET;
+    me_csr |= MEI_ME_CSR_READY;
+    raiseInterrupt(MEI_H_CSR_INT_STA);
+}
+
+void MEIDeviceModel::requestReset() {
+    me_csr &= ~MEI_ME_CSR_READY;
+    me_csr |= MEI_ME_CSR_RESET;
+    raiseInterrupt(MEI_H_CSR_INT_STA);
+}
+
+void MEIDeviceModel::raiseInterrupt(UInt32 status) {
+    h_csr |= status;
+    if (!irq_handler)
+        return;
+    if (((h_csr & MEI_H_CSR_INT_STA) && (h_csr & MEI_H_CSR_INT_ENABLE)) ||
+        ((h_csr & MEI_H_CSR_D0I3C_INT_STA) && (h_csr & MEI_H_CSR_D0I3C_INT_ENABLE))) {
+        stats.interrupts++;
+        irq_handler(irq_owner);
+    }
+}
+
+MEIModelClient *MEIDeviceModel::findClient(UInt8 me_addr) {
+    for (auto &client : clients) {
+        if (client.present && client.me_addr == me_addr)
+            return &client;
+    }
+    return nullptr;
+}
+
+bool MEIDeviceModel::pushMessage(MEIBusMessageHeader *hdr, const UInt8 *data, UInt16 len) {
+    UInt32 slots = 1 + MEI_DATA_TO_SLOTS(len);
+    if (MEI_MODEL_BACKLOG_SLOTS - (backlog_head - backlog_tail) < slots) {
+        stats.dropped++;
+        return false;
+    }
+
+    MEI_SLOT_TYPE slot;
+    memcpy(&slot, hdr, sizeof(slot));
+    backlog[backlog_head++ & (MEI_MODEL_BACKLOG_SLOTS - 1)] = slot;
+    for (UInt16 pos = 0; pos < len; pos += MEI_SLOT_SIZE) {
+        slot = 0;
+        UInt16 left = len - pos;
+        memcpy(&slot, data + pos, left < MEI_SLOT_SIZE ? left : MEI_SLOT_SIZE);
+        backlog[backlog_head++ & (MEI_MODEL_BACKLOG_SLOTS - 1)] = slot;
+    }
+    if (backlog_head - backlog_tail > stats.backlog_high_water)
+        stats.backlog_high_water = backlog_head - backlog_tail;
+    return true;
+}
+
+bool MEIDeviceModel::sendHostBusMessage(const void *msg, UInt16 len) {
+    MEIBusMessageHeader hdr;
+    memset(&hdr, 0, sizeof(MEIBusMessageHeader));
+    hdr.length = len;
+    hdr.msg_complete = 1;
+    return pushMessage(&hdr, reinterpret_cast<const UInt8 *>(msg), len);
+}
+
+bool MEIDeviceModel::sendClientMessage(UInt8 me_addr, const UInt8 *msg, UInt32 msg_len) {
+    MEIModelClient *client = findClient(me_addr);
+    if (!client || !started || msg_len > client->props.max_msg_length)
+        return false;
+    if (MEI_MODEL_BACKLOG_SLOTS - (backlog_head - backlog_tail) < msg_len / MEI_SLOT_SIZE + 2 * (msg_len / MEI_MODEL_FRAGMENT_LEN + 1)) {
+        stats.dropped++;
+        return false;
+    }
+    // dynamic clients may only send with a credit from the host
+    if (!client->props.fixed_address) {
+        if (!client->connected || !client->host_credits)
+            return false;
+        client->host_credits--;
+    }
+
+    MEIBusMessageHeader hdr;
+    memset(&hdr, 0, sizeof(MEIBusMessageHeader));
+    hdr.me_addr = me_addr;
+    hdr.host_addr = client->props.fixed_address ? 0 : client->host_addr;
+    // what does not fit a fragment goes into the client buffer or on the DMA ring when they can take it
+    bool sent = msg_len > MEI_MODEL_FRAGMENT_LEN &&
+        ((client_dma_mapped && pushClientDMA(&hdr, msg, msg_len)) || (dma_ring_granted && pushDMARing(&hdr, msg, msg_len)));
+    if (!sent) {
+        UInt32 pos = 0;
+        do {
+            UInt32 len = msg_len - pos > MEI_MODEL_FRAGMENT_LEN ? MEI_MODEL_FRAGMENT_LEN : msg_len - pos;
+            hdr.length = len;
+            hdr.msg_complete = pos + len == msg_len;
+            pushMessage(&hdr, msg + pos, len);
+            pos += len;
+        } while (pos < msg_len);
+    }
+
+    stats.client_tx++;
+    stats.client_tx_bytes += msg_len;
+    fillMEBuffer();
+    return true;
+}
+
+UInt8 *MEIDeviceModel::dmaRingAddress(int dscr) {
+    return reinterpret_cast<UInt8 *>(static_cast<uintptr_t>((static_cast<UInt64>(dma_ring[dscr].addr_hi) << 32) | dma_ring[dscr].addr_lo));
+}
+
+/*
+ * The whole message goes into the device ring, the circular buffer only carries its length
+ */
+bool MEIDeviceModel::pushDMARing(MEIBusMessageHeader *hdr, const UInt8 *msg, UInt32 msg_len) {
+    UInt8 *ring = dmaRingAddress(MEIDMADescriptorDevice);
+    UInt8 *ctrl = dmaRingAddress(MEIDMADescriptorControl);
+    UInt32 size = dma_ring[MEIDMADescriptorDevice].size;
+    volatile UInt32 *wr_idx = MEI_DMA_RING_INDEX(ctrl, dbuf_wr_idx);
+    UInt32 wr = *wr_idx;
+    if (size / MEI_SLOT_SIZE - (wr - *MEI_DMA_RING_INDEX(ctrl, dbuf_rd_idx)) < MEI_DATA_TO_SLOTS(msg_len))
+        return false;
+
+    UInt32 offset = MEI_SLOTS_TO_DATA(wr & (size / MEI_SLOT_SIZE - 1));
+    UInt32 first = size - offset < msg_len ? size - offset : msg_len;
+    memcpy(ring + offset, msg, first);
+    if (first < msg_len)
+        memcpy(ring, msg + first, msg_len - first);
+    *wr_idx = wr + MEI_DATA_TO_SLOTS(msg_len);
+
+    hdr->length = MEI_SLOT_SIZE;
+    hdr->dma_ring = 1;
+    hdr->msg_complete = 1;
+    pushMessage(hdr, reinterpret_cast<const UInt8 *>(&msg_len), sizeof(msg_len));
+    stats.dma_ring_tx++;
+    return true;
+}
+
+/*
+ * The payload goes into the mapped client buffer and a GSC extended header tells the host how much was written.
+ * The buffer holds one message, so it is only reused once the host has read everything queued before.
+ */
+bool MEIDeviceModel::pushClientDMA(MEIBusMessageHeader *hdr, const UInt8 *msg, UInt32 msg_len) {
+    if (msg_len > client_dma_size || me_wp != me_rp || backlog_head != backlog_tail)
+        return false;
+    memcpy(reinterpret_cast<UInt8 *>(static_cast<uintptr_t>(client_dma_addr)), msg, msg_len);
+
+    UInt8 ext[sizeof(MEIBusExtendedMetaHeader) + sizeof(MEIBusExtendedGSCF2H)] {};
+    MEIBusExtendedMetaHeader *meta = reinterpret_cast<MEIBusExtendedMetaHeader *>(ext);
+    MEIBusExtendedGSCF2H *gsc = reinterpret_cast<MEIBusExtendedGSCF2H *>(meta->hdrs);
+    meta->count = 1;
+    meta->size = MEI_DATA_TO_SLOTS(sizeof(MEIBusExtendedGSCF2H));
+    gsc->type = MEIExtendedHeaderGSC;
+    gsc->length = MEI_DATA_TO_SLOTS(sizeof(MEIBusExtendedGSCF2H));
+    gsc->client_id = client_dma_id;
+    gsc->fence_id = ++client_dma_fence;
+    gsc->written = msg_len;
+
+    hdr->length = sizeof(ext);
+    hdr->extended = 1;
+    hdr->msg_complete = 1;
+    pushMessage(hdr, ext, sizeof(ext));
+    stats.client_dma_tx++;
+    return true;
+}
+
+/*
+ * Moves whole messages into the ME buffer, the host reads a message only once all of it is there
+ */
+void MEIDeviceModel::fillMEBuffer() {
+    bool moved = false;
+    while (backlog_head != backlog_tail) {
+        MEI_SLOT_TYPE slot = backlog[backlog_tail & (MEI_MODEL_BACKLOG_SLOTS - 1)];
+        MEIBusMessageHeader *hdr = reinterpret_cast<MEIBusMessageHeader *>(&slot);
+        UInt32 slots = 1 + MEI_DATA_TO_SLOTS(hdr->length);
+        if (static_cast<UInt8>(me_wp - me_rp) + slots > MEI_MODEL_ME_BUF_DEPTH)
+            break;
+        for (UInt32 i = 0; i < slots; i++)
+            me_buf[me_wp++ % MEI_MODEL_ME_BUF_DEPTH] = backlog[backlog_tail++ & (MEI_MODEL_BACKLOG_SLOTS - 1)];
+        moved = true;
+    }
+    if (moved)
+        raiseInterrupt(MEI_H_CSR_INT_STA);
+}
+
+void MEIDeviceModel::consumeHostBuffer() {
+    bool consumed = false;
+    while (h_wp != h_rp) {
+        MEI_SLOT_TYPE slot = h_buf[h_rp % MEI_MODEL_HOST_BUF_DEPTH];
+        MEIBusMessageHeader *hdr = reinterpret_cast<MEIBusMessageHeader *>(&slot);
+        UInt8 slots = 1 + MEI_DATA_TO_SLOTS(hdr->length);
+        if (static_cast<UInt8>(h_wp - h_rp) < slots)
+            break;
+        h_rp++;
+        for (UInt8 i = 0; i < slots - 1; i++)
+            memcpy(rx_msg + MEI_SLOTS_TO_DATA(i), &h_buf[h_rp++ % MEI_MODEL_HOST_BUF_DEPTH], MEI_SLOT_SIZE);
+        consumed = true;
+
+        if (!hdr->me_addr && !hdr->host_addr)
+            handleHostBusMessage(rx_msg, hdr->length);
+        else
+            handleClientMessage(hdr, rx_msg);
+    }
+    // an empty host buffer is signalled like on hardware
+    if (consumed)
+        raiseInterrupt(MEI_H_CSR_INT_STA);
+}
+
+void MEIDeviceModel::handleHostBusMessage(const UInt8 *msg, UInt16 len) {
+    stats.host_messages++;
+    if (!len)
+        return;
+
+    switch (msg[0]) {
+        case MEI_HOST_START_REQ_CMD: {
+            const MEIBusHostVersionRequest *req = reinterpret_cast<const MEIBusHostVersionRequest *>(msg);
+            MEIBusHostVersionResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_HOST_START_RES_CMD;
+            res.host_version_supported = req->host_version_major < MEI_MODEL_HBM_MAJOR_VERSION ||
+                (req->host_version_major == MEI_MODEL_HBM_MAJOR_VERSION && req->host_version_minor <= MEI_MODEL_HBM_MINOR_VERSION);
+            res.me_max_version_major = MEI_MODEL_HBM_MAJOR_VERSION;
+            res.me_max_version_minor = MEI_MODEL_HBM_MINOR_VERSION;
+            started = true;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_HOST_STOP_REQ_CMD: {
+            MEIBusHostStopResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_HOST_STOP_RES_CMD;
+            started = false;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_CAPABILITIES_REQ_CMD: {
+            // no vtag, client dma only where the model can reach host memory
+            MEIBusCapabilityResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_CAPABILITIES_RES_CMD;
+            if (client_dma_allowed)
+                res.capability_granted[0] |= MEI_HBM_CAP_CLIENT_DMA;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_DMA_SETUP_REQ_CMD: {
+            const MEIBusDMASetupRequest *req = reinterpret_cast<const MEIBusDMASetupRequest *>(msg);
+            MEIBusDMASetupResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_DMA_SETUP_RES_CMD;
+            res.status = MEIHostBusMessageReturnNotAllowed;
+            if (dma_ring_allowed) {
+                memcpy(dma_ring, req->dma_info, sizeof(dma_ring));
+                dma_ring_granted = true;
+                res.status = MEIHostBusMessageReturnSuccess;
+            }
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_HOST_ENUM_REQ_CMD: {
+            MEIBusHostEnumerationResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_HOST_ENUM_RES_CMD;
+            for (auto &client : clients) {
+                if (client.present)
+                    res.valid_addresses[client.me_addr / 8] |= 1 << (client.me_addr % 8);
+            }
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_HOST_CLIENT_PROP_REQ_CMD: {
+            const MEIBusClientPropertyRequest *req = reinterpret_cast<const MEIBusClientPropertyRequest *>(msg);
+            MEIModelClient *client = findClient(req->me_addr);
+            MEIBusClientPropertyResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_HOST_CLIENT_PROP_RES_CMD;
+            res.me_addr = req->me_addr;
+            if (client) {
+                res.status = MEIHostBusMessageReturnSuccess;
+                memcpy(&res.client_properties, &client->props, sizeof(MEIClientProperty));
+            } else
+                res.status = MEIHostBusMessageReturnClientNotFound;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_CLIENT_CONNECT_REQ_CMD:
+        case MEI_CLIENT_DISCONNECT_REQ_CMD: {
+            const MEIBusClientCommand *req = reinterpret_cast<const MEIBusClientCommand *>(msg);
+            MEIModelClient *client = findClient(req->me_addr);
+            bool connect = msg[0] == MEI_CLIENT_CONNECT_REQ_CMD;
+            MEIBusClientConnectionResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = connect ? MEI_CLIENT_CONNECT_RES_CMD : MEI_CLIENT_DISCONNECT_RES_CMD;
+            res.me_addr = req->me_addr;
+            res.host_addr = req->host_addr;
+            if (!client)
+                res.status = MEIClientConnectionNotFound;
+            else if (connect && client->connected)
+                res.status = MEIClientConnectionAlreadyStarted;
+            else {
+                res.status = MEIClientConnectionSuccess;
+                client->connected = connect;
+                client->host_addr = req->host_addr;
+                client->host_credits = 0;
+            }
+            sendHostBusMessage(&res, sizeof(res));
+            // ready to receive one message
+            if (connect && res.status == MEIClientConnectionSuccess) {
+                MEIBusFlowControl fc;
+                memset(&fc, 0, sizeof(fc));
+                fc.cmd = MEI_FLOW_CONTROL_CMD;
+                fc.me_addr = client->me_addr;
+                fc.host_addr = client->host_addr;
+                sendHostBusMessage(&fc, sizeof(fc));
+            }
+            break;
+        }
+        case MEI_FLOW_CONTROL_CMD: {
+            const MEIBusFlowControl *fc = reinterpret_cast<const MEIBusFlowControl *>(msg);
+            MEIModelClient *client = findClient(fc->me_addr);
+            if (client && client->connected)
+                client->host_credits++;
+            break;
+        }
+        case MEI_NOTIFY_REQ_CMD: {
+            const MEIBusNotificationRequest *req = reinterpret_cast<const MEIBusNotificationRequest *>(msg);
+            MEIBusNotificationResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_NOTIFY_RES_CMD;
+            res.me_addr = req->me_addr;
+            res.host_addr = req->host_addr;
+            res.start = req->start;
+            res.status = findClient(req->me_addr) ? MEIHostBusMessageReturnSuccess : MEIHostBusMessageReturnClientNotFound;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_PG_ISOLATION_ENTRY_REQ_CMD: {
+            MEIBusPowerGatingResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_PG_ISOLATION_ENTRY_RES_CMD;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_CLIENT_DMA_MAP_REQ_CMD: {
+            const MEIBusClientDMAMapRequest *req = reinterpret_cast<const MEIBusClientDMAMapRequest *>(msg);
+            MEIBusClientDMAResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_CLIENT_DMA_MAP_RES_CMD;
+            res.status = MEIClientConnectionNotAllowed;
+            if (client_dma_allowed && !client_dma_mapped) {
+                client_dma_mapped = true;
+                client_dma_id = req->client_buffer_id;
+                client_dma_addr = (static_cast<UInt64>(req->address_msb) << 32) | req->address_lsb;
+                client_dma_size = req->size;
+                res.status = MEIClientConnectionSuccess;
+            }
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_CLIENT_DMA_UNMAP_REQ_CMD: {
+            MEIBusClientDMAResponse res;
+            memset(&res, 0, sizeof(res));
+            res.cmd = MEI_CLIENT_DMA_UNMAP_RES_CMD;
+            res.status = MEIClientConnectionSuccess;
+            client_dma_mapped = false;
+            sendHostBusMessage(&res, sizeof(res));
+            break;
+        }
+        case MEI_PG_ISOLATION_EXIT_RES_CMD:
+        case MEI_ADD_CLIENT_RES_CMD:
+            break;
+        default:
+            stats.unknown_messages++;
+            break;
+    }
+}
+
+void MEIDeviceModel::handleClientMessage(MEIBusMessageHeader *hdr, const UInt8 *data) {
+    MEIModelClient *client = findClient(hdr->me_addr);
+    if (!client || client->rx_len + hdr->length > client->props.max_msg_length) {
+        if (client)
+            client->rx_len = 0;
+        stats.unknown_messages++;
+        return;
+    }
+    memcpy(client->rx_buf + client->rx_len, data, hdr->length);
+    client->rx_len += hdr->length;
+    if (!hdr->msg_complete)
+        return;
+
+    UInt32 len = client->rx_len;
+    client->rx_len = 0;
+    stats.client_rx++;
+    stats.client_rx_bytes += len;
+    if (client->handler)
+        client->handler(client->owner, this, client->me_addr, client->rx_buf, len);
+
+    if (!client->props.fixed_address && client->connected) {
+        MEIBusFlowControl fc;
+        memset(&fc, 0, sizeof(fc));
+        fc.cmd = MEI_FLOW_CONTROL_CMD;
+        fc.me_addr = client->me_addr;
+        fc.host_addr = client->host_addr;
+        sendHostBusMessage(&fc, sizeof(fc));
+    }
+}
+
+void MEIDeviceModel::loopback(void *owner, MEIDeviceModel *model, UInt8 me_addr, const UInt8 *msg, UInt32 msg_len) {
+    model->sendClientMessage(me_addr, msg, msg_len);
+}
+
+#endif /* MEI_DEVICE_MODEL */
@@ -0,0 +1,169 @@
+//
+//  MEIDeviceModel.hpp
+//  SurfaceTouchScreen
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef MEIDeviceModel_hpp
+#define MEIDeviceModel_hpp
+
+#ifdef MEI_DEVICE_MODEL
+
+#include "MEIProtocol.h"
+
+#define MEI_MODEL_HOST_BUF_DEPTH    128     // slots, both circular buffers of the Surface ME are this deep
+#define MEI_MODEL_ME_BUF_DEPTH      128
+#define MEI_MODEL_BACKLOG_SLOTS     4096    // power of 2, messages waiting for room in the ME buffer
+#define MEI_MODEL_MAX_CLIENTS       8
+#define MEI_MODEL_HBM_MAJOR_VERSION 2
+#define MEI_MODEL_HBM_MINOR_VERSION 2
+
+struct MEIDeviceModelStats {
+    UInt64  register_reads;
+    UInt64  register_writes;
+    UInt64  interrupts;         // delivered to the handler, masked ones are only latched
+    UInt64  host_messages;      // host bus messages received
+    UInt64  unknown_messages;
+    UInt64  client_rx;          // complete client messages received from the host
+    UInt64  client_rx_bytes;
+    UInt64  client_tx;          // client messages queued for the host
+    UInt64  client_tx_bytes;
+    UInt64  dma_ring_tx;        // client messages sent through the DMA ring
+    UInt64  client_dma_tx;      // client messages written into the mapped client buffer
+    UInt64  dropped;            // backlog full
+    UInt64  overruns;           // host wrote into a full buffer
+    UInt64  resets;
+    UInt64  pg_entries;
+    UInt64  pg_exits;
+    UInt32  backlog_high_water;
+};
+
+class MEIDeviceModel;
+
+// complete message from the host to a client, answer with MEIDeviceModel::sendClientMessage
+typedef void (*MEIModelClientHandler)(void *owner, MEIDeviceModel *model, UInt8 me_addr, const UInt8 *msg, UInt32 msg_len);
+
+struct MEIModelClient {
+    bool    present;
+    bool    connected;
+    UInt8   me_addr;
+    UInt8   host_addr;
+    UInt32  host_credits;       // flow control from the host, dynamic clients only
+    MEIClientProperty props;
+    UInt8*  rx_buf;
+    UInt32  rx_len;
+    MEIModelClientHandler handler;
+    void*   owner;
+};
+
+/*
+ * Software model of the HECI registers and the ME side of the host bus protocol.
+ * Builds with MEI_DEVICE_MODEL only, SurfaceManagementEngineDriver then talks to it instead of BAR0.
+ * Only MEIProtocol.h is needed so a host-side harness can drive the model with the same register sequences.
+ *
+ * ME reacts synchronously inside register accesses, the interrupt handler is called with the
+ * status already latched in MEI_H_CSR and has to defer its work like a real MSI.
+ */
+class MEIDeviceModel {
+public:
+    typedef void (*InterruptHandler)(void *owner);
+
+    MEIDeviceModel();
+
+    ~MEIDeviceModel();
+
+    void setInterruptHandler(void *owner, InterruptHandler handler);
+
+    bool addClient(UInt8 me_addr, const MEIClientProperty *props, MEIModelClientHandler handler, void *owner);
+
+    bool setClientHandler(UInt8 me_addr, MEIModelClientHandler handler, void *owner);
+
+    UInt32 readRegister(int offset);
+
+    void writeRegister(UInt32 value, int offset);
+
+    // split into fragments the host buffer can take, false if the backlog is full
+    bool sendClientMessage(UInt8 me_addr, const UInt8 *msg, UInt32 msg_len);
+
+    // firmware initiated reset, the host has to assert MEI_H_CSR_RESET to bring ME back
+    void requestReset();
+
+    // grant the DMA ring from the next setup request on, bus addresses have to be host addresses like the shim hands out
+    void allowDMARing(bool allow) { dma_ring_allowed = allow; }
+
+    // offer client dma from the next capability request on, same condition on bus addresses
+    void allowClientDMA(bool allow) { client_dma_allowed = allow; }
+
+    const MEIDeviceModelStats *getStats() { return &stats; }
+
+    // client handler echoing every message, for throughput runs
+    static void loopback(void *owner, MEIDeviceModel *model, UInt8 me_addr, const UInt8 *msg, UInt32 msg_len);
+
+private:
+    UInt32  h_csr {0};
+    UInt32  me_csr {0};
+    UInt32  d0i3c {0};
+    bool    cip_pending {false};
+    bool    started {false};
+    bool    dma_ring_allowed {false};
+    bool    dma_ring_granted {false};
+    MEIBusDMAInfo   dma_ring[MEIDMADescriptorSize] {};
+    bool    client_dma_allowed {false};
+    bool    client_dma_mapped {false};
+    UInt8   client_dma_id {0};
+    UInt64  client_dma_addr {0};
+    UInt32  client_dma_size {0};
+    UInt32  client_dma_fence {0};
+
+    MEI_SLOT_TYPE   h_buf[MEI_MODEL_HOST_BUF_DEPTH] {};
+    UInt8           h_wp {0};
+    UInt8           h_rp {0};
+    MEI_SLOT_TYPE   me_buf[MEI_MODEL_ME_BUF_DEPTH] {};
+    UInt8           me_wp {0};
+    UInt8           me_rp {0};
+    MEI_SLOT_TYPE   backlog[MEI_MODEL_BACKLOG_SLOTS] {};
+    UInt32          backlog_head {0};
+    UInt32          backlog_tail {0};
+    UInt8           rx_msg[MEI_SLOTS_TO_DATA(MEI_MODEL_HOST_BUF_DEPTH)] {};
+
+    MEIModelClient  clients[MEI_MODEL_MAX_CLIENTS] {};
+
+    void*               irq_owner {nullptr};
+    InterruptHandler    irq_handler {nullptr};
+
+    MEIDeviceModelStats stats {};
+
+    void writeHostCSR(UInt32 value);
+
+    void writeD0I3C(UInt32 value);
+
+    void resetFirmware();
+
+    void raiseInterrupt(UInt32 status);
+
+    MEIModelClient *findClient(UInt8 me_addr);
+
+    bool pushMessage(MEIBusMessageHeader *hdr, const UInt8 *data, UInt16 len);
+
+    bool sendHostBusMessage(const void *msg, UInt16 len);
+
+    UInt8 *dmaRingAddress(int dscr);
+
+    bool pushDMARing(MEIBusMessageHeader *hdr, const UInt8 *msg, UInt32 msg_len);
+
+    bool pushClientDMA(MEIBusMessageHeader *hdr, const UInt8 *msg, UInt32 msg_len);
+
+    void fillMEBuffer();
+
+    void consumeHostBuffer();
+
+    void handleHostBusMessage(const UInt8 *msg, UInt16 len);
+
+    void handleClientMessage(MEIBusMessageHeader *hdr, const UInt8 *data);
+};
+
+#endif /* MEI_DEVICE_MODEL */
+
+#endif /* MEIDeviceModel_hpp */
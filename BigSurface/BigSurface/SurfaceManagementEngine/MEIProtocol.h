@@ -9,7 +9,31 @@
 #ifndef MEIProtocol_h
 #define MEIProtocol_h
 
-#include "../helpers.hpp"
+/*
+ * Only plain types in here, MEIDeviceModel and the host tests build this without IOKit
+ */
+#ifdef KERNEL
+#include <libkern/OSTypes.h>
+#include <uuid/uuid.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+typedef uint8_t     UInt8;
+typedef int8_t      SInt8;
+typedef uint16_t    UInt16;
+typedef int16_t     SInt16;
+typedef uint32_t    UInt32;
+typedef int32_t     SInt32;
+typedef uint64_t    UInt64;
+typedef int64_t     SInt64;
+typedef unsigned int UInt;
+typedef unsigned char uuid_t[16];
+#endif
+
+#ifndef BIT
+#define BIT(nr) (1UL << (nr))
+#endif
 
 /*
  * IPTS MEI constants and communication protocol ported from linux
@@ -219,6 +243,7 @@ enum MEIHostBusMessageReturnType : UInt8 {
 enum MEIExtendedHeaderType : UInt8 {
     MEIExtendedHeaderNone = 0,
     MEIExtendedHeaderVtag = 1,
+    MEIExtendedHeaderGSC = 2,
 };
 
 /**
@@ -235,6 +260,24 @@ struct PACKED MEIBusExtendedHeader {
 
 #define MEI_EXTHEADER_DATA_VTAG_IDX  0
 
+/**
+ * struct MEIBusExtendedGSCF2H - firmware to host GSC extended header
+ * @type: MEIExtendedHeaderGSC
+ * @length: header length in slots
+ * @client_id: dma buffer id given in the map request
+ * @reserved: reserved
+ * @fence_id: completed request
+ * @written: bytes written into the client dma buffer
+ */
+struct PACKED MEIBusExtendedGSCF2H {
+    MEIExtendedHeaderType type;
+    UInt8 length;
+    UInt8 client_id;
+    UInt8 reserved;
+    UInt32 fence_id;
+    UInt32 written;
+};
+
 /**
  * struct MEIExtendedMetaHeader - extend header meta data
  * @count: number of headers
@@ -617,6 +660,12 @@ struct PACKED MEIBusDMARingControl {
     UInt32 reserved4;
 };
 
+/*
+ * The control block is page aligned and every index sits on a slot boundary,
+ * ME and host access them as aligned words rather than through the packed struct
+ */
+#define MEI_DMA_RING_INDEX(ctrl, idx)   (reinterpret_cast<volatile UInt32 *>((ctrl) + offsetof(MEIBusDMARingControl, idx)))
+
 /* virtual tag supported */
 #define MEI_HBM_CAP_VTAG        BIT(0)
 /* client dma supported */
@@ -0,0 +1,71 @@
+//
+//  MEIUserRing.h
+//  SurfaceTouchScreen
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef MEIUserRing_h
+#define MEIUserRing_h
+
+/*
+ * Layout of the message ring shared with the IPTS daemon.
+ * Open a SurfaceManagementEngineUserClient on SurfaceManagementEngineClient, map it with
+ * IOConnectMapMemory64(connect, kMEIUserRingMemoryType, ...) and register a port with IOConnectSetNotificationPort.
+ *
+ * rx (ME -> daemon): the kernel fills the slot at rx_head then bumps rx_head, the daemon consumes slots up to rx_head
+ * and bumps rx_tail. A message is sent on the port whenever rx_head moved, messages arriving on a full ring are counted
+ * in rx_dropped.
+ * tx (daemon -> ME): the daemon fills the slot at tx_head, bumps tx_head and calls kMEIUserRingMethodSubmit once for
+ * everything queued, the kernel bumps tx_tail as slots are sent.
+ *
+ * Indexes are free running, slot i lives at (offset + (i % count) * slot_size).
+ * While the ring is mapped, messages are no longer delivered to the in-kernel handler.
+ *
+ * kMEIUserRingMethodMapDMA(buffer_id, size) asks ME to write large payloads into a client dma buffer instead of the
+ * circular buffer, they still show up in the rx ring. It fails if ME refuses, the FIFO keeps working then.
+ * The mapping is dropped with kMEIUserRingMethodUnmapDMA or when the connection closes, and restored after ME resets.
+ */
+
+#define MEI_USER_RING_RX_COUNT  16      // must be a power of 2
+#define MEI_USER_RING_TX_COUNT  8       // must be a power of 2
+
+enum {
+    kMEIUserRingMemoryType = 0,
+};
+
+enum {
+    kMEIUserRingNotificationType = 0,
+};
+
+enum {
+    kMEIUserRingMethodSubmit = 0,
+    kMEIUserRingMethodMapDMA = 1,
+    kMEIUserRingMethodUnmapDMA = 2,
+};
+
+struct MEIUserRingSlot {
+    volatile UInt32 length;
+    UInt32  _reserved;
+    UInt8   data[];
+};
+
+struct MEIUserRingHeader {
+    UInt32  slot_size;      // stride between slots, data holds up to max_msg_length bytes
+    UInt32  max_msg_length;
+    UInt32  rx_count;
+    UInt32  tx_count;
+    UInt32  rx_offset;      // from the start of the mapping
+    UInt32  tx_offset;
+    UInt32  _reserved[2];
+    volatile UInt32 rx_head;
+    volatile UInt32 rx_tail;
+    volatile UInt32 rx_dropped;
+    UInt32  _reserved1;
+    volatile UInt32 tx_head;
+    volatile UInt32 tx_tail;
+    UInt32  _reserved2[2];
+};
+
+#endif /* MEIUserRing_h */
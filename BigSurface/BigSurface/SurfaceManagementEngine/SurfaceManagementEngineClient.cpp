@@ -7,6 +7,7 @@
 //
 
 #include "SurfaceManagementEngineClient.hpp"
+#include "SurfaceManagementEngineUserClient.hpp"
 
 #define super IOService
 OSDefineMetaClassAndStructors(SurfaceManagementEngineClient, IOService)
@@ -19,7 +20,8 @@ bool SurfaceManagementEngineClient::attach(IOService* provider) {
     if (!api)
         return false;
     
-    queue_head_init(rx_queue);
+    rx_queue.reset();
+    rx_free.reset();
 
     return true;
 }
@@ -33,12 +35,6 @@ bool SurfaceManagementEngineClient::start(IOService *provider) {
     if (!super::start(provider))
         return false;
     
-    queue_lock = IOLockAlloc();
-    if (!queue_lock) {
-        LOG("Failed to create lock");
-        goto exit;
-    }
-    
     work_loop = IOWorkLoop::workLoop();
     if (!work_loop) {
         LOG("Failed to create work loop");
@@ -61,8 +57,23 @@ bool SurfaceManagementEngineClient::start(IOService *provider) {
     setProperty("MEIClientUUID", uuid_str);
     setProperty("MEIClientAddress", properties.fixed_address, 32);
     setProperty("MEIClientMaxMessageLength", properties.max_msg_length, 32);
+    setProperty("IOUserClientClass", "SurfaceManagementEngineUserClient");
     
-    rx_cache = new UInt8[properties.max_msg_length];
+    rx_pool = new MEIClientMessage[MEI_CLIENT_RX_POOL_SIZE];
+    rx_pool_buf = new UInt8[MEI_CLIENT_RX_POOL_SIZE * properties.max_msg_length];
+    tx_pool_buf = new UInt8[MEI_CLIENT_TX_POOL_SIZE * properties.max_msg_length];
+    if (!rx_pool || !rx_pool_buf || !tx_pool_buf) {
+        LOG("Failed to allocate message pools");
+        goto exit;
+    }
+    for (int i = 0; i < MEI_CLIENT_RX_POOL_SIZE; i++) {
+        rx_pool[i].msg = rx_pool_buf + i * properties.max_msg_length;
+        rx_pool[i].len = 0;
+        rx_free.push(&rx_pool[i]);
+    }
+    for (int i = 0; i < MEI_CLIENT_TX_POOL_SIZE; i++)
+        tx_free[i] = tx_pool_buf + i * properties.max_msg_length;
+    tx_free_cnt = MEI_CLIENT_TX_POOL_SIZE;
     
     initial = false;
     
@@ -89,14 +100,30 @@ IOReturn SurfaceManagementEngineClient::setPowerState(unsigned long whichState,
 }
 
 void SurfaceManagementEngineClient::releaseResources() {
-    MEIClientMessage *msg;
-    qe_foreach_element_safe(msg, &rx_queue, entry) {
-        remqueue(&msg->entry);
-        delete[] msg->msg;
-        delete msg;
+    user_hdr = nullptr;
+    user_slot = nullptr;
+    if (user_client) {
+        // the daemon still has the connection open, it must not reach us anymore
+        user_client->providerStopped();
+        user_client = nullptr;
+    }
+    OSSafeReleaseNULL(user_ring);
+    rx_queue.reset();
+    rx_free.reset();
+    rx_current = nullptr;
+    if (rx_pool) {
+        delete[] rx_pool;
+        rx_pool = nullptr;
+    }
+    if (rx_pool_buf) {
+        delete[] rx_pool_buf;
+        rx_pool_buf = nullptr;
+    }
+    tx_free_cnt = 0;
+    if (tx_pool_buf) {
+        delete[] tx_pool_buf;
+        tx_pool_buf = nullptr;
     }
-    if (rx_cache)
-        delete[] rx_cache;
     
     if (interrupt_source) {
         interrupt_source->disable();
@@ -104,8 +131,6 @@ void SurfaceManagementEngineClient::releaseResources() {
         OSSafeReleaseNULL(interrupt_source);
     }
     OSSafeReleaseNULL(work_loop);
-    if (queue_lock)
-        IOLockFree(queue_lock);
 }
 
 IOReturn SurfaceManagementEngineClient::registerMessageHandler(OSObject *owner, MessageHandler _handler) {
@@ -121,10 +146,24 @@ IOReturn SurfaceManagementEngineClient::registerMessageHandler(OSObject *owner,
     return kIOReturnSuccess;
 }
 
+IOReturn SurfaceManagementEngineClient::registerOwningMessageHandler(OSObject *owner, OwningMessageHandler _handler) {
+    if (!owner || !_handler)
+        return kIOReturnError;
+    if (target) {
+        LOG("Already has a handler!");
+        return kIOReturnNoResources;
+    }
+    
+    target = owner;
+    owning_handler = _handler;
+    return kIOReturnSuccess;
+}
+
 void SurfaceManagementEngineClient::unregisterMessageHandler(OSObject *owner) {
     if (target && target == owner) {
         target = nullptr;
         handler = nullptr;
+        owning_handler = nullptr;
     }
 }
 
@@ -135,6 +174,23 @@ IOReturn SurfaceManagementEngineClient::sendMessage(UInt8 *data, UInt16 data_len
     return api->sendClientMessage(this, data, data_len, blocking);
 }
 
+IOReturn SurfaceManagementEngineClient::mapDMABuffer(UInt8 buffer_id, UInt32 size) {
+    if (!api)
+        return kIOReturnNotAttached;
+    if (!active)
+        return kIOReturnNoDevice;
+    if (!size || size > properties.max_msg_length)
+        return kIOReturnBadArgument;
+    
+    return api->mapClientDMABuffer(this, buffer_id, size);
+}
+
+IOReturn SurfaceManagementEngineClient::unmapDMABuffer() {
+    if (!api)
+        return kIOReturnNotAttached;
+    return api->unmapClientDMABuffer(this);
+}
+
 void SurfaceManagementEngineClient::resetProperties(MEIClientProperty *client_props, UInt8 me_addr) {
     active = true;
     properties = *client_props;
@@ -143,47 +199,275 @@ void SurfaceManagementEngineClient::resetProperties(MEIClientProperty *client_pr
 
 void SurfaceManagementEngineClient::hostRequestDisconnect() {
     rx_cache_pos = 0;
-    
-    IOLockLock(queue_lock);
-    while (dequeue(&rx_queue));
-    IOLockUnlock(queue_lock);
+    // messages already queued belong to the old connection, notifyMessage recycles them
+    rx_epoch++;
 }
 
 void SurfaceManagementEngineClient::hostRequestReconnect() {
     
 }
 
+void SurfaceManagementEngineClient::returnMessage(UInt8 *msg) {
+    if (!rx_pool_buf || msg < rx_pool_buf || msg >= rx_pool_buf + MEI_CLIENT_RX_POOL_SIZE * properties.max_msg_length) {
+        LOG("Returning a buffer not from the pool!");
+        return;
+    }
+    MEIClientMessage *client_msg = &rx_pool[(msg - rx_pool_buf) / properties.max_msg_length];
+    // rx_free has a single producer, which is our work loop
+    work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceManagementEngineClient::returnMessageGated), this, client_msg);
+}
+
+IOReturn SurfaceManagementEngineClient::returnMessageGated(MEIClientMessage *client_msg) {
+    rx_free.push(client_msg);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Buffer the driver reads the current message into, nullptr if every buffer is still held by the handler
+ */
+UInt8 *SurfaceManagementEngineClient::acquireRxBuffer() {
+    if (user_hdr) {
+        if (!user_slot) {
+            if (user_published - user_hdr->rx_tail >= MEI_USER_RING_RX_COUNT)
+                return nullptr;
+            user_slot = userRingSlot(user_rx_offset, user_published, MEI_USER_RING_RX_COUNT);
+        }
+        return user_slot->data;
+    }
+    if (!rx_current) {
+        rx_current = rx_free.pop();
+        if (!rx_current)
+            return nullptr;
+    }
+    return rx_current->msg;
+}
+
+/*
+ * Called with the last fragment of a message acquireRxBuffer had no buffer for
+ */
+void SurfaceManagementEngineClient::dropMessage() {
+    if (user_hdr) {
+        user_hdr->rx_dropped++;
+        return;
+    }
+    if (++rx_dropped % MEI_CLIENT_STATS_INTERVAL == 1)
+        LOG("Rx buffer pool exhausted, %d messages dropped", rx_dropped);
+}
+
+UInt8 *SurfaceManagementEngineClient::acquireTxBuffer() {
+    return tx_free_cnt ? tx_free[--tx_free_cnt] : nullptr;
+}
+
+void SurfaceManagementEngineClient::releaseTxBuffer(UInt8 *buffer) {
+    if (tx_free_cnt < MEI_CLIENT_TX_POOL_SIZE)
+        tx_free[tx_free_cnt++] = buffer;
+}
+
 void SurfaceManagementEngineClient::messageComplete() {
-    if (!rx_cache_pos)
+    if (user_hdr) {
+        if (!rx_cache_pos || !user_slot)
+            return;
+        user_slot->length = rx_cache_pos;
+        rx_cache_pos = 0;
+        user_slot = nullptr;
+        OSMemoryBarrier();
+        user_hdr->rx_head = ++user_published;
+        interrupt_source->interruptOccurred(nullptr, this, 0);
+        return;
+    }
+    if (!rx_cache_pos || !rx_current)
         return;
     
-    MEIClientMessage *client_msg = new MEIClientMessage;
-    client_msg->msg = new UInt8[rx_cache_pos];
-    client_msg->len = rx_cache_pos;
-    memcpy(client_msg->msg, rx_cache, rx_cache_pos);
+    rx_current->len = rx_cache_pos;
+    rx_current->epoch = rx_epoch;
     rx_cache_pos = 0;
     
-    IOLockLock(queue_lock);
-    enqueue(&rx_queue, &client_msg->entry);
-    IOLockUnlock(queue_lock);
+    // never full as long as the queue is larger than the pool, keep the buffer for the next message otherwise
+    if (!rx_queue.push(rx_current)) {
+        rx_dropped++;
+        return;
+    }
+    rx_current = nullptr;
+    
+    UInt32 depth = rx_queue.count();
+    if (depth > rx_high_water)
+        rx_high_water = depth;
     interrupt_source->interruptOccurred(nullptr, this, 0);
 }
 
+void SurfaceManagementEngineClient::accountMessage(MEIClientRxPath path, UInt32 len, UInt64 elapsed) {
+    MEIClientRxStats *stats = &rx_stats[path];
+    stats->messages++;
+    stats->bytes += len;
+    stats->cpu_time += elapsed;
+    
+    if (++stats_cnt % MEI_CLIENT_STATS_INTERVAL == 0)
+        publishRxStats();
+}
+
+void SurfaceManagementEngineClient::publishRxStats() {
+    static const char *path_names[MEIClientRxPathCount] = {"FIFO", "DMARing", "ClientDMA"};
+    UInt64 now = mach_absolute_time();
+    UInt64 interval_ns, cpu_ns;
+    absolutetime_to_nanoseconds(now - stats_time, &interval_ns);
+    
+    OSDictionary *stats = OSDictionary::withCapacity(MEIClientRxPathCount + 3);
+    if (!stats)
+        return;
+    for (int i = 0; i < MEIClientRxPathCount; i++) {
+        MEIClientRxStats *path = &rx_stats[i];
+        if (!path->messages)
+            continue;
+        OSDictionary *entry_dict = OSDictionary::withCapacity(4);
+        if (!entry_dict)
+            continue;
+        absolutetime_to_nanoseconds(path->cpu_time / path->messages, &cpu_ns);
+        const NumberEntry entries[] = {
+            {"Messages", path->messages},
+            {"Bytes", path->bytes},
+            {"BytesPerSecond", stats_time && interval_ns ? (path->bytes - path->last_bytes) * 1000000000ULL / interval_ns : 0},
+            {"CPUNsPerMessage", cpu_ns},
+        };
+        setNumberEntries(entry_dict, entries);
+        stats->setObject(path_names[i], entry_dict);
+        entry_dict->release();
+        path->last_bytes = path->bytes;
+    }
+    const NumberEntry queue_entries[] = {
+        {"QueueDropped", rx_dropped},
+        {"QueueHighWater", rx_high_water},
+        {"QueueMaxBatch", rx_max_batch},
+    };
+    setNumberEntries(stats, queue_entries);
+    stats_time = now;
+    setProperty("RxStats", stats);
+    stats->release();
+}
+
 void SurfaceManagementEngineClient::notifyMessage(IOInterruptEventSource *sender, int count) {
     MEIClientMessage *client_msg;
-    queue_entry *item;
-    
-    IOLockLock(queue_lock);
-    while ((item = dequeue(&rx_queue)) != nullptr) {
-        IOLockUnlock(queue_lock);
-        client_msg = qe_element(item, MEIClientMessage, entry);
-        
-        if (handler)
-            handler(target, this, client_msg->msg, client_msg->len);
-        
-        delete[] client_msg->msg;
-        delete client_msg;
-        IOLockLock(queue_lock);
-    }
-    IOLockUnlock(queue_lock);
+    UInt32 batch = 0;
+    
+    // drain whatever is queued, the producer keeps appending while we run
+    while ((client_msg = rx_queue.pop()) != nullptr) {
+        batch++;
+        if (client_msg->epoch == rx_epoch) {
+            if (owning_handler && owning_handler(target, this, client_msg->msg, client_msg->len))
+                continue;
+            if (handler)
+                handler(target, this, client_msg->msg, client_msg->len);
+        }
+        rx_free.push(client_msg);
+    }
+    if (batch > rx_max_batch)
+        rx_max_batch = batch;
+    
+    UInt32 published = user_published;
+    if (user_client && published != user_notified) {
+        user_notified = published;
+        user_client->notifyRing();
+    }
+}
+
+/*
+ * The header is writable by the daemon, so the layout is only ever taken from our own copy
+ */
+inline MEIUserRingSlot *SurfaceManagementEngineClient::userRingSlot(UInt32 offset, UInt32 idx, UInt32 count) {
+    UInt8 *base = reinterpret_cast<UInt8 *>(user_ring->getBytesNoCopy());
+    return reinterpret_cast<MEIUserRingSlot *>(base + offset + (idx & (count - 1)) * user_slot_size);
+}
+
+IOReturn SurfaceManagementEngineClient::openUserRing(SurfaceManagementEngineUserClient *owner, IOBufferMemoryDescriptor **ring) {
+    if (!api || !work_loop)
+        return kIOReturnNotAttached;
+    if (user_ring)
+        return kIOReturnExclusiveAccess;
+    
+    UInt32 hdr_size = (sizeof(MEIUserRingHeader) + 63) & ~63;
+    UInt32 slot_size = (sizeof(MEIUserRingSlot) + properties.max_msg_length + 63) & ~63;
+    UInt32 size = hdr_size + (MEI_USER_RING_RX_COUNT + MEI_USER_RING_TX_COUNT) * slot_size;
+    IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut | kIOMemoryKernelUserShared, size, PAGE_SIZE);
+    if (!buffer)
+        return kIOReturnNoMemory;
+    memset(buffer->getBytesNoCopy(), 0, size);
+    
+    MEIUserRingHeader *hdr = reinterpret_cast<MEIUserRingHeader *>(buffer->getBytesNoCopy());
+    hdr->slot_size = slot_size;
+    hdr->max_msg_length = properties.max_msg_length;
+    hdr->rx_count = MEI_USER_RING_RX_COUNT;
+    hdr->tx_count = MEI_USER_RING_TX_COUNT;
+    hdr->rx_offset = hdr_size;
+    hdr->tx_offset = hdr_size + MEI_USER_RING_RX_COUNT * slot_size;
+    user_slot_size = slot_size;
+    user_rx_offset = hdr->rx_offset;
+    user_tx_offset = hdr->tx_offset;
+    user_ring = buffer;
+    
+    work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceManagementEngineClient::setUserClientGated), this, owner);
+    // the driver fills rx slots from its own work loop
+    api->runGated(this, OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceManagementEngineClient::setUserRingGated), hdr);
+    
+    buffer->retain();
+    *ring = buffer;
+    return kIOReturnSuccess;
+}
+
+void SurfaceManagementEngineClient::closeUserRing(SurfaceManagementEngineUserClient *owner) {
+    if (!api || !user_ring || user_client != owner)
+        return;
+    
+    api->runGated(this, OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceManagementEngineClient::setUserRingGated), nullptr);
+    work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceManagementEngineClient::setUserClientGated), this, nullptr);
+    OSSafeReleaseNULL(user_ring);
+}
+
+IOReturn SurfaceManagementEngineClient::setUserRingGated(MEIUserRingHeader *hdr) {
+    // drop whatever partial message was being assembled, it is on the wrong side now
+    rx_cache_pos = 0;
+    user_slot = nullptr;
+    user_published = 0;
+    user_hdr = hdr;
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceManagementEngineClient::setUserClientGated(SurfaceManagementEngineUserClient *owner) {
+    user_client = owner;
+    user_notified = 0;
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceManagementEngineClient::submitUserMessages() {
+    if (!work_loop)
+        return kIOReturnNotAttached;
+    // the tx ring has a single consumer, which is our work loop
+    return work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceManagementEngineClient::submitUserMessagesGated), this);
+}
+
+IOReturn SurfaceManagementEngineClient::submitUserMessagesGated() {
+    MEIUserRingHeader *hdr = user_ring ? reinterpret_cast<MEIUserRingHeader *>(user_ring->getBytesNoCopy()) : nullptr;
+    if (!hdr || !user_client)
+        return kIOReturnNotOpen;
+    
+    IOReturn ret = kIOReturnSuccess;
+    UInt32 tail = hdr->tx_tail;
+    UInt32 head = hdr->tx_head;
+    // the daemon owns head, never trust it for more than one lap
+    if (head - tail > MEI_USER_RING_TX_COUNT)
+        return kIOReturnBadArgument;
+    OSMemoryBarrier();
+    
+    for (; tail != head; tail++) {
+        MEIUserRingSlot *slot = userRingSlot(user_tx_offset, tail, MEI_USER_RING_TX_COUNT);
+        UInt32 length = slot->length;
+        if (length > properties.max_msg_length) {
+            ret = kIOReturnMessageTooLarge;
+            continue;
+        }
+        ret = sendMessage(slot->data, length, false);
+        if (ret != kIOReturnSuccess)
+            break;
+    }
+    OSMemoryBarrier();
+    hdr->tx_tail = tail;
+    return ret;
 }
@@ -10,21 +10,99 @@
 #define SurfaceManagementEngineClient_hpp
 
 #include "SurfaceManagementEngineDriver.hpp"
+#include "MEIUserRing.h"
+
+#define MEI_CLIENT_STATS_INTERVAL   256
+#define MEI_CLIENT_RX_POOL_SIZE     16
+#define MEI_CLIENT_RX_QUEUE_SIZE    32  /* power of 2, larger than the pool */
+#define MEI_CLIENT_TX_POOL_SIZE     8
+#define MEI_CLIENT_CACHE_LINE_SIZE  64
+
+/*
+ * How the payload of a client message reached the host
+ * ClientDMA counts messages whose payload ME wrote into the mapped buffer, told apart by their GSC extended header
+ */
+enum MEIClientRxPath {
+    MEIClientRxFIFO = 0,
+    MEIClientRxDMARing,
+    MEIClientRxClientDMA,
+    MEIClientRxPathCount,
+};
+
+struct MEIClientRxStats {
+    UInt64  messages;
+    UInt64  bytes;
+    UInt64  cpu_time;
+    UInt64  last_bytes;
+};
 
 struct MEIClientMessage {
-    queue_entry entry;
     UInt8*      msg;
     UInt16      len;
+    UInt32      epoch;
+};
+
+/*
+ * Bounded single producer single consumer queue, head is only written by the producer and tail by the consumer
+ * kalloc gives no cache line alignment, so head and tail are kept apart by padding rather than alignas
+ */
+template <UInt32 N>
+struct MEIClientMessageQueue {
+    static_assert((N & (N - 1)) == 0, "queue size must be a power of 2");
+    
+    MEIClientMessage*   slots[N];
+    UInt8               head_pad[MEI_CLIENT_CACHE_LINE_SIZE];
+    volatile UInt32     head;
+    UInt8               tail_pad[MEI_CLIENT_CACHE_LINE_SIZE - sizeof(UInt32)];
+    volatile UInt32     tail;
+    UInt8               end_pad[MEI_CLIENT_CACHE_LINE_SIZE - sizeof(UInt32)];
+    
+    void reset() {
+        head = 0;
+        tail = 0;
+    }
+    
+    UInt32 count() {
+        return head - tail;
+    }
+    
+    bool push(MEIClientMessage *msg) {
+        UInt32 h = head;
+        if (h - tail == N)
+            return false;
+        slots[h & (N - 1)] = msg;
+        OSMemoryBarrier();
+        head = h + 1;
+        return true;
+    }
+    
+    MEIClientMessage *pop() {
+        UInt32 t = tail;
+        if (t == head)
+            return nullptr;
+        OSMemoryBarrier();
+        MEIClientMessage *msg = slots[t & (N - 1)];
+        OSMemoryBarrier();
+        tail = t + 1;
+        return msg;
+    }
 };
 
+class SurfaceManagementEngineUserClient;
+
 class EXPORT SurfaceManagementEngineClient : public IOService {
     OSDeclareDefaultStructors(SurfaceManagementEngineClient);
     friend class SurfaceManagementEngineDriver;
     
 public:
-    // handle received message
+    // handle received message, msg is only valid for the duration of the call
     typedef void (*MessageHandler)(OSObject *owner, SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len);
     
+    /*
+     * msg is a pool buffer, return true to keep it past the call and hand it back later with returnMessage
+     */
+    typedef bool (*OwningMessageHandler)(OSObject *owner, SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len);
+    
     bool attach(IOService* provider) override;
     
     void detach(IOService* provider) override;
@@ -37,22 +115,68 @@ public:
     
     IOReturn registerMessageHandler(OSObject *owner, MessageHandler _handler);
     
+    IOReturn registerOwningMessageHandler(OSObject *owner, OwningMessageHandler _handler);
+    
     void unregisterMessageHandler(OSObject *owner);
     
     IOReturn sendMessage(UInt8 *data, UInt16 data_len, bool blocking);
     
+    void returnMessage(UInt8 *msg);
+    
+    // ME writes large payloads into a buffer of its own, messages still arrive through the handler or the user ring
+    IOReturn mapDMABuffer(UInt8 buffer_id, UInt32 size);
+    
+    IOReturn unmapDMABuffer();
+    
+    // shared ring for the IPTS daemon, see MEIUserRing.h
+    IOReturn openUserRing(SurfaceManagementEngineUserClient *owner, IOBufferMemoryDescriptor **ring);
+    
+    void closeUserRing(SurfaceManagementEngineUserClient *owner);
+    
+    IOReturn submitUserMessages();
+    
 private:
     SurfaceManagementEngineDriver*      api {nullptr};
-    IOLock*                             queue_lock {nullptr};
     IOWorkLoop*                         work_loop {nullptr};
     IOInterruptEventSource*             interrupt_source {nullptr};
     MEIClientProperty                   properties;
     
     OSObject*       target {nullptr};
     MessageHandler  handler {nullptr};
-    queue_head_t    rx_queue;
-    UInt8*          rx_cache {nullptr};
+    OwningMessageHandler    owning_handler {nullptr};
+    // filled buffers go driver -> client work loop, recycled ones come back the other way
+    MEIClientMessageQueue<MEI_CLIENT_RX_QUEUE_SIZE> rx_queue {};
+    MEIClientMessageQueue<MEI_CLIENT_RX_QUEUE_SIZE> rx_free {};
+    MEIClientMessage*   rx_pool {nullptr};
+    UInt8*              rx_pool_buf {nullptr};
+    MEIClientMessage*   rx_current {nullptr};
+    volatile UInt32     rx_epoch {0};
     UInt16          rx_cache_pos {0};
+    UInt32          rx_dropped {0};
+    UInt32          rx_high_water {0};
+    UInt32          rx_max_batch {0};
+    // payload copies of queued non-blocking sends, only touched on the driver's gate
+    UInt8*          tx_pool_buf {nullptr};
+    UInt8*          tx_free[MEI_CLIENT_TX_POOL_SIZE] {};
+    UInt32          tx_free_cnt {0};
+    
+    SurfaceManagementEngineUserClient*  user_client {nullptr};
+    IOBufferMemoryDescriptor*           user_ring {nullptr};
+    MEIUserRingHeader*                  user_hdr {nullptr};
+    MEIUserRingSlot*                    user_slot {nullptr};
+    volatile UInt32                     user_published {0};
+    UInt32                              user_notified {0};
+    UInt32                              user_slot_size {0};
+    UInt32                              user_rx_offset {0};
+    UInt32                              user_tx_offset {0};
+    
+    MEIDMABuffer        dma {};
+    UInt8               dma_buffer_id {0};
+    bool                dma_mapped {false};
+    
+    MEIClientRxStats    rx_stats[MEIClientRxPathCount] {};
+    UInt64              stats_time {0};
+    UInt32              stats_cnt {0};
     
     UInt8   addr;
     bool    active {false};
@@ -66,8 +190,30 @@ private:
     
     void hostRequestReconnect();
     
+    UInt8 *acquireRxBuffer();
+    
+    void dropMessage();
+    
+    UInt8 *acquireTxBuffer();
+    
+    void releaseTxBuffer(UInt8 *buffer);
+    
     void messageComplete();
     
+    IOReturn returnMessageGated(MEIClientMessage *client_msg);
+    
+    inline MEIUserRingSlot *userRingSlot(UInt32 offset, UInt32 idx, UInt32 count);
+    
+    IOReturn setUserRingGated(MEIUserRingHeader *hdr);
+    
+    IOReturn setUserClientGated(SurfaceManagementEngineUserClient *owner);
+    
+    IOReturn submitUserMessagesGated();
+    
+    void accountMessage(MEIClientRxPath path, UInt32 len, UInt64 elapsed);
+    
+    void publishRxStats();
+    
     void notifyMessage(IOInterruptEventSource *sender, int count);
 };
 
@@ -12,6 +12,11 @@
 #define super IOService
 OSDefineMetaClassAndStructors(SurfaceManagementEngineDriver, IOService);
 
+// ME clients we publish a SurfaceManagementEngineClient for, add new ones here
+static const unsigned char *MEISupportedClients[] = {
+    SURFACE_IPTS_CLIENT_UUID,
+};
+
 void bitmap_set_bit(UInt8 *map, UInt addr, bool set) {
     UInt i = addr / 8;
     UInt offset = addr % 8;
@@ -41,6 +46,14 @@ bool SurfaceManagementEngineDriver::init(OSDictionary* properties) {
     memset(&device, 0, sizeof(MEIPhysicalDevice));
     memset(&bus, 0, sizeof(MEIBus));
     queue_init(&bus.tx_queue);
+    queue_init(&tx_free);
+    for (int i = 0; i < MEI_TX_POOL_SIZE; i++) {
+        tx_pool[i].pooled = true;
+        enqueue(&tx_free, &tx_pool[i].entry);
+    }
+    memset(&idle, 0, sizeof(MEIIdlePolicy));
+    idle.delay_ms = MEI_DEVICE_IDLE_TIMEOUT * 1000;
+    memset(&poll, 0, sizeof(MEIPollPolicy));
     
     return true;
 }
@@ -112,7 +125,7 @@ bool SurfaceManagementEngineDriver::start(IOService* provider) {
     
     PMinit();
     device.pci_dev->joinPMtree(this);
-    registerPowerDriver(this, MyIOPMPowerStates, kIOPMNumberPowerStates);
+    registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
 
     device.pci_dev->retain();
     registerService();
@@ -186,6 +199,12 @@ void SurfaceManagementEngineDriver::releaseResources() {
         work_loop->removeEventSource(idle_timeout);
         OSSafeReleaseNULL(idle_timeout);
     }
+    if (poll_timer) {
+        poll_timer->cancelTimeout();
+        poll_timer->disable();
+        work_loop->removeEventSource(poll_timer);
+        OSSafeReleaseNULL(poll_timer);
+    }
     if (reset_work) {
         reset_work->disable();
         work_loop->removeEventSource(reset_work);
@@ -202,6 +221,7 @@ void SurfaceManagementEngineDriver::releaseResources() {
         OSSafeReleaseNULL(resume_work);
     }
     unmapMemory();
+    freeDMARing();
     if (device.pci_dev->isOpen(this))
         device.pci_dev->close(this);
     if (command_gate) {
@@ -209,10 +229,9 @@ void SurfaceManagementEngineDriver::releaseResources() {
         OSSafeReleaseNULL(command_gate);
     }
     OSSafeReleaseNULL(work_loop);
-    if (ipts_client) {
-        ipts_client->stop(this);
-        ipts_client->detach(this);
-        OSSafeReleaseNULL(ipts_client);
+    for (UInt addr = 0; addr < MEI_MAX_CLIENT_NUM; addr++) {
+        if (me_clients[addr])
+            removeClient(addr);
     }
     
     OSSafeReleaseNULL(device.pci_dev);
@@ -296,6 +315,22 @@ IOReturn SurfaceManagementEngineDriver::restartDeviceGated() {
 }
 
 IOReturn SurfaceManagementEngineDriver::mapMemory() {
+#ifdef MEI_DEVICE_MODEL
+    if (!model) {
+        MEIClientProperty props;
+        memset(&props, 0, sizeof(MEIClientProperty));
+        uuid_copy(props.uuid, SURFACE_IPTS_CLIENT_UUID);
+        props.protocol_version = 1;
+        props.max_connection_num = 1;
+        props.fixed_address = MEI_MODEL_IPTS_ADDR;
+        props.max_msg_length = MEI_MODEL_IPTS_MSG_LENGTH;
+        model = new MEIDeviceModel;
+        model->setInterruptHandler(this, &SurfaceManagementEngineDriver::modelInterrupt);
+        model->addClient(MEI_MODEL_IPTS_ADDR, &props, nullptr, nullptr);
+        LOG("Running against the device model");
+    }
+    return kIOReturnSuccess;
+#endif
     if (device.pci_dev->getDeviceMemoryCount() == 0) {
         return kIOReturnDeviceError;
     } else {
@@ -306,10 +341,20 @@ IOReturn SurfaceManagementEngineDriver::mapMemory() {
 }
 
 void SurfaceManagementEngineDriver::unmapMemory() {
+#ifdef MEI_DEVICE_MODEL
+    if (model) {
+        delete model;
+        model = nullptr;
+    }
+#endif
     OSSafeReleaseNULL(device.mmap);
 }
 
 inline UInt32 SurfaceManagementEngineDriver::readRegister(int offset) {
+#ifdef MEI_DEVICE_MODEL
+    if (model)
+        return model->readRegister(offset);
+#endif
     if (device.mmap) {
          IOVirtualAddress address = device.mmap->getVirtualAddress();
          if (address != 0)
@@ -319,6 +364,12 @@ inline UInt32 SurfaceManagementEngineDriver::readRegister(int offset) {
 }
 
 inline void SurfaceManagementEngineDriver::writeRegister(UInt32 value, int offset) {
+#ifdef MEI_DEVICE_MODEL
+    if (model) {
+        model->writeRegister(value, offset);
+        return;
+    }
+#endif
     if (device.mmap) {
         IOVirtualAddress address = device.mmap->getVirtualAddress();
         if (address != 0)
@@ -326,6 +377,46 @@ inline void SurfaceManagementEngineDriver::writeRegister(UInt32 value, int offse
     }
 }
 
+#ifdef MEI_DEVICE_MODEL
+/*
+ * Raised from inside register accesses, filter like the MSI would and leave the rest to the work loop
+ */
+void SurfaceManagementEngineDriver::modelInterrupt(void *owner) {
+    SurfaceManagementEngineDriver *that = static_cast<SurfaceManagementEngineDriver *>(owner);
+    if (that->interrupt_source && that->filterInterrupt(that->interrupt_source))
+        that->interrupt_source->signalInterrupt();
+}
+
+void SurfaceManagementEngineDriver::publishModelStats() {
+    if (!model)
+        return;
+    const MEIDeviceModelStats *model_stats = model->getStats();
+    OSDictionary *stats = OSDictionary::withCapacity(15);
+    if (!stats)
+        return;
+    const NumberEntry entries[] = {
+        {"RegisterReads", model_stats->register_reads},
+        {"RegisterWrites", model_stats->register_writes},
+        {"Interrupts", model_stats->interrupts},
+        {"HostBusMessages", model_stats->host_messages},
+        {"UnknownMessages", model_stats->unknown_messages},
+        {"ClientRxMessages", model_stats->client_rx},
+        {"ClientRxBytes", model_stats->client_rx_bytes},
+        {"ClientTxMessages", model_stats->client_tx},
+        {"ClientTxBytes", model_stats->client_tx_bytes},
+        {"Dropped", model_stats->dropped},
+        {"Overruns", model_stats->overruns},
+        {"Resets", model_stats->resets},
+        {"PowerGatingEntries", model_stats->pg_entries},
+        {"PowerGatingExits", model_stats->pg_exits},
+        {"BacklogHighWater", model_stats->backlog_high_water},
+    };
+    setNumberEntries(stats, entries);
+    setProperty("DeviceModel", stats);
+    stats->release();
+}
+#endif
+
 UInt8 SurfaceManagementEngineDriver::calcFilledSlots() {
     UInt32 hcsr = readRegister(MEI_H_CSR);
     SInt8 read_ptr = (hcsr & MEI_CSR_BUF_RPOINTER) >> 8;
@@ -440,12 +531,14 @@ IOReturn SurfaceManagementEngineDriver::initDevice() {
     
     init_timeout = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SurfaceManagementEngineDriver::initialiseTimeout));
     idle_timeout = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SurfaceManagementEngineDriver::enterIdle));
-    if (!init_timeout || !idle_timeout) {
+    poll_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SurfaceManagementEngineDriver::pollDevice));
+    if (!init_timeout || !idle_timeout || !poll_timer) {
         LOG("Failed to create timer for device");
         return kIOReturnError;
     }
     work_loop->addEventSource(init_timeout);
     work_loop->addEventSource(idle_timeout);
+    work_loop->addEventSource(poll_timer);
     
     return kIOReturnSuccess;
 }
@@ -461,6 +554,8 @@ IOReturn SurfaceManagementEngineDriver::resetDevice() {
         LOG("Warning! Unexpected reset call from state: %x", device.state);
     }
     clearInterrupts();
+    // the reset decides on interrupts itself
+    stopPolling(false);
     // put bus into idle before actual reset
     init_timeout->cancelTimeout();
     bus.state = MEIBusIdle;
@@ -497,6 +592,7 @@ IOReturn SurfaceManagementEngineDriver::resetDevice() {
     if (!interrupts_enabled)
         hcsr &= ~MEI_H_CSR_INT_ENABLE_MASK;
 
+    hw_ready = false;
     writeRegister(hcsr, MEI_H_CSR);
 
     // Host reads the MEI_H_CSR once to ensure that the posted write to MEI_H_CSR completes.
@@ -527,8 +623,10 @@ sw_reset:
             // Give up work_loop's thread to let pending transactions to finish their work on gate.
             command_gate->commandSleep(&awake, deadline, THREAD_INTERRUPTIBLE);
         }
-        if (ipts_client)
-            ipts_client->hostRequestDisconnect();
+        for (UInt addr = 0; addr < MEI_MAX_CLIENT_NUM; addr++) {
+            if (me_clients[addr])
+                me_clients[addr]->hostRequestDisconnect();
+        }
     }
     resetBus();
 
@@ -582,11 +680,15 @@ IOReturn SurfaceManagementEngineDriver::waitDeviceReady() {
     IOReturn sleep;
     nanoseconds_to_absolutetime(MEI_HW_READY_TIMEOUT * 1000000000ULL, &abstime);
     clock_absolutetime_interval_to_deadline(abstime, &deadline);
-    sleep = command_gate->commandSleep(&wait_hw_ready, deadline, THREAD_INTERRUPTIBLE);
-    if (sleep == THREAD_TIMED_OUT) {
-        LOG("Timeout waiting for hardware to be ready!");
-        return kIOReturnTimeout;
+    // the interrupt may have come in while the reset flow slept for something else
+    if (!hw_ready) {
+        sleep = command_gate->commandSleep(&wait_hw_ready, deadline, THREAD_INTERRUPTIBLE);
+        if (sleep == THREAD_TIMED_OUT && !hw_ready) {
+            LOG("Timeout waiting for hardware to be ready!");
+            return kIOReturnTimeout;
+        }
     }
+    hw_ready = false;
 
     deresetDevice();
     LOG("Hardware is ready");
@@ -660,14 +762,24 @@ void SurfaceManagementEngineDriver::configDeviceFeatures() {
 //    LOG("vtag                             %d", device.vt_supported);
 //    LOG("capabilities message             %d", device.cap_supported);
 //    LOG("client dma                       %d", device.cd_supported);
-    
-    device.dr_supported = false;
-    device.cd_supported = false;
 }
 
 void SurfaceManagementEngineDriver::resetBus() {
-    if (ipts_client)
-        ipts_client->active = false;
+    for (UInt addr = 0; addr < MEI_MAX_CLIENT_NUM; addr++) {
+        if (!me_clients[addr])
+            continue;
+        me_clients[addr]->active = false;
+        // ME forgets the mapping, the buffer is kept so that it can be mapped again
+        me_clients[addr]->dma_mapped = false;
+    }
+    if (cd_client) {
+        // an unmap in flight is done now, nothing can write into the buffer any more
+        if (!cd_map)
+            freeDMABuffer(&cd_client->dma);
+        cd_client = nullptr;
+        cd_status = kIOReturnAborted;
+        command_gate->commandWakeup(&wait_client_dma);
+    }
     
     init_timeout->cancelTimeout();
     bus.state = MEIBusIdle;
@@ -737,6 +849,9 @@ IOReturn SurfaceManagementEngineDriver::enterPowerGatingSync() {
 on:
     ret = kIOReturnSuccess;
     device.pg_state = MEIPowerGatingOn;
+    idle.pg_entries++;
+    idle.gated_time = mach_absolute_time();
+    publishPowerGatingStats();
     LOG("Enter d0i3 mode");
 out:
     device.pg_event = MEIPowerGatingEventIdle;
@@ -746,6 +861,7 @@ out:
 IOReturn SurfaceManagementEngineDriver::exitPowerGatingSync() {
     IOReturn ret;
     AbsoluteTime abstime, deadline;
+    UInt64 start = 0;
 
     device.pg_event = MEIPowerGatingInterruptWait;
     UInt32 reg = readRegister(MEI_H_D0I3C);
@@ -753,6 +869,7 @@ IOReturn SurfaceManagementEngineDriver::exitPowerGatingSync() {
         LOG("No need to exit d0i3");
         goto off;
     }
+    start = mach_absolute_time();
 
     reg &= ~MEI_H_D0I3C_I3;
     reg |= MEI_H_D0I3C_IR;
@@ -774,6 +891,8 @@ IOReturn SurfaceManagementEngineDriver::exitPowerGatingSync() {
 off:
     ret = kIOReturnSuccess;
     device.pg_state = MEIPowerGatingOff;
+    if (start)
+        recordPowerGatingExit(start);
     LOG("Exit d0i3 mode");
 out:
     device.pg_event = MEIPowerGatingEventIdle;
@@ -791,6 +910,89 @@ void SurfaceManagementEngineDriver::readMessage(UInt8 *buffer, UInt16 buffer_len
     setHostInterrupt();
 }
 
+IOReturn SurfaceManagementEngineDriver::allocateDMABuffer(MEIDMABuffer *dma, UInt32 size) {
+    UInt64 offset = 0;
+    UInt32 num_segments = 1;
+    IODMACommand::Segment64 segment;
+    
+    dma->buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous, size, DMA_BIT_MASK(64) & ~(static_cast<UInt64>(PAGE_SIZE) - 1));
+    if (!dma->buffer)
+        return kIOReturnNoMemory;
+    dma->dma_cmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, size, IODMACommand::kMapped, size, PAGE_SIZE);
+    if (!dma->dma_cmd || dma->dma_cmd->setMemoryDescriptor(dma->buffer) != kIOReturnSuccess)
+        goto err;
+    if (dma->dma_cmd->genIOVMSegments(&offset, &segment, &num_segments) != kIOReturnSuccess || num_segments != 1)
+        goto err;
+    
+    dma->bus_addr = segment.fIOVMAddr;
+    dma->size = size;
+    dma->vaddr = reinterpret_cast<UInt8 *>(dma->buffer->getBytesNoCopy());
+    memset(dma->vaddr, 0, size);
+    return kIOReturnSuccess;
+err:
+    freeDMABuffer(dma);
+    return kIOReturnNoResources;
+}
+
+void SurfaceManagementEngineDriver::freeDMABuffer(MEIDMABuffer *dma) {
+    if (dma->dma_cmd) {
+        dma->dma_cmd->clearMemoryDescriptor();
+        OSSafeReleaseNULL(dma->dma_cmd);
+    }
+    OSSafeReleaseNULL(dma->buffer);
+    dma->bus_addr = 0;
+    dma->size = 0;
+    dma->vaddr = nullptr;
+}
+
+IOReturn SurfaceManagementEngineDriver::allocateDMARing() {
+    static const UInt32 sizes[MEIDMADescriptorSize] = {MEI_DMA_RING_HOST_SIZE, MEI_DMA_RING_DEVICE_SIZE, MEI_DMA_RING_CTRL_SIZE};
+    for (int i = 0; i < MEIDMADescriptorSize; i++) {
+        if (device.dr_dscr[i].buffer)
+            continue;
+        if (allocateDMABuffer(&device.dr_dscr[i], sizes[i]) != kIOReturnSuccess) {
+            LOG("Could not allocate dma ring, using the circular buffer only");
+            freeDMARing();
+            return kIOReturnNoMemory;
+        }
+    }
+    return kIOReturnSuccess;
+}
+
+void SurfaceManagementEngineDriver::freeDMARing() {
+    for (int i = 0; i < MEIDMADescriptorSize; i++)
+        freeDMABuffer(&device.dr_dscr[i]);
+}
+
+void SurfaceManagementEngineDriver::resetDMARing() {
+    MEIDMABuffer *ctrl = &device.dr_dscr[MEIDMADescriptorControl];
+    if (ctrl->vaddr)
+        memset(ctrl->vaddr, 0, sizeof(MEIBusDMARingControl));
+}
+
+/*
+ * Copy a message out of the device ring and hand the slots back, a nullptr buffer drops the message
+ */
+void SurfaceManagementEngineDriver::readDMARing(UInt8 *buffer, UInt32 len) {
+    MEIDMABuffer *ring = &device.dr_dscr[MEIDMADescriptorDevice];
+    UInt8 *ctrl = device.dr_dscr[MEIDMADescriptorControl].vaddr;
+    if (!ctrl || !len)
+        return;
+    
+    volatile UInt32 *rd_idx = MEI_DMA_RING_INDEX(ctrl, dbuf_rd_idx);
+    UInt32 idx = *rd_idx;
+    if (buffer) {
+        UInt32 offset = MEI_SLOTS_TO_DATA(idx & (ring->size / MEI_SLOT_SIZE - 1));
+        UInt32 first = ring->size - offset < len ? ring->size - offset : len;
+        memcpy(buffer, ring->vaddr + offset, first);
+        if (first < len)
+            memcpy(buffer + first, ring->vaddr, len - first);
+    }
+    // ME may reuse the slots as soon as the index moves
+    OSMemoryBarrier();
+    *rd_idx = idx + MEI_DATA_TO_SLOTS(len);
+}
+
 IOReturn SurfaceManagementEngineDriver::writeMessage(UInt8 *header, UInt16 header_len, UInt8 *data, UInt16 data_len) {
     if (!header || !data || header_len % MEI_SLOT_SIZE) {
         LOG("Message invalid!");
@@ -810,10 +1012,10 @@ IOReturn SurfaceManagementEngineDriver::writeMessage(UInt8 *header, UInt16 heade
     }
 
     const MEI_SLOT_TYPE *buf = reinterpret_cast<MEI_SLOT_TYPE *>(header);
-    for (int i = 0; i < header_len / MEI_SLOT_SIZE; i++)
+    for (UInt16 i = 0; i < header_len / MEI_SLOT_SIZE; i++)
         writeRegister(buf[i], MEI_H_CB_WW);
     buf = reinterpret_cast<MEI_SLOT_TYPE *>(data);
-    for (int i = 0; i < data_len / MEI_SLOT_SIZE; i++)
+    for (UInt16 i = 0; i < data_len / MEI_SLOT_SIZE; i++)
         writeRegister(buf[i], MEI_H_CB_WW);
     UInt8 tail = data_len % MEI_SLOT_SIZE;
     if (tail > 0) {
@@ -856,39 +1058,145 @@ IOReturn SurfaceManagementEngineDriver::sendClientMessageGated(SurfaceManagement
         return kIOReturnAborted;
     }
     
-    MEIClientTransaction *tx = new MEIClientTransaction;
+    // Nothing ahead of us and room in the host buffer, write from the caller's buffer
+    MEIClientTransaction direct;
+    direct.client = client;
+    direct.data = buffer;
+    direct.data_len = *buffer_len;
+    direct.completed = false;
+    if (queue_empty(&bus.tx_queue) && acquireWriteBuffer() && submitTransaction(&direct)) {
+        if (!direct.completed) {
+            LOG("Failed to send message!");
+            return kIOReturnIOError;
+        }
+        tx_stats.direct++;
+        if (++tx_msg_cnt % MEI_TX_STATS_INTERVAL == 0)
+            publishTxStats();
+        noteActivity();
+        return kIOReturnSuccess;
+    }
+    
+    // Queue whatever is left, data and data_len already skip a partially written part
+    MEIClientTransaction *tx = acquireTransaction();
+    if (!tx)
+        return kIOReturnNoMemory;
     tx->client = client;
-    tx->data_len = *buffer_len;
-    tx->data = new UInt8[tx->data_len];
-    memcpy(tx->data, buffer, tx->data_len);
+    tx->data_len = direct.data_len;
     tx->completed = false;
     tx->blocking = *blocking;
-    
-    IOReturn ret = kIOReturnSuccess;
-    if (acquireWriteBuffer() && submitTransaction(tx)) {
-        delete[] tx->data;
-        delete tx;
+    if (tx->blocking) {
+        tx->payload = nullptr;
+        tx->payload_type = MEITxPayloadBorrowed;
+        tx->data = direct.data;
+        tx_stats.borrowed++;
     } else {
-        enqueue(&bus.tx_queue, &tx->entry);
-        if (tx->blocking) {
-            AbsoluteTime abstime, deadline;
-            nanoseconds_to_absolutetime(MEI_CLIENT_SEND_MSG_TIMEOUT * 1000000ULL, &abstime);
-            clock_absolutetime_interval_to_deadline(abstime, &deadline);
-            command_gate->commandSleep(&tx->wait, deadline, THREAD_INTERRUPTIBLE);
-            if (!tx->completed) {
-                LOG("Failed to send message!");
-                ret = kIOReturnTimeout;
+        tx->payload = client->acquireTxBuffer();
+        tx->payload_type = MEITxPayloadClientPool;
+        if (!tx->payload) {
+            tx->payload = new UInt8[client->properties.max_msg_length];
+            tx->payload_type = MEITxPayloadAllocated;
+            if (!tx->payload) {
+                releaseTransaction(tx);
+                return kIOReturnNoMemory;
             }
+            tx_stats.allocations++;
+            tx_stats.pool_misses++;
+        }
+        memcpy(tx->payload, direct.data, tx->data_len);
+        tx->data = tx->payload;
+    }
+    tx_stats.queued++;
+    if (++tx_msg_cnt % MEI_TX_STATS_INTERVAL == 0)
+        publishTxStats();
+    
+    IOReturn ret = kIOReturnSuccess;
+    tx->queued = true;
+    enqueue(&bus.tx_queue, &tx->entry);
+    if (tx->blocking) {
+        AbsoluteTime abstime, deadline;
+        nanoseconds_to_absolutetime(MEI_CLIENT_SEND_MSG_TIMEOUT * 1000000ULL, &abstime);
+        clock_absolutetime_interval_to_deadline(abstime, &deadline);
+        command_gate->commandSleep(&tx->wait, deadline, THREAD_INTERRUPTIBLE);
+        if (!tx->completed) {
+            LOG("Failed to send message!");
+            ret = kIOReturnTimeout;
+        }
+        // the caller's buffer must not be touched once we return
+        if (tx->queued) {
             remqueue(&tx->entry);
-            delete[] tx->data;
-            delete tx;
+            tx->queued = false;
         }
+        releaseTransaction(tx);
     }
     
-    idle_timeout->setTimeoutMS(MEI_DEVICE_IDLE_TIMEOUT * 1000);
+    noteActivity();
     return ret;
 }
 
+IOReturn SurfaceManagementEngineDriver::runGated(OSObject *target, IOWorkLoop::Action action, void *arg0) {
+    return work_loop->runAction(action, target, arg0);
+}
+
+IOReturn SurfaceManagementEngineDriver::mapClientDMABuffer(SurfaceManagementEngineClient *client, UInt8 buffer_id, UInt32 size) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceManagementEngineDriver::mapClientDMABufferGated), client, &buffer_id, &size);
+}
+
+IOReturn SurfaceManagementEngineDriver::mapClientDMABufferGated(SurfaceManagementEngineClient *client, UInt8 *buffer_id, UInt32 *size) {
+    if (device.state != MEIDeviceEnabled || !client->active)
+        return kIOReturnNoDevice;
+    if (!device.cd_supported)
+        return kIOReturnUnsupported;
+    if (client->dma.buffer)
+        return kIOReturnExclusiveAccess;
+    
+    if (cd_client)
+        return kIOReturnBusy;
+    if (device.pg_state == MEIPowerGatingOn && exitPowerGatingSync() != kIOReturnSuccess) {
+        LOG("Failed to get device active");
+        return kIOReturnAborted;
+    }
+    
+    if (allocateDMABuffer(&client->dma, (*size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) != kIOReturnSuccess)
+        return kIOReturnNoMemory;
+    client->dma_buffer_id = *buffer_id;
+    
+    IOReturn ret = sendClientDMARequest(client, true);
+    if (ret != kIOReturnSuccess) {
+        LOG("Client dma map failed, using the circular buffer only");
+        freeDMABuffer(&client->dma);
+        return ret;
+    }
+    return waitClientDMA();
+}
+
+IOReturn SurfaceManagementEngineDriver::unmapClientDMABuffer(SurfaceManagementEngineClient *client) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceManagementEngineDriver::unmapClientDMABufferGated), client);
+}
+
+IOReturn SurfaceManagementEngineDriver::unmapClientDMABufferGated(SurfaceManagementEngineClient *client) {
+    if (!client->dma.buffer)
+        return kIOReturnNotOpen;
+    if (cd_client)
+        return kIOReturnBusy;
+    
+    if (client->dma_mapped && device.state == MEIDeviceEnabled) {
+        if (device.pg_state == MEIPowerGatingOn && exitPowerGatingSync() != kIOReturnSuccess) {
+            LOG("Failed to get device active");
+            return kIOReturnAborted;
+        }
+        // the buffer is freed once ME confirms, a refusal keeps it as ME may still write into it
+        IOReturn ret = sendClientDMARequest(client, false);
+        if (ret == kIOReturnSuccess)
+            ret = waitClientDMA();
+        if (ret != kIOReturnSuccess)
+            LOG("Client dma unmap failed");
+        return ret;
+    }
+    client->dma_mapped = false;
+    freeDMABuffer(&client->dma);
+    return kIOReturnSuccess;
+}
+
 IOReturn SurfaceManagementEngineDriver::sendStartRequest() {
     MEIBusMessageHeader header;
     MEIBusHostVersionRequest req;
@@ -950,6 +1258,118 @@ IOReturn SurfaceManagementEngineDriver::sendCapabilityRequest() {
     return kIOReturnSuccess;
 }
 
+IOReturn SurfaceManagementEngineDriver::sendDMASetupRequest() {
+    MEIBusMessageHeader header;
+    MEIBusDMASetupRequest req;
+    setupMessageHeader(&header, sizeof(req));
+    memset(&req, 0, sizeof(req));
+    req.cmd = MEI_DMA_SETUP_REQ_CMD;
+    for (int i = 0; i < MEIDMADescriptorSize; i++) {
+        req.dma_info[i].addr_hi = device.dr_dscr[i].bus_addr >> 32;
+        req.dma_info[i].addr_lo = device.dr_dscr[i].bus_addr & 0xFFFFFFFF;
+        req.dma_info[i].size = device.dr_dscr[i].size;
+    }
+    resetDMARing();
+    
+    IOReturn ret = writeHostMessage(&header, MEI_TO_MSG(&req));
+    if (ret != kIOReturnSuccess)
+        return ret;
+    bus.state = MEIBusSetupDMARing;
+    init_timeout->setTimeoutMS(MEI_CLIENTS_INIT_TIMEOUT * 1000);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Only one map/unmap request can be outstanding, the response does not carry the client.
+ * The result is applied by completeClientDMA when the response arrives, whether somebody waits for it or not.
+ */
+IOReturn SurfaceManagementEngineDriver::sendClientDMARequest(SurfaceManagementEngineClient *client, bool map) {
+    MEIBusMessageHeader header;
+    MEIBusClientDMAMapRequest map_req;
+    MEIBusClientDMAUnmapRequest unmap_req;
+    IOReturn ret;
+    
+    if (cd_client)
+        return kIOReturnBusy;
+    
+    if (map) {
+        setupMessageHeader(&header, sizeof(map_req));
+        memset(&map_req, 0, sizeof(map_req));
+        map_req.cmd = MEI_CLIENT_DMA_MAP_REQ_CMD;
+        map_req.client_buffer_id = client->dma_buffer_id;
+        map_req.address_lsb = client->dma.bus_addr & 0xFFFFFFFF;
+        map_req.address_msb = client->dma.bus_addr >> 32;
+        map_req.size = client->dma.size;
+        ret = writeHostMessage(&header, MEI_TO_MSG(&map_req));
+    } else {
+        setupMessageHeader(&header, sizeof(unmap_req));
+        memset(&unmap_req, 0, sizeof(unmap_req));
+        unmap_req.cmd = MEI_CLIENT_DMA_UNMAP_REQ_CMD;
+        unmap_req.client_buffer_id = client->dma_buffer_id;
+        ret = writeHostMessage(&header, MEI_TO_MSG(&unmap_req));
+    }
+    if (ret != kIOReturnSuccess)
+        return ret;
+    
+    cd_client = client;
+    cd_map = map;
+    noteActivity();
+    return kIOReturnSuccess;
+}
+
+/*
+ * Must not be called on the work loop thread, the response is handled there.
+ * On timeout the request stays outstanding and is still completed if ME answers late.
+ */
+IOReturn SurfaceManagementEngineDriver::waitClientDMA() {
+    AbsoluteTime abstime, deadline;
+    nanoseconds_to_absolutetime(MEI_HOST_BUS_MSG_TIMEOUT * 1000000000ULL, &abstime);
+    clock_absolutetime_interval_to_deadline(abstime, &deadline);
+    while (cd_client) {
+        if (command_gate->commandSleep(&wait_client_dma, deadline, THREAD_INTERRUPTIBLE) == THREAD_TIMED_OUT)
+            return kIOReturnTimeout;
+    }
+    return cd_status;
+}
+
+void SurfaceManagementEngineDriver::completeClientDMA(IOReturn status) {
+    SurfaceManagementEngineClient *client = cd_client;
+    cd_client = nullptr;
+    cd_status = status;
+    if (cd_map) {
+        if (status == kIOReturnSuccess)
+            client->dma_mapped = true;
+        else {
+            LOG("Client dma map refused, using the circular buffer only");
+            freeDMABuffer(&client->dma);
+        }
+    } else if (status == kIOReturnSuccess) {
+        client->dma_mapped = false;
+        freeDMABuffer(&client->dma);
+    }
+    client->setProperty("ClientDMA", client->dma_mapped);
+    command_gate->commandWakeup(&wait_client_dma);
+    remapClientDMA();
+}
+
+void SurfaceManagementEngineDriver::remapClientDMA() {
+    // buffers kept across a reset, one request at a time
+    if (cd_client || device.pg_state == MEIPowerGatingOn)
+        return;
+    for (UInt addr = 0; addr < MEI_MAX_CLIENT_NUM; addr++) {
+        SurfaceManagementEngineClient *client = me_clients[addr];
+        if (!client || !client->active || !client->dma.buffer || client->dma_mapped)
+            continue;
+        if (sendClientDMARequest(client, true) != kIOReturnSuccess) {
+            LOG("Client dma remap failed, using the circular buffer only");
+            freeDMABuffer(&client->dma);
+            client->setProperty("ClientDMA", false);
+            continue;
+        }
+        break;
+    }
+}
+
 IOReturn SurfaceManagementEngineDriver::sendClientEnumerationRequest() {
     MEIBusMessageHeader header;
     MEIBusHostEnumerationRequest req;
@@ -976,7 +1396,7 @@ IOReturn SurfaceManagementEngineDriver::sendClientPropertyRequest(UInt start_idx
         device.reset_cnt = 0;
         rescan_work->interruptOccurred(nullptr, this, 0);
         // Enable idle (d0i3 mode)
-        idle_timeout->setTimeoutMS(MEI_DEVICE_IDLE_TIMEOUT * 1000);
+        noteActivity();
         return kIOReturnSuccess;
     }
     
@@ -1021,24 +1441,29 @@ void SurfaceManagementEngineDriver::scheduleReset(IOInterruptEventSource *sender
 }
 
 void SurfaceManagementEngineDriver::scheduleRescan(IOInterruptEventSource *sender, int count) {
-    if (!ipts_client->active) {
-        LOG("Seems the client has been removed by hardware");
-        ipts_client->stop(this);
-        ipts_client->detach(this);
-        OSSafeReleaseNULL(ipts_client);
-    } else if (!ipts_client->initial) {
-        // Disabled due to bus reset
-        LOG("Reconnecting client...");
-        ipts_client->hostRequestReconnect();
-        return;
-    } else {
-        LOG("Starting client...");
-        if (!ipts_client->attach(this) || !ipts_client->start(this)) {
-            LOG("Failed to start client");
-            ipts_client->detach(this);
-            OSSafeReleaseNULL(ipts_client);
+    SurfaceManagementEngineClient *client;
+    for (UInt addr = 0; addr < MEI_MAX_CLIENT_NUM; addr++) {
+        client = me_clients[addr];
+        if (!client)
+            continue;
+        
+        if (!client->active) {
+            LOG("Seems client %d has been removed by hardware", addr);
+            removeClient(addr);
+        } else if (!client->initial) {
+            // Disabled due to bus reset
+            LOG("Reconnecting client %d...", addr);
+            client->hostRequestReconnect();
+        } else {
+            LOG("Starting client %d...", addr);
+            if (!client->attach(this) || !client->start(this)) {
+                LOG("Failed to start client");
+                removeClient(addr);
+            }
         }
     }
+    // responses come back through handleHostMessage, so never wait for them here
+    remapClientDMA();
 }
 
 void SurfaceManagementEngineDriver::scheduleResume(IOInterruptEventSource *sender, int count) {
@@ -1054,7 +1479,7 @@ bool SurfaceManagementEngineDriver::filterInterrupt(IOFilterInterruptEventSource
 }
 
 void SurfaceManagementEngineDriver::handleInterrupt(IOInterruptEventSource *sender, int count) {
-    UInt8 rx_slots = 0;
+    UInt64 start = mach_absolute_time();
     
     disableInterrupts();
     
@@ -1062,6 +1487,149 @@ void SurfaceManagementEngineDriver::handleInterrupt(IOInterruptEventSource *send
     
     clearInterrupts();
     
+    UInt32 msgs = drainDevice(hcsr);
+    accountDrain(MEIDrainInterrupt, msgs, start);
+    
+    // leave the interrupt masked while polling
+    if (poll.polling || updateDrainMode(msgs))
+        return;
+    enableInterrupts();
+}
+
+void SurfaceManagementEngineDriver::pollDevice(IOTimerEventSource *timer) {
+    if (!poll.polling)
+        return;
+    
+    UInt64 start = mach_absolute_time();
+    UInt32 hcsr = readRegister(MEI_H_CSR);
+    clearInterrupts();
+    
+    UInt32 msgs = drainDevice(hcsr);
+    accountDrain(MEIDrainPolling, msgs, start);
+    if (!poll.polling)
+        return;
+    
+    if (msgs)
+        poll.last_msg = start;
+    else {
+        UInt64 idle_ns;
+        absolutetime_to_nanoseconds(start - poll.last_msg, &idle_ns);
+        if (idle_ns >= MEI_POLL_IDLE_EXIT_MS * 1000000ULL) {
+            stopPolling(true);
+            return;
+        }
+    }
+    
+    // keep about MEI_POLL_BATCH_MSGS per poll
+    if (msgs < MEI_POLL_BATCH_MSGS / 2)
+        poll.period_us = min(poll.period_us * 2, MEI_POLL_MAX_US);
+    else if (msgs > MEI_POLL_BATCH_MSGS * 2)
+        poll.period_us = max(poll.period_us / 2, MEI_POLL_MIN_US);
+    poll_timer->setTimeoutUS(poll.period_us);
+}
+
+/*
+ * Interrupt mode only, switch to polling once a window holds enough messages
+ */
+bool SurfaceManagementEngineDriver::updateDrainMode(UInt32 msgs) {
+    UInt64 now = mach_absolute_time();
+    UInt64 window_ns;
+    absolutetime_to_nanoseconds(now - poll.window_start, &window_ns);
+    if (window_ns >= MEI_POLL_WINDOW_MS * 1000000ULL) {
+        poll.window_start = now;
+        poll.window_msgs = 0;
+    }
+    poll.window_msgs += msgs;
+    if (poll.window_msgs < MEI_POLL_ENTER_MSGS || device.state != MEIDeviceEnabled)
+        return false;
+    
+    // start from the interval seen in this window
+    absolutetime_to_nanoseconds(now - poll.window_start, &window_ns);
+    UInt32 period_us = static_cast<UInt32>(window_ns / 1000 * MEI_POLL_BATCH_MSGS / poll.window_msgs);
+    poll.period_us = min(max(period_us, MEI_POLL_MIN_US), MEI_POLL_MAX_US);
+    poll.polling = true;
+    poll.last_msg = now;
+    poll.window_msgs = 0;
+    poll.switches++;
+    poll_timer->setTimeoutUS(poll.period_us);
+    return true;
+}
+
+void SurfaceManagementEngineDriver::stopPolling(bool unmask) {
+    if (!poll.polling)
+        return;
+    poll.polling = false;
+    poll.window_start = mach_absolute_time();
+    poll.window_msgs = 0;
+    poll_timer->cancelTimeout();
+    if (unmask)
+        enableInterrupts();
+}
+
+void SurfaceManagementEngineDriver::accountDrain(MEIDrainMode mode, UInt32 msgs, UInt64 start) {
+    UInt64 now = mach_absolute_time();
+    UInt64 elapsed_ns;
+    MEIDrainStats *stats = &poll.stats[mode];
+    stats->wakeups++;
+    stats->messages += msgs;
+    stats->cpu_time += now - start;
+    
+    absolutetime_to_nanoseconds(now - poll.stats_time, &elapsed_ns);
+    if (elapsed_ns >= MEI_POLL_STATS_INTERVAL_MS * 1000000ULL)
+        publishDrainStats(now);
+}
+
+void SurfaceManagementEngineDriver::publishDrainStats(UInt64 now) {
+    static const char *mode_names[MEIDrainModeCount] = {"Interrupt", "Polling"};
+    UInt64 interval_ns, cpu_ns;
+    absolutetime_to_nanoseconds(now - poll.stats_time, &interval_ns);
+    poll.stats_time = now;
+    if (!interval_ns)
+        return;
+    
+    OSDictionary *stats = OSDictionary::withCapacity(MEIDrainModeCount + 2);
+    if (!stats)
+        return;
+    for (int i = 0; i < MEIDrainModeCount; i++) {
+        MEIDrainStats *cur = &poll.stats[i];
+        MEIDrainStats *last = &poll.last[i];
+        OSDictionary *mode_dict = OSDictionary::withCapacity(5);
+        if (!mode_dict)
+            continue;
+        absolutetime_to_nanoseconds(cur->cpu_time - last->cpu_time, &cpu_ns);
+        const NumberEntry entries[] = {
+            {"Wakeups", cur->wakeups},
+            {"Messages", cur->messages},
+            {"WakeupsPerSecond", (cur->wakeups - last->wakeups) * 1000000000ULL / interval_ns},
+            {"MessagesPerSecond", (cur->messages - last->messages) * 1000000000ULL / interval_ns},
+            {"CPUUsPerSecond", cpu_ns * 1000000ULL / interval_ns},
+        };
+        setNumberEntries(mode_dict, entries);
+        stats->setObject(mode_names[i], mode_dict);
+        mode_dict->release();
+        *last = *cur;
+    }
+    const NumberEntry entries[] = {
+        {"ModeSwitches", poll.switches},
+        {"PollPeriodUs", poll.period_us},
+    };
+    setNumberEntries(stats, entries);
+    stats->setObject("PollingActive", poll.polling ? kOSBooleanTrue : kOSBooleanFalse);
+    setProperty("DrainStats", stats);
+    stats->release();
+#ifdef MEI_DEVICE_MODEL
+    publishModelStats();
+#endif
+}
+
+/*
+ * Shared by interrupt and polled mode, returns the number of messages completed,
+ * a fragmented message counts once with its last fragment
+ */
+UInt32 SurfaceManagementEngineDriver::drainDevice(UInt32 hcsr) {
+    UInt8 rx_slots = 0;
+    UInt32 start_cnt = rx_msg_cnt;
+    
     /* check if ME wants a reset */
     if (!isHardwareReady() && device.state != MEIDeviceResetting) {
         LOG("Hardware not ready! Resetting...");
@@ -1078,6 +1646,7 @@ void SurfaceManagementEngineDriver::handleInterrupt(IOInterruptEventSource *send
     if (!isHostReady()) {
         if (isHardwareReady()) {
             LOG("We need to start the device");
+            hw_ready = true;
             command_gate->commandWakeup(&wait_hw_ready);
         } else {
             LOG("Spurious Interrupt");
@@ -1116,7 +1685,7 @@ void SurfaceManagementEngineDriver::handleInterrupt(IOInterruptEventSource *send
         bus.tx_buf_ready = calcFilledSlots() == 0;
     }
 end:
-    enableInterrupts();
+    return rx_msg_cnt - start_cnt;
 }
 
 void SurfaceManagementEngineDriver::handlePowerGatingInterrupt(UInt32 source) {
@@ -1147,6 +1716,7 @@ void SurfaceManagementEngineDriver::handlePowerGatingInterrupt(UInt32 source) {
 IOReturn SurfaceManagementEngineDriver::handleRead(UInt8 *filled_slots) {
     MEIBusMessageHeader *msg_hdr;
     MEIBusExtendedMetaHeader *meta_hdr = nullptr;
+    SurfaceManagementEngineClient *client;
     IOReturn ret = kIOReturnSuccess;
 
     if (!bus.rx_msg_hdr[0]) {
@@ -1196,9 +1766,11 @@ IOReturn SurfaceManagementEngineDriver::handleRead(UInt8 *filled_slots) {
             bus.rx_msg_hdr_len++;
             (*filled_slots)--;
         }
+        // from here on length only covers the payload
+        msg_hdr->length = hdr_size_left;
     }
     if (msg_hdr->dma_ring) {
-        LOG("Got dma ring set");
+        // the only payload left in the circular buffer is the length of the message on the dma ring
         if (hdr_size_left != MEI_SLOT_SIZE) {
             LOG("Error! Corrupted message header len %d", msg_hdr->length);
             return kIOReturnInvalid;
@@ -1218,7 +1790,8 @@ IOReturn SurfaceManagementEngineDriver::handleRead(UInt8 *filled_slots) {
         }
     } else {
         // Client message
-        if (!ipts_client || !ipts_client->active || msg_hdr->me_addr != ipts_client->addr) {
+        client = me_clients[msg_hdr->me_addr];
+        if (!client || !client->active) {
             /*
              * A message for not connected fixed address clients should be silently discarded
              * On power down client may be force cleaned, silently discard such messages
@@ -1232,8 +1805,10 @@ IOReturn SurfaceManagementEngineDriver::handleRead(UInt8 *filled_slots) {
             }
             
         } else
-            ret = handleClientMessage(ipts_client, msg_hdr, meta_hdr);
+            ret = handleClientMessage(client, msg_hdr, meta_hdr);
     }
+    if (msg_hdr->msg_complete)
+        rx_msg_cnt++;
     // Reset the number of slots and header
     memset(bus.rx_msg_hdr, 0, sizeof(bus.rx_msg_hdr));
     bus.rx_msg_hdr_len = 0;
@@ -1250,6 +1825,8 @@ IOReturn SurfaceManagementEngineDriver::handleHostMessage(MEIBusMessageHeader *h
     MEIBusHostEnumerationResponse *enum_res;
     MEIBusAddClientRequest *add_client_req;
     MEIBusCapabilityResponse *cap_res;
+    MEIBusDMASetupResponse *dma_res;
+    MEIBusClientDMAResponse *cd_res;
     
     MEIHostBusMessageReturnType status;
     IOReturn ret;
@@ -1318,6 +1895,15 @@ IOReturn SurfaceManagementEngineDriver::handleHostMessage(MEIBusMessageHeader *h
                 break;
             }
             
+            if (device.dr_supported && allocateDMARing() == kIOReturnSuccess) {
+                if (sendDMASetupRequest() != kIOReturnSuccess) {
+                    LOG("DMA setup request failed");
+                    return kIOReturnIOError;
+                }
+                command_gate->commandWakeup(&wait_bus_start);
+                break;
+            }
+            
             if (sendClientEnumerationRequest() != kIOReturnSuccess) {
                 LOG("Enumeration request failed");
                 return kIOReturnIOError;
@@ -1342,6 +1928,14 @@ IOReturn SurfaceManagementEngineDriver::handleHostMessage(MEIBusMessageHeader *h
                 device.vt_supported = false;
             if (!(cap_res->capability_granted[0] & MEI_HBM_CAP_CLIENT_DMA))
                 device.cd_supported = false;
+            
+            if (device.dr_supported && allocateDMARing() == kIOReturnSuccess) {
+                if (sendDMASetupRequest() != kIOReturnSuccess) {
+                    LOG("DMA setup request failed");
+                    return kIOReturnIOError;
+                }
+                break;
+            }
 
             if (sendClientEnumerationRequest() != kIOReturnSuccess) {
                 LOG("Enumeration request failed");
@@ -1349,6 +1943,48 @@ IOReturn SurfaceManagementEngineDriver::handleHostMessage(MEIBusMessageHeader *h
             }
             break;
             
+        case MEI_DMA_SETUP_RES_CMD:
+            LOG("DMA setup response message received");
+            init_timeout->cancelTimeout();
+            if (device.state != MEIDeviceInitClients || bus.state != MEIBusSetupDMARing) {
+                if (device.state == MEIDevicePowerDown) {
+                    LOG("DMA setup response on shutdown, ignoring");
+                    return kIOReturnSuccess;
+                }
+                LOG("Error! DMA setup response state mismatch, [%d, %d]", device.state, bus.state);
+                return kIOReturnError;
+            }
+            
+            dma_res = reinterpret_cast<MEIBusDMASetupResponse *>(mei_msg);
+            if (dma_res->status != MEIHostBusMessageReturnSuccess) {
+                if (dma_res->status == MEIHostBusMessageReturnNotAllowed)
+                    LOG("DMA ring not allowed, using the circular buffer only");
+                else
+                    LOG("DMA ring setup failed with status %d, using the circular buffer only", dma_res->status);
+                device.dr_supported = false;
+                freeDMARing();
+            }
+            setProperty("DMARing", device.dr_supported);
+            
+            if (sendClientEnumerationRequest() != kIOReturnSuccess) {
+                LOG("Enumeration request failed");
+                return kIOReturnIOError;
+            }
+            break;
+            
+        case MEI_CLIENT_DMA_MAP_RES_CMD:
+        case MEI_CLIENT_DMA_UNMAP_RES_CMD:
+            LOG("Client dma response message received");
+            if (!cd_client) {
+                LOG("Client dma response without request, ignoring");
+                break;
+            }
+            cd_res = reinterpret_cast<MEIBusClientDMAResponse *>(mei_msg);
+            if (cd_res->status != MEIClientConnectionSuccess)
+                LOG("Client dma request refused with status %d", cd_res->status);
+            completeClientDMA(cd_res->status == MEIClientConnectionSuccess ? kIOReturnSuccess : kIOReturnNotPermitted);
+            break;
+            
         case MEI_HOST_ENUM_RES_CMD:
             LOG("Enumeration response message received");
             init_timeout->cancelTimeout();
@@ -1399,7 +2035,7 @@ IOReturn SurfaceManagementEngineDriver::handleHostMessage(MEIBusMessageHeader *h
                     *(reinterpret_cast<UInt16 *>(swapped_uuid) + 3) = OSSwapInt16(*(reinterpret_cast<UInt16 *>(swapped_uuid) + 3));
                     uuid_unparse_lower(swapped_uuid, uuid_str);
                     LOG("Unknown MEI client with uuid %s", uuid_str);
-                    LOG("Ignore non IPTS client, continue to request client properties");
+                    LOG("Ignore unsupported client, continue to request client properties");
                 }
             }
             // Request property for next client
@@ -1499,34 +2135,89 @@ IOReturn SurfaceManagementEngineDriver::handleHostMessage(MEIBusMessageHeader *h
     return kIOReturnSuccess;
 }
 
+/*
+ * A GSC extended header means ME wrote the payload into the client dma buffer, anything else is not supported
+ */
+MEIBusExtendedGSCF2H *SurfaceManagementEngineDriver::findClientDMAHeader(SurfaceManagementEngineClient *client, MEIBusExtendedMetaHeader *meta) {
+    MEIBusExtendedGSCF2H *gsc = nullptr;
+    MEIBusExtendedHeader *ext = mei_ext_begin(meta);
+    for (int i = 0; i < meta->count && !mei_ext_last(meta, ext); i++) {
+        if (!ext->length || ext->type != MEIExtendedHeaderGSC)
+            return nullptr;
+        gsc = reinterpret_cast<MEIBusExtendedGSCF2H *>(ext);
+        ext = reinterpret_cast<MEIBusExtendedHeader *>(reinterpret_cast<UInt8 *>(ext) + MEI_SLOTS_TO_DATA(ext->length));
+    }
+    if (!gsc || gsc->length != MEI_DATA_TO_SLOTS(sizeof(MEIBusExtendedGSCF2H)) ||
+        reinterpret_cast<UInt8 *>(gsc) + sizeof(MEIBusExtendedGSCF2H) > meta->hdrs + MEI_SLOTS_TO_DATA(meta->size))
+        return nullptr;
+    if (!client->dma_mapped || gsc->client_id != client->dma_buffer_id || gsc->written > client->dma.size)
+        return nullptr;
+    return gsc;
+}
+
 IOReturn SurfaceManagementEngineDriver::handleClientMessage(SurfaceManagementEngineClient *client, MEIBusMessageHeader *mei_hdr, MEIBusExtendedMetaHeader *meta) {
-    UInt16 data_len;
-    UInt16 length = mei_hdr->length;
+    UInt32 data_len;
+    UInt32 length = mei_hdr->length;
+    UInt64 start;
+    UInt8 *buffer;
+    MEIBusExtendedGSCF2H *gsc = nullptr;
+    MEIClientRxPath path = MEIClientRxFIFO;
+    
+    if (mei_hdr->extended) {
+        gsc = findClientDMAHeader(client, meta);
+        if (!gsc)
+            goto discard;
+        // whatever is left in the circular buffer carries no payload
+        length = gsc->written;
+        path = MEIClientRxClientDMA;
+    } else if (mei_hdr->dma_ring) {
+        length = mei_hdr->extension[bus.rx_msg_hdr_len - 2];
+        path = MEIClientRxDMARing;
+    }
     
-    if (mei_hdr->extended || mei_hdr->dma_ring)
-        goto discard;
-
     data_len = length + client->rx_cache_pos;
     if (client->properties.max_msg_length < data_len) {
         LOG("Warning, message overflow. client max msg size %d, rx msg size %d", client->properties.max_msg_length, data_len);
         goto discard;
     }
 
-    readMessage(client->rx_cache + client->rx_cache_pos, length);
+    // read straight into the pool buffer handed to the client handler
+    buffer = client->acquireRxBuffer();
+    if (!buffer) {
+        // every fragment of the message is discarded, count it once
+        if (mei_hdr->msg_complete)
+            client->dropMessage();
+        goto discard;
+    }
+    
+    start = mach_absolute_time();
+    if (gsc) {
+        memcpy(buffer + client->rx_cache_pos, client->dma.vaddr, length);
+        readMessage(bus.rx_msg_buf, mei_hdr->length);
+    } else if (mei_hdr->dma_ring) {
+        readDMARing(buffer + client->rx_cache_pos, length);
+        readMessage(nullptr, 0);
+    } else
+        readMessage(buffer + client->rx_cache_pos, length);
     client->rx_cache_pos += length;
+    client->accountMessage(path, length, mach_absolute_time() - start);
 
     if (mei_hdr->msg_complete)
         client->messageComplete();
     
-    idle_timeout->setTimeoutMS(MEI_DEVICE_IDLE_TIMEOUT * 1000);
+    noteActivity();
 
     return kIOReturnSuccess;
 discard:
-    discardMessage(mei_hdr, length);
+    discardMessage(mei_hdr, mei_hdr->length);
     return kIOReturnSuccess;
 }
 
 void SurfaceManagementEngineDriver::discardMessage(MEIBusMessageHeader *hdr, UInt16 discard_len) {
+    if (hdr->dma_ring) {
+        readDMARing(nullptr, hdr->extension[bus.rx_msg_hdr_len - 2]);
+        discard_len = 0;
+    }
     readMessage(bus.rx_msg_buf, discard_len);
 }
 
@@ -1536,20 +2227,66 @@ IOReturn SurfaceManagementEngineDriver::handleWrite() {
     
     MEIClientTransaction *tx;
     qe_foreach_element_safe(tx, &bus.tx_queue, entry) {
-        if (submitTransaction(tx))
-            completeTransaction(tx);
+        // fragments of one message must not interleave with the next one
+        if (!submitTransaction(tx))
+            break;
+        completeTransaction(tx);
     }
     return kIOReturnSuccess;
 }
 
+/*
+ * Blocking transactions are released by their sender once it wakes up
+ */
 void SurfaceManagementEngineDriver::completeTransaction(MEIClientTransaction *tx) {
+    remqueue(&tx->entry);
+    tx->queued = false;
     if (tx->blocking)
         command_gate->commandWakeup(&tx->wait);
-    else {
-        remqueue(&tx->entry);
-        delete[] tx->data;
+    else
+        releaseTransaction(tx);
+}
+
+MEIClientTransaction *SurfaceManagementEngineDriver::acquireTransaction() {
+    if (!queue_empty(&tx_free))
+        return qe_dequeue_head(&tx_free, MEIClientTransaction, entry);
+    MEIClientTransaction *tx = new MEIClientTransaction;
+    if (!tx)
+        return nullptr;
+    tx_stats.allocations++;
+    tx_stats.pool_misses++;
+    tx->pooled = false;
+    return tx;
+}
+
+void SurfaceManagementEngineDriver::releaseTransaction(MEIClientTransaction *tx) {
+    if (tx->payload_type == MEITxPayloadClientPool)
+        tx->client->releaseTxBuffer(tx->payload);
+    else if (tx->payload_type == MEITxPayloadAllocated)
+        delete[] tx->payload;
+    tx->payload = nullptr;
+    tx->data = nullptr;
+    
+    if (tx->pooled)
+        enqueue(&tx_free, &tx->entry);
+    else
         delete tx;
-    }
+}
+
+void SurfaceManagementEngineDriver::publishTxStats() {
+    OSDictionary *stats = OSDictionary::withCapacity(5);
+    if (!stats)
+        return;
+    const NumberEntry entries[] = {
+        {"Direct", tx_stats.direct},
+        {"Queued", tx_stats.queued},
+        {"Borrowed", tx_stats.borrowed},
+        {"Allocations", tx_stats.allocations},
+        {"PoolMisses", tx_stats.pool_misses},
+    };
+    setNumberEntries(stats, entries);
+    setProperty("TxStats", stats);
+    stats->release();
 }
 
 bool SurfaceManagementEngineDriver::submitTransaction(MEIClientTransaction *tx) {
@@ -1597,8 +2334,133 @@ bool SurfaceManagementEngineDriver::submitTransaction(MEIClientTransaction *tx)
     }
 }
 
+/*
+ * Called for every message in either direction, only arms the timer when it is not running
+ * so that busy traffic never reprograms it, enterIdle works out the remaining time instead
+ */
+void SurfaceManagementEngineDriver::noteActivity() {
+    UInt64 now = mach_absolute_time();
+    UInt64 gap_ns;
+    if (idle.last_activity) {
+        absolutetime_to_nanoseconds(now - idle.last_activity, &gap_ns);
+        if (gap_ns >= MEI_IDLE_BURST_GAP_MS * 1000000ULL)
+            recordIdleGap(static_cast<UInt32>(gap_ns / 1000000ULL));
+    }
+    idle.last_activity = now;
+    
+    if (!idle.armed) {
+        idle.armed = true;
+        idle_timeout->setTimeoutMS(idle.delay_ms);
+    }
+}
+
+void SurfaceManagementEngineDriver::recordIdleGap(UInt32 gap_ms) {
+    int bucket = 0;
+    while (bucket < MEI_IDLE_GAP_BUCKETS - 1 && (1U << (bucket + 1)) <= gap_ms)
+        bucket++;
+    idle.gap_hist[bucket]++;
+    if (++idle.gap_samples >= MEI_IDLE_GAP_DECAY_SAMPLES) {
+        idle.gap_samples = 0;
+        for (int i = 0; i < MEI_IDLE_GAP_BUCKETS; i++) {
+            idle.gap_hist[i] >>= 1;
+            idle.gap_samples += idle.gap_hist[i];
+        }
+    }
+    
+    // pauses beyond the longest delay are real idle periods, they must not stretch the delay
+    // max_bucket is the bucket holding MEI_IDLE_DELAY_MAX_MS itself and still counts as interactive
+    UInt32 interactive = 0, seen = 0;
+    int max_bucket = 0;
+    while (max_bucket < MEI_IDLE_GAP_BUCKETS - 1 && (1U << (max_bucket + 1)) <= MEI_IDLE_DELAY_MAX_MS)
+        max_bucket++;
+    for (int i = 0; i <= max_bucket; i++)
+        interactive += idle.gap_hist[i];
+    if (interactive < MEI_IDLE_GAP_MIN_SAMPLES) {
+        idle.delay_ms = MEI_DEVICE_IDLE_TIMEOUT * 1000;
+        return;
+    }
+    
+    int quantile = 0;
+    for (; quantile <= max_bucket; quantile++) {
+        seen += idle.gap_hist[quantile];
+        if (seen * 100 >= interactive * MEI_IDLE_GAP_QUANTILE)
+            break;
+    }
+    UInt32 delay = 1U << (quantile + 1);     // upper bound of the bucket
+    if (delay < MEI_IDLE_DELAY_MIN_MS)
+        delay = MEI_IDLE_DELAY_MIN_MS;
+    if (delay > MEI_IDLE_DELAY_MAX_MS)
+        delay = MEI_IDLE_DELAY_MAX_MS;
+    idle.delay_ms = delay;
+}
+
+void SurfaceManagementEngineDriver::recordPowerGatingExit(UInt64 start) {
+    UInt64 now = mach_absolute_time();
+    UInt64 latency_ns, gated_ns;
+    absolutetime_to_nanoseconds(now - start, &latency_ns);
+    UInt64 latency_us = latency_ns / 1000;
+    
+    int bucket = 0;
+    while (bucket < MEI_PG_EXIT_BUCKETS - 1 && (static_cast<UInt64>(MEI_PG_EXIT_BUCKET_BASE_US) << bucket) <= latency_us)
+        bucket++;
+    idle.exit_hist[bucket]++;
+    if (latency_us > idle.exit_max_us)
+        idle.exit_max_us = latency_us;
+    idle.pg_exits++;
+    
+    if (idle.gated_time) {
+        absolutetime_to_nanoseconds(start - idle.gated_time, &gated_ns);
+        if (gated_ns < idle.delay_ms * 1000000ULL)
+            idle.pg_premature++;
+        idle.gated_time = 0;
+    }
+    publishPowerGatingStats();
+}
+
+void SurfaceManagementEngineDriver::publishPowerGatingStats() {
+    OSDictionary *stats = OSDictionary::withCapacity(8);
+    OSArray *hist = OSArray::withCapacity(MEI_PG_EXIT_BUCKETS);
+    if (!stats || !hist) {
+        OSSafeReleaseNULL(stats);
+        OSSafeReleaseNULL(hist);
+        return;
+    }
+    const NumberEntry entries[] = {
+        {"Entries", idle.pg_entries},
+        {"Exits", idle.pg_exits},
+        {"EntryFailures", idle.pg_failures},
+        {"Premature", idle.pg_premature},
+        {"IdleDelayMs", idle.delay_ms},
+        {"GapSamples", idle.gap_samples},
+        {"ExitLatencyMaxUs", idle.exit_max_us},
+    };
+    setNumberEntries(stats, entries);
+    // bucket i counts exits faster than 32us << i, the last one everything slower
+    for (int i = 0; i < MEI_PG_EXIT_BUCKETS; i++) {
+        OSNumber *num = OSNumber::withNumber(idle.exit_hist[i], 32);
+        if (num) {
+            hist->setObject(num);
+            num->release();
+        }
+    }
+    stats->setObject("ExitLatencyHistogram", hist);
+    hist->release();
+    setProperty("PowerGatingStats", stats);
+    stats->release();
+}
+
 void SurfaceManagementEngineDriver::enterIdle(IOTimerEventSource *timer) {
     IOReturn ret;
+    UInt64 idle_ns;
+    
+    idle.armed = false;
+    absolutetime_to_nanoseconds(mach_absolute_time() - idle.last_activity, &idle_ns);
+    if (idle_ns < idle.delay_ms * 1000000ULL) {
+        idle.armed = true;
+        idle_timeout->setTimeoutMS(idle.delay_ms - static_cast<UInt32>(idle_ns / 1000000ULL));
+        return;
+    }
+    
     if (isWriteQueueEmpty())
         ret = enterPowerGatingSync();
     else
@@ -1606,9 +2468,13 @@ void SurfaceManagementEngineDriver::enterIdle(IOTimerEventSource *timer) {
     
     if (ret != kIOReturnSuccess && ret != kIOReturnBusy) {
         LOG("Warning! Enter d0i3 failed. Resetting...");
+        idle.pg_failures++;
+        publishPowerGatingStats();
         reset_work->interruptOccurred(nullptr, this, 0);
-    } else if (ret == kIOReturnBusy)
-        idle_timeout->setTimeoutMS(MEI_DEVICE_IDLE_TIMEOUT * 1000);
+    } else if (ret == kIOReturnBusy) {
+        idle.armed = true;
+        idle_timeout->setTimeoutMS(idle.delay_ms);
+    }
 }
 
 void SurfaceManagementEngineDriver::initialiseTimeout(IOTimerEventSource *timer) {
@@ -1619,17 +2485,61 @@ void SurfaceManagementEngineDriver::initialiseTimeout(IOTimerEventSource *timer)
 }
 
 IOReturn SurfaceManagementEngineDriver::addClient(MEIClientProperty *client_props, UInt8 addr) {
-    if (uuid_compare(SURFACE_IPTS_CLIENT_UUID, client_props->uuid) != 0)
+    SurfaceManagementEngineClient *client = nullptr;
+    bool supported = false;
+    for (auto uuid : MEISupportedClients) {
+        if (uuid_compare(uuid, client_props->uuid) == 0) {
+            supported = true;
+            break;
+        }
+    }
+    if (!supported)
         return kIOReturnInvalid;
+    
+    // ME may hand out another address to a known client after a reset
+    for (UInt old_addr = 0; old_addr < MEI_MAX_CLIENT_NUM; old_addr++) {
+        if (me_clients[old_addr] && uuid_compare(me_clients[old_addr]->properties.uuid, client_props->uuid) == 0) {
+            client = me_clients[old_addr];
+            me_clients[old_addr] = nullptr;
+            break;
+        }
+    }
+    if (me_clients[addr])
+        removeClient(addr);
 
-    if (!ipts_client) {
-        ipts_client = OSTypeAlloc(SurfaceManagementEngineClient);
-        if (!ipts_client || !ipts_client->init()) {
-            LOG("Failed to create ipts client");
-            OSSafeReleaseNULL(ipts_client);
+    if (!client) {
+        client = OSTypeAlloc(SurfaceManagementEngineClient);
+        if (!client || !client->init()) {
+            LOG("Failed to create client");
+            OSSafeReleaseNULL(client);
             return kIOReturnError;
         }
     }
-    ipts_client->resetProperties(client_props, addr);
+    client->resetProperties(client_props, addr);
+    me_clients[addr] = client;
     return kIOReturnSuccess;
 }
+
+void SurfaceManagementEngineDriver::removeClient(UInt8 addr) {
+    SurfaceManagementEngineClient *client = me_clients[addr];
+    me_clients[addr] = nullptr;
+    
+    // queued payloads may live in the client's tx pool
+    MEIClientTransaction *tx;
+    qe_foreach_element_safe(tx, &bus.tx_queue, entry) {
+        if (tx->client == client)
+            completeTransaction(tx);
+    }
+    
+    if (cd_client == client) {
+        cd_client = nullptr;
+        cd_status = kIOReturnNoDevice;
+        command_gate->commandWakeup(&wait_client_dma);
+    }
+    client->dma_mapped = false;
+    freeDMABuffer(&client->dma);
+    if (!client->initial)
+        client->stop(this);
+    client->detach(this);
+    OSSafeReleaseNULL(client);
+}
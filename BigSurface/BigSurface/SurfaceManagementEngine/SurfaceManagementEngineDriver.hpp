@@ -17,14 +17,14 @@
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IODMACommand.h>
 
+#include "../helpers.hpp"
 #include "MEIProtocol.h"
+#ifdef MEI_DEVICE_MODEL
+#include "MEIDeviceModel.hpp"
 
-#define kIOPMPowerOff                       0
-#define kIOPMNumberPowerStates              2
-static IOPMPowerState MyIOPMPowerStates[kIOPMNumberPowerStates] = {
-    {1, kIOPMPowerOff, kIOPMPowerOff, kIOPMPowerOff, 0, 0, 0, 0, 0, 0, 0, 0},
-    {1, kIOPMPowerOn, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
-};
+#define MEI_MODEL_IPTS_ADDR         12      // as reported by the Surface ME
+#define MEI_MODEL_IPTS_MSG_LENGTH   4096
+#endif
 
 enum MEIDeviceState {
     MEIDeviceInitializing = 0,
@@ -87,6 +87,82 @@ enum MEIPowerGatingState {
     MEIPowerGatingOn  = 1,
 };
 
+#define MEI_IDLE_BURST_GAP_MS       20      // shorter pauses belong to the same burst of traffic
+#define MEI_IDLE_GAP_BUCKETS        16      // log2 buckets of inter-burst gaps, from 1ms
+#define MEI_IDLE_GAP_QUANTILE       90
+#define MEI_IDLE_GAP_MIN_SAMPLES    16
+#define MEI_IDLE_GAP_DECAY_SAMPLES  1024    // halve the histogram so that the policy follows usage
+#define MEI_IDLE_DELAY_MIN_MS       250
+#define MEI_IDLE_DELAY_MAX_MS       (MEI_DEVICE_IDLE_TIMEOUT * 2000)
+#define MEI_PG_EXIT_BUCKETS         12      // log2 buckets of d0i3 exit latency, from 32us
+#define MEI_PG_EXIT_BUCKET_BASE_US  32
+
+/*
+ * Learns how long traffic pauses between bursts and only power gates after a pause
+ * longer than MEI_IDLE_GAP_QUANTILE percent of the pauses seen during interactive use
+ */
+struct MEIIdlePolicy {
+    UInt32  gap_hist[MEI_IDLE_GAP_BUCKETS];
+    UInt32  gap_samples;
+    UInt32  delay_ms;
+    UInt64  last_activity;
+    UInt64  gated_time;
+    bool    armed;
+    UInt64  pg_entries;
+    UInt64  pg_exits;
+    UInt64  pg_failures;
+    UInt64  pg_premature;       // woken up again sooner than the delay we waited before gating
+    UInt32  exit_hist[MEI_PG_EXIT_BUCKETS];
+    UInt64  exit_max_us;
+};
+
+#define MEI_POLL_WINDOW_MS          100
+#define MEI_POLL_ENTER_MSGS         60      // messages per window before polling, 600 per second, over twice the slowest poll rate
+#define MEI_POLL_BATCH_MSGS         4       // messages a poll should find, the period follows the message rate
+#define MEI_POLL_MIN_US             1000
+#define MEI_POLL_MAX_US             4000    // bounds the added latency
+#define MEI_POLL_IDLE_EXIT_MS       50      // longer than the gap between frames of any touch stream
+#define MEI_POLL_STATS_INTERVAL_MS  1000
+
+enum MEIDrainMode {
+    MEIDrainInterrupt = 0,
+    MEIDrainPolling,
+    MEIDrainModeCount,
+};
+
+struct MEIDrainStats {
+    UInt64  wakeups;        // interrupts or timer polls
+    UInt64  messages;
+    UInt64  cpu_time;
+};
+
+/*
+ * Bursts of traffic mask the interrupt and drain the circular buffer from a timer instead,
+ * until no message arrived for MEI_POLL_IDLE_EXIT_MS
+ */
+struct MEIPollPolicy {
+    bool    polling;
+    UInt32  period_us;
+    UInt64  last_msg;
+    UInt32  window_msgs;
+    UInt64  window_start;
+    UInt64  switches;
+    UInt64  stats_time;
+    MEIDrainStats   stats[MEIDrainModeCount];
+    MEIDrainStats   last[MEIDrainModeCount];
+};
+
+/*
+ * Host memory shared with ME, contiguous and mapped for the device once at allocation
+ */
+struct MEIDMABuffer {
+    IOBufferMemoryDescriptor*   buffer;
+    IODMACommand*               dma_cmd;
+    UInt64                      bus_addr;
+    UInt32                      size;
+    UInt8*                      vaddr;
+};
+
 struct MEIPhysicalDevice {
     IOPCIDevice*        pci_dev;
     IOMemoryMap*        mmap;
@@ -112,20 +188,43 @@ struct MEIPhysicalDevice {
     bool    vt_supported;       // vtag
     bool    cap_supported;      // capabilities message
     bool    cd_supported;       // client dma
+    MEIDMABuffer dr_dscr[MEIDMADescriptorSize];    // dma ring, kept across resets
 };
 
 class SurfaceManagementEngineClient;
 
+#define MEI_TX_POOL_SIZE            16
+#define MEI_TX_STATS_INTERVAL       256
+
+// Where the payload of a queued transaction lives
+enum MEITxPayload {
+    MEITxPayloadBorrowed = 0,   // caller's buffer, blocking senders wait until it is consumed
+    MEITxPayloadClientPool,     // one of the client's tx buffers
+    MEITxPayloadAllocated,      // client pool exhausted
+};
+
 struct MEIClientTransaction {
     queue_entry entry;
     SurfaceManagementEngineClient *client;
     UInt8*  data;
     UInt16  data_len;
+    UInt8*  payload;    // start of the buffer to hand back, data advances on partial writes
+    MEITxPayload payload_type;
+    bool    pooled;
+    bool    queued;
     bool    completed;
     bool    blocking;
     bool    wait;
 };
 
+struct MEITxStats {
+    UInt64  direct;         // written straight from the caller's buffer
+    UInt64  queued;
+    UInt64  borrowed;       // queued without copying the payload
+    UInt64  allocations;    // transactions or payloads taken from the heap
+    UInt64  pool_misses;
+};
+
 struct MEIBus {
     MEIBusState     state;
     UInt8           rx_msg_buf[MEI_RX_MSG_BUF_SIZE];
@@ -139,7 +238,7 @@ struct MEIBus {
 UUID_DEFINE(SURFACE_IPTS_CLIENT_UUID, 0x70, 0x08, 0x8d, 0x3e, 0x1a, 0x27, 0x08, 0x42, 0x8e, 0xb5, 0x9a, 0xcb, 0x94, 0x02, 0xae, 0x04);
 
 /*
- * Implements a MEI based IPTS driver
+ * Implements a MEI bus driver, supported clients are published as SurfaceManagementEngineClient
  * fixed_addr=12 vt_supported=0
  */
 class EXPORT SurfaceManagementEngineDriver : public IOService {
@@ -160,6 +259,18 @@ class EXPORT SurfaceManagementEngineDriver : public IOService {
     
     IOReturn sendClientMessage(SurfaceManagementEngineClient *client, UInt8 *buffer, UInt16 buffer_len, bool blocking);
     
+    IOReturn mapClientDMABuffer(SurfaceManagementEngineClient *client, UInt8 buffer_id, UInt32 size);
+    
+    IOReturn unmapClientDMABuffer(SurfaceManagementEngineClient *client);
+    
+    // serialise with the interrupt path, which fills client buffers
+    IOReturn runGated(OSObject *target, IOWorkLoop::Action action, void *arg0 = nullptr);
+    
+#ifdef MEI_DEVICE_MODEL
+    // the host tests play the ME side through it
+    MEIDeviceModel *getDeviceModel() { return model; }
+    
+#endif
 protected:
     IOReturn mapMemory();
 
@@ -174,17 +285,34 @@ private:
     IOInterruptEventSource*         resume_work {nullptr};
     IOTimerEventSource*             init_timeout {nullptr};
     IOTimerEventSource*             idle_timeout {nullptr};
-    SurfaceManagementEngineClient*  ipts_client {nullptr};
+    IOTimerEventSource*             poll_timer {nullptr};
     IOCommandGate::Action           client_msg_action {nullptr};
     
     MEIPhysicalDevice   device;
     MEIBus              bus;
+    MEIIdlePolicy       idle;
+    MEIPollPolicy       poll;
+    UInt32              rx_msg_cnt {0};
+    MEIClientTransaction    tx_pool[MEI_TX_POOL_SIZE] {};
+    queue_head_t            tx_free;
+    MEITxStats              tx_stats {};
+    UInt32                  tx_msg_cnt {0};
     UInt8               me_client_map[MEI_MAX_CLIENT_NUM/8];
+    SurfaceManagementEngineClient*  me_clients[MEI_MAX_CLIENT_NUM] {};    // indexed by me_addr
     
     bool awake {true};
     bool wait_hw_ready {false};
+    bool hw_ready {false};      // ME came out of reset, wait_hw_ready may not have been waited on yet
     bool wait_bus_start {false};
     bool wait_power_gating {false};
+    bool wait_client_dma {false};
+    
+    SurfaceManagementEngineClient*  cd_client {nullptr};
+    IOReturn                        cd_status {kIOReturnSuccess};
+    bool                            cd_map {false};
+#ifdef MEI_DEVICE_MODEL
+    MEIDeviceModel*                 model {nullptr};    // stands in for BAR0 and the MSI
+#endif
 
     void releaseResources();
     
@@ -194,6 +322,10 @@ private:
     
     inline UInt32 readRegister(int offset);
     inline void writeRegister(UInt32 value, int offset);
+#ifdef MEI_DEVICE_MODEL
+    static void modelInterrupt(void *owner);
+    void publishModelStats();
+#endif
     
     UInt8 calcFilledSlots();
     IOReturn findEmptySlots(UInt8 *empty_slots);
@@ -228,6 +360,13 @@ private:
     
     void readMessage(UInt8 *buffer, UInt16 buffer_len);
     
+    IOReturn allocateDMABuffer(MEIDMABuffer *dma, UInt32 size);
+    void freeDMABuffer(MEIDMABuffer *dma);
+    IOReturn allocateDMARing();
+    void freeDMARing();
+    void resetDMARing();
+    void readDMARing(UInt8 *buffer, UInt32 len);
+    
     IOReturn writeMessage(UInt8 *header, UInt16 header_len, UInt8 *data, UInt16 data_len);
     inline void setupMessageHeader(MEIBusMessageHeader *header, UInt16 length);
     IOReturn writeHostMessage(MEIBusMessageHeader *header, MEIBusMessage *msg);
@@ -236,6 +375,13 @@ private:
     IOReturn sendStopRequest();
     IOReturn sendPowerGatingCommand(bool enter);
     IOReturn sendCapabilityRequest();
+    IOReturn sendDMASetupRequest();
+    IOReturn sendClientDMARequest(SurfaceManagementEngineClient *client, bool map);
+    IOReturn waitClientDMA();
+    void completeClientDMA(IOReturn status);
+    void remapClientDMA();
+    IOReturn mapClientDMABufferGated(SurfaceManagementEngineClient *client, UInt8 *buffer_id, UInt32 *size);
+    IOReturn unmapClientDMABufferGated(SurfaceManagementEngineClient *client);
     IOReturn sendClientEnumerationRequest();
     IOReturn sendClientPropertyRequest(UInt client_idx);
     IOReturn sendAddClientResponse(UInt8 me_addr, MEIHostBusMessageReturnType status);
@@ -246,22 +392,37 @@ private:
     
     bool filterInterrupt(IOFilterInterruptEventSource *sender);
     void handleInterrupt(IOInterruptEventSource *sender, int count);
+    void pollDevice(IOTimerEventSource *timer);
+    UInt32 drainDevice(UInt32 hcsr);
+    bool updateDrainMode(UInt32 msgs);
+    void stopPolling(bool unmask);
+    void accountDrain(MEIDrainMode mode, UInt32 msgs, UInt64 start);
+    void publishDrainStats(UInt64 now);
     
     void handlePowerGatingInterrupt(UInt32 source);
     
     IOReturn handleRead(UInt8 *filled_slots);
     IOReturn handleHostMessage(MEIBusMessageHeader *hdr);
+    MEIBusExtendedGSCF2H *findClientDMAHeader(SurfaceManagementEngineClient *client, MEIBusExtendedMetaHeader *meta);
     IOReturn handleClientMessage(SurfaceManagementEngineClient *client, MEIBusMessageHeader *mei_hdr, MEIBusExtendedMetaHeader *meta);
     void discardMessage(MEIBusMessageHeader *hdr, UInt16 discard_len);
         
     IOReturn handleWrite();
     void completeTransaction(MEIClientTransaction *tx);
     bool submitTransaction(MEIClientTransaction *tx);
+    MEIClientTransaction *acquireTransaction();
+    void releaseTransaction(MEIClientTransaction *tx);
+    void publishTxStats();
     
+    void noteActivity();
+    void recordIdleGap(UInt32 gap_ms);
+    void recordPowerGatingExit(UInt64 start);
+    void publishPowerGatingStats();
     void enterIdle(IOTimerEventSource *timer);
     void initialiseTimeout(IOTimerEventSource *timer);
     
     IOReturn addClient(MEIClientProperty *client_props, UInt8 addr);
+    void removeClient(UInt8 addr);
 };
 
 #endif /* SurfaceManagementEngineDriver_hpp */
@@ -0,0 +1,114 @@
+//
+//  SurfaceManagementEngineUserClient.cpp
+//  SurfaceTouchScreen
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "SurfaceManagementEngineUserClient.hpp"
+#include "MEIUserRing.h"
+
+#define super IOUserClient
+OSDefineMetaClassAndStructors(SurfaceManagementEngineUserClient, IOUserClient);
+
+bool SurfaceManagementEngineUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+    // Touch data and feedback go straight to ME
+    if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+        return false;
+    return super::initWithTask(owningTask, securityToken, type, properties);
+}
+
+bool SurfaceManagementEngineUserClient::start(IOService *provider) {
+    client = OSDynamicCast(SurfaceManagementEngineClient, provider);
+    if (!client)
+        return false;
+    if (!super::start(provider))
+        return false;
+
+    if (client->openUserRing(this, &ring) != kIOReturnSuccess) {
+        client = nullptr;
+        return false;
+    }
+    // the daemon may call in after the client stopped, keep it around until we are gone
+    client->retain();
+    return true;
+}
+
+void SurfaceManagementEngineUserClient::free() {
+    OSSafeReleaseNULL(ring);
+    OSSafeReleaseNULL(client);
+    super::free();
+}
+
+IOReturn SurfaceManagementEngineUserClient::clientClose() {
+    if (client && !stopped) {
+        // a map that timed out may still complete later, so always try
+        client->unmapDMABuffer();
+        client->closeUserRing(this);
+    }
+    OSSafeReleaseNULL(client);
+    OSSafeReleaseNULL(ring);
+    terminate();
+    return kIOReturnSuccess;
+}
+
+void SurfaceManagementEngineUserClient::providerStopped() {
+    stopped = true;
+    terminate();
+}
+
+IOReturn SurfaceManagementEngineUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    if (!client || stopped || !ring)
+        return kIOReturnNotAttached;
+    if (type != kMEIUserRingMemoryType)
+        return kIOReturnBadArgument;
+    ring->retain();
+    *options = 0;
+    *memory = ring;
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceManagementEngineUserClient::registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon) {
+    if (type != kMEIUserRingNotificationType)
+        return kIOReturnBadArgument;
+    notify_port = port;
+    notify_ref = refCon;
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceManagementEngineUserClient::externalMethod(UInt32 selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch, OSObject *target, void *reference) {
+    if (!client || stopped)
+        return kIOReturnNotAttached;
+    switch (selector) {
+        case kMEIUserRingMethodSubmit:
+            return client->submitUserMessages();
+        case kMEIUserRingMethodMapDMA: {
+            if (arguments->scalarInputCount != 2 || arguments->scalarInput[0] > 0xFF || arguments->scalarInput[1] > UINT32_MAX)
+                return kIOReturnBadArgument;
+            return client->mapDMABuffer(static_cast<UInt8>(arguments->scalarInput[0]), static_cast<UInt32>(arguments->scalarInput[1]));
+        }
+        case kMEIUserRingMethodUnmapDMA:
+            return client->unmapDMABuffer();
+        default:
+            return kIOReturnUnsupported;
+    }
+}
+
+/*
+ * Called on the client work loop, a full port queue already means a pending wakeup so never wait
+ */
+void SurfaceManagementEngineUserClient::notifyRing() {
+    mach_port_t port = notify_port;
+    if (port == MACH_PORT_NULL)
+        return;
+
+    mach_msg_header_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+    msg.msgh_size = sizeof(msg);
+    msg.msgh_remote_port = port;
+    msg.msgh_local_port = MACH_PORT_NULL;
+    msg.msgh_id = notify_ref;
+    mach_msg_send_from_kernel_with_options(&msg, sizeof(msg), MACH_SEND_TIMEOUT, 0);
+}
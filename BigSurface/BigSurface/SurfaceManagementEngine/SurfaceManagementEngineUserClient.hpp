@@ -0,0 +1,47 @@
+//
+//  SurfaceManagementEngineUserClient.hpp
+//  SurfaceTouchScreen
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceManagementEngineUserClient_hpp
+#define SurfaceManagementEngineUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+
+#include "SurfaceManagementEngineClient.hpp"
+
+class EXPORT SurfaceManagementEngineUserClient : public IOUserClient {
+    OSDeclareDefaultStructors(SurfaceManagementEngineUserClient);
+
+public:
+    bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) override;
+
+    bool start(IOService *provider) override;
+
+    void free() override;
+
+    IOReturn clientClose() override;
+
+    IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) override;
+
+    IOReturn registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon) override;
+
+    IOReturn externalMethod(UInt32 selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch, OSObject *target, void *reference) override;
+
+    void notifyRing();
+
+    // the client is going away, everything after this returns kIOReturnNotAttached
+    void providerStopped();
+
+private:
+    SurfaceManagementEngineClient*  client {nullptr};
+    volatile bool                   stopped {false};
+    IOBufferMemoryDescriptor*       ring {nullptr};
+    mach_port_t                     notify_port {MACH_PORT_NULL};
+    UInt32                          notify_ref {0};
+};
+
+#endif /* SurfaceManagementEngineUserClient_hpp */
@@ -86,6 +86,8 @@
 #define SSH_TEMP_SENSOR_GPU         0x06
 #define SSH_TEMP_SENSOR_SSD         0x07
 #define SSH_TEMP_SENSOR_SOC         0x08
+/* TC=0x05 */
+#define SSH_CID_FAN_RPM             0x01
 /* TC=0x08 */
 #define SSH_CID_KBD_GET_DESCRIPTOR      0x00
 #define SSH_CID_KBD_SET_CAPS_LED        0x01
@@ -95,6 +97,7 @@
 /* TC=0x0e */
 #define SSH_CID_KIP_ENABLE_EVENT    0x27
 #define SSH_CID_KIP_DISABLE_EVENT   0x28
+#define SSH_CID_KIP_CONNECTION      0x2c    // also the cid of connection change events
 /* TC=0x15 */
 #define SSH_CID_HID_OUT_REPORT      0x01
 #define SSH_CID_HID_GET_FEAT_REPORT 0x02
@@ -0,0 +1,82 @@
+//
+//  SerialRing.h
+//  SurfaceSerialHub
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SerialRing_h
+#define SerialRing_h
+
+#define SSH_RING_BUFFER_SIZE    10
+#define SSH_RING_BUFFER_NEXT(pos)   ((pos) + 1) % SSH_RING_BUFFER_SIZE
+#define SSH_CACHE_LINE_SIZE     64
+
+/*
+ * Buffers handed over by the UART controller, a single producer (the controller's thread)
+ * and a single consumer (the hub's work loop).
+ * Allocate it with IOMallocAligned(sizeof(SurfaceSerialRing), SSH_CACHE_LINE_SIZE), the alignment below only
+ * holds then: producer state, consumer state and every slot get cache lines of their own.
+ */
+struct SurfaceSerialRing {
+    struct alignas(SSH_CACHE_LINE_SIZE) Slot {
+        UInt8*          buffer;
+        volatile UInt16 filled_len;
+        UInt64          timestamp;  // when the UART controller handed the buffer over
+    };
+
+    /* Producer state */
+    alignas(SSH_CACHE_LINE_SIZE) int last;
+    UInt32  overrun_count;
+
+    /* Consumer state */
+    alignas(SSH_CACHE_LINE_SIZE) int current;
+
+    Slot    slots[SSH_RING_BUFFER_SIZE];
+
+    void reset() {
+        last = SSH_RING_BUFFER_SIZE - 1;
+        overrun_count = 0;
+        current = 0;
+        for (int i = 0; i < SSH_RING_BUFFER_SIZE; i++)
+            slots[i].filled_len = 0;
+    }
+
+    /*
+     * Called by the producer, false if the consumer has not caught up.
+     * Only the slot to fill is looked at, so `current` is never read from the consumer's cache line.
+     */
+    bool push(const UInt8 *buffer, UInt16 length, UInt64 timestamp) {
+        int next = SSH_RING_BUFFER_NEXT(last);
+        if (slots[next].filled_len) {
+            overrun_count++;
+            return false;
+        }
+        last = next;
+        memcpy(slots[next].buffer, buffer, length);
+        slots[next].timestamp = timestamp;
+        OSMemoryBarrier();
+        slots[next].filled_len = length;
+        return true;
+    }
+
+    /*
+     * Called by the consumer, the oldest filled slot or nullptr, hand it back with pop once processed
+     */
+    Slot *front() {
+        Slot *slot = &slots[current];
+        if (!slot->filled_len)
+            return nullptr;
+        OSMemoryBarrier();
+        return slot;
+    }
+
+    void pop() {
+        OSMemoryBarrier();
+        slots[current].filled_len = 0;
+        current = SSH_RING_BUFFER_NEXT(current);
+    }
+};
+
+#endif /* SerialRing_h */
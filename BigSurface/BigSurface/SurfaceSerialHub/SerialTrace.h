@@ -0,0 +1,60 @@
+//
+//  SerialTrace.h
+//  SurfaceSerialHub
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SerialTrace_h
+#define SerialTrace_h
+
+/*
+ * Layout of the event trace ring shared with user space.
+ * Map it with IOConnectMapMemory64(connect, kSurfaceSerialTraceMemoryType, ...) on a SurfaceSerialHubUserClient,
+ * and switch tracing with `ioio -s SurfaceSerialHubDriver TraceMode <mode>`.
+ *
+ * The ring is written by the hub's work loop only and never waits for readers, old records are overwritten.
+ * A record is valid when its seq equals (its absolute index + 1) both before and after copying it out.
+ */
+
+#define SSH_TRACE_MODE_KEY          "TraceMode"
+#define SSH_TRACE_RECORD_COUNT      1024    // must be a power of 2
+#define SSH_TRACE_PAYLOAD_SIZE      32
+#define SSH_TRACE_CATEGORY_COUNT    0x40
+
+enum SurfaceSerialTraceMode {
+    kSurfaceSerialTraceDisabled = 0,
+    kSurfaceSerialTraceHeaders,
+    kSurfaceSerialTracePayloads,
+};
+
+enum {
+    kSurfaceSerialTraceMemoryType = 0,
+    kSurfaceSerialLatencyMemoryType,    // SurfaceHIDLatencyRing of the HID nub, see HIDLatency.h
+};
+
+struct SurfaceSerialTraceRecord {
+    volatile UInt32 seq;
+    UInt16  length;         // length of the whole event payload
+    UInt16  request_id;
+    UInt8   tc;
+    UInt8   tid;
+    UInt8   iid;
+    UInt8   cid;
+    UInt8   captured;       // bytes of payload copied into this record
+    UInt8   _reserved[7];
+    UInt64  timestamp;      // mach absolute time when the frame was processed
+    UInt8   payload[SSH_TRACE_PAYLOAD_SIZE];
+};
+
+struct SurfaceSerialTraceRing {
+    volatile UInt32 head;   // total number of records ever written
+    UInt32  record_count;
+    volatile UInt32 mode;
+    UInt32  _reserved;
+    volatile UInt64 category_count[SSH_TRACE_CATEGORY_COUNT];  // events per target category while tracing
+    SurfaceSerialTraceRecord records[SSH_TRACE_RECORD_COUNT];
+};
+
+#endif /* SerialTrace_h */
@@ -10,6 +10,8 @@
 #include "../../../Dependencies/VoodooSerial/VoodooSerial/ACPIParser/VoodooACPIResourcesParser.hpp"
 #include "../SurfaceSerialHubDevices/SurfaceBatteryNub.hpp"
 #include "../SurfaceSerialHubDevices/SurfaceHIDNub.hpp"
+#include "../SurfaceSerialHubDevices/SurfaceThermalNub.hpp"
+#include "../SurfaceSerialHubDevices/SurfaceFanNub.hpp"
 
 struct SurfaceSerialEventRegistryConfig {
     UInt8 target_category;
@@ -29,7 +31,7 @@ OSDefineMetaClassAndAbstractStructors(SurfaceSerialHubClient, IOService);
 #define super IOService
 OSDefineMetaClassAndStructors(SurfaceSerialHubDriver, IOService);
 
-void err_dump(const char *name, const char *str, UInt8 *buffer, UInt16 len) {
+void err_dump(const char *name, const char *str, UInt8 *buffer, UInt32 len) {
     IOLog("%s::%s\n", name, str);
     if (len == 0)
         return;
@@ -68,22 +70,19 @@ int find_sync_bytes(UInt8 *buffer, UInt16 len) {
 void SurfaceSerialHubDriver::bufferReceived(VoodooUARTController *sender, UInt8 *buffer, UInt16 length) {
     if (!awake)
         return;
-    if (SSH_RING_BUFFER_NEXT(last) == current && ring_buffer[current].filled_len) {
-        LOG("Overrun!");
+    if (!ring->push(buffer, length, mach_absolute_time())) {
+        LOG("Overrun! (%u)", ring->overrun_count);
         return;
     }
-    
-    last = SSH_RING_BUFFER_NEXT(last);
-    memcpy(ring_buffer[last].buffer, buffer, length);
-    ring_buffer[last].filled_len = length;
     uart_interrupt->interruptOccurred(nullptr, this, 0);
 }
 
 void SurfaceSerialHubDriver::processReceivedBuffer(IOInterruptEventSource *sender, int count) {
-    while (ring_buffer[current].filled_len) {
-        _process(ring_buffer[current].buffer, ring_buffer[current].filled_len);
-        ring_buffer[current].filled_len = 0;
-        current = SSH_RING_BUFFER_NEXT(current);
+    SurfaceSerialRing::Slot *slot;
+    while ((slot = ring->front())) {
+        chunk_time = slot->timestamp;
+        _process(slot->buffer, slot->filled_len);
+        ring->pop();
     }
 }
 
@@ -91,41 +90,43 @@ void SurfaceSerialHubDriver::_process(UInt8 *buffer, UInt16 length) {
     if (length == 0)
         return;
     if (rx_msg.partial_syn) {
+        UInt8 syn = SSH_SYN_BYTE_1;
         if (judge_sync(buffer, length)) {
             processMessage();
             rx_msg.pos = 1;
             rx_msg.cache[0] = SSH_SYN_BYTE_1;
         } else {
-            rx_msg.cache[rx_msg.pos++] = SSH_SYN_BYTE_1;
+            appendToCache(&syn, 1);
         }
         rx_msg.partial_syn = false;
     }
     int end = find_sync_bytes(buffer, length);
     if (end != -1) {    // found sync bytes
-        if (end > 0) {
-            memcpy(rx_msg.cache+rx_msg.pos, buffer, end);
-            rx_msg.pos += end;
-        }
-        if (rx_msg.pos > 0) {  // a message is completed
+        bool cached = end == 0 || appendToCache(buffer, end);
+        if (cached && rx_msg.pos > 0)  // a message is completed
             processMessage();
-            buffer += end;
-            length -= end;
-        }
+        // restart at the sync bytes, also when the message before them was dropped
+        buffer += end;
+        length -= end;
         rx_msg.pos = 2;
         rx_msg.cache[0] = SSH_SYN_BYTE_1;
         rx_msg.cache[1] = SSH_SYN_BYTE_2;
         _process(buffer+2, length-2);
     } else {
         if (buffer[length-1] == SSH_SYN_BYTE_1) {
-            memcpy(rx_msg.cache+rx_msg.pos, buffer, length-1);
-            rx_msg.pos += length-1;
+            if (!appendToCache(buffer, length-1))
+                return;
             rx_msg.partial_syn = true;
-        } else {
-            memcpy(rx_msg.cache+rx_msg.pos, buffer, length);
-            rx_msg.pos += length;
-        }
-        if (rx_msg.pos >= 5 && rx_msg.len == SSH_MSG_LENGTH_UNKNOWN)
+        } else if (!appendToCache(buffer, length))
+            return;
+        if (rx_msg.pos >= 5 && rx_msg.len == SSH_MSG_LENGTH_UNKNOWN) {
             rx_msg.len = reinterpret_cast<SurfaceSerialMessage *>(rx_msg.cache)->frame.length+10;
+            if (rx_msg.len > rx_msg.capacity && !growCache(rx_msg.len)) {
+                LOG("Could not allocate cache for a message of length %u, dropped!", rx_msg.len);
+                resetCache();
+                return;
+            }
+        }
         if (rx_msg.pos == rx_msg.len) {  // a message is completed
             processMessage();
             if (rx_msg.partial_syn) {  // certainly another message
@@ -137,9 +138,44 @@ void SurfaceSerialHubDriver::_process(UInt8 *buffer, UInt16 length) {
     }
 }
 
+bool SurfaceSerialHubDriver::appendToCache(UInt8 *buffer, UInt32 length) {
+    if (rx_msg.pos+length > rx_msg.capacity && !growCache(rx_msg.pos+length)) {
+        // Without a sync byte the message can not be longer than the maximum frame, drop it
+        LOG("Message exceeds maximum length, dropped!");
+        resetCache();
+        return false;
+    }
+    memcpy(rx_msg.cache+rx_msg.pos, buffer, length);
+    rx_msg.pos += length;
+    return true;
+}
+
+bool SurfaceSerialHubDriver::growCache(UInt32 length) {
+    if (length > SSH_MSG_MAX_SIZE || rx_msg.cache == large_cache)
+        return false;
+    if (!large_cache) {
+        large_cache = new UInt8[SSH_MSG_MAX_SIZE];
+        if (!large_cache)
+            return false;
+    }
+    memcpy(large_cache, rx_msg.cache, rx_msg.pos);
+    rx_msg.cache = large_cache;
+    rx_msg.capacity = SSH_MSG_MAX_SIZE;
+    return true;
+}
+
+void SurfaceSerialHubDriver::resetCache() {
+    rx_msg.cache = rx_msg.small_cache;
+    rx_msg.capacity = SSH_MSG_CACHE_SIZE;
+    rx_msg.pos = 0;
+    rx_msg.len = SSH_MSG_LENGTH_UNKNOWN;
+    rx_msg.partial_syn = false;
+}
+
 #define ERR_DUMP_MSG(str) err_dump(getName(), str, rx_msg.cache, rx_msg.pos)
 
 IOReturn SurfaceSerialHubDriver::processMessage() {
+    UInt64 completed = mach_absolute_time();
     if (rx_msg.pos < 10) {
         sendNAK();
         ERR_DUMP_MSG("Message received incomplete! Protential data loss!");
@@ -223,14 +259,21 @@ IOReturn SurfaceSerialHubDriver::processMessage() {
                             req->data_len = rx_data_len;
                             memcpy(req->data, rx_data, rx_data_len);
                         }
+                        req->received = true;
                         command_gate->commandWakeup(&req->waiting);
                         remqueue(&req->entry);
+                        if (prefetch_count)     // a slot of the window is free again
+                            topUpPrefetched();
                         break;
                     }
                 }
                 if (!found)
                     DBG_LOG("Warning, received data with unknown tc %x, cid %x", command->target_category, command->command_id);
             } else {    // an event
+                if (trace_mode)
+                    traceEvent(command, rx_data, rx_data_len);
+                event_received = chunk_time;
+                event_completed = completed;
                 if (!queue_empty(&event_handler_lists[command->request_id]) || !queue_empty(&event_handler_lists[0])) {
                     EventHandler *h;
                     bool handled = false;
@@ -258,6 +301,10 @@ IOReturn SurfaceSerialHubDriver::processMessage() {
             return kIOReturnError;
     }
     
+    if (rx_msg.cache != rx_msg.small_cache) {
+        rx_msg.cache = rx_msg.small_cache;
+        rx_msg.capacity = SSH_MSG_CACHE_SIZE;
+    }
     rx_msg.pos = 0;
     rx_msg.len = SSH_MSG_LENGTH_UNKNOWN;
     
@@ -380,12 +427,32 @@ void SurfaceSerialHubDriver::commandTimeout(IOTimerEventSource* timer) {
         DBG_LOG("Warning, timeout occurred but find no timer");
 }
 
-IOReturn SurfaceSerialHubDriver::getResponse(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len, bool seq, UInt8 *buffer, UInt16 buffer_len) {
-    UInt16 req_id = sendCommand(tc, tid, iid, cid, payload, payload_len, seq);
+IOReturn SurfaceSerialHubDriver::getResponse(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len, bool seq, UInt8 *buffer, UInt16 buffer_len, UInt16 *received_len) {
+    IOReturn ret;
+    if (prefetch_count && payload_len <= SSH_PREFETCH_PAYLOAD_MAX) {
+        PrefetchedResponse key;
+        key.tc = tc;
+        key.tid = tid;
+        key.iid = iid;
+        key.cid = cid;
+        key.payload_len = payload_len;
+        if (payload_len)
+            memcpy(key.payload, payload, payload_len);
+        ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::consumePrefetchedGated), &key, buffer, &buffer_len);
+        if (ret != kIOReturnNotFound)
+            goto exit;
+    }
     
-    if (req_id != 0)
-        return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::waitResponse), &req_id, buffer, &buffer_len);
-    return kIOReturnError;
+    {
+        UInt16 req_id = sendCommand(tc, tid, iid, cid, payload, payload_len, seq);
+        if (req_id == 0)
+            return kIOReturnError;
+        ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::waitResponse), &req_id, buffer, &buffer_len);
+    }
+exit:
+    if (ret == kIOReturnSuccess && received_len)
+        *received_len = buffer_len;
+    return ret;
 }
 
 IOReturn SurfaceSerialHubDriver::waitResponse(UInt16 *req_id, UInt8 *buffer, UInt16 *buffer_len) {
@@ -394,6 +461,7 @@ IOReturn SurfaceSerialHubDriver::waitResponse(UInt16 *req_id, UInt8 *buffer, UIn
     
     WaitingRequest *w = new WaitingRequest;
     w->waiting = false;
+    w->received = false;
     w->req_id = *req_id;
     w->data = nullptr;
     w->data_len = 0;
@@ -409,6 +477,76 @@ IOReturn SurfaceSerialHubDriver::waitResponse(UInt16 *req_id, UInt8 *buffer, UIn
         delete w;
         return kIOReturnTimeout;
     }
+    copyResponse(w, buffer, buffer_len);
+    *buffer_len = w->data_len;
+    delete w;
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceSerialHubDriver::getResponses(SurfaceSerialRequest *requests, UInt16 count) {
+    if (!requests || !count)
+        return kIOReturnBadArgument;
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::getResponsesGated), requests, &count);
+}
+
+IOReturn SurfaceSerialHubDriver::getResponsesGated(SurfaceSerialRequest *requests, UInt16 *count) {
+    WaitingRequest *inflight[SSH_MAX_INFLIGHT_REQUESTS];
+    UInt64 deadlines[SSH_MAX_INFLIGHT_REQUESTS];
+    UInt64 timeout;
+    UInt16 sent = 0, done = 0;
+    IOReturn ret = kIOReturnSuccess;
+    
+    nanoseconds_to_absolutetime(SSH_WAIT_TIMEOUT * 1000000ULL, &timeout);
+    while (done < *count) {
+        // Top up the window, the gate is held so no response can be missed in between
+        while (sent < *count && sent - done < SSH_MAX_INFLIGHT_REQUESTS) {
+            SurfaceSerialRequest *r = &requests[sent];
+            int slot = sent % SSH_MAX_INFLIGHT_REQUESTS;
+            UInt16 req_id = sendCommand(r->tc, r->tid, r->iid, r->cid, r->payload, r->payload_len, true);
+            if (req_id == 0) {
+                inflight[slot] = nullptr;
+            } else {
+                WaitingRequest *w = new WaitingRequest;
+                w->waiting = false;
+                w->received = false;
+                w->req_id = req_id;
+                w->data = nullptr;
+                w->data_len = 0;
+                enqueue(&waiting_list, &w->entry);
+                inflight[slot] = w;
+                deadlines[slot] = mach_absolute_time() + timeout;
+            }
+            sent++;
+        }
+        
+        SurfaceSerialRequest *r = &requests[done];
+        int slot = done % SSH_MAX_INFLIGHT_REQUESTS;
+        WaitingRequest *w = inflight[slot];
+        if (!w) {
+            r->status = kIOReturnError;
+        } else {
+            if (!w->received)
+                command_gate->commandSleep(&w->waiting, deadlines[slot], THREAD_INTERRUPTIBLE);
+            if (w->received) {
+                copyResponse(w, r->buffer, &r->buffer_len);
+                r->buffer_len = w->data_len;
+                r->status = kIOReturnSuccess;
+            } else {
+                remqueue(&w->entry);
+                r->status = kIOReturnTimeout;
+            }
+            delete w;
+        }
+        if (r->status != kIOReturnSuccess) {
+            DBG_LOG("Batched request tc %x, tid %x, iid %x, cid %x failed", r->tc, r->tid, r->iid, r->cid);
+            ret = r->status;
+        }
+        done++;
+    }
+    return ret;
+}
+
+void SurfaceSerialHubDriver::copyResponse(WaitingRequest *w, UInt8 *buffer, UInt16 *buffer_len) {
     if (*buffer_len != w->data_len)
         DBG_LOG("Warning, given buffer_len(%d) and received data_len(%d) mismatched!", *buffer_len, w->data_len);
     if (w->data_len) {
@@ -416,8 +554,183 @@ IOReturn SurfaceSerialHubDriver::waitResponse(UInt16 *req_id, UInt8 *buffer, UIn
             w->data_len = *buffer_len;
         memcpy(buffer, w->data, w->data_len);
         delete[] w->data;
+        w->data = nullptr;
+    }
+}
+
+IOReturn SurfaceSerialHubDriver::prefetchBootDataGated() {
+    // Queries issued by start and by the nubs once they are published, queued here and sent through the
+    // request window so that their round trips overlap. Payloads must match the requests exactly.
+    // Only static data is prefetched, time-varying state such as the battery could be replayed stale,
+    // the boot notifications are consumed by start right away.
+    prefetchResponse(SSH_TC_SAM, SSH_TID_PRIMARY, 0, SSH_CID_SAM_VERSION, nullptr, 0);
+    prefetchResponse(SSH_TC_SAM, SSH_TID_PRIMARY, 0, SSH_CID_SAM_D0_ENTRY, nullptr, 0);
+    prefetchResponse(SSH_TC_SAM, SSH_TID_PRIMARY, 0, SSH_CID_SAM_DISPLAY_ON, nullptr, 0);
+    
+    const SurfaceHIDDeviceType hid_devices[] = {SurfaceKeyboardDevice, SurfaceTouchpadDevice};
+    const SurfaceHIDDescriptorEntryType hid_entries[] = {SurfaceHIDDescriptorEntry, SurfaceHIDAttributesEntry};
+    SurfaceHIDDescriptorBufferHeader header;
+    header.offset = 0;
+    header.length = SURFACE_HID_DESC_WINDOW_SIZE;
+    header.finished = false;
+    for (SurfaceHIDDeviceType device : hid_devices) {
+        for (SurfaceHIDDescriptorEntryType e : hid_entries) {
+            header.entry = e;
+            prefetchResponse(SSH_TC_HID, SSH_TID_SECONDARY, device, SSH_CID_HID_GET_DESCRIPTOR, reinterpret_cast<UInt8 *>(&header), SURFACE_HID_DESC_HEADER_SIZE);
+        }
+    }
+    
+    // Last, so that it is dropped before being sent once a HID query is answered
+    UInt8 entry = SurfaceHIDDescriptorEntry;
+    prefetchResponse(SSH_TC_KBD, SSH_TID_SECONDARY, SurfaceLegacyKeyboardDevice, SSH_CID_KBD_GET_DESCRIPTOR, &entry, 1);
+    
+    topUpPrefetched();
+    DBG_LOG("%d boot queries prefetched", prefetch_count);
+    return kIOReturnSuccess;
+}
+
+void SurfaceSerialHubDriver::prefetchResponse(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len) {
+    // Only queued, topUpPrefetched sends it once there is room in the window
+    PrefetchedResponse *p = new PrefetchedResponse;
+    p->req = nullptr;
+    p->tc = tc;
+    p->tid = tid;
+    p->iid = iid;
+    p->cid = cid;
+    p->payload_len = payload_len;
+    if (payload_len)
+        memcpy(p->payload, payload, payload_len);
+    clock_get_uptime(&p->issued);
+    enqueue(&prefetch_list, &p->entry);
+    prefetch_count++;
+}
+
+void SurfaceSerialHubDriver::topUpPrefetched() {
+    // Same window as getResponsesGated, called with the gate closed so a response can not arrive before its request is queued
+    PrefetchedResponse *p;
+    UInt64 now, timeout;
+    UInt32 inflight = 0, unsent = 0;
+    
+    clock_get_uptime(&now);
+    nanoseconds_to_absolutetime(SSH_WAIT_TIMEOUT * 1000000ULL, &timeout);
+    qe_foreach_element(p, &prefetch_list, entry) {
+        // requests which timed out do not hold a slot any more
+        if (p->req && !p->req->received && now - p->issued < timeout)
+            inflight++;
+        if (p->req && p->req->received && p->tc == SSH_TC_HID)
+            hid_answered = true;
+    }
+    qe_foreach_element_safe(p, &prefetch_list, entry) {
+        if (p->req)
+            continue;
+        // Only the legacy keyboard (Laptop 1/2) answers it, anything else would let it time out in the window
+        if (p->tc == SSH_TC_KBD && hid_answered) {
+            remqueue(&p->entry);
+            releasePrefetched(p);
+            continue;
+        }
+        if (inflight >= SSH_MAX_INFLIGHT_REQUESTS) {
+            unsent++;
+            continue;
+        }
+        UInt16 req_id = sendCommand(p->tc, p->tid, p->iid, p->cid, p->payload, p->payload_len, true);
+        if (req_id == 0) {
+            unsent++;
+            break;
+        }
+        WaitingRequest *w = new WaitingRequest;
+        w->waiting = false;
+        w->received = false;
+        w->req_id = req_id;
+        w->data = nullptr;
+        w->data_len = 0;
+        enqueue(&waiting_list, &w->entry);
+        p->req = w;
+        p->issued = now;
+        inflight++;
+    }
+    
+    // Nubs go out once every boot query is answered, or has surely timed out
+    if (publish_ready && !nubs_published && !unsent)
+        publish_timer->setTimeoutMS(inflight ? SSH_WAIT_TIMEOUT : 1);
+}
+
+IOReturn SurfaceSerialHubDriver::schedulePublishingGated() {
+    publish_ready = true;
+    topUpPrefetched();
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceSerialHubDriver::consumePrefetchedGated(PrefetchedResponse *key, UInt8 *buffer, UInt16 *buffer_len) {
+    PrefetchedResponse *p;
+    UInt64 now, lifetime, deadline;
+    IOReturn ret = kIOReturnNotFound;
+    
+    clock_get_uptime(&now);
+    nanoseconds_to_absolutetime(SSH_PREFETCH_LIFETIME * 1000000ULL, &lifetime);
+    qe_foreach_element_safe(p, &prefetch_list, entry) {
+        if (now - p->issued > lifetime) {
+            remqueue(&p->entry);
+            releasePrefetched(p);
+            continue;
+        }
+        if (p->tc != key->tc || p->tid != key->tid || p->iid != key->iid || p->cid != key->cid ||
+            p->payload_len != key->payload_len || memcmp(p->payload, key->payload, key->payload_len) != 0)
+            continue;
+        
+        // Taken off the list first so that a flush can not free it while we are sleeping
+        remqueue(&p->entry);
+        if (!p->req) {
+            // Not sent yet, the caller asks for it directly
+            releasePrefetched(p);
+            break;
+        }
+        if (!p->req->received) {
+            // Still in flight, wait for what is left of its timeout instead of asking again
+            nanoseconds_to_absolutetime(SSH_WAIT_TIMEOUT * 1000000ULL, &deadline);
+            deadline += p->issued;
+            command_gate->commandSleep(&p->req->waiting, deadline, THREAD_INTERRUPTIBLE);
+        }
+        if (p->req->received) {
+            copyResponse(p->req, buffer, buffer_len);
+            *buffer_len = p->req->data_len;
+            ret = kIOReturnSuccess;
+        } else {
+            DBG_LOG("Prefetched request tc %x, cid %x timed out", p->tc, p->cid);
+            ret = kIOReturnTimeout;
+        }
+        releasePrefetched(p);
+        break;
+    }
+    if (prefetch_count)
+        topUpPrefetched();
+    return ret;
+}
+
+void SurfaceSerialHubDriver::releasePrefetched(PrefetchedResponse *p) {
+    prefetch_count--;
+    if (p->req) {
+        if (!p->req->received)
+            remqueue(&p->req->entry);
+        if (p->req->data)
+            delete[] p->req->data;
+        delete p->req;
+    }
+    delete p;
+}
+
+void SurfaceSerialHubDriver::dropPrefetched(UInt8 tc) {
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::dropPrefetchedGated), &tc);
+}
+
+IOReturn SurfaceSerialHubDriver::dropPrefetchedGated(UInt8 *tc) {
+    PrefetchedResponse *p;
+    qe_foreach_element_safe(p, &prefetch_list, entry) {
+        if (p->tc == *tc) {
+            remqueue(&p->entry);
+            releasePrefetched(p);
+        }
     }
-    delete w;
     return kIOReturnSuccess;
 }
 
@@ -478,6 +791,62 @@ void SurfaceSerialHubDriver::unregisterEvent(SurfaceSerialHubClient *client, Sur
     }
 }
 
+IOReturn SurfaceSerialHubDriver::setTraceModeGated(UInt32 *mode) {
+    if (*mode > kSurfaceSerialTracePayloads)
+        return kIOReturnBadArgument;
+    
+    if (*mode != kSurfaceSerialTraceDisabled && !trace_buffer) {
+        trace_buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(SurfaceSerialTraceRing), PAGE_SIZE);
+        if (!trace_buffer) {
+            LOG("Could not allocate trace ring!");
+            return kIOReturnNoMemory;
+        }
+        trace_ring = reinterpret_cast<SurfaceSerialTraceRing *>(trace_buffer->getBytesNoCopy());
+        memset(trace_ring, 0, sizeof(SurfaceSerialTraceRing));
+        trace_ring->record_count = SSH_TRACE_RECORD_COUNT;
+    }
+    trace_mode = *mode;
+    if (trace_ring)
+        trace_ring->mode = trace_mode;
+    setProperty(SSH_TRACE_MODE_KEY, trace_mode, 32);
+    LOG("Event tracing mode set to %d", trace_mode);
+    return kIOReturnSuccess;
+}
+
+void SurfaceSerialHubDriver::traceEvent(SurfaceSerialCommand *command, UInt8 *data, UInt16 length) {
+    UInt32 index = trace_ring->head;
+    SurfaceSerialTraceRecord *r = &trace_ring->records[index & (SSH_TRACE_RECORD_COUNT-1)];
+    
+    // Invalidate the slot first so that a reader never takes a half-written record as valid
+    r->seq = 0;
+    OSMemoryBarrier();
+    r->length = length;
+    r->request_id = command->request_id;
+    r->tc = command->target_category;
+    r->tid = command->target_id_in;
+    r->iid = command->instance_id;
+    r->cid = command->command_id;
+    r->timestamp = mach_absolute_time();
+    if (trace_mode == kSurfaceSerialTracePayloads) {
+        r->captured = length < SSH_TRACE_PAYLOAD_SIZE ? length : SSH_TRACE_PAYLOAD_SIZE;
+        memcpy(r->payload, data, r->captured);
+    } else
+        r->captured = 0;
+    OSMemoryBarrier();
+    r->seq = index + 1;
+    trace_ring->head = index + 1;
+    trace_ring->category_count[command->target_category & (SSH_TRACE_CATEGORY_COUNT-1)]++;
+}
+
+IOBufferMemoryDescriptor* SurfaceSerialHubDriver::getLatencyTraceBuffer() {
+    return hid_nub ? hid_nub->getLatencyTraceBuffer() : nullptr;
+}
+
+void SurfaceSerialHubDriver::getEventTimestamps(UInt64 *received, UInt64 *completed) {
+    *received = event_received;
+    *completed = event_completed;
+}
+
 IOReturn SurfaceSerialHubDriver::sendEventCommand(SurfaceSerialEventRegistryType type, UInt8 tc, UInt8 iid, bool enable) {
     SurfaceSerialEventData payload;
     payload.target_category = tc;
@@ -498,14 +867,12 @@ bool SurfaceSerialHubDriver::init(OSDictionary *properties) {
     if (!super::init(properties))
         return false;
     
-    memset(ring_buffer, 0, sizeof(ring_buffer));
-    memset(rx_msg.cache, 0, SSH_MSG_CACHE_SIZE);
-    rx_msg.pos = 0;
-    rx_msg.len = SSH_MSG_LENGTH_UNKNOWN;
-    rx_msg.partial_syn = false;
+    memset(rx_msg.small_cache, 0, SSH_MSG_CACHE_SIZE);
+    resetCache();
     
     queue_head_init(pending_list);
     queue_head_init(waiting_list);
+    queue_head_init(prefetch_list);
     for (int i=0; i < SSH_REQID_MIN; i++)
         queue_head_init(event_handler_lists[i]);
     
@@ -538,9 +905,17 @@ IOService* SurfaceSerialHubDriver::probe(IOService *provider, SInt32 *score) {
     // Give the UART controller some time to load
     IOSleep(100);
     
-    // Allocate a ring buffer with size SSH_BUFFER_SIZE to store buffer from UART
-    for (int i=0; i < SSH_RING_BUFFER_SIZE; i++)
-        ring_buffer[i].buffer = new UInt8[fifo_size];
+    // Allocate a ring buffer with size SSH_BUFFER_SIZE to store buffer from UART,
+    // kalloc gives the object no cache line alignment so the ring gets an allocation of its own
+    if (!ring) {
+        ring = reinterpret_cast<SurfaceSerialRing *>(IOMallocAligned(sizeof(SurfaceSerialRing), SSH_CACHE_LINE_SIZE));
+        if (!ring)
+            return nullptr;
+        memset(ring, 0, sizeof(SurfaceSerialRing));
+        ring->reset();
+        for (int i=0; i < SSH_RING_BUFFER_SIZE; i++)
+            ring->slots[i].buffer = new UInt8[fifo_size];
+    }
     
     LOG("Surface Serial Hub found!");
     return this;
@@ -571,8 +946,8 @@ bool SurfaceSerialHubDriver::start(IOService *provider) {
         goto exit;
     }
     work_loop->addEventSource(publish_timer);
-    // publishing nubs after 20s
-    publish_timer->setTimeoutMS(20000);
+    // topUpPrefetched publishes them earlier once the boot queries are done
+    publish_timer->setTimeoutMS(SSH_PUBLISH_DELAY_MAX);
     
     uart_interrupt = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &SurfaceSerialHubDriver::processReceivedBuffer));
     if (!uart_interrupt) {
@@ -594,6 +969,9 @@ bool SurfaceSerialHubDriver::start(IOService *provider) {
         goto exit;
     }
     
+    // The boot queries share the request window, the ones below are answered first
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::prefetchBootDataGated));
+    
     if (getResponse(SSH_TC_SAM, SSH_TID_PRIMARY, 0, SSH_CID_SAM_VERSION, nullptr, 0, true, reinterpret_cast<UInt8 *>(&version), 4) != kIOReturnSuccess) {
         LOG("Failed to get SAM version! UART probably misconfigured!");
         goto exit_connected;
@@ -605,11 +983,15 @@ bool SurfaceSerialHubDriver::start(IOService *provider) {
     if (getResponse(SSH_TC_SAM, SSH_TID_PRIMARY, 0, SSH_CID_SAM_DISPLAY_ON, nullptr, 0, true, &ret, 1) != kIOReturnSuccess || ret != 0)
         DBG_LOG("Unexpected response from display-on notification, ret=%x", ret);
     
+    setProperty("IOUserClientClass", "SurfaceSerialHubUserClient");
+    setProperty(SSH_TRACE_MODE_KEY, trace_mode, 32);
+    
     PMinit();
     uart_controller->joinPMtree(this);
     registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
     
     registerService();
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::schedulePublishingGated));
     return true;
     
 exit_connected:
@@ -649,20 +1031,33 @@ IOReturn SurfaceSerialHubDriver::flushCacheGated() {
             delete cmd;
         }
     }
-    if (ring_buffer[current].filled_len) {
+    PrefetchedResponse *p;
+    qe_foreach_element_safe(p, &prefetch_list, entry) {
+        remqueue(&p->entry);
+        releasePrefetched(p);
+    }
+    if (ring->front()) {
         DBG_LOG("There are still raw data unprocessed!");
-        while (ring_buffer[current].filled_len) {
-            ring_buffer[current].filled_len = 0;
-            current = (current + 1) % SSH_RING_BUFFER_SIZE;
-        }
+        while (ring->front())
+            ring->pop();
     }
-    rx_msg.pos = 0;
-    rx_msg.len = SSH_MSG_LENGTH_UNKNOWN;
-    rx_msg.partial_syn = false;
+    resetCache();
     
     return kIOReturnSuccess;
 }
 
+IOReturn SurfaceSerialHubDriver::setProperties(OSObject *props) {
+    OSDictionary* dict = OSDynamicCast(OSDictionary, props);
+    if (!dict)
+        return kIOReturnError;
+    
+    OSNumber *mode = OSDynamicCast(OSNumber, dict->getObject(SSH_TRACE_MODE_KEY));
+    if (!mode)
+        return kIOReturnUnsupported;
+    UInt32 m = mode->unsigned32BitValue();
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SurfaceSerialHubDriver::setTraceModeGated), &m);
+}
+
 IOReturn SurfaceSerialHubDriver::setPowerState(unsigned long whichState, IOService *whatDevice) {
     if (whatDevice != this)
         return kIOReturnInvalid;
@@ -704,6 +1099,16 @@ void SurfaceSerialHubDriver::releaseResources() {
         hid_nub->detach(this);
         OSSafeReleaseNULL(hid_nub);
     }
+    if (thermal_nub) {
+        thermal_nub->stop(this);
+        thermal_nub->detach(this);
+        OSSafeReleaseNULL(thermal_nub);
+    }
+    if (fan_nub) {
+        fan_nub->stop(this);
+        fan_nub->detach(this);
+        OSSafeReleaseNULL(fan_nub);
+    }
     EventHandler *h;
     for (int i=0; i < SSH_REQID_MIN; i++) {
         qe_foreach_element_safe(h, &event_handler_lists[i], entry) {
@@ -711,6 +1116,11 @@ void SurfaceSerialHubDriver::releaseResources() {
             delete h;
         }
     }
+    PrefetchedResponse *p;
+    qe_foreach_element_safe(p, &prefetch_list, entry) {
+        remqueue(&p->entry);
+        releasePrefetched(p);
+    }
     WaitingRequest *req;
     qe_foreach_element_safe(req, &waiting_list, entry) {
         remqueue(&req->entry);
@@ -728,8 +1138,16 @@ void SurfaceSerialHubDriver::releaseResources() {
         delete[] cmd->buffer;
         delete cmd;
     }
-    for (int i=0; i < SSH_RING_BUFFER_SIZE; i++) {
-        delete[] ring_buffer[i].buffer;
+    if (ring) {
+        for (int i=0; i < SSH_RING_BUFFER_SIZE; i++)
+            delete[] ring->slots[i].buffer;
+        IOFreeAligned(ring, sizeof(SurfaceSerialRing));
+        ring = nullptr;
+    }
+    resetCache();
+    if (large_cache) {
+        delete[] large_cache;
+        large_cache = nullptr;
     }
     if (uart_interrupt) {
         uart_interrupt->disable();
@@ -747,6 +1165,9 @@ void SurfaceSerialHubDriver::releaseResources() {
         work_loop->removeEventSource(publish_timer);
         OSSafeReleaseNULL(publish_timer);
     }
+    trace_mode = kSurfaceSerialTraceDisabled;
+    trace_ring = nullptr;
+    OSSafeReleaseNULL(trace_buffer);
     if (command_gate) {
         work_loop->removeEventSource(command_gate);
         OSSafeReleaseNULL(command_gate);
@@ -841,6 +1262,10 @@ IOReturn SurfaceSerialHubDriver::getDeviceResources() {
 }
 
 void SurfaceSerialHubDriver::delayedPublishingNubs(IOTimerEventSource *sender) {
+    if (nubs_published)
+        return;
+    nubs_published = true;
+    
     battery_nub = OSTypeAlloc(SurfaceBatteryNub);
     if (!battery_nub || !battery_nub->init() || !battery_nub->attach(this)) {
         LOG("Failed to init Surface Battery nub!");
@@ -866,6 +1291,32 @@ void SurfaceSerialHubDriver::delayedPublishingNubs(IOTimerEventSource *sender) {
         } else
             DBG_LOG("Surface HID nub published!");
     }
+    
+    thermal_nub = OSTypeAlloc(SurfaceThermalNub);
+    if (!thermal_nub || !thermal_nub->init() || !thermal_nub->attach(this)) {
+        LOG("Failed to init Surface Thermal nub!");
+        OSSafeReleaseNULL(thermal_nub);
+    } else {
+        if (!thermal_nub->start(this)) {
+            LOG("Failed to attach Surface Thermal nub!");
+            thermal_nub->detach(this);
+            OSSafeReleaseNULL(thermal_nub);
+        } else
+            DBG_LOG("Surface Thermal nub published!");
+    }
+    
+    fan_nub = OSTypeAlloc(SurfaceFanNub);
+    if (!fan_nub || !fan_nub->init() || !fan_nub->attach(this)) {
+        LOG("Failed to init Surface Fan nub!");
+        OSSafeReleaseNULL(fan_nub);
+    } else {
+        if (!fan_nub->start(this)) {
+            LOG("Failed to attach Surface Fan nub!");
+            fan_nub->detach(this);
+            OSSafeReleaseNULL(fan_nub);
+        } else
+            DBG_LOG("Surface Fan nub published!");
+    }
 }
 
 void SurfaceSerialHubDriver::gpioWakeUp(IOInterruptEventSource *sender, int count) {
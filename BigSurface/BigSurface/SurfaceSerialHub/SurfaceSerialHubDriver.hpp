@@ -9,11 +9,14 @@
 #ifndef SurfaceSerialHubDriver_hpp
 #define SurfaceSerialHubDriver_hpp
 
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
 #include "../../../Dependencies/VoodooGPIO/VoodooGPIO/VoodooGPIO.hpp"
 #include "../../../Dependencies/VoodooSerial/VoodooSerial/VoodooUART/VoodooUARTController.hpp"
 #include "SerialProtocol.h"
+#include "SerialRing.h"
+#include "SerialTrace.h"
 
 enum SurfaceSerialEventRegistryType {
     SurfaceSerialEventHostManagedV1 = 0,
@@ -23,13 +26,16 @@ enum SurfaceSerialEventRegistryType {
 };
 
 #define SSH_REQID_MIN           SSH_TC_COUNT+1
-#define SSH_MSG_CACHE_SIZE      256     // max length for a single message
-#define SSH_MSG_LENGTH_UNKNOWN  (SSH_MSG_CACHE_SIZE+1)
-#define SSH_RING_BUFFER_SIZE    10
-#define SSH_RING_BUFFER_NEXT(pos)   ((pos) + 1) % SSH_RING_BUFFER_SIZE
+#define SSH_MSG_CACHE_SIZE      256     // inline cache, large enough for most messages
+#define SSH_MSG_MAX_SIZE        (0xffff+10) // frame length is 16-bit, plus syn, frame, frame crc and payload crc
+#define SSH_MSG_LENGTH_UNKNOWN  0
 #define SSH_ACK_TIMEOUT         50
 #define SSH_CMD_TRAIL_CNT       3
 #define SSH_WAIT_TIMEOUT        (SSH_ACK_TIMEOUT * SSH_CMD_TRAIL_CNT)
+#define SSH_MAX_INFLIGHT_REQUESTS   3   // same limit as the windows and linux drivers
+#define SSH_PUBLISH_DELAY_MAX   20000   // nubs are published once the boot queries are done, at the latest after this
+#define SSH_PREFETCH_LIFETIME   30000   // prefetched responses have to outlive the delay of publishing nubs
+#define SSH_PREFETCH_PAYLOAD_MAX    16
 
 
 class EXPORT SurfaceSerialHubClient : public IOService {
@@ -44,8 +50,25 @@ public:
     virtual void eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) = 0;
 };
 
+/*
+ * One request of a batch passed to getResponses
+ */
+struct SurfaceSerialRequest {
+    UInt8       tc;
+    UInt8       tid;
+    UInt8       iid;
+    UInt8       cid;
+    UInt8*      payload;
+    UInt16      payload_len;
+    UInt8*      buffer;
+    UInt16      buffer_len;
+    IOReturn    status;
+};
+
 class SurfaceBatteryNub;
 class SurfaceHIDNub;
+class SurfaceThermalNub;
+class SurfaceFanNub;
 
 class EXPORT SurfaceSerialHubDriver : public IOService {
     OSDeclareDefaultStructors(SurfaceSerialHubDriver);
@@ -53,12 +76,43 @@ class EXPORT SurfaceSerialHubDriver : public IOService {
 public:
     UInt16 sendCommand(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len, bool seq);
 
-    IOReturn getResponse(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len, bool seq, UInt8 *buffer, UInt16 buffer_len);
+    /*
+     * received_len is set to the bytes actually copied, which can be less than buffer_len
+     */
+    IOReturn getResponse(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len, bool seq, UInt8 *buffer, UInt16 buffer_len, UInt16 *received_len = nullptr);
+
+    /*
+     * Pipelined version of getResponse, keeps up to SSH_MAX_INFLIGHT_REQUESTS requests in flight
+     * Each request gets its own status and buffer_len is updated to the received length,
+     * the return value is kIOReturnSuccess only if all of them succeeded
+     */
+    IOReturn getResponses(SurfaceSerialRequest *requests, UInt16 count);
 
     IOReturn registerEvent(SurfaceSerialHubClient *client, SurfaceSerialEventRegistryType type, UInt8 tc, UInt8 iid);
     
     void unregisterEvent(SurfaceSerialHubClient *client, SurfaceSerialEventRegistryType type, UInt8 tc, UInt8 iid);
     
+    /*
+     * Discard boot-time prefetched responses of a target category, e.g. when the device behind it changed
+     */
+    void dropPrefetched(UInt8 tc);
+    
+    /*
+     * Buffer holding the SurfaceSerialTraceRing, nullptr if tracing has never been enabled
+     */
+    IOBufferMemoryDescriptor* getTraceBuffer() { return trace_buffer; }
+    
+    /*
+     * Buffer holding the SurfaceHIDLatencyRing of the HID nub, nullptr if latency tracing has never been enabled
+     */
+    IOBufferMemoryDescriptor* getLatencyTraceBuffer();
+    
+    /*
+     * When the event being dispatched was received and completed, in mach absolute time
+     * only valid inside eventReceived
+     */
+    void getEventTimestamps(UInt64 *received, UInt64 *completed);
+    
     bool init(OSDictionary* properties) override;
     
     IOService* probe(IOService* provider, SInt32* score) override;
@@ -70,6 +124,8 @@ public:
     void free() override;
     
     IOReturn setPowerState(unsigned long whichState, IOService *whatDevice) override;
+    
+    IOReturn setProperties(OSObject* props) override;
 
     IOReturn enableInterrupt(int source) override;
     
@@ -105,10 +161,23 @@ private:
     struct WaitingRequest {
         queue_entry entry;
         bool    waiting;
+        bool    received;
         UInt16  req_id;
         UInt8*  data;
         UInt16  data_len;
     };
+    
+    struct PrefetchedResponse {
+        queue_entry entry;
+        WaitingRequest* req;    // nullptr until sent
+        UInt8   tc;
+        UInt8   tid;
+        UInt8   iid;
+        UInt8   cid;
+        UInt8   payload[SSH_PREFETCH_PAYLOAD_MAX];
+        UInt16  payload_len;
+        UInt64  issued;         // queued, then sent
+    };
 
     struct PendingCommand {
         queue_entry entry;
@@ -119,23 +188,21 @@ private:
     };
 
     struct MessageCache {
-        UInt8   cache[SSH_MSG_CACHE_SIZE];
-        UInt16  len;
-        UInt16  pos;
+        UInt8*  cache;      // points to either small_cache or large_cache
+        UInt32  capacity;
+        UInt32  len;
+        UInt32  pos;
         bool    partial_syn;
+        UInt8   small_cache[SSH_MSG_CACHE_SIZE];
     };
 
-    struct RingBuffer {
-        UInt8* buffer;
-        UInt16 filled_len;
-    };
-    
     struct EventHandler {
         queue_entry entry;
         UInt8 target_iid;
         SurfaceSerialHubClient *client;
     };
     
+    /* Read-mostly state, shared by the UART callback and the work loop */
     IOWorkLoop*             work_loop {nullptr};
     IOCommandGate*          command_gate {nullptr};
     IOTimerEventSource*     publish_timer {nullptr};
@@ -146,18 +213,12 @@ private:
     VoodooGPIO*             gpio_controller {nullptr};
     SurfaceBatteryNub*      battery_nub {nullptr};
     SurfaceHIDNub*          hid_nub {nullptr};
+    SurfaceThermalNub*      thermal_nub {nullptr};
+    SurfaceFanNub*          fan_nub {nullptr};
+    SurfaceSerialRing*      ring {nullptr};     // UART buffers, filled by bufferReceived and drained on the work loop
     
-    bool            awake {true};
-    RingBuffer      ring_buffer[SSH_RING_BUFFER_SIZE];
-    int             current {0};
-    int             last {SSH_RING_BUFFER_SIZE-1};
-    MessageCache    rx_msg;
-    queue_head_t    pending_list;
-    queue_head_t    waiting_list;
-    queue_head_t    event_handler_lists[SSH_REQID_MIN];
-    
-    CircleIDCounter seq_counter {CircleIDCounter(0x00, 0xff)};
-    CircleIDCounter req_counter {CircleIDCounter(SSH_REQID_MIN, 0xffff)};
+    bool    awake {true};
+    UInt32  trace_mode {kSurfaceSerialTraceDisabled};
     
     UInt32  baudrate {0};
     UInt8   data_bits {0};
@@ -168,6 +229,27 @@ private:
     UInt16  gpio_pin {0};
     UInt16  gpio_irq {0};
     
+    /* Only touched on the work loop */
+    MessageCache    rx_msg;
+    UInt8*          large_cache {nullptr};  // allocated on the first oversized frame and reused afterwards
+    queue_head_t    pending_list;
+    queue_head_t    waiting_list;
+    queue_head_t    prefetch_list;
+    UInt32          prefetch_count {0};
+    bool            hid_answered {false};   // the device speaks the HID category, so it has no legacy keyboard
+    bool            publish_ready {false};  // start is done, nubs may go out
+    bool            nubs_published {false};
+    queue_head_t    event_handler_lists[SSH_REQID_MIN];
+    UInt64          chunk_time {0};         // timestamp of the buffer being parsed
+    UInt64          event_received {0};
+    UInt64          event_completed {0};
+    
+    IOBufferMemoryDescriptor*   trace_buffer {nullptr};
+    SurfaceSerialTraceRing*     trace_ring {nullptr};
+    
+    CircleIDCounter seq_counter {CircleIDCounter(0x00, 0xff)};
+    CircleIDCounter req_counter {CircleIDCounter(SSH_REQID_MIN, 0xffff)};
+    
     void bufferReceived(VoodooUARTController *sender, UInt8 *buffer, UInt16 length);
     
     IOReturn sendACK(UInt8 seq_id);
@@ -184,12 +266,40 @@ private:
     
     void _process(UInt8* buffer, UInt16 length);
     
+    bool appendToCache(UInt8 *buffer, UInt32 length);
+    
+    bool growCache(UInt32 length);
+    
+    void resetCache();
+    
     IOReturn sendCommandGated(UInt8 *tx_buffer, UInt16 *len, bool *seq);
     
     void commandTimeout(IOTimerEventSource* timer);
     
     IOReturn waitResponse(UInt16 *req_id, UInt8 *buffer, UInt16 *buffer_len);
     
+    void copyResponse(WaitingRequest *w, UInt8 *buffer, UInt16 *buffer_len);
+    
+    IOReturn getResponsesGated(SurfaceSerialRequest *requests, UInt16 *count);
+    
+    IOReturn prefetchBootDataGated();
+    
+    void prefetchResponse(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *payload, UInt16 payload_len);
+    
+    void topUpPrefetched();
+    
+    IOReturn schedulePublishingGated();
+    
+    IOReturn consumePrefetchedGated(PrefetchedResponse *key, UInt8 *buffer, UInt16 *buffer_len);
+    
+    void releasePrefetched(PrefetchedResponse *p);
+    
+    IOReturn dropPrefetchedGated(UInt8 *tc);
+    
+    IOReturn setTraceModeGated(UInt32 *mode);
+    
+    void traceEvent(SurfaceSerialCommand *command, UInt8 *data, UInt16 length);
+    
     IOReturn sendEventCommand(SurfaceSerialEventRegistryType type, UInt8 tc, UInt8 iid, bool enable);
     
     IOReturn getDeviceResources();
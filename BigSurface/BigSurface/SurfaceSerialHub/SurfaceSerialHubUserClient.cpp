@@ -0,0 +1,55 @@
+//
+//  SurfaceSerialHubUserClient.cpp
+//  SurfaceSerialHub
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "SurfaceSerialHubUserClient.hpp"
+#include "SerialTrace.h"
+
+#define super IOUserClient
+OSDefineMetaClassAndStructors(SurfaceSerialHubUserClient, IOUserClient);
+
+bool SurfaceSerialHubUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+    // Event payloads may contain keystrokes
+    if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+        return false;
+    return super::initWithTask(owningTask, securityToken, type, properties);
+}
+
+bool SurfaceSerialHubUserClient::start(IOService *provider) {
+    ssh = OSDynamicCast(SurfaceSerialHubDriver, provider);
+    if (!ssh)
+        return false;
+    return super::start(provider);
+}
+
+IOReturn SurfaceSerialHubUserClient::clientClose() {
+    ssh = nullptr;
+    terminate();
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceSerialHubUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    if (!ssh)
+        return kIOReturnNotAttached;
+    IOBufferMemoryDescriptor *ring;
+    switch (type) {
+        case kSurfaceSerialTraceMemoryType:
+            ring = ssh->getTraceBuffer();
+            break;
+        case kSurfaceSerialLatencyMemoryType:
+            ring = ssh->getLatencyTraceBuffer();
+            break;
+        default:
+            return kIOReturnBadArgument;
+    }
+    if (!ring)
+        return kIOReturnNoResources;
+    ring->retain();
+    *options = kIOMapReadOnly;
+    *memory = ring;
+    return kIOReturnSuccess;
+}
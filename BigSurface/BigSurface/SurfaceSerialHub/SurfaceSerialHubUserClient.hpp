@@ -0,0 +1,32 @@
+//
+//  SurfaceSerialHubUserClient.hpp
+//  SurfaceSerialHub
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceSerialHubUserClient_hpp
+#define SurfaceSerialHubUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+
+#include "SurfaceSerialHubDriver.hpp"
+
+class EXPORT SurfaceSerialHubUserClient : public IOUserClient {
+    OSDeclareDefaultStructors(SurfaceSerialHubUserClient);
+    
+public:
+    bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) override;
+    
+    bool start(IOService *provider) override;
+    
+    IOReturn clientClose() override;
+    
+    IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) override;
+    
+private:
+    SurfaceSerialHubDriver* ssh {nullptr};
+};
+
+#endif /* SurfaceSerialHubUserClient_hpp */
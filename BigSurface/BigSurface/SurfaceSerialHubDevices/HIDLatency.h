@@ -0,0 +1,47 @@
+//
+//  HIDLatency.h
+//  SurfaceSerialHubDevices
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef HIDLatency_h
+#define HIDLatency_h
+
+/*
+ * Input latency of HID reports, from the UART buffer which completed the frame to the HID driver.
+ * Per device histograms are published in the InputLatency property of SurfaceHIDNub.
+ *
+ * With `ioio -s SurfaceHIDNub LatencyTrace 1`, every report is also recorded into a ring shared with user space,
+ * map it with IOConnectMapMemory64(connect, kSurfaceSerialLatencyMemoryType, ...) on a SurfaceSerialHubUserClient.
+ * Records follow the same validity rule as the event trace ring, see SerialTrace.h.
+ */
+
+#define SURFACE_HID_LATENCY_TRACE_KEY       "LatencyTrace"
+#define SURFACE_HID_LATENCY_RECORD_COUNT    1024    // must be a power of 2
+#define SURFACE_HID_LATENCY_BUCKETS         12
+#define SURFACE_HID_LATENCY_BUCKET_BASE     32      // us, upper bound of the first bucket, doubled for each next one
+
+/* All timestamps are in mach absolute time */
+struct SurfaceHIDLatencyRecord {
+    volatile UInt32 seq;
+    UInt8   device;
+    UInt8   _reserved;
+    UInt16  length;
+    UInt64  received;       // UART buffer completing the frame handed to the hub
+    UInt64  completed;      // frame validated in processMessage
+    UInt64  queued;         // report entered SurfaceHIDNub
+    UInt64  handoff;        // report handed to the HID driver
+    UInt64  handled;        // HID driver returned
+};
+
+struct SurfaceHIDLatencyRing {
+    volatile UInt32 head;   // total number of records ever written
+    UInt32  record_count;
+    volatile UInt32 enabled;
+    UInt32  _reserved;
+    SurfaceHIDLatencyRecord records[SURFACE_HID_LATENCY_RECORD_COUNT];
+};
+
+#endif /* HIDLatency_h */
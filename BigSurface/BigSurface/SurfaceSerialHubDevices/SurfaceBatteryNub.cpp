@@ -160,7 +160,7 @@ IOReturn SurfaceBatteryNub::getBatteryStatus(UInt8 index, UInt32 *bst, UInt16 *t
         return kIOReturnError;
     
     
-    if (ssh->getResponse(SSH_TC_TMP, SSH_TID_PRIMARY, SSH_TEMP_SENSOR_BAT, SSH_CID_TMP_SENSOR, nullptr, 0, true, reinterpret_cast<UInt8 *>(temp), 2) != kIOReturnSuccess)
+    if (getTemperature(SSH_TEMP_SENSOR_BAT, temp) != kIOReturnSuccess)
         LOG("Failed to get battery temperature!");
     
     return kIOReturnSuccess;
@@ -170,9 +170,21 @@ IOReturn SurfaceBatteryNub::getAdaptorStatus(UInt32 *psr) {
     return ssh->getResponse(SSH_TC_BAT, SSH_TID_PRIMARY, 0x01, SSH_CID_BAT_PSR, nullptr, 0, true, reinterpret_cast<UInt8 *>(psr), 4);
 }
 
+IOReturn SurfaceBatteryNub::getTemperature(UInt8 sensor, UInt16 *temp) {
+    return ssh->getResponse(SSH_TC_TMP, SSH_TID_PRIMARY, sensor, SSH_CID_TMP_SENSOR, nullptr, 0, true, reinterpret_cast<UInt8 *>(temp), 2);
+}
+
 IOReturn SurfaceBatteryNub::setPerformanceMode(UInt32 mode) {
     if (!ssh->sendCommand(SSH_TC_TMP, SSH_TID_PRIMARY, 0, SSH_CID_TMP_SET_PERF, reinterpret_cast<UInt8 *>(&mode), 4, true))
         return kIOReturnError;
     else
         return kIOReturnSuccess;
 }
+
+IOReturn SurfaceBatteryNub::getPerformanceMode(UInt32 *mode) {
+    UInt16 info[3];     // profile, followed by two unknown fields
+    if (ssh->getResponse(SSH_TC_TMP, SSH_TID_PRIMARY, 0, SSH_CID_TMP_GET_PERF, nullptr, 0, true, reinterpret_cast<UInt8 *>(info), sizeof(info)) != kIOReturnSuccess)
+        return kIOReturnError;
+    *mode = info[0];
+    return kIOReturnSuccess;
+}
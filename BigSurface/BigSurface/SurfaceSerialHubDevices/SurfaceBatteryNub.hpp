@@ -60,8 +60,18 @@ public:
     
     IOReturn getAdaptorStatus(UInt32 *psr);
     
+    /*
+     * sensor: SSH_TEMP_SENSOR_*, temperature is in 0.1 Kelvin
+     */
+    IOReturn getTemperature(UInt8 sensor, UInt16 *temp);
+    
     IOReturn setPerformanceMode(UInt32 mode);
     
+    /*
+     * The mode SAM is actually running with
+     */
+    IOReturn getPerformanceMode(UInt32 *mode);
+    
 private:
     SurfaceSerialHubDriver* ssh {nullptr};
     OSObject*               target {nullptr};
@@ -0,0 +1,59 @@
+//
+//  SurfaceFanNub.cpp
+//  SurfaceSerialHubDevices
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "SurfaceFanNub.hpp"
+
+#define super SurfaceSerialHubClient
+OSDefineMetaClassAndStructors(SurfaceFanNub, SurfaceSerialHubClient)
+
+bool SurfaceFanNub::attach(IOService* provider) {
+    if (!super::attach(provider))
+        return false;
+
+    ssh = OSDynamicCast(SurfaceSerialHubDriver, provider);
+    if (!ssh)
+        return false;
+
+    return true;
+}
+
+void SurfaceFanNub::detach(IOService* provider) {
+    ssh = nullptr;
+    super::detach(provider);
+}
+
+bool SurfaceFanNub::start(IOService *provider) {
+    if (!super::start(provider))
+        return false;
+    
+    PMinit();
+    ssh->joinPMtree(this);
+    registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
+    
+    registerService();
+    return true;
+}
+
+void SurfaceFanNub::stop(IOService *provider) {
+    PMstop();
+    super::stop(provider);
+}
+
+IOReturn SurfaceFanNub::setPowerState(unsigned long whichState, IOService *device) {
+    if (device != this)
+        return kIOReturnInvalid;
+    return kIOPMAckImplied;
+}
+
+void SurfaceFanNub::eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) {
+    DBG_LOG("Unknown fan event! tid: %d, iid: %d, cid: %x, data_len: %d", tid, iid, cid, length);
+}
+
+IOReturn SurfaceFanNub::getFanSpeed(UInt16 *rpm) {
+    return ssh->getResponse(SSH_TC_FAN, SSH_TID_PRIMARY, 0x01, SSH_CID_FAN_RPM, nullptr, 0, true, reinterpret_cast<UInt8 *>(rpm), 2);
+}
@@ -0,0 +1,39 @@
+//
+//  SurfaceFanNub.hpp
+//  SurfaceSerialHubDevices
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceFanNub_hpp
+#define SurfaceFanNub_hpp
+
+#include "../SurfaceSerialHub/SurfaceSerialHubDriver.hpp"
+
+class EXPORT SurfaceFanNub : public SurfaceSerialHubClient {
+    OSDeclareDefaultStructors(SurfaceFanNub);
+    
+public:
+    bool attach(IOService* provider) override;
+    
+    void detach(IOService* provider) override;
+    
+    bool start(IOService* provider) override;
+    
+    void stop(IOService* provider) override;
+    
+    IOReturn setPowerState(unsigned long whichState, IOService *device) override;
+    
+    void eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) override;
+    
+    /*
+     * Current fan speed in RPM, 0 means the fan is stopped
+     */
+    IOReturn getFanSpeed(UInt16 *rpm);
+    
+private:
+    SurfaceSerialHubDriver* ssh {nullptr};
+};
+
+#endif /* SurfaceFanNub_hpp */
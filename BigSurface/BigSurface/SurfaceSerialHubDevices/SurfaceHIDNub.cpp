@@ -33,15 +33,42 @@ bool SurfaceHIDNub::start(IOService *provider) {
     if (!super::start(provider))
         return false;
     
+    cache_lock = IOLockAlloc();
+    output_lock = IOLockAlloc();
+    work_loop = IOWorkLoop::workLoop();
+    report_ring = new SurfaceHIDReportSlot[SURFACE_HID_RING_SIZE];
+    if (!cache_lock || !output_lock || !work_loop || !report_ring) {
+        LOG("Could not allocate resources!");
+        releaseResources();
+        return false;
+    }
+    output_event = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &SurfaceHIDNub::flushOutputReports));
+    if (!output_event) {
+        LOG("Could not create output event!");
+        releaseResources();
+        return false;
+    }
+    work_loop->addEventSource(output_event);
+    
+    // The hub only prefetches the legacy keyboard on devices without HID queries, so try v2 first
     SurfaceHIDDescriptor desc;
-    if (getHIDDescriptor(SurfaceLegacyKeyboardDevice, &desc) != kIOReturnSuccess) {
-        legacy = false;
-        if (getHIDDescriptor(SurfaceKeyboardDevice, &desc) != kIOReturnSuccess)
+    legacy = false;
+    if (getHIDDescriptor(SurfaceKeyboardDevice, &desc) != kIOReturnSuccess) {
+        legacy = true;
+        if (getHIDDescriptor(SurfaceLegacyKeyboardDevice, &desc) != kIOReturnSuccess) {
+            releaseResources();
             return false;
+        }
     }
     LOG("HID version %d", !legacy+1);
     setProperty(SURFACE_LEGACY_HID_STRING, legacy);
     
+    // Only detachable keyboards report KIP connection changes
+    if (!legacy && initCoverEvent() != kIOReturnSuccess) {
+        DBG_LOG("Type Cover hot-plug is not supported");
+        releaseCoverEvent();
+    }
+    
     PMinit();
     ssh->joinPMtree(this);
     registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
@@ -52,12 +79,76 @@ bool SurfaceHIDNub::start(IOService *provider) {
 
 void SurfaceHIDNub::stop(IOService *provider) {
     unregisterHIDEvent(target);
+    releaseResources();
     super::stop(provider);
 }
 
+IOReturn SurfaceHIDNub::initCoverEvent() {
+    if (getCoverConnection(&cover_connected) != kIOReturnSuccess)
+        return kIOReturnUnsupported;
+    
+    cover_event = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &SurfaceHIDNub::coverChanged));
+    if (!cover_event) {
+        LOG("Could not create interrupt event!");
+        return kIOReturnError;
+    }
+    work_loop->addEventSource(cover_event);
+    
+    IOReturn ret = ssh->registerEvent(this, SurfaceSerialEventHostManagedV1, SSH_TC_KIP, 0);
+    if (ret != kIOReturnSuccess) {
+        LOG("KIP event registration failed!");
+        return ret;
+    }
+    setProperty("CoverConnected", cover_connected);
+    return kIOReturnSuccess;
+}
+
+void SurfaceHIDNub::releaseCoverEvent() {
+    if (cover_event) {
+        ssh->unregisterEvent(this, SurfaceSerialEventHostManagedV1, SSH_TC_KIP, 0);
+        cover_event->disable();
+        work_loop->removeEventSource(cover_event);
+        OSSafeReleaseNULL(cover_event);
+    }
+}
+
+void SurfaceHIDNub::releaseResources() {
+    releaseCoverEvent();
+    if (output_event) {
+        output_event->disable();
+        work_loop->removeEventSource(output_event);
+        OSSafeReleaseNULL(output_event);
+    }
+    OSSafeReleaseNULL(work_loop);
+    latency_trace = false;
+    latency_ring = nullptr;
+    OSSafeReleaseNULL(latency_buffer);
+    if (report_ring) {
+        delete[] report_ring;
+        report_ring = nullptr;
+    }
+    for (int i = 0; i < SURFACE_HID_DEVICE_MAX; i++) {
+        if (desc_cache[i].report_desc) {
+            delete[] desc_cache[i].report_desc;
+            desc_cache[i].report_desc = nullptr;
+        }
+    }
+    if (cache_lock) {
+        IOLockFree(cache_lock);
+        cache_lock = nullptr;
+    }
+    if (output_lock) {
+        IOLockFree(output_lock);
+        output_lock = nullptr;
+    }
+}
+
 IOReturn SurfaceHIDNub::setPowerState(unsigned long whichState, IOService *device) {
     if (device != this)
         return kIOReturnInvalid;
+    // The keyboard may have been swapped while we were asleep
+    if (whichState == 0)
+        markCacheStale();
     return kIOPMAckImplied;
 }
 
@@ -80,6 +171,18 @@ IOReturn SurfaceHIDNub::registerHIDEvent(OSObject* owner, EventHandler _handler)
     if (ret != kIOReturnSuccess)
         return ret;
     
+    // Drain reports in batches on the owner's work loop so that the SSH work loop only does the copy
+    IOService *service = OSDynamicCast(IOService, owner);
+    report_work_loop = service ? service->getWorkLoop() : nullptr;
+    if (!report_work_loop)
+        report_work_loop = work_loop;
+    report_event = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &SurfaceHIDNub::drainReports));
+    if (report_event && report_work_loop->addEventSource(report_event) != kIOReturnSuccess)
+        OSSafeReleaseNULL(report_event);
+    if (!report_event)
+        LOG("Could not create report event, reports will be delivered synchronously");
+    ring_head = ring_tail = 0;
+    
     target = owner;
     handler = _handler;
     return kIOReturnSuccess;
@@ -95,14 +198,74 @@ void SurfaceHIDNub::unregisterHIDEvent(OSObject* owner) {
             ssh->unregisterEvent(this, SurfaceSerialEventHostManagedV2, SSH_TC_HID, SurfaceKeyboardDevice);
             ssh->unregisterEvent(this, SurfaceSerialEventHostManagedV2, SSH_TC_HID, SurfaceTouchpadDevice);
         }
+        if (report_event) {
+            report_event->disable();
+            report_work_loop->removeEventSource(report_event);
+            OSSafeReleaseNULL(report_event);
+        }
+        report_work_loop = nullptr;
         target = nullptr;
         handler = nullptr;
     } else
         LOG("HID event not registered for this handler!");
 }
 
+IOReturn SurfaceHIDNub::registerTouchpadEvent(OSObject* owner, EventHandler _handler) {
+    if (!owner || !_handler)
+        return kIOReturnError;
+    if (touchpad_target) {
+        LOG("Touchpad event already registered for a handler!");
+        return kIOReturnNoResources;
+    }
+    // Switch handlers on the loop draining the reports so that a report is never decoded twice or lost halfway
+    if (report_work_loop)
+        return report_work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceHIDNub::setTouchpadHandlerGated), this, owner, &_handler);
+    return setTouchpadHandlerGated(owner, &_handler);
+}
+
+void SurfaceHIDNub::unregisterTouchpadEvent(OSObject* owner) {
+    if (touchpad_target != owner) {
+        LOG("Touchpad event not registered for this handler!");
+        return;
+    }
+    EventHandler none = nullptr;
+    if (report_work_loop)
+        report_work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceHIDNub::setTouchpadHandlerGated), this, nullptr, &none);
+    else
+        setTouchpadHandlerGated(nullptr, &none);
+}
+
+IOReturn SurfaceHIDNub::runTouchpadAction(OSObject* owner, IOWorkLoop::Action action, void *arg0) {
+    IOWorkLoop *loop = report_work_loop ? report_work_loop : work_loop;
+    return loop->runAction(action, owner, arg0);
+}
+
+IOReturn SurfaceHIDNub::setTouchpadHandlerGated(OSObject *owner, EventHandler *_handler) {
+    touchpad_target = owner;
+    touchpad_handler = *_handler;
+    return kIOReturnSuccess;
+}
+
+void SurfaceHIDNub::dispatchReport(SurfaceHIDDeviceType device, UInt8 *buffer, UInt16 len) {
+    if (device == SurfaceTouchpadDevice && touchpad_handler)
+        touchpad_handler(touchpad_target, this, device, buffer, len);
+    else if (handler)
+        handler(target, this, device, buffer, len);
+}
+
 void SurfaceHIDNub::eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) {
     SurfaceHIDDeviceType device;
+    if (tc == SSH_TC_KIP) {
+        if (cid != SSH_CID_KIP_CONNECTION || length < 1)
+            goto error;
+        
+        cover_connected = data_buffer[0];
+        if (cover_connected)
+            clock_get_uptime(&cover_attach_time);
+        wait_first_key = cover_connected;
+        cover_event->interruptOccurred(nullptr, this, 0);
+        return;
+    }
     if (legacy) {
         if ((cid != SSH_EVENT_CID_KBD_INPUT_GENERIC && cid != SSH_EVENT_CID_KBD_INPUT_HOTKEYS)
             || tid != SSH_TID_SECONDARY
@@ -126,24 +289,357 @@ void SurfaceHIDNub::eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UIn
         }
     }
     
-    if (handler)
-        handler(target, this, device, data_buffer, length);
+    if (wait_first_key && device == SurfaceKeyboardDevice) {
+        AbsoluteTime cur_time;
+        UInt64 nsecs;
+        wait_first_key = false;
+        clock_get_uptime(&cur_time);
+        SUB_ABSOLUTETIME(&cur_time, &cover_attach_time);
+        absolutetime_to_nanoseconds(cur_time, &nsecs);
+        setProperty("CoverAttachToFirstKey", nsecs / 1000000, 32);
+    }
+    
+    if (report_event && length <= SURFACE_HID_REPORT_MAX) {
+        UInt64 start = mach_absolute_time();
+        UInt32 head = ring_head;
+        if (head - ring_tail >= SURFACE_HID_RING_SIZE) {
+            ring_dropped++;
+            return;
+        }
+        SurfaceHIDReportSlot &slot = report_ring[head & (SURFACE_HID_RING_SIZE-1)];
+        slot.device = device;
+        slot.length = length;
+        slot.queued = start;
+        ssh->getEventTimestamps(&slot.received, &slot.completed);
+        memcpy(slot.data, data_buffer, length);
+        // publish the slot only after its content is visible
+        OSMemoryBarrier();
+        ring_head = head + 1;
+        report_event->interruptOccurred(nullptr, this, 0);
+        enqueue_time += mach_absolute_time() - start;
+    } else    // reports too large for a slot are rare, they are handed over directly instead of being lost
+        dispatchReport(device, data_buffer, length);
     return;
     
 error:
     DBG_LOG("Unknown HID event with tid: %d, iid: %d, cid: %d, data_len: %d", tid, iid, cid, length);
 }
 
+void SurfaceHIDNub::coverChanged(IOInterruptEventSource *sender, int count) {
+    bool connected = cover_connected;
+    setProperty("CoverConnected", connected);
+    if (connected) {
+        LOG("Type Cover attached");
+        setProperty("CoverAttachCount", ++cover_attach_cnt, 32);
+        // Whatever was fetched at boot describes the previous cover
+        ssh->dropPrefetched(SSH_TC_HID);
+        markCacheStale();
+        // Enable the input events again right away rather than waiting for the HID driver to time out
+        if (target) {
+            ssh->registerEvent(nullptr, SurfaceSerialEventHostManagedV2, SSH_TC_HID, SurfaceKeyboardDevice);
+            ssh->registerEvent(nullptr, SurfaceSerialEventHostManagedV2, SSH_TC_HID, SurfaceTouchpadDevice);
+        }
+        messageClients(kSurfaceHIDMessageDeviceAttached);
+    } else {
+        LOG("Type Cover detached");
+        messageClients(kSurfaceHIDMessageDeviceDetached);
+    }
+}
+
+void SurfaceHIDNub::drainReports(IOInterruptEventSource *sender, int count) {
+    UInt64 start = mach_absolute_time();
+    UInt32 tail = ring_tail;
+    UInt32 head = ring_head;
+    UInt32 batch = 0;
+    
+    OSMemoryBarrier();
+    while (tail != head) {
+        SurfaceHIDReportSlot &slot = report_ring[tail & (SURFACE_HID_RING_SIZE-1)];
+        UInt64 handoff = mach_absolute_time();
+        dispatchReport(slot.device, slot.data, slot.length);
+        recordLatency(&slot, handoff, mach_absolute_time());
+        // hand the slot back to the producer only once the handler is done with it
+        OSMemoryBarrier();
+        ring_tail = ++tail;
+        batch++;
+        head = ring_head;
+        OSMemoryBarrier();
+    }
+    if (!batch)
+        return;
+    
+    UInt64 elapsed = mach_absolute_time() - start;
+    drain_cnt++;
+    drain_time += elapsed;
+    if (elapsed > drain_max_time)
+        drain_max_time = elapsed;
+    if (batch > drain_max_batch)
+        drain_max_batch = batch;
+    stats_reports += batch;
+    if (stats_reports % SURFACE_HID_STATS_INTERVAL < batch)
+        publishRingStats();
+}
+
+void SurfaceHIDNub::publishRingStats() {
+    UInt64 enqueue_ns, drain_ns, drain_max_ns;
+    absolutetime_to_nanoseconds(enqueue_time / stats_reports, &enqueue_ns);
+    absolutetime_to_nanoseconds(drain_time / drain_cnt, &drain_ns);
+    absolutetime_to_nanoseconds(drain_max_time, &drain_max_ns);
+    
+    OSDictionary *stats = OSDictionary::withCapacity(7);
+    if (!stats)
+        return;
+    const NumberEntry entries[] = {
+        {"Reports", stats_reports},
+        {"Dropped", ring_dropped},
+        {"Batches", drain_cnt},
+        {"MaxBatch", drain_max_batch},
+        {"EnqueueNsAvg", enqueue_ns},
+        {"DrainNsAvg", drain_ns},
+        {"DrainNsMax", drain_max_ns},
+    };
+    setNumberEntries(stats, entries);
+    setProperty("ReportRingStats", stats);
+    stats->release();
+}
+
+void SurfaceHIDNub::recordLatency(SurfaceHIDReportSlot *slot, UInt64 handoff, UInt64 handled) {
+    if (latency_trace) {
+        UInt32 index = latency_ring->head;
+        SurfaceHIDLatencyRecord *r = &latency_ring->records[index & (SURFACE_HID_LATENCY_RECORD_COUNT-1)];
+        r->seq = 0;
+        OSMemoryBarrier();
+        r->device = slot->device;
+        r->length = slot->length;
+        r->received = slot->received;
+        r->completed = slot->completed;
+        r->queued = slot->queued;
+        r->handoff = handoff;
+        r->handled = handled;
+        OSMemoryBarrier();
+        r->seq = index + 1;
+        latency_ring->head = index + 1;
+    }
+    
+    // a frame may be completed by a later buffer than the one carrying its last byte, do not underflow
+    UInt64 frame_ns = 0, dispatch_ns, queue_ns, total_us;
+    if (slot->completed > slot->received)
+        absolutetime_to_nanoseconds(slot->completed - slot->received, &frame_ns);
+    absolutetime_to_nanoseconds(slot->queued - slot->completed, &dispatch_ns);
+    absolutetime_to_nanoseconds(handoff - slot->queued, &queue_ns);
+    total_us = (frame_ns + dispatch_ns + queue_ns) / 1000;
+    
+    SurfaceHIDLatencyStats &stats = latency[slot->device == SurfaceTouchpadDevice ? SurfaceHIDLatencyTouchpad : SurfaceHIDLatencyKeyboard];
+    int bucket = 0;
+    for (UInt64 limit = SURFACE_HID_LATENCY_BUCKET_BASE; total_us >= limit && bucket < SURFACE_HID_LATENCY_BUCKETS-1; limit <<= 1)
+        bucket++;
+    stats.histogram[bucket]++;
+    stats.frame_sum += frame_ns;
+    stats.dispatch_sum += dispatch_ns;
+    stats.queue_sum += queue_ns;
+    if (total_us > stats.max)
+        stats.max = total_us;
+    if (++stats.count % SURFACE_HID_LATENCY_INTERVAL == 0)
+        publishLatency();
+}
+
+void SurfaceHIDNub::publishLatency() {
+    static const char *names[SurfaceHIDLatencyCount] = {"Keyboard", "Touchpad"};
+    OSDictionary *result = OSDictionary::withCapacity(SurfaceHIDLatencyCount);
+    if (!result)
+        return;
+    for (int i = 0; i < SurfaceHIDLatencyCount; i++) {
+        SurfaceHIDLatencyStats &stats = latency[i];
+        if (!stats.count)
+            continue;
+        OSDictionary *dev = OSDictionary::withCapacity(6);
+        OSArray *histogram = OSArray::withCapacity(SURFACE_HID_LATENCY_BUCKETS);
+        if (!dev || !histogram) {
+            OSSafeReleaseNULL(dev);
+            OSSafeReleaseNULL(histogram);
+            continue;
+        }
+        for (int j = 0; j < SURFACE_HID_LATENCY_BUCKETS; j++) {
+            OSNumber *num = OSNumber::withNumber(stats.histogram[j], 32);
+            if (num) {
+                histogram->setObject(num);
+                num->release();
+            }
+        }
+        const NumberEntry entries[] = {
+            {"Count", stats.count},
+            {"FrameUsAvg", stats.frame_sum / stats.count / 1000},
+            {"DispatchUsAvg", stats.dispatch_sum / stats.count / 1000},
+            {"QueueUsAvg", stats.queue_sum / stats.count / 1000},
+            {"TotalUsMax", stats.max},
+        };
+        setNumberEntries(dev, entries);
+        dev->setObject("Histogram", histogram);
+        histogram->release();
+        result->setObject(names[i], dev);
+        dev->release();
+    }
+    setProperty("InputLatency", result);
+    result->release();
+}
+
+IOReturn SurfaceHIDNub::setLatencyTraceGated(bool *enable) {
+    if (*enable && !latency_buffer) {
+        latency_buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(SurfaceHIDLatencyRing), PAGE_SIZE);
+        if (!latency_buffer) {
+            LOG("Could not allocate latency trace ring!");
+            return kIOReturnNoMemory;
+        }
+        latency_ring = reinterpret_cast<SurfaceHIDLatencyRing *>(latency_buffer->getBytesNoCopy());
+        memset(latency_ring, 0, sizeof(SurfaceHIDLatencyRing));
+        latency_ring->record_count = SURFACE_HID_LATENCY_RECORD_COUNT;
+        OSMemoryBarrier();
+    }
+    latency_trace = *enable;
+    if (latency_ring)
+        latency_ring->enabled = latency_trace;
+    setProperty(SURFACE_HID_LATENCY_TRACE_KEY, latency_trace);
+    LOG("Latency tracing %s", latency_trace ? "enabled" : "disabled");
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceHIDNub::setProperties(OSObject *props) {
+    OSDictionary* dict = OSDynamicCast(OSDictionary, props);
+    if (!dict)
+        return kIOReturnError;
+    
+    OSObject *value = dict->getObject(SURFACE_HID_LATENCY_TRACE_KEY);
+    bool enable;
+    if (OSBoolean *b = OSDynamicCast(OSBoolean, value))
+        enable = b->getValue();
+    else if (OSNumber *n = OSDynamicCast(OSNumber, value))
+        enable = n->unsigned32BitValue() != 0;
+    else
+        return kIOReturnUnsupported;
+    return work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceHIDNub::setLatencyTraceGated), this, &enable);
+}
+
+IOReturn SurfaceHIDNub::getCoverConnection(bool *connected) {
+    UInt8 state;
+    IOReturn ret = ssh->getResponse(SSH_TC_KIP, SSH_TID_PRIMARY, 0, SSH_CID_KIP_CONNECTION, nullptr, 0, true, &state, 1);
+    if (ret == kIOReturnSuccess)
+        *connected = state;
+    return ret;
+}
+
 IOReturn SurfaceHIDNub::getHIDDescriptor(SurfaceHIDDeviceType device, SurfaceHIDDescriptor *desc) {
-    return getDescriptorData(device, SurfaceHIDDescriptorEntry, reinterpret_cast<UInt8 *>(desc), sizeof(SurfaceHIDDescriptor));
+    if (device >= SURFACE_HID_DEVICE_MAX)
+        return kIOReturnBadArgument;
+    SurfaceHIDDescriptorCache &cache = desc_cache[device];
+    IOReturn ret;
+    
+    IOLockLock(cache_lock);
+    if (revalidateCache(device) == kIOReturnSuccess && cache.desc_valid) {
+        memcpy(desc, &cache.desc, sizeof(SurfaceHIDDescriptor));
+        updateCacheStats(true);
+        ret = kIOReturnSuccess;
+    } else {
+        ret = getDescriptorData(device, SurfaceHIDDescriptorEntry, reinterpret_cast<UInt8 *>(desc), sizeof(SurfaceHIDDescriptor));
+        if (ret == kIOReturnSuccess && cache.checked) {
+            memcpy(&cache.desc, desc, sizeof(SurfaceHIDDescriptor));
+            cache.desc_valid = true;
+        }
+        updateCacheStats(false);
+    }
+    IOLockUnlock(cache_lock);
+    return ret;
 }
 
 IOReturn SurfaceHIDNub::getHIDAttributes(SurfaceHIDDeviceType device, SurfaceHIDAttributes *attr) {
-    return getDescriptorData(device, SurfaceHIDAttributesEntry, reinterpret_cast<UInt8 *>(attr), sizeof(SurfaceHIDAttributes));
+    if (device >= SURFACE_HID_DEVICE_MAX)
+        return kIOReturnBadArgument;
+    
+    SurfaceHIDDescriptorCache &cache = desc_cache[device];
+    
+    IOLockLock(cache_lock);
+    IOReturn ret = revalidateCache(device);
+    if (ret == kIOReturnSuccess && !cache.attr_valid) {
+        // first request, the attributes key the cache from now on
+        ret = getDescriptorData(device, SurfaceHIDAttributesEntry, reinterpret_cast<UInt8 *>(&cache.attr), sizeof(SurfaceHIDAttributes));
+        cache.attr_valid = ret == kIOReturnSuccess;
+    }
+    if (ret == kIOReturnSuccess)
+        memcpy(attr, &cache.attr, sizeof(SurfaceHIDAttributes));
+    IOLockUnlock(cache_lock);
+    return ret;
 }
 
 IOReturn SurfaceHIDNub::getReportDescriptor(SurfaceHIDDeviceType device, UInt8 *buffer, UInt16 len) {
-    return getDescriptorData(device, SurfaceReportDescriptorEntry, buffer, len);
+    if (device >= SURFACE_HID_DEVICE_MAX)
+        return kIOReturnBadArgument;
+    SurfaceHIDDescriptorCache &cache = desc_cache[device];
+    IOReturn ret;
+    
+    IOLockLock(cache_lock);
+    if (revalidateCache(device) == kIOReturnSuccess && cache.report_desc && cache.report_desc_len == len) {
+        memcpy(buffer, cache.report_desc, len);
+        updateCacheStats(true);
+        ret = kIOReturnSuccess;
+    } else {
+        ret = getDescriptorData(device, SurfaceReportDescriptorEntry, buffer, len);
+        if (ret == kIOReturnSuccess && cache.checked) {
+            if (cache.report_desc)
+                delete[] cache.report_desc;
+            cache.report_desc = new UInt8[len];
+            memcpy(cache.report_desc, buffer, len);
+            cache.report_desc_len = len;
+        }
+        updateCacheStats(false);
+    }
+    IOLockUnlock(cache_lock);
+    return ret;
+}
+
+IOReturn SurfaceHIDNub::revalidateCache(SurfaceHIDDeviceType device) {
+    SurfaceHIDDescriptorCache &cache = desc_cache[device];
+    if (cache.checked)
+        return kIOReturnSuccess;
+    
+    SurfaceHIDAttributes attr;
+    IOReturn ret = kIOReturnSuccess;
+    // Without known attributes there is nothing to compare against, so nothing cached is kept.
+    // Querying them here would cost a round trip, or a full timeout on devices that never answer it.
+    if (cache.attr_valid)
+        ret = getDescriptorData(device, SurfaceHIDAttributesEntry, reinterpret_cast<UInt8 *>(&attr), sizeof(SurfaceHIDAttributes));
+    if (ret != kIOReturnSuccess)
+        return ret;
+    
+    if (!cache.attr_valid || attr.vendor != cache.attr.vendor || attr.product != cache.attr.product || attr.version != cache.attr.version) {
+        if (cache.attr_valid)
+            LOG("HID device %d changed to %04x:%04x (version %x), dropping cached descriptors", device, attr.vendor, attr.product, attr.version);
+        cache.desc_valid = false;
+        if (cache.report_desc) {
+            delete[] cache.report_desc;
+            cache.report_desc = nullptr;
+        }
+        cache.report_desc_len = 0;
+    }
+    if (cache.attr_valid)
+        memcpy(&cache.attr, &attr, sizeof(SurfaceHIDAttributes));
+    cache.checked = true;
+    return kIOReturnSuccess;
+}
+
+void SurfaceHIDNub::markCacheStale() {
+    IOLockLock(cache_lock);
+    for (int i = 0; i < SURFACE_HID_DEVICE_MAX; i++) {
+        desc_cache[i].checked = false;
+        for (int j = 0; j < SURFACE_HID_FEATURE_CACHE_SIZE; j++)
+            feature_cache[i][j].valid = false;
+    }
+    IOLockUnlock(cache_lock);
+}
+
+void SurfaceHIDNub::updateCacheStats(bool hit) {
+    if (hit)
+        setProperty("DescriptorCacheHits", ++cache_hits, 32);
+    else
+        setProperty("DescriptorCacheMisses", ++cache_misses, 32);
 }
 
 IOReturn SurfaceHIDNub::getDescriptorData(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len) {
@@ -158,27 +654,111 @@ IOReturn SurfaceHIDNub::getLegacyData(SurfaceHIDDeviceType device, SurfaceHIDDes
 }
 
 IOReturn SurfaceHIDNub::getData(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len) {
-    UInt8 cache[SURFACE_HID_DESC_HEADER_SIZE + 0x76];    // 0x76 is used by windows driver
+    IOReturn ret = getDataPipelined(device, entry, buffer, buffer_len, desc_window);
+    if (ret == kIOReturnUnsupported && desc_window > SURFACE_HID_DESC_WINDOW_LEGACY) {
+        // Older firmwares may refuse windows larger than the one used by windows driver,
+        // only an answer we can not use counts as that, a timeout does not downgrade for good
+        LOG("Large descriptor window refused, falling back to 0x%x", SURFACE_HID_DESC_WINDOW_LEGACY);
+        desc_window = SURFACE_HID_DESC_WINDOW_LEGACY;
+        ret = getDataPipelined(device, entry, buffer, buffer_len, desc_window);
+    }
+    return ret;
+}
+
+IOReturn SurfaceHIDNub::getDataPipelined(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len, UInt16 window) {
+    UInt16 count = (buffer_len + window - 1) / window;
+    if (count <= 1)
+        return getDataWindowed(device, entry, buffer, buffer_len, window);
+    
+    UInt32 slot_len = SURFACE_HID_DESC_HEADER_SIZE + window;
+    UInt8 *cache = new UInt8[count * slot_len];
+    SurfaceSerialRequest *requests = new SurfaceSerialRequest[count];
+    SurfaceHIDDescriptorBufferHeader *header;
+    UInt32 offset, length, received = 0;
+    bool fallback = false;
+    IOReturn ret = kIOReturnSuccess;
+    
+    for (UInt16 i = 0; i < count; i++) {
+        header = reinterpret_cast<SurfaceHIDDescriptorBufferHeader *>(cache + i * slot_len);
+        offset = i * window;
+        length = buffer_len - offset < window ? buffer_len - offset : window;
+        header->entry = entry;
+        header->offset = offset;
+        header->length = window;
+        header->finished = false;
+        
+        requests[i].tc = SSH_TC_HID;
+        requests[i].tid = SSH_TID_SECONDARY;
+        requests[i].iid = device;
+        requests[i].cid = SSH_CID_HID_GET_DESCRIPTOR;
+        requests[i].payload = reinterpret_cast<UInt8 *>(header);
+        requests[i].payload_len = SURFACE_HID_DESC_HEADER_SIZE;
+        requests[i].buffer = reinterpret_cast<UInt8 *>(header);
+        requests[i].buffer_len = SURFACE_HID_DESC_HEADER_SIZE + length;
+    }
+    
+    if (ssh->getResponses(requests, count) != kIOReturnSuccess) {
+        LOG("Failed to get data from SSH!");
+        fallback = true;
+        goto exit;
+    }
+    
+    for (UInt16 i = 0; i < count; i++) {
+        header = reinterpret_cast<SurfaceHIDDescriptorBufferHeader *>(cache + i * slot_len);
+        offset = header->offset;
+        length = header->length;
+        
+        // Each window has to come back where we asked for it, and only the last one may be marked finished
+        if (requests[i].buffer_len < SURFACE_HID_DESC_HEADER_SIZE || offset != i * window
+            || length > requests[i].buffer_len - SURFACE_HID_DESC_HEADER_SIZE
+            || (header->finished != 0) != (i == count - 1)) {
+            LOG("Received bogus data at window %d!", i);
+            fallback = true;
+            goto exit;
+        }
+        memcpy(buffer + offset, &header->data[0], length);
+        received += length;
+    }
+    
+    if (received != buffer_len) {
+        LOG("Unexpected descriptor length: got %u, expected %u", received, buffer_len);
+        fallback = true;
+    }
+exit:
+    delete[] requests;
+    delete[] cache;
+    if (fallback) {
+        DBG_LOG("Pipelined descriptor fetch failed, retrying window by window");
+        ret = getDataWindowed(device, entry, buffer, buffer_len, window);
+    }
+    return ret;
+}
+
+IOReturn SurfaceHIDNub::getDataWindowed(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len, UInt16 window) {
+    UInt16 cache_len = SURFACE_HID_DESC_HEADER_SIZE + window;
+    UInt8 *cache = new UInt8[cache_len];
     SurfaceHIDDescriptorBufferHeader *cache_as_buf = reinterpret_cast<SurfaceHIDDescriptorBufferHeader *>(cache);
     
-    UInt16 rx_data_len = sizeof(cache) - SURFACE_HID_DESC_HEADER_SIZE;
+    UInt16 rx_data_len = window;
     UInt16 offset = 0;
     UInt16 length = rx_data_len;
     UInt16 remain_len = buffer_len;
     UInt16 response_len;
+    IOReturn ret = kIOReturnSuccess;
     
     cache_as_buf->entry = entry;
     cache_as_buf->finished = false;
     
     while (!cache_as_buf->finished && offset < buffer_len) {
-        response_len = rx_data_len > remain_len ? SURFACE_HID_DESC_HEADER_SIZE + remain_len : sizeof(cache);
+        response_len = rx_data_len > remain_len ? SURFACE_HID_DESC_HEADER_SIZE + remain_len : cache_len;
         
         cache_as_buf->offset = offset;
         cache_as_buf->length = length;
 
-        if (ssh->getResponse(SSH_TC_HID, SSH_TID_SECONDARY, device, SSH_CID_HID_GET_DESCRIPTOR, cache, SURFACE_HID_DESC_HEADER_SIZE, true, cache, response_len) != kIOReturnSuccess) {
+        ret = ssh->getResponse(SSH_TC_HID, SSH_TID_SECONDARY, device, SSH_CID_HID_GET_DESCRIPTOR, cache, SURFACE_HID_DESC_HEADER_SIZE, true, cache, response_len);
+        if (ret != kIOReturnSuccess) {
             LOG("Failed to get data from SSH!");
-            return kIOReturnError;
+            goto exit;
         }
 
         offset = cache_as_buf->offset;
@@ -187,7 +767,8 @@ IOReturn SurfaceHIDNub::getData(SurfaceHIDDeviceType device, SurfaceHIDDescripto
         // Don't mess stuff up in case we receive garbage.
         if (length > rx_data_len || offset > buffer_len) {
             LOG("Received bogus data!");
-            return kIOReturnError;
+            ret = kIOReturnUnsupported;
+            goto exit;
         }
 
         if (offset + length > buffer_len) {
@@ -204,12 +785,78 @@ IOReturn SurfaceHIDNub::getData(SurfaceHIDDeviceType device, SurfaceHIDDescripto
 
     if (offset != buffer_len) {
         LOG("Unexpected descriptor length: got %u, expected %u", offset, buffer_len);
-        return kIOReturnError;
+        ret = kIOReturnError;
     }
-    return kIOReturnSuccess;
+exit:
+    delete[] cache;
+    return ret;
+}
+
+bool SurfaceHIDNub::lookupFeatureReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len) {
+    bool hit = false;
+    IOLockLock(cache_lock);
+    for (int i = 0; i < SURFACE_HID_FEATURE_CACHE_SIZE; i++) {
+        SurfaceHIDCachedReport &entry = feature_cache[device][i];
+        // a longer answer serves any shorter read, a short one only the same read again
+        if (entry.valid && entry.report_id == report_id && (entry.length >= len || entry.requested == len)) {
+            memcpy(buffer, entry.data, entry.length < len ? entry.length : len);
+            hit = true;
+            break;
+        }
+    }
+    IOLockUnlock(cache_lock);
+    if (hit)
+        feature_hits++;
+    else
+        feature_misses++;
+    if ((feature_hits + feature_misses) % SURFACE_HID_FEATURE_STATS_INTERVAL == 0) {
+        setProperty("FeatureCacheHits", feature_hits, 32);
+        setProperty("FeatureCacheMisses", feature_misses, 32);
+    }
+    return hit;
+}
+
+void SurfaceHIDNub::storeFeatureReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len, UInt16 requested) {
+    if (len > SURFACE_HID_CACHED_REPORT_MAX)
+        return;
+    IOLockLock(cache_lock);
+    // Reuse the entry of the same report, otherwise an empty one, otherwise evict the first
+    SurfaceHIDCachedReport *slot = &feature_cache[device][0];
+    for (int i = 0; i < SURFACE_HID_FEATURE_CACHE_SIZE; i++) {
+        SurfaceHIDCachedReport &entry = feature_cache[device][i];
+        if (entry.valid && entry.report_id == report_id) {
+            slot = &entry;
+            break;
+        }
+        if (!entry.valid && slot->valid)
+            slot = &entry;
+    }
+    slot->report_id = report_id;
+    slot->length = len;
+    slot->requested = requested;
+    memcpy(slot->data, buffer, len);
+    slot->valid = true;
+    IOLockUnlock(cache_lock);
+}
+
+void SurfaceHIDNub::invalidateFeatureReport(SurfaceHIDDeviceType device, UInt8 report_id) {
+    IOLockLock(cache_lock);
+    for (int i = 0; i < SURFACE_HID_FEATURE_CACHE_SIZE; i++) {
+        SurfaceHIDCachedReport &entry = feature_cache[device][i];
+        if (entry.valid && entry.report_id == report_id)
+            entry.valid = false;
+    }
+    IOLockUnlock(cache_lock);
 }
 
 IOReturn SurfaceHIDNub::getHIDRawReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len) {
+    // legacy feature reports always have the same size whatever the caller asks for
+    UInt16 cached_len = legacy ? SURFACE_LEGACY_FEAT_REPORT_SIZE : len;
+    if (cached_len <= len && lookupFeatureReport(device, report_id, buffer, cached_len))
+        return kIOReturnSuccess;
+    
+    UInt16 requested = cached_len;
+    IOReturn ret;
     if (legacy) {
         UInt8 payload = 0;
         UInt8 report[SURFACE_LEGACY_FEAT_REPORT_SIZE];
@@ -217,22 +864,100 @@ IOReturn SurfaceHIDNub::getHIDRawReport(SurfaceHIDDeviceType device, UInt8 repor
         if (len < SURFACE_LEGACY_FEAT_REPORT_SIZE)
             return kIOReturnNoSpace;
         
-        IOReturn ret = ssh->getResponse(SSH_TC_KBD, SSH_TID_SECONDARY, device, SSH_CID_KBD_GET_FEAT_REPORT, &payload, 1, true, report, SURFACE_LEGACY_FEAT_REPORT_SIZE);
+        ret = ssh->getResponse(SSH_TC_KBD, SSH_TID_SECONDARY, device, SSH_CID_KBD_GET_FEAT_REPORT, &payload, 1, true, report, SURFACE_LEGACY_FEAT_REPORT_SIZE);
         if (ret != kIOReturnSuccess)
             return ret;
         if (report[0] != report_id)
             return kIOReturnUnsupported;
         
         memcpy(buffer, report, SURFACE_LEGACY_FEAT_REPORT_SIZE);
-        return kIOReturnSuccess;
-    } else
-        return ssh->getResponse(SSH_TC_HID, SSH_TID_SECONDARY, device, SSH_CID_HID_GET_FEAT_REPORT, &report_id, 1, true, buffer, len);
+        len = SURFACE_LEGACY_FEAT_REPORT_SIZE;
+    } else {
+        ret = ssh->getResponse(SSH_TC_HID, SSH_TID_SECONDARY, device, SSH_CID_HID_GET_FEAT_REPORT, &report_id, 1, true, buffer, len, &len);
+        if (ret != kIOReturnSuccess)
+            return ret;
+    }
+    // only what was received is cached, a shorter answer must not be replayed padded with the caller's buffer
+    storeFeatureReport(device, report_id, buffer, len, requested);
+    return kIOReturnSuccess;
 }
 
 void SurfaceHIDNub::setHIDRawReport(SurfaceHIDDeviceType device, UInt8 report_id, bool feature, UInt8 *buffer, UInt16 len) {
     if (!legacy) {
-        UInt8 cid = feature ? SSH_CID_HID_SET_FEAT_REPORT : SSH_CID_HID_OUT_REPORT;
         buffer[0] = report_id;
-        ssh->sendCommand(SSH_TC_HID, SSH_TID_SECONDARY, device, cid, buffer, len, true);
+        if (!feature && queueOutputReport(device, report_id, buffer, len))
+            return;
+        work_loop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceHIDNub::sendReportGated), this, &device, &feature, buffer, &len);
+    }
+}
+
+IOReturn SurfaceHIDNub::sendReportGated(SurfaceHIDDeviceType *device, bool *feature, UInt8 *buffer, UInt16 *len) {
+    flushOutputReports(nullptr, 0);
+    if (*feature) {
+        invalidateFeatureReport(*device, buffer[0]);
+        return ssh->sendCommand(SSH_TC_HID, SSH_TID_SECONDARY, *device, SSH_CID_HID_SET_FEAT_REPORT, buffer, *len, true);
+    }
+    return ssh->sendCommand(SSH_TC_HID, SSH_TID_SECONDARY, *device, SSH_CID_HID_OUT_REPORT, buffer, *len, true);
+}
+
+bool SurfaceHIDNub::queueOutputReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len) {
+    if (len > SURFACE_HID_CACHED_REPORT_MAX)
+        return false;
+    
+    SurfaceHIDCachedReport *slot = nullptr;
+    bool combined = false;
+    IOLockLock(output_lock);
+    UInt8 cnt = output_cnt[device];
+    if (cnt) {
+        // only the last one, combining with an older report would send this one ahead of those in between
+        SurfaceHIDCachedReport &last = pending_output[device][(output_head[device] + cnt - 1) % SURFACE_HID_OUTPUT_PENDING_MAX];
+        if (last.report_id == report_id) {
+            slot = &last;
+            combined = true;
+        }
+    }
+    if (!slot && cnt < SURFACE_HID_OUTPUT_PENDING_MAX) {
+        slot = &pending_output[device][(output_head[device] + cnt) % SURFACE_HID_OUTPUT_PENDING_MAX];
+        output_cnt[device]++;
+    }
+    if (slot) {
+        slot->report_id = report_id;
+        slot->length = len;
+        memcpy(slot->data, buffer, len);
+        slot->valid = true;
+        if (combined)
+            output_combined++;
+    }
+    IOLockUnlock(output_lock);
+    
+    if (!slot)
+        return false;
+    if (!combined)
+        output_event->interruptOccurred(nullptr, this, 0);
+    return true;
+}
+
+void SurfaceHIDNub::flushOutputReports(IOInterruptEventSource *sender, int count) {
+    SurfaceHIDCachedReport report;
+    for (int i = 0; i < SURFACE_HID_DEVICE_MAX; i++) {
+        while (true) {
+            // Send from a copy so that a newer value can be queued meanwhile
+            IOLockLock(output_lock);
+            bool pending = output_cnt[i] != 0;
+            if (pending) {
+                SurfaceHIDCachedReport &entry = pending_output[i][output_head[i]];
+                report = entry;
+                entry.valid = false;
+                output_head[i] = (output_head[i] + 1) % SURFACE_HID_OUTPUT_PENDING_MAX;
+                output_cnt[i]--;
+            }
+            IOLockUnlock(output_lock);
+            if (!pending)
+                break;
+            ssh->sendCommand(SSH_TC_HID, SSH_TID_SECONDARY, i, SSH_CID_HID_OUT_REPORT, report.data, report.length, true);
+            output_sent++;
+        }
     }
+    setProperty("OutputReportsSent", output_sent, 32);
+    setProperty("OutputReportsCombined", output_combined, 32);
 }
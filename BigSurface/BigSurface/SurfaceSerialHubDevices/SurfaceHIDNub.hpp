@@ -9,7 +9,16 @@
 #ifndef SurfaceHIDNub_hpp
 #define SurfaceHIDNub_hpp
 
+#include <IOKit/IOMessage.h>
 #include "../SurfaceSerialHub/SurfaceSerialHubDriver.hpp"
+#include "HIDLatency.h"
+
+/*
+ * Sent to the clients of the nub through message() when the Type Cover is attached/detached,
+ * descriptors fetched before an attach should be considered stale.
+ */
+#define kSurfaceHIDMessageDeviceAttached    iokit_vendor_specific_msg(0x51)
+#define kSurfaceHIDMessageDeviceDetached    iokit_vendor_specific_msg(0x52)
 
 enum SurfaceHIDDescriptorEntryType : UInt8 {
     SurfaceHIDDescriptorEntry       = 0,
@@ -49,10 +58,77 @@ struct PACKED SurfaceHIDAttributes {
     UInt8  _unknown[22];
 };
 
+/*
+ * Descriptors of one device, kept across sleep and cover re-attach as long as
+ * vendor, product and version reported by the attributes stay the same
+ */
+struct SurfaceHIDDescriptorCache {
+    bool                    checked {false};    // attributes revalidated since last wake/attach
+    bool                    attr_valid {false};
+    bool                    desc_valid {false};
+    SurfaceHIDAttributes    attr;
+    SurfaceHIDDescriptor    desc;
+    UInt8*                  report_desc {nullptr};
+    UInt16                  report_desc_len {0};
+};
+
+#define SURFACE_HID_DEVICE_MAX          (SurfaceTouchpadDevice+1)
+
+#define SURFACE_HID_FEATURE_CACHE_SIZE  8       // feature reports cached per device
+#define SURFACE_HID_OUTPUT_PENDING_MAX  4       // output reports waiting to be sent per device
+#define SURFACE_HID_CACHED_REPORT_MAX   64      // larger reports are neither cached nor combined
+#define SURFACE_HID_FEATURE_STATS_INTERVAL  64  // feature lookups between two updates of FeatureCacheHits/Misses
+
+/*
+ * A feature report as last read or written, or an output report waiting to be sent
+ */
+struct SurfaceHIDCachedReport {
+    bool    valid {false};
+    UInt8   report_id {0};
+    UInt16  length {0};
+    UInt16  requested {0};  // buffer size of the read that filled a feature report, the answer may be shorter
+    UInt8   data[SURFACE_HID_CACHED_REPORT_MAX];
+};
+
+#define SURFACE_HID_RING_SIZE           64      // power of 2
+#define SURFACE_HID_REPORT_MAX          SSH_MSG_CACHE_SIZE
+#define SURFACE_HID_STATS_INTERVAL      512     // reports between two updates of ReportRingStats
+
+#define SURFACE_HID_LATENCY_INTERVAL    64      // reports of a device between two updates of InputLatency
+
+struct SurfaceHIDReportSlot {
+    SurfaceHIDDeviceType    device;
+    UInt16                  length;
+    UInt64                  received;
+    UInt64                  completed;
+    UInt64                  queued;
+    UInt8                   data[SURFACE_HID_REPORT_MAX];
+};
+
+/*
+ * Latency of the reports of one device, stage sums are in ns
+ */
+struct SurfaceHIDLatencyStats {
+    UInt32  count;
+    UInt32  histogram[SURFACE_HID_LATENCY_BUCKETS];
+    UInt64  frame_sum;      // UART buffer -> frame completed
+    UInt64  dispatch_sum;   // frame completed -> HID nub
+    UInt64  queue_sum;      // HID nub -> HID driver
+    UInt64  max;
+};
+
+enum {
+    SurfaceHIDLatencyKeyboard = 0,
+    SurfaceHIDLatencyTouchpad,
+    SurfaceHIDLatencyCount
+};
+
 #define SURFACE_LEGACY_HID_STRING       "SurfaceLegacyHID"
 #define SURFACE_LEGACY_FEAT_REPORT_SIZE 7
 
 #define SURFACE_HID_DESC_HEADER_SIZE sizeof(SurfaceHIDDescriptorBufferHeader)
+#define SURFACE_HID_DESC_WINDOW_LEGACY  0x76    // used by windows driver
+#define SURFACE_HID_DESC_WINDOW_SIZE    0x800   // SSH frames are no longer limited to SSH_MSG_CACHE_SIZE
 
 class EXPORT SurfaceHIDNub : public SurfaceSerialHubClient {
     OSDeclareDefaultStructors(SurfaceHIDNub)
@@ -74,6 +150,19 @@ public:
     
     void unregisterHIDEvent(OSObject* owner);
     
+    /*
+     * Route touchpad reports to a dedicated decoder instead of the HID event handler,
+     * they are only delivered while a HID event handler is registered as it enables the events
+     */
+    IOReturn registerTouchpadEvent(OSObject* owner, EventHandler _handler);
+    
+    void unregisterTouchpadEvent(OSObject* owner);
+    
+    /*
+     * Run action on the loop delivering touchpad reports, so that it never races the touchpad handler
+     */
+    IOReturn runTouchpadAction(OSObject* owner, IOWorkLoop::Action action, void *arg0 = nullptr);
+    
     void eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) override;
     
     IOReturn getHIDDescriptor(SurfaceHIDDeviceType device, SurfaceHIDDescriptor *desc);
@@ -86,17 +175,141 @@ public:
     
     void setHIDRawReport(SurfaceHIDDeviceType device, UInt8 report_id, bool feature, UInt8 *buffer, UInt16 len);
     
+    IOReturn getCoverConnection(bool *connected);
+    
+    /*
+     * Reports are delivered on this work loop unless the event owner has one of its own
+     */
+    IOWorkLoop* getWorkLoop() const override { return work_loop; }
+    
+    IOReturn setProperties(OSObject* props) override;
+    
+    /*
+     * Buffer holding the SurfaceHIDLatencyRing, nullptr if latency tracing has never been enabled
+     */
+    IOBufferMemoryDescriptor* getLatencyTraceBuffer() { return latency_buffer; }
+    
 private:
     SurfaceSerialHubDriver* ssh {nullptr};
     OSObject*               target {nullptr};
     EventHandler            handler {nullptr};
+    OSObject*               touchpad_target {nullptr};
+    EventHandler            touchpad_handler {nullptr};
+    IOWorkLoop*             work_loop {nullptr};
+    IOInterruptEventSource* cover_event {nullptr};
+    
+    bool    cover_connected {true};
+    bool    wait_first_key {false};
+    UInt32  cover_attach_cnt {0};
+    AbsoluteTime cover_attach_time {0};
 
     bool    legacy {true};
+    UInt16  desc_window {SURFACE_HID_DESC_WINDOW_SIZE};
+    
+    IOLock*                     cache_lock {nullptr};
+    SurfaceHIDDescriptorCache   desc_cache[SURFACE_HID_DEVICE_MAX];
+    UInt32                      cache_hits {0};
+    UInt32                      cache_misses {0};
+    
+    /* Feature reports only change when written, so they are cached until written, sleep or cover re-attach */
+    SurfaceHIDCachedReport      feature_cache[SURFACE_HID_DEVICE_MAX][SURFACE_HID_FEATURE_CACHE_SIZE];
+    UInt32                      feature_hits {0};
+    UInt32                      feature_misses {0};
+    
+    /*
+     * Output reports are sent in the order they were written, one written right after another
+     * with the same id that is not sent yet replaces it instead of queueing up
+     */
+    IOLock*                     output_lock {nullptr};
+    IOInterruptEventSource*     output_event {nullptr};
+    SurfaceHIDCachedReport      pending_output[SURFACE_HID_DEVICE_MAX][SURFACE_HID_OUTPUT_PENDING_MAX];
+    UInt8                       output_head[SURFACE_HID_DEVICE_MAX] {};
+    UInt8                       output_cnt[SURFACE_HID_DEVICE_MAX] {};
+    UInt32                      output_sent {0};
+    UInt32                      output_combined {0};
+    
+    /*
+     * Single producer (SSH work loop) single consumer (owner's work loop) report ring,
+     * the handler is called directly on the slot so the report is copied only once
+     */
+    IOInterruptEventSource*     report_event {nullptr};
+    IOWorkLoop*                 report_work_loop {nullptr};
+    SurfaceHIDReportSlot*       report_ring {nullptr};
+    UInt8                       producer_pad[SSH_CACHE_LINE_SIZE];  // kalloc gives no cache line alignment, pad instead
+    volatile UInt32             ring_head {0};
+    UInt32                      ring_dropped {0};
+    UInt64                      enqueue_time {0};
+    UInt8                       consumer_pad[SSH_CACHE_LINE_SIZE];
+    volatile UInt32             ring_tail {0};
+    UInt32                      drain_cnt {0};
+    UInt32                      drain_max_batch {0};
+    UInt64                      drain_time {0};
+    UInt64                      drain_max_time {0};
+    UInt32                      stats_reports {0};
+    
+    SurfaceHIDLatencyStats      latency[SurfaceHIDLatencyCount] {};
+    IOBufferMemoryDescriptor*   latency_buffer {nullptr};
+    SurfaceHIDLatencyRing*      latency_ring {nullptr};
+    volatile bool               latency_trace {false};
 
     IOReturn getDescriptorData(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len);
     
+    /*
+     * Check the cached descriptors of the device against its attributes with a single query,
+     * must be called with cache_lock held
+     */
+    IOReturn revalidateCache(SurfaceHIDDeviceType device);
+    
+    void markCacheStale();
+    
+    void updateCacheStats(bool hit);
+    
+    bool lookupFeatureReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len);
+    
+    void storeFeatureReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len, UInt16 requested);
+    
+    void invalidateFeatureReport(SurfaceHIDDeviceType device, UInt8 report_id);
+    
+    bool queueOutputReport(SurfaceHIDDeviceType device, UInt8 report_id, UInt8 *buffer, UInt16 len);
+    
+    void flushOutputReports(IOInterruptEventSource *sender, int count);
+    
+    /*
+     * Send a report right away, behind the output reports still queued
+     */
+    IOReturn sendReportGated(SurfaceHIDDeviceType *device, bool *feature, UInt8 *buffer, UInt16 *len);
+    
     IOReturn getLegacyData(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len);
     IOReturn getData(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len);
+    
+    IOReturn getDataWindowed(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len, UInt16 window);
+    
+    /*
+     * Request all windows of a descriptor whose total length is known at once, and reassemble them by offset
+     */
+    IOReturn getDataPipelined(SurfaceHIDDeviceType device, SurfaceHIDDescriptorEntryType entry, UInt8 *buffer, UInt16 buffer_len, UInt16 window);
+    
+    IOReturn initCoverEvent();
+    
+    void coverChanged(IOInterruptEventSource *sender, int count);
+    
+    IOReturn setTouchpadHandlerGated(OSObject *owner, EventHandler *_handler);
+    
+    void dispatchReport(SurfaceHIDDeviceType device, UInt8 *buffer, UInt16 len);
+    
+    void drainReports(IOInterruptEventSource *sender, int count);
+    
+    void publishRingStats();
+    
+    void recordLatency(SurfaceHIDReportSlot *slot, UInt64 handoff, UInt64 handled);
+    
+    void publishLatency();
+    
+    IOReturn setLatencyTraceGated(bool *enable);
+    
+    void releaseCoverEvent();
+    
+    void releaseResources();
 };
 
 #endif /* SurfaceHIDNub_hpp */
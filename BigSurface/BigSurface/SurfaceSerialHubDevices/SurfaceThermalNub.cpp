@@ -0,0 +1,83 @@
+//
+//  SurfaceThermalNub.cpp
+//  SurfaceSerialHubDevices
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "SurfaceThermalNub.hpp"
+
+#define super SurfaceSerialHubClient
+OSDefineMetaClassAndStructors(SurfaceThermalNub, SurfaceSerialHubClient)
+
+bool SurfaceThermalNub::attach(IOService* provider) {
+    if (!super::attach(provider))
+        return false;
+
+    ssh = OSDynamicCast(SurfaceSerialHubDriver, provider);
+    if (!ssh)
+        return false;
+
+    return true;
+}
+
+void SurfaceThermalNub::detach(IOService* provider) {
+    ssh = nullptr;
+    super::detach(provider);
+}
+
+bool SurfaceThermalNub::start(IOService *provider) {
+    if (!super::start(provider))
+        return false;
+    
+    PMinit();
+    ssh->joinPMtree(this);
+    registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
+    
+    registerService();
+    return true;
+}
+
+void SurfaceThermalNub::stop(IOService *provider) {
+    PMstop();
+    super::stop(provider);
+}
+
+IOReturn SurfaceThermalNub::setPowerState(unsigned long whichState, IOService *device) {
+    if (device != this)
+        return kIOReturnInvalid;
+    return kIOPMAckImplied;
+}
+
+void SurfaceThermalNub::eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) {
+    DBG_LOG("Unknown thermal event! tid: %d, iid: %d, cid: %x, data_len: %d", tid, iid, cid, length);
+}
+
+IOReturn SurfaceThermalNub::getTemperature(UInt8 sensor, UInt16 *temp) {
+    return ssh->getResponse(SSH_TC_TMP, SSH_TID_PRIMARY, sensor, SSH_CID_TMP_SENSOR, nullptr, 0, true, reinterpret_cast<UInt8 *>(temp), 2);
+}
+
+IOReturn SurfaceThermalNub::getTemperatures(const UInt8 *sensors, UInt8 count, UInt16 *temps) {
+    SurfaceSerialRequest requests[SSH_TEMP_SENSOR_COUNT];
+    if (count > SSH_TEMP_SENSOR_COUNT)
+        return kIOReturnBadArgument;
+    
+    for (UInt8 i = 0; i < count; i++) {
+        temps[i] = 0;
+        requests[i].tc = SSH_TC_TMP;
+        requests[i].tid = SSH_TID_PRIMARY;
+        requests[i].iid = sensors[i];
+        requests[i].cid = SSH_CID_TMP_SENSOR;
+        requests[i].payload = nullptr;
+        requests[i].payload_len = 0;
+        requests[i].buffer = reinterpret_cast<UInt8 *>(&temps[i]);
+        requests[i].buffer_len = 2;
+    }
+    IOReturn ret = ssh->getResponses(requests, count);
+    for (UInt8 i = 0; i < count; i++) {
+        if (requests[i].status != kIOReturnSuccess || requests[i].buffer_len != 2)
+            temps[i] = 0;
+    }
+    return ret;
+}
@@ -0,0 +1,46 @@
+//
+//  SurfaceThermalNub.hpp
+//  SurfaceSerialHubDevices
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceThermalNub_hpp
+#define SurfaceThermalNub_hpp
+
+#include "../SurfaceSerialHub/SurfaceSerialHubDriver.hpp"
+
+#define SSH_TEMP_SENSOR_COUNT   8
+
+class EXPORT SurfaceThermalNub : public SurfaceSerialHubClient {
+    OSDeclareDefaultStructors(SurfaceThermalNub);
+    
+public:
+    bool attach(IOService* provider) override;
+    
+    void detach(IOService* provider) override;
+    
+    bool start(IOService* provider) override;
+    
+    void stop(IOService* provider) override;
+    
+    IOReturn setPowerState(unsigned long whichState, IOService *device) override;
+    
+    void eventReceived(UInt8 tc, UInt8 tid, UInt8 iid, UInt8 cid, UInt8 *data_buffer, UInt16 length) override;
+    
+    /*
+     * sensor: SSH_TEMP_SENSOR_*, temperature is in 0.1 Kelvin
+     */
+    IOReturn getTemperature(UInt8 sensor, UInt16 *temp);
+    
+    /*
+     * Read several sensors in one pipelined burst, temps[i] is set to 0 if sensors[i] could not be read
+     */
+    IOReturn getTemperatures(const UInt8 *sensors, UInt8 count, UInt16 *temps);
+    
+private:
+    SurfaceSerialHubDriver* ssh {nullptr};
+};
+
+#endif /* SurfaceThermalNub_hpp */
@@ -0,0 +1,15 @@
+//
+//  FanSpeedValue.cpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "FanSpeedValue.hpp"
+
+SMC_RESULT SMCFanSpeedValue::readAccess() {
+    UInt16 *ptr = reinterpret_cast<UInt16 *>(data);
+    *ptr = VirtualSMCAPI::encodeIntFp(SmcKeyTypeFpe2, atomic_load_explicit(currentRPM, memory_order_acquire));
+    return SmcSuccess;
+}
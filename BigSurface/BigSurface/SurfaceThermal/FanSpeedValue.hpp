@@ -0,0 +1,24 @@
+//
+//  FanSpeedValue.hpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FanSpeedValue_hpp
+#define FanSpeedValue_hpp
+
+#include <libkern/libkern.h>
+#include <VirtualSMCSDK/kern_vsmcapi.hpp>
+
+class SMCFanSpeedValue : public VirtualSMCValue {
+    _Atomic(UInt16) *currentRPM;
+protected:
+    SMC_RESULT readAccess() override;
+
+public:
+    SMCFanSpeedValue(_Atomic(UInt16) *currentRPM) : currentRPM(currentRPM) {}
+};
+
+#endif /* FanSpeedValue_hpp */
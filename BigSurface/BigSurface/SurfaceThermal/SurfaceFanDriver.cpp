@@ -0,0 +1,150 @@
+//
+//  SurfaceFanDriver.cpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <Headers/kern_util.hpp>
+
+#include "SurfaceFanDriver.hpp"
+
+#define super IOService
+OSDefineMetaClassAndStructors(SurfaceFanDriver, IOService);
+
+IOService* SurfaceFanDriver::probe(IOService *provider, SInt32 *score) {
+    if (!super::probe(provider, score))
+        return nullptr;
+    
+    nub = OSDynamicCast(SurfaceFanNub, provider);
+    if (!nub)
+        return nullptr;
+    
+    return this;
+}
+
+bool SurfaceFanDriver::start(IOService *provider) {
+    if (!super::start(provider))
+        return false;
+    
+    // Fanless models do not answer the RPM query at all
+    UInt16 rpm;
+    if (nub->getFanSpeed(&rpm) != kIOReturnSuccess) {
+        LOG("No fan found");
+        return false;
+    }
+    atomic_store_explicit(&current_rpm, rpm, memory_order_release);
+    
+    work_loop = IOWorkLoop::workLoop();
+    if (!work_loop) {
+        LOG("Could not get work loop!");
+        return false;
+    }
+    poller = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SurfaceFanDriver::pollFanSpeed));
+    if (!poller) {
+        LOG("Could not create timer event source");
+        goto exit;
+    }
+    work_loop->addEventSource(poller);
+    
+    VirtualSMCAPI::addKey(KeyF0Ac, vsmcPlugin.data, VirtualSMCAPI::valueWithFp(0, SmcKeyTypeFpe2, new SMCFanSpeedValue(&current_rpm)));
+    VirtualSMCAPI::addKey(KeyF0Mn, vsmcPlugin.data, VirtualSMCAPI::valueWithFp(FAN_SPEED_MIN, SmcKeyTypeFpe2));
+    VirtualSMCAPI::addKey(KeyF0Mx, vsmcPlugin.data, VirtualSMCAPI::valueWithFp(FAN_SPEED_MAX, SmcKeyTypeFpe2));
+    VirtualSMCAPI::addKey(KeyFNum, vsmcPlugin.data, VirtualSMCAPI::valueWithUint8(1));
+    
+    PMinit();
+    nub->joinPMtree(this);
+    registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
+    
+    vsmcNotifier = VirtualSMCAPI::registerHandler(vsmcNotificationHandler, this);
+    if (!vsmcNotifier) {
+        PMstop();
+        goto exit;
+    }
+    
+    registerService();
+    return true;
+exit:
+    releaseResources();
+    vsmcPlugin.data.deinit();
+    return false;
+}
+
+void SurfaceFanDriver::stop(IOService *provider) {
+//    PMstop();
+//    releaseResources();
+//    super::stop(provider);
+    PANIC("SurfaceFanDriver", "called stop!!!");
+}
+
+bool SurfaceFanDriver::vsmcNotificationHandler(void *sensors, void *refCon, IOService *vsmc, IONotifier *notifier) {
+    if (sensors && vsmc) {
+        auto self = static_cast<SurfaceFanDriver *>(sensors);
+        auto ret = vsmc->callPlatformFunction(VirtualSMCAPI::SubmitPlugin, true, sensors, &self->vsmcPlugin, nullptr, nullptr);
+        if (ret == kIOReturnSuccess) {
+            IOLog("%s::Plugin submitted\n", self->getName());
+            self->poller->setTimeoutMS(FAN_UPDATE_MIN);
+            return true;
+        } else
+            IOLog("%s::Plugin submission failure %X\n", self->getName(), ret);
+    }
+    return false;
+}
+
+void SurfaceFanDriver::pollFanSpeed(IOTimerEventSource *timer) {
+    if (!awake)
+        return;
+    
+    UInt16 rpm;
+    if (nub->getFanSpeed(&rpm) != kIOReturnSuccess) {
+        LOG("Failed to get fan speed from SSH!");
+        interval = FAN_UPDATE_MIN;
+        poller->setTimeoutMS(interval);
+        return;
+    }
+    
+    // Back off while the fan is steady, go back to quick polling as soon as it ramps.
+    // SAM has no on/off state for the fan, starting or stopping is only seen as the RPM leaving or reaching 0
+    UInt16 last = atomic_load_explicit(&current_rpm, memory_order_acquire);
+    UInt16 delta = rpm > last ? rpm - last : last - rpm;
+    if (delta > FAN_STABLE_DELTA || (!rpm != !last))
+        interval = FAN_UPDATE_MIN;
+    else if (interval < FAN_UPDATE_MAX)
+        interval *= 2;
+    atomic_store_explicit(&current_rpm, rpm, memory_order_release);
+    
+    poller->setTimeoutMS(interval);
+}
+
+IOReturn SurfaceFanDriver::setPowerState(unsigned long whichState, IOService *whatDevice) {
+    if (whatDevice != this)
+        return kIOReturnInvalid;
+    if (whichState == 0) {
+        if (awake) {
+            poller->cancelTimeout();
+            poller->disable();
+            awake = false;
+            DBG_LOG("Going to sleep");
+        }
+    } else {
+        if (!awake) {
+            awake = true;
+            interval = FAN_UPDATE_MIN;
+            poller->enable();
+            poller->setTimeoutMS(interval);
+            DBG_LOG("Woke up");
+        }
+    }
+    return kIOPMAckImplied;
+}
+
+void SurfaceFanDriver::releaseResources() {
+    if (poller) {
+        poller->cancelTimeout();
+        poller->disable();
+        work_loop->removeEventSource(poller);
+        OSSafeReleaseNULL(poller);
+    }
+    OSSafeReleaseNULL(work_loop);
+}
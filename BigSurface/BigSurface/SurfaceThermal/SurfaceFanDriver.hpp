@@ -0,0 +1,68 @@
+//
+//  SurfaceFanDriver.hpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceFanDriver_hpp
+#define SurfaceFanDriver_hpp
+
+#include <IOKit/IOTimerEventSource.h>
+#include <VirtualSMCSDK/kern_vsmcapi.hpp>
+
+#include "../SurfaceSerialHubDevices/SurfaceFanNub.hpp"
+#include "FanSpeedValue.hpp"
+
+#define FAN_UPDATE_MIN      1000
+#define FAN_UPDATE_MAX      8000
+#define FAN_STABLE_DELTA    100     // RPM
+/*
+ * Placeholders: SAM only reports the current RPM, there is no query for the fan's limits.
+ * MIN is 0 since the fan stops when idle, MAX is an unverified bound that only scales the readout in monitoring tools.
+ */
+#define FAN_SPEED_MIN       0
+#define FAN_SPEED_MAX       6000
+
+class EXPORT SurfaceFanDriver : public IOService {
+    OSDeclareDefaultStructors(SurfaceFanDriver);
+    
+    static constexpr SMC_KEY KeyFNum = SMC_MAKE_IDENTIFIER('F','N','u','m');
+    static constexpr SMC_KEY KeyF0Ac = SMC_MAKE_IDENTIFIER('F','0','A','c');
+    static constexpr SMC_KEY KeyF0Mn = SMC_MAKE_IDENTIFIER('F','0','M','n');
+    static constexpr SMC_KEY KeyF0Mx = SMC_MAKE_IDENTIFIER('F','0','M','x');
+    
+public:
+    IOService* probe(IOService* provider, SInt32* score) override;
+    
+    bool start(IOService* provider) override;
+    
+    void stop(IOService* provider) override;
+    
+    IOReturn setPowerState(unsigned long whichState, IOService *whatDevice) override;
+    
+    static bool vsmcNotificationHandler(void *sensors, void *refCon, IOService *vsmc, IONotifier *notifier);
+    
+private:
+    SurfaceFanNub*      nub {nullptr};
+    IOWorkLoop*         work_loop {nullptr};
+    IOTimerEventSource* poller {nullptr};
+    
+    bool    awake {true};
+    UInt32  interval {FAN_UPDATE_MIN};
+    
+    _Atomic(UInt16) current_rpm;
+    IONotifier *vsmcNotifier {nullptr};
+    VirtualSMCAPI::Plugin vsmcPlugin {
+        "SurfaceFanDriver",
+        parseModuleVersion(xStringify(MODULE_VERSION)),
+        VirtualSMCAPI::Version,
+    };
+    
+    void pollFanSpeed(IOTimerEventSource *timer);
+    
+    void releaseResources();
+};
+
+#endif /* SurfaceFanDriver_hpp */
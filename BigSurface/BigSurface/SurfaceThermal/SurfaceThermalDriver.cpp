@@ -0,0 +1,234 @@
+//
+//  SurfaceThermalDriver.cpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <Headers/kern_util.hpp>
+
+#include "SurfaceThermalDriver.hpp"
+
+#define super IOService
+OSDefineMetaClassAndStructors(SurfaceThermalDriver, IOService);
+
+// Battery temperature is already provided by SurfaceBatteryDriver as TB0T
+static const struct {
+    UInt8   id;
+    SMC_KEY key;
+} sensor_keys[] = {
+    {SSH_TEMP_SENSOR_MB1, SMC_MAKE_IDENTIFIER('T','m','0','P')},
+    {SSH_TEMP_SENSOR_MB2, SMC_MAKE_IDENTIFIER('T','m','1','P')},
+    {SSH_TEMP_SENSOR_MB3, SMC_MAKE_IDENTIFIER('T','m','2','P')},
+    {SSH_TEMP_SENSOR_MB4, SMC_MAKE_IDENTIFIER('T','m','3','P')},
+    {SSH_TEMP_SENSOR_GPU, SMC_MAKE_IDENTIFIER('T','G','0','P')},
+    {SSH_TEMP_SENSOR_SSD, SMC_MAKE_IDENTIFIER('T','H','0','P')},
+    {SSH_TEMP_SENSOR_SOC, SMC_MAKE_IDENTIFIER('T','C','0','P')},
+};
+
+static UInt64 getUptimeMS() {
+    UInt64 now, nsecs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &nsecs);
+    return nsecs / 1000000;
+}
+
+IOService* SurfaceThermalDriver::probe(IOService *provider, SInt32 *score) {
+    if (!super::probe(provider, score))
+        return nullptr;
+    
+    nub = OSDynamicCast(SurfaceThermalNub, provider);
+    if (!nub)
+        return nullptr;
+    
+    return this;
+}
+
+bool SurfaceThermalDriver::start(IOService *provider) {
+    if (!super::start(provider))
+        return false;
+    
+    const UInt8 total = sizeof(sensor_keys) / sizeof(sensor_keys[0]);
+    UInt8 ids[total];
+    UInt16 temps[total];
+    
+    // Only publish keys for the sensors this model actually has
+    for (UInt8 i = 0; i < total; i++)
+        ids[i] = sensor_keys[i].id;
+    nub->getTemperatures(ids, total, temps);
+    for (UInt8 i = 0; i < total; i++) {
+        if (!temps[i])
+            continue;
+        ThermalSensor &sensor = sensors[sensor_cnt++];
+        sensor.id = sensor_keys[i].id;
+        sensor.key = sensor_keys[i].key;
+        atomic_store_explicit(&sensor.temp, temps[i], memory_order_release);
+        VirtualSMCAPI::addKey(sensor.key, vsmcPlugin.data, VirtualSMCAPI::valueWithSp(0, SmcKeyTypeSp78, new SMCTemperatureValue(&sensor.temp)));
+    }
+    if (!sensor_cnt) {
+        LOG("No temperature sensor available");
+        return false;
+    }
+    LOG("Found %d temperature sensors", sensor_cnt);
+    resetSchedule();
+    publishTemperatures();
+    
+    work_loop = IOWorkLoop::workLoop();
+    if (!work_loop) {
+        LOG("Could not get work loop!");
+        goto exit;
+    }
+    poller = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SurfaceThermalDriver::pollTemperatures));
+    if (!poller) {
+        LOG("Could not create timer event source");
+        goto exit;
+    }
+    work_loop->addEventSource(poller);
+    
+    qsort(const_cast<VirtualSMCKeyValue *>(vsmcPlugin.data.data()), vsmcPlugin.data.size(), sizeof(VirtualSMCKeyValue), VirtualSMCKeyValue::compare);
+    
+    PMinit();
+    nub->joinPMtree(this);
+    registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
+    
+    vsmcNotifier = VirtualSMCAPI::registerHandler(vsmcNotificationHandler, this);
+    if (!vsmcNotifier) {
+        PMstop();
+        goto exit;
+    }
+    
+    registerService();
+    return true;
+exit:
+    releaseResources();
+    // the keys were never submitted, free them together with their values
+    vsmcPlugin.data.deinit();
+    return false;
+}
+
+void SurfaceThermalDriver::stop(IOService *provider) {
+//    PMstop();
+//    releaseResources();
+//    super::stop(provider);
+    PANIC("SurfaceThermalDriver", "called stop!!!");
+}
+
+bool SurfaceThermalDriver::vsmcNotificationHandler(void *sensors, void *refCon, IOService *vsmc, IONotifier *notifier) {
+    if (sensors && vsmc) {
+        auto self = static_cast<SurfaceThermalDriver *>(sensors);
+        auto ret = vsmc->callPlatformFunction(VirtualSMCAPI::SubmitPlugin, true, sensors, &self->vsmcPlugin, nullptr, nullptr);
+        if (ret == kIOReturnSuccess) {
+            IOLog("%s::Plugin submitted\n", self->getName());
+            self->poller->setTimeoutMS(TMP_UPDATE_MIN);
+            return true;
+        } else
+            IOLog("%s::Plugin submission failure %X\n", self->getName(), ret);
+    }
+    return false;
+}
+
+void SurfaceThermalDriver::resetSchedule() {
+    UInt64 now = getUptimeMS();
+    for (UInt8 i = 0; i < sensor_cnt; i++) {
+        sensors[i].interval = TMP_UPDATE_MIN;
+        sensors[i].deadline = now + TMP_UPDATE_MIN;
+    }
+}
+
+void SurfaceThermalDriver::pollTemperatures(IOTimerEventSource *timer) {
+    if (!awake)
+        return;
+    
+    UInt8 ids[SSH_TEMP_SENSOR_COUNT];
+    UInt8 index[SSH_TEMP_SENSOR_COUNT];
+    UInt16 temps[SSH_TEMP_SENSOR_COUNT];
+    UInt8 cnt = 0;
+    
+    UInt64 now = getUptimeMS();
+    for (UInt8 i = 0; i < sensor_cnt; i++) {
+        if (sensors[i].deadline <= now + TMP_UPDATE_COALESCE) {
+            ids[cnt] = sensors[i].id;
+            index[cnt++] = i;
+        }
+    }
+    if (cnt && nub->getTemperatures(ids, cnt, temps) != kIOReturnSuccess)
+        DBG_LOG("Failed to read some of the temperature sensors");
+    
+    // A sensor that is changing is polled twice as often, a stable one half as often
+    now = getUptimeMS();
+    for (UInt8 i = 0; i < cnt; i++) {
+        ThermalSensor &sensor = sensors[index[i]];
+        if (temps[i]) {
+            UInt16 last = atomic_load_explicit(&sensor.temp, memory_order_acquire);
+            UInt16 delta = temps[i] > last ? temps[i] - last : last - temps[i];
+            if (delta > TMP_STABLE_DELTA)
+                sensor.interval = sensor.interval > TMP_UPDATE_MIN ? sensor.interval / 2 : TMP_UPDATE_MIN;
+            else
+                sensor.interval = sensor.interval < TMP_UPDATE_MAX ? sensor.interval * 2 : TMP_UPDATE_MAX;
+            atomic_store_explicit(&sensor.temp, temps[i], memory_order_release);
+        } else
+            sensor.interval = TMP_UPDATE_MIN;
+        sensor.deadline = now + sensor.interval;
+    }
+    
+    if (cnt)
+        publishTemperatures();
+    
+    UInt64 next = now + TMP_UPDATE_MAX;
+    for (UInt8 i = 0; i < sensor_cnt; i++) {
+        if (sensors[i].deadline < next)
+            next = sensors[i].deadline;
+    }
+    poller->setTimeoutMS(next > now ? static_cast<UInt32>(next - now) : 0);
+}
+
+void SurfaceThermalDriver::publishTemperatures() {
+    OSDictionary *dict = OSDictionary::withCapacity(sensor_cnt);
+    if (!dict)
+        return;
+    
+    for (UInt8 i = 0; i < sensor_cnt; i++) {
+        char name[5] = {static_cast<char>(sensors[i].key >> 24), static_cast<char>(sensors[i].key >> 16),
+                        static_cast<char>(sensors[i].key >> 8), static_cast<char>(sensors[i].key), '\0'};
+        OSNumber *temp = OSNumber::withNumber(atomic_load_explicit(&sensors[i].temp, memory_order_acquire), 16);
+        if (temp) {
+            dict->setObject(name, temp);
+            temp->release();
+        }
+    }
+    setProperty("Temperatures", dict);
+    dict->release();
+}
+
+IOReturn SurfaceThermalDriver::setPowerState(unsigned long whichState, IOService *whatDevice) {
+    if (whatDevice != this)
+        return kIOReturnInvalid;
+    if (whichState == 0) {
+        if (awake) {
+            poller->cancelTimeout();
+            poller->disable();
+            awake = false;
+            DBG_LOG("Going to sleep");
+        }
+    } else {
+        if (!awake) {
+            awake = true;
+            resetSchedule();
+            poller->enable();
+            poller->setTimeoutMS(TMP_UPDATE_MIN);
+            DBG_LOG("Woke up");
+        }
+    }
+    return kIOPMAckImplied;
+}
+
+void SurfaceThermalDriver::releaseResources() {
+    if (poller) {
+        poller->cancelTimeout();
+        poller->disable();
+        work_loop->removeEventSource(poller);
+        OSSafeReleaseNULL(poller);
+    }
+    OSSafeReleaseNULL(work_loop);
+}
@@ -0,0 +1,71 @@
+//
+//  SurfaceThermalDriver.hpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceThermalDriver_hpp
+#define SurfaceThermalDriver_hpp
+
+#include <IOKit/IOTimerEventSource.h>
+#include <VirtualSMCSDK/kern_vsmcapi.hpp>
+
+#include "../SurfaceSerialHubDevices/SurfaceThermalNub.hpp"
+#include "TemperatureValue.hpp"
+
+#define TMP_UPDATE_MIN      1000
+#define TMP_UPDATE_MAX      16000
+#define TMP_UPDATE_COALESCE 500     // sensors due within this window are read in the same burst
+#define TMP_STABLE_DELTA    5       // 0.5 degree
+
+class EXPORT SurfaceThermalDriver : public IOService {
+    OSDeclareDefaultStructors(SurfaceThermalDriver);
+    
+    struct ThermalSensor {
+        UInt8           id;
+        SMC_KEY         key;
+        _Atomic(UInt16) temp;
+        UInt32          interval;
+        UInt64          deadline;
+    };
+    
+public:
+    IOService* probe(IOService* provider, SInt32* score) override;
+    
+    bool start(IOService* provider) override;
+    
+    void stop(IOService* provider) override;
+    
+    IOReturn setPowerState(unsigned long whichState, IOService *whatDevice) override;
+    
+    static bool vsmcNotificationHandler(void *sensors, void *refCon, IOService *vsmc, IONotifier *notifier);
+    
+private:
+    SurfaceThermalNub*  nub {nullptr};
+    IOWorkLoop*         work_loop {nullptr};
+    IOTimerEventSource* poller {nullptr};
+    
+    bool awake {true};
+    
+    ThermalSensor   sensors[SSH_TEMP_SENSOR_COUNT];
+    UInt8           sensor_cnt {0};
+    
+    IONotifier *vsmcNotifier {nullptr};
+    VirtualSMCAPI::Plugin vsmcPlugin {
+        "SurfaceThermalDriver",
+        parseModuleVersion(xStringify(MODULE_VERSION)),
+        VirtualSMCAPI::Version,
+    };
+    
+    void pollTemperatures(IOTimerEventSource *timer);
+    
+    void resetSchedule();
+    
+    void publishTemperatures();
+    
+    void releaseResources();
+};
+
+#endif /* SurfaceThermalDriver_hpp */
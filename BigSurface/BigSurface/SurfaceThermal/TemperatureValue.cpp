@@ -0,0 +1,20 @@
+//
+//  TemperatureValue.cpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "TemperatureValue.hpp"
+
+SMC_RESULT SMCTemperatureValue::readAccess() {
+    UInt16 *ptr = reinterpret_cast<UInt16 *>(data);
+    UInt16 temp = atomic_load_explicit(currentTemp, memory_order_acquire);
+    
+    if (temp > DECI_KELVIN_OFFSET)
+        *ptr = VirtualSMCAPI::encodeSp(SmcKeyTypeSp78, (temp - DECI_KELVIN_OFFSET) / 10.0);
+    else
+        *ptr = 0;
+    return SmcSuccess;
+}
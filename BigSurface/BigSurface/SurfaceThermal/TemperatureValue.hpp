@@ -0,0 +1,29 @@
+//
+//  TemperatureValue.hpp
+//  SurfaceThermal
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef TemperatureValue_hpp
+#define TemperatureValue_hpp
+
+#include <libkern/libkern.h>
+#include <VirtualSMCSDK/kern_vsmcapi.hpp>
+
+#define DECI_KELVIN_OFFSET  2731
+
+class SMCTemperatureValue : public VirtualSMCValue {
+    _Atomic(UInt16) *currentTemp;
+protected:
+    SMC_RESULT readAccess() override;
+
+public:
+    /**
+     *  currentTemp is the latest reading in 0.1 Kelvin, 0 if invalid
+     */
+    SMCTemperatureValue(_Atomic(UInt16) *currentTemp) : currentTemp(currentTemp) {}
+};
+
+#endif /* TemperatureValue_hpp */
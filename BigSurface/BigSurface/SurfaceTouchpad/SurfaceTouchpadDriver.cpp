@@ -0,0 +1,414 @@
+//
+//  SurfaceTouchpadDriver.cpp
+//  SurfaceTouchpad
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <Headers/kern_util.hpp>
+
+#include "SurfaceTouchpadDriver.hpp"
+
+#define HID_ITEM_MAIN           0
+#define HID_ITEM_GLOBAL         1
+#define HID_ITEM_LOCAL          2
+#define HID_MAIN_INPUT          0x8
+#define HID_MAIN_COLLECTION     0xA
+#define HID_MAIN_END_COLLECTION 0xC
+#define HID_GLOBAL_USAGE_PAGE   0x0
+#define HID_GLOBAL_LOGICAL_MAX  0x2
+#define HID_GLOBAL_PHYSICAL_MAX 0x4
+#define HID_GLOBAL_UNIT_EXP     0x5
+#define HID_GLOBAL_UNIT         0x6
+#define HID_GLOBAL_REPORT_SIZE  0x7
+#define HID_GLOBAL_REPORT_ID    0x8
+#define HID_GLOBAL_REPORT_COUNT 0x9
+#define HID_GLOBAL_PUSH         0xA
+#define HID_LOCAL_USAGE         0x0
+#define HID_LOCAL_USAGE_MIN     0x1
+#define HID_LOCAL_USAGE_MAX     0x2
+#define HID_LONG_ITEM           0xFE
+
+#define HID_UNIT_CENTIMETER     0x11
+#define HID_UNIT_INCH           0x13
+
+#define super IOService
+OSDefineMetaClassAndStructors(SurfaceTouchpadDriver, IOService);
+
+IOService* SurfaceTouchpadDriver::probe(IOService *provider, SInt32 *score) {
+    if (!super::probe(provider, score))
+        return nullptr;
+    
+    nub = OSDynamicCast(SurfaceHIDNub, provider);
+    if (!nub)
+        return nullptr;
+    
+    return this;
+}
+
+bool SurfaceTouchpadDriver::start(IOService *provider) {
+    if (!super::start(provider))
+        return false;
+    
+    // Leave the touchpad to the generic HID path if we do not know its report layout
+    if (selectLayout() != kIOReturnSuccess)
+        return false;
+    
+    setProperty(VOODOO_INPUT_LOGICAL_MAX_X_KEY, geometry.logical_max_x, 32);
+    setProperty(VOODOO_INPUT_LOGICAL_MAX_Y_KEY, geometry.logical_max_y, 32);
+    setProperty(VOODOO_INPUT_PHYSICAL_MAX_X_KEY, geometry.physical_max_x, 32);
+    setProperty(VOODOO_INPUT_PHYSICAL_MAX_Y_KEY, geometry.physical_max_y, 32);
+    setProperty(VOODOO_INPUT_TRANSFORM_KEY, 0ull, 32);
+    setProperty(VOODOO_INPUT_IDENTIFIER, kOSBooleanTrue);
+    
+    if (nub->registerTouchpadEvent(this, OSMemberFunctionCast(SurfaceHIDNub::EventHandler, this, &SurfaceTouchpadDriver::reportReceived)) != kIOReturnSuccess) {
+        LOG("Could not register touchpad event!");
+        return false;
+    }
+    registered = true;
+    
+    PMinit();
+    nub->joinPMtree(this);
+    registerPowerDriver(this, myIOPMPowerStates, kIOPMNumberPowerStates);
+    
+    registerService();
+    return true;
+}
+
+void SurfaceTouchpadDriver::stop(IOService *provider) {
+    if (registered) {
+        nub->unregisterTouchpadEvent(this);
+        registered = false;
+    }
+    PMstop();
+    super::stop(provider);
+}
+
+bool SurfaceTouchpadDriver::handleOpen(IOService *forClient, IOOptionBits options, void *arg) {
+    if (forClient && forClient->getProperty(VOODOO_INPUT_IDENTIFIER)) {
+        voodoo_input = forClient;
+        voodoo_input->retain();
+        return true;
+    }
+    return super::handleOpen(forClient, options, arg);
+}
+
+void SurfaceTouchpadDriver::handleClose(IOService *forClient, IOOptionBits options) {
+    if (forClient && forClient == voodoo_input)
+        OSSafeReleaseNULL(voodoo_input);
+    super::handleClose(forClient, options);
+}
+
+IOReturn SurfaceTouchpadDriver::message(UInt32 type, IOService *provider, void *argument) {
+    switch (type) {
+        case kSurfaceHIDMessageDeviceDetached:
+            liftAll();
+            break;
+        case kSurfaceHIDMessageDeviceAttached:
+            // Another cover may have another touchpad, hand it back to the HID driver if we can not decode it
+            // and take it over again once a cover we can decode comes back
+            liftAll();
+            if (selectLayout() != kIOReturnSuccess) {
+                if (registered) {
+                    LOG("Unknown touchpad layout after cover attach, falling back to HID");
+                    nub->unregisterTouchpadEvent(this);
+                    registered = false;
+                }
+            } else if (!registered) {
+                if (nub->registerTouchpadEvent(this, OSMemberFunctionCast(SurfaceHIDNub::EventHandler, this, &SurfaceTouchpadDriver::reportReceived)) == kIOReturnSuccess) {
+                    LOG("Known touchpad layout after cover attach, decoding it directly again");
+                    registered = true;
+                } else
+                    LOG("Could not register touchpad event!");
+            }
+            break;
+        default:
+            return super::message(type, provider, argument);
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn SurfaceTouchpadDriver::setPowerState(unsigned long whichState, IOService *whatDevice) {
+    if (whatDevice != this)
+        return kIOReturnInvalid;
+    if (whichState == 0)
+        liftAll();
+    return kIOPMAckImplied;
+}
+
+IOReturn SurfaceTouchpadDriver::selectLayout() {
+    return nub->runTouchpadAction(this, OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceTouchpadDriver::selectLayoutGated));
+}
+
+IOReturn SurfaceTouchpadDriver::selectLayoutGated() {
+    SurfaceHIDDescriptor desc;
+    IOReturn ret = nub->getHIDDescriptor(SurfaceTouchpadDevice, &desc);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    
+    UInt8 *report_desc = new UInt8[desc.report_desc_len];
+    if (!report_desc)
+        return kIOReturnNoMemory;
+    ret = nub->getReportDescriptor(SurfaceTouchpadDevice, report_desc, desc.report_desc_len);
+    if (ret == kIOReturnSuccess)
+        ret = parseReportDescriptor(report_desc, desc.report_desc_len);
+    delete[] report_desc;
+    if (ret != kIOReturnSuccess)
+        return ret;
+    
+    if (layoutMatches<SurfacePTPReport5>())
+        decoder = &SurfaceTouchpadDriver::decodeReport<SurfacePTPReport5>;
+    else {
+        decoder = nullptr;
+        DBG_LOG("Unsupported touchpad report: id %d, %d bytes, %d contacts of %d bytes", geometry.report_id, geometry.report_size, geometry.contacts, geometry.contact_size);
+        return kIOReturnUnsupported;
+    }
+    DBG_LOG("Touchpad report %d decoded directly, %d contacts", geometry.report_id, geometry.contacts);
+    return kIOReturnSuccess;
+}
+
+static UInt32 toHundredthMM(UInt32 value, UInt8 unit, SInt8 exponent) {
+    UInt64 result = value;
+    if (unit == HID_UNIT_INCH)
+        result *= 2540;     // 0.01mm per inch
+    else if (unit == HID_UNIT_CENTIMETER)
+        result *= 1000;
+    else
+        return 0;
+    for (; exponent > 0; exponent--)
+        result *= 10;
+    for (; exponent < 0; exponent++)
+        result /= 10;
+    return static_cast<UInt32>(result);
+}
+
+static void addField(SurfaceTouchpadField *fields, UInt8 *cnt, UInt32 usage, UInt16 offset, UInt16 size) {
+    // the first occurrence of a usage is the one the decoder reads
+    for (int i = 0; i < *cnt; i++)
+        if (fields[i].usage == usage)
+            return;
+    if (*cnt == PTP_FIELD_MAX)
+        return;
+    fields[*cnt].usage = usage;
+    fields[*cnt].offset = offset;
+    fields[*cnt].size = size;
+    (*cnt)++;
+}
+
+bool SurfaceTouchpadDriver::hasField(const SurfaceTouchpadField *fields, UInt8 cnt, UInt32 usage, UInt16 offset, UInt16 size) {
+    for (int i = 0; i < cnt; i++)
+        if (fields[i].usage == usage)
+            return fields[i].offset == offset && fields[i].size == size;
+    return false;
+}
+
+/*
+ * A single pass over the report descriptor, only what is needed to compare it with the known layouts.
+ * Offsets of the usages in the touchpad report are recorded, including the report id byte.
+ */
+IOReturn SurfaceTouchpadDriver::parseReportDescriptor(UInt8 *desc, UInt16 len) {
+    UInt32 usage_page = 0, logical_max = 0, physical_max = 0, unit = 0, report_size = 0, report_count = 0, usage_min = 0;
+    SInt8 unit_exp = 0;
+    UInt8 report_id = 0;
+    UInt32 usages[8];
+    int usage_cnt = 0, depth = 0, finger_depth = -1;
+    UInt32 report_bits[256] = {0};
+    UInt32 finger_bits = 0, finger_start = 0;
+    SurfaceTouchpadGeometry geo {};
+    geo.contacts_uniform = true;
+    
+    for (UInt16 i = 0; i < len;) {
+        UInt8 prefix = desc[i++];
+        if (prefix == HID_LONG_ITEM) {
+            if (i + 1 >= len)
+                return kIOReturnInvalid;
+            i += desc[i] + 2;
+            continue;
+        }
+        UInt8 size = prefix & 0x3;
+        if (size == 3)
+            size = 4;
+        if (i + size > len)
+            return kIOReturnInvalid;
+        UInt32 data = 0;
+        for (int j = 0; j < size; j++)
+            data |= desc[i+j] << (8 * j);
+        i += size;
+        
+        UInt8 tag = prefix >> 4;
+        switch ((prefix >> 2) & 0x3) {
+            case HID_ITEM_MAIN:
+                if (tag == HID_MAIN_INPUT) {
+                    UInt32 bits = report_size * report_count;
+                    UInt32 offset = report_bits[report_id] + 8;
+                    // fields without usages are padding
+                    if (geo.contacts && report_id == geo.report_id && usage_cnt) {
+                        for (UInt32 j = 0; j < report_count; j++) {
+                            UInt32 usage = usages[j < usage_cnt ? j : usage_cnt - 1];
+                            UInt32 bit = offset + j * report_size;
+                            if (finger_depth < 0)
+                                addField(geo.report_fields, &geo.report_field_cnt, usage, bit, report_size);
+                            else if (geo.contacts == 1)
+                                addField(geo.contact_fields, &geo.contact_field_cnt, usage, bit - finger_start, report_size);
+                            else if (!hasField(geo.contact_fields, geo.contact_field_cnt, usage, bit - finger_start, report_size))
+                                geo.contacts_uniform = false;
+                        }
+                    }
+                    report_bits[report_id] += bits;
+                    if (finger_depth >= 0 && geo.contacts == 1 && report_id == geo.report_id)
+                        finger_bits += bits;
+                    for (int j = 0; j < usage_cnt; j++) {
+                        if (usages[j] == HID_USAGE_X && !geo.logical_max_x) {
+                            geo.logical_max_x = logical_max;
+                            geo.physical_max_x = toHundredthMM(physical_max, unit, unit_exp);
+                        } else if (usages[j] == HID_USAGE_Y && !geo.logical_max_y) {
+                            geo.logical_max_y = logical_max;
+                            geo.physical_max_y = toHundredthMM(physical_max, unit, unit_exp);
+                        }
+                    }
+                } else if (tag == HID_MAIN_COLLECTION) {
+                    if (finger_depth < 0 && usage_cnt && usages[0] == HID_USAGE_FINGER) {
+                        if (!geo.contacts)
+                            geo.report_id = report_id;
+                        if (report_id == geo.report_id) {
+                            finger_depth = depth;
+                            finger_start = report_bits[report_id] + 8;
+                            if (!geo.contacts)
+                                geo.contact_offset = finger_start;
+                            else if (finger_start != geo.contact_offset + geo.contacts * finger_bits)
+                                geo.contacts_uniform = false;
+                            geo.contacts++;
+                        }
+                    }
+                    depth++;
+                } else if (tag == HID_MAIN_END_COLLECTION) {
+                    depth--;
+                    if (depth == finger_depth)
+                        finger_depth = -1;
+                }
+                usage_cnt = 0;
+                break;
+            case HID_ITEM_GLOBAL:
+                switch (tag) {
+                    case HID_GLOBAL_USAGE_PAGE:
+                        usage_page = data;
+                        break;
+                    case HID_GLOBAL_LOGICAL_MAX:
+                        logical_max = data;
+                        break;
+                    case HID_GLOBAL_PHYSICAL_MAX:
+                        physical_max = data;
+                        break;
+                    case HID_GLOBAL_UNIT_EXP:
+                        unit_exp = (data & 0x8) ? static_cast<SInt8>(data | 0xF0) : static_cast<SInt8>(data);
+                        break;
+                    case HID_GLOBAL_UNIT:
+                        unit = data;
+                        break;
+                    case HID_GLOBAL_REPORT_SIZE:
+                        report_size = data;
+                        break;
+                    case HID_GLOBAL_REPORT_ID:
+                        report_id = data;
+                        break;
+                    case HID_GLOBAL_REPORT_COUNT:
+                        report_count = data;
+                        break;
+                    case HID_GLOBAL_PUSH:
+                        // not used by the touchpads we know, do not guess
+                        return kIOReturnUnsupported;
+                    default:
+                        break;
+                }
+                break;
+            case HID_ITEM_LOCAL:
+                if (tag == HID_LOCAL_USAGE && usage_cnt < 8)
+                    usages[usage_cnt++] = size == 4 ? data : (usage_page << 16) | data;
+                else if (tag == HID_LOCAL_USAGE_MIN)
+                    usage_min = size == 4 ? data : (usage_page << 16) | data;
+                else if (tag == HID_LOCAL_USAGE_MAX) {
+                    UInt32 usage_max = size == 4 ? data : (usage_page << 16) | data;
+                    for (UInt32 u = usage_min; u <= usage_max && usage_cnt < 8; u++)
+                        usages[usage_cnt++] = u;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if (!geo.contacts || !geo.report_id || !geo.logical_max_x || !geo.logical_max_y)
+        return kIOReturnUnsupported;
+    
+    geo.report_size = report_bits[geo.report_id] / 8 + 1;
+    geo.contact_size = finger_bits / 8;
+    geometry = geo;
+    return kIOReturnSuccess;
+}
+
+void SurfaceTouchpadDriver::reportReceived(SurfaceHIDNub *sender, SurfaceHIDDeviceType device, UInt8 *buffer, UInt16 len) {
+    if (decoder && voodoo_input)
+        (this->*decoder)(buffer, len);
+}
+
+template <typename Report>
+void SurfaceTouchpadDriver::decodeReport(UInt8 *buffer, UInt16 len) {
+    if (len != sizeof(Report) || buffer[0] != geometry.report_id)
+        return;
+    const Report *report = reinterpret_cast<const Report *>(buffer);
+    
+    // A frame starts with a report carrying the contact count, or with any report once the last one is complete
+    if (report->contact_count || frame_collected >= frame_expected) {
+        frame_expected = report->contact_count < VOODOO_INPUT_MAX_TRANSDUCERS ? report->contact_count : VOODOO_INPUT_MAX_TRANSDUCERS;
+        frame_collected = 0;
+        button_down = report->buttons & PTP_BUTTON_PRIMARY;
+        clock_get_uptime(&event.timestamp);
+    }
+    
+    for (int i = 0; i < Report::kContacts && frame_collected < frame_expected; i++) {
+        const SurfacePTPContact &contact = report->contacts[i];
+        VoodooInputTransducer &transducer = event.transducers[frame_collected++];
+        TouchCoordinates &last = last_coords[contact.contact_id % TOUCHPAD_CONTACT_ID_MAX];
+        
+        transducer.timestamp = event.timestamp;
+        transducer.type = FINGER;
+        transducer.secondaryId = contact.contact_id;
+        transducer.fingerType = kMT2FingerTypeUndefined;
+        transducer.isValid = contact.flags & PTP_CONTACT_CONFIDENCE;
+        transducer.isTransducerActive = contact.flags & PTP_CONTACT_TIP;
+        transducer.isPhysicalButtonDown = button_down;
+        transducer.supportsPressure = false;
+        transducer.previousCoordinates = transducer.isTransducerActive ? last : transducer.currentCoordinates;
+        transducer.currentCoordinates.x = contact.x;
+        transducer.currentCoordinates.y = contact.y;
+        transducer.currentCoordinates.pressure = 0;
+        transducer.currentCoordinates.width = 0;
+        last = transducer.currentCoordinates;
+    }
+    
+    if (frame_collected == frame_expected)
+        sendFrame();
+}
+
+void SurfaceTouchpadDriver::sendFrame() {
+    event.contact_count = frame_collected;
+    if (voodoo_input)
+        super::messageClient(kIOMessageVoodooInputMessage, voodoo_input, &event, sizeof(VoodooInputEvent));
+}
+
+void SurfaceTouchpadDriver::liftAll() {
+    nub->runTouchpadAction(this, OSMemberFunctionCast(IOWorkLoop::Action, this, &SurfaceTouchpadDriver::liftAllGated));
+}
+
+IOReturn SurfaceTouchpadDriver::liftAllGated() {
+    for (int i = 0; i < frame_collected; i++) {
+        event.transducers[i].isTransducerActive = false;
+        event.transducers[i].isPhysicalButtonDown = false;
+    }
+    clock_get_uptime(&event.timestamp);
+    if (frame_collected)
+        sendFrame();
+    frame_expected = frame_collected = 0;
+    button_down = false;
+    return kIOReturnSuccess;
+}
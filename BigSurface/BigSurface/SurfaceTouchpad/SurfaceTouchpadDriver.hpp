@@ -0,0 +1,104 @@
+//
+//  SurfaceTouchpadDriver.hpp
+//  SurfaceTouchpad
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef SurfaceTouchpadDriver_hpp
+#define SurfaceTouchpadDriver_hpp
+
+#include "../../../Dependencies/VoodooInput/VoodooInput/VoodooInputMultitouch/VoodooInputMessages.h"
+#include "../SurfaceSerialHubDevices/SurfaceHIDNub.hpp"
+#include "TouchpadReport.hpp"
+
+#define TOUCHPAD_CONTACT_ID_MAX     16
+
+/*
+ * Decodes the touchpad reports of SurfaceHIDNub into VoodooInput events directly,
+ * bypassing the generic HID path of the touchpad when its report layout is known
+ */
+class EXPORT SurfaceTouchpadDriver : public IOService {
+    OSDeclareDefaultStructors(SurfaceTouchpadDriver);
+    
+    typedef void (SurfaceTouchpadDriver::*Decoder)(UInt8 *buffer, UInt16 len);
+    
+public:
+    IOService* probe(IOService* provider, SInt32* score) override;
+    
+    bool start(IOService* provider) override;
+    
+    void stop(IOService* provider) override;
+    
+    bool handleOpen(IOService *forClient, IOOptionBits options, void *arg) override;
+    
+    void handleClose(IOService *forClient, IOOptionBits options) override;
+    
+    IOReturn message(UInt32 type, IOService *provider, void *argument) override;
+    
+    IOReturn setPowerState(unsigned long whichState, IOService *whatDevice) override;
+    
+private:
+    SurfaceHIDNub*  nub {nullptr};
+    IOService*      voodoo_input {nullptr};
+    Decoder         decoder {nullptr};
+    bool            registered {false};
+    
+    SurfaceTouchpadGeometry geometry {};
+    
+    /* Frame being assembled, a frame spans several reports in hybrid mode */
+    VoodooInputEvent    event {};
+    UInt8               frame_expected {0};
+    UInt8               frame_collected {0};
+    bool                button_down {false};
+    TouchCoordinates    last_coords[TOUCHPAD_CONTACT_ID_MAX] {};
+    
+    IOReturn parseReportDescriptor(UInt8 *desc, UInt16 len);
+    
+    /*
+     * geometry and decoder belong to the report loop, switch them there
+     */
+    IOReturn selectLayout();
+    
+    IOReturn selectLayoutGated();
+    
+    static bool hasField(const SurfaceTouchpadField *fields, UInt8 cnt, UInt32 usage, UInt16 offset, UInt16 size);
+    
+    /*
+     * Every usage the decoder reads has to sit exactly where the compiled report puts it
+     */
+    template <typename Report>
+    bool layoutMatches() {
+        const SurfaceTouchpadField *contact = geometry.contact_fields;
+        const SurfaceTouchpadField *report = geometry.report_fields;
+        UInt8 contact_cnt = geometry.contact_field_cnt, report_cnt = geometry.report_field_cnt;
+        UInt16 flags = offsetof(SurfacePTPContact, flags) * 8;
+        return geometry.report_size == sizeof(Report)
+            && geometry.contacts == Report::kContacts
+            && geometry.contact_size == sizeof(SurfacePTPContact)
+            && geometry.contacts_uniform
+            && geometry.contact_offset == offsetof(Report, contacts) * 8
+            && hasField(contact, contact_cnt, HID_USAGE_CONFIDENCE, flags + 0, 1)    // PTP_CONTACT_CONFIDENCE
+            && hasField(contact, contact_cnt, HID_USAGE_TIP, flags + 1, 1)           // PTP_CONTACT_TIP
+            && hasField(contact, contact_cnt, HID_USAGE_CONTACT_ID, offsetof(SurfacePTPContact, contact_id) * 8, 8)
+            && hasField(contact, contact_cnt, HID_USAGE_X, offsetof(SurfacePTPContact, x) * 8, 16)
+            && hasField(contact, contact_cnt, HID_USAGE_Y, offsetof(SurfacePTPContact, y) * 8, 16)
+            && hasField(report, report_cnt, HID_USAGE_SCAN_TIME, offsetof(Report, scan_time) * 8, 16)
+            && hasField(report, report_cnt, HID_USAGE_CONTACT_COUNT, offsetof(Report, contact_count) * 8, 8)
+            && hasField(report, report_cnt, HID_USAGE_BUTTON_1, offsetof(Report, buttons) * 8, 1);  // PTP_BUTTON_PRIMARY
+    }
+    
+    template <typename Report>
+    void decodeReport(UInt8 *buffer, UInt16 len);
+    
+    void reportReceived(SurfaceHIDNub *sender, SurfaceHIDDeviceType device, UInt8 *buffer, UInt16 len);
+    
+    void sendFrame();
+    
+    void liftAll();
+    
+    IOReturn liftAllGated();
+};
+
+#endif /* SurfaceTouchpadDriver_hpp */
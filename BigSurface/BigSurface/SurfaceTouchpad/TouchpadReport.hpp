@@ -0,0 +1,86 @@
+//
+//  TouchpadReport.hpp
+//  SurfaceTouchpad
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef TouchpadReport_hpp
+#define TouchpadReport_hpp
+
+#include <IOKit/IOLib.h>
+
+/*
+ * Precision touchpad input report layouts decoded without the generic HID parser.
+ * A layout is only used if the report descriptor of the touchpad describes exactly the same report,
+ * support for another layout is one more typedef here and one more candidate in selectLayout().
+ */
+
+#define PTP_CONTACT_CONFIDENCE  BIT(0)
+#define PTP_CONTACT_TIP         BIT(1)
+#define PTP_BUTTON_PRIMARY      BIT(0)
+
+#define HID_USAGE_X             0x00010030
+#define HID_USAGE_Y             0x00010031
+#define HID_USAGE_BUTTON_1      0x00090001
+#define HID_USAGE_FINGER        0x000D0022
+#define HID_USAGE_TIP           0x000D0042
+#define HID_USAGE_CONFIDENCE    0x000D0047
+#define HID_USAGE_CONTACT_ID    0x000D0051
+#define HID_USAGE_CONTACT_COUNT 0x000D0054
+#define HID_USAGE_SCAN_TIME     0x000D0056
+
+struct PACKED SurfacePTPContact {
+    UInt8   flags;
+    UInt8   contact_id;
+    UInt16  x;
+    UInt16  y;
+};
+
+template <int N>
+struct PACKED SurfacePTPReport {
+    static constexpr int kContacts = N;
+    
+    UInt8   report_id;
+    SurfacePTPContact contacts[N];
+    UInt16  scan_time;
+    UInt8   contact_count;      // only set in the first report of a frame in hybrid mode
+    UInt8   buttons;
+};
+
+typedef SurfacePTPReport<5> SurfacePTPReport5;
+
+#define PTP_FIELD_MAX           8
+
+/*
+ * Position of a usage in the report, in bits
+ */
+struct SurfaceTouchpadField {
+    UInt32  usage;
+    UInt16  offset;
+    UInt16  size;
+};
+
+/*
+ * What the report descriptor tells about the multi-touch input report, physical sizes are in 0.01mm
+ */
+struct SurfaceTouchpadGeometry {
+    UInt8   report_id;
+    UInt16  report_size;        // bytes, including the report id
+    UInt8   contacts;           // finger collections in the report
+    UInt16  contact_size;       // bytes of the first finger collection
+    UInt16  contact_offset;     // bits from the start of the report to the first finger collection
+    bool    contacts_uniform;   // every finger collection repeats the first one right after it
+    UInt32  logical_max_x;
+    UInt32  logical_max_y;
+    UInt32  physical_max_x;
+    UInt32  physical_max_y;
+    
+    SurfaceTouchpadField    contact_fields[PTP_FIELD_MAX];  // offsets from the start of the finger collection
+    UInt8                   contact_field_cnt;
+    SurfaceTouchpadField    report_fields[PTP_FIELD_MAX];   // outside of the finger collections, offsets from the report id
+    UInt8                   report_field_cnt;
+};
+
+#endif /* TouchpadReport_hpp */
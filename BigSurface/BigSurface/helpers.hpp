@@ -25,11 +25,29 @@
 #define GENMASK(h, l) (((~0UL) << (l)) & (~0UL >> (64 - 1 - (h))))
 #endif
 
-static IOPMPowerState myIOPMPowerStates[kIOPMNumberPowerStates] = {
+// not every file including this registers a power driver
+static IOPMPowerState myIOPMPowerStates[kIOPMNumberPowerStates] __attribute__((unused)) = {
     {1, kIOPMPowerOff, kIOPMPowerOff, kIOPMPowerOff, 0, 0, 0, 0, 0, 0, 0, 0},
     {1, kIOPMPowerOn, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
 };
 
+struct NumberEntry {
+    const char* key;
+    UInt64      value;
+};
+
+// statistics dictionaries, every entry becomes a 64 bit OSNumber under its key
+template <unsigned int N>
+static inline void setNumberEntries(OSDictionary *dict, const NumberEntry (&entries)[N]) {
+    for (const NumberEntry &entry : entries) {
+        OSNumber *num = OSNumber::withNumber(entry.value, 64);
+        if (num) {
+            dict->setObject(entry.key, num);
+            num->release();
+        }
+    }
+}
+
 #define LOG(str, ...)    IOLog("%s::" str "\n", getName(), ##__VA_ARGS__)
 
 #ifdef DEBUG
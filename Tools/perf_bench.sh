@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+#  perf_bench.sh
+#  Cycle through the SAM performance modes under a fixed CPU load and record
+#  the mode SAM reports back, the SoC temperature and the sustained throughput.
+#
+#  usage: sudo ./perf_bench.sh [seconds per mode] [modes...] > result.csv
+#  needs ioio in PATH, BigSurface loaded with SurfaceThermalDriver running
+#
+
+DURATION=${1:-120}
+shift
+MODES=${@:-1 2 3 4}
+SETTLE=30
+SAMPLE=5
+SENSOR=TC0P
+WORKERS=$(sysctl -n hw.ncpu)
+
+if [ "$(id -u)" != "0" ]; then
+    echo "Please run as root" >&2
+    exit 1
+fi
+if ! command -v ioio >/dev/null; then
+    echo "ioio not found" >&2
+    exit 1
+fi
+
+# $1: class, $2: property
+read_property() {
+    ioreg -rc "$1" -k "$2" -d 1 | sed -n "s/.*\"$2\" = \([0-9]*\).*/\1/p" | head -n 1
+}
+
+# SoC temperature in 0.1 Kelvin
+read_temperature() {
+    ioreg -rc SurfaceThermalDriver -k Temperatures -d 1 | sed -n "s/.*\"$SENSOR\"=\([0-9]*\).*/\1/p" | head -n 1
+}
+
+# each worker hashes 64MB blocks until the deadline and prints how many it finished
+worker() {
+    local n=0
+    while [ "$(date +%s)" -lt "$1" ]; do
+        dd if=/dev/zero bs=1m count=64 2>/dev/null | md5 >/dev/null
+        n=$((n+1))
+    done
+    echo $n
+}
+
+ORIG_POLICY=$(read_property SurfaceBatteryDriver PerformancePolicy)
+ORIG_MODE=$(read_property SurfaceBatteryDriver CurrentPerformanceMode)
+restore() {
+    if [ "$ORIG_POLICY" = "0" ]; then
+        ioio -s SurfaceBatteryDriver PerformanceMode "$ORIG_MODE" >/dev/null
+    else
+        ioio -s SurfaceBatteryDriver PerformancePolicy "$ORIG_POLICY" >/dev/null
+    fi
+    rm -rf "$TMPDIR_BENCH"
+}
+TMPDIR_BENCH=$(mktemp -d)
+trap restore EXIT
+
+echo "mode,actual_mode,seconds,throughput_mb_s,avg_temp_c,max_temp_c"
+for mode in $MODES; do
+    ioio -s SurfaceBatteryDriver PerformanceMode "$mode" >/dev/null
+    sleep $SETTLE
+    actual=$(read_property SurfaceBatteryDriver ActualPerformanceMode)
+    
+    start=$(date +%s)
+    deadline=$((start + DURATION))
+    for i in $(seq 1 "$WORKERS"); do
+        worker $deadline > "$TMPDIR_BENCH/$i" &
+    done
+    
+    sum=0; cnt=0; max=0
+    while [ "$(date +%s)" -lt "$deadline" ]; do
+        sleep $SAMPLE
+        t=$(read_temperature)
+        if [ -n "$t" ] && [ "$t" -gt 0 ]; then
+            sum=$((sum + t)); cnt=$((cnt + 1))
+            [ "$t" -gt "$max" ] && max=$t
+        fi
+    done
+    wait
+    elapsed=$(( $(date +%s) - start ))
+    
+    blocks=0
+    for i in $(seq 1 "$WORKERS"); do
+        blocks=$((blocks + $(cat "$TMPDIR_BENCH/$i")))
+    done
+    avg=0
+    [ $cnt -gt 0 ] && avg=$((sum / cnt))
+    printf "%s,%s,%s,%s,%s,%s\n" "$mode" "$actual" "$elapsed" \
+        "$(echo "scale=1; $blocks * 64 / $elapsed" | bc)" \
+        "$(echo "scale=1; ($avg - 2731) / 10" | bc)" \
+        "$(echo "scale=1; ($max - 2731) / 10" | bc)"
+done
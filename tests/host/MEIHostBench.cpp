@@ -0,0 +1,193 @@
+//
+//  MEIHostBench.cpp
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <cstdio>
+
+#include "MEIHostHarness.hpp"
+
+/*
+ * Everything runs on the virtual clock of the shim and the model answers synchronously,
+ * so the figures are counts of register accesses, interrupts and event source runs and
+ * come out the same on every run and every machine
+ */
+struct MEIBenchSample {
+    unsigned long long accesses;
+    unsigned long long interrupts;
+    unsigned long long event_runs;
+    unsigned long long host_messages;
+    unsigned long long nested_sleeps;
+    unsigned long long time;
+
+    static MEIBenchSample take(MEIHostHarness &harness) {
+        const MEIDeviceModelStats *stats = harness.model()->getStats();
+        return {harness.registerAccesses(), stats->interrupts,
+            IOShimStatistics.event_runs + IOShimStatistics.interrupt_runs + IOShimStatistics.timer_runs,
+            stats->host_messages, IOShimStatistics.nested_sleeps, IOShimNow()};
+    }
+
+    MEIBenchSample operator-(const MEIBenchSample &start) const {
+        return {accesses - start.accesses, interrupts - start.interrupts, event_runs - start.event_runs,
+            host_messages - start.host_messages, nested_sleeps - start.nested_sleeps, time - start.time};
+    }
+};
+
+#define BENCH_MESSAGES  256
+#define BENCH_GAP_NS    10000000ULL     // 100 messages per second, the driver stays in interrupt mode
+
+static void bench_message_cost() {
+    const UInt32 lengths[] = {64, 508, 1024, MEI_MODEL_IPTS_MSG_LENGTH};
+    printf("per message, %d messages each way, one every %llums\n", BENCH_MESSAGES, BENCH_GAP_NS / 1000000);
+    printf("  %-6s %-4s %10s %10s %10s\n", "bytes", "dir", "accesses", "irqs", "events");
+    for (UInt32 len : lengths) {
+        MEIHostHarness harness;
+        if (!harness.start())
+            return;
+        SurfaceManagementEngineClient *ipts = harness.client();
+        MEIHostMessage msg = MEIHostPattern(len, 0);
+
+        MEIBenchSample start = MEIBenchSample::take(harness);
+        for (int i = 0; i < BENCH_MESSAGES; i++) {
+            ipts->sendMessage(msg.data(), msg.size(), false);
+            IOShimAdvance(BENCH_GAP_NS);
+        }
+        MEIBenchSample tx = MEIBenchSample::take(harness) - start;
+
+        start = MEIBenchSample::take(harness);
+        for (int i = 0; i < BENCH_MESSAGES; i++) {
+            harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size());
+            IOShimAdvance(BENCH_GAP_NS);
+        }
+        MEIBenchSample rx = MEIBenchSample::take(harness) - start;
+
+        if (harness.sink->me_rx.size() != BENCH_MESSAGES || harness.sink->host_rx.size() != BENCH_MESSAGES)
+            printf("  %u bytes: lost messages\n", len);
+        printf("  %-6u %-4s %10.1f %10.2f %10.2f\n", len, "tx", double(tx.accesses) / BENCH_MESSAGES,
+               double(tx.interrupts) / BENCH_MESSAGES, double(tx.event_runs) / BENCH_MESSAGES);
+        printf("  %-6u %-4s %10.1f %10.2f %10.2f\n", len, "rx", double(rx.accesses) / BENCH_MESSAGES,
+               double(rx.interrupts) / BENCH_MESSAGES, double(rx.event_runs) / BENCH_MESSAGES);
+    }
+}
+
+/*
+ * ME streams at a fixed rate like touch input does, the driver picks between interrupts and polling
+ */
+static void bench_stream() {
+    const UInt32 rates[] = {100, 250, 1000, 4000};
+    const UInt32 seconds = 2;
+    const UInt32 len = 1024;
+    printf("\nME to host stream, %u bytes for %us\n", len, seconds);
+    printf("  %-6s %10s %10s %10s %10s %10s %8s\n", "msg/s", "accesses", "irqs", "events", "irq wake", "poll wake", "period");
+    for (UInt32 rate : rates) {
+        MEIHostHarness harness;
+        if (!harness.start())
+            return;
+        MEIHostMessage msg = MEIHostPattern(len, 1);
+        UInt32 count = rate * seconds;
+
+        MEIBenchSample start = MEIBenchSample::take(harness);
+        for (UInt32 i = 0; i < count; i++) {
+            harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size());
+            IOShimAdvance(1000000000ULL / rate);
+        }
+        MEIBenchSample run = MEIBenchSample::take(harness) - start;
+        // the last poll and the statistics of the last second
+        IOShimAdvance(MEI_POLL_MAX_US * 1000ULL);
+
+        if (harness.sink->host_rx.size() != count)
+            printf("  %u msg/s: %zu of %u delivered\n", rate, harness.sink->host_rx.size(), count);
+        printf("  %-6u %10.1f %10.2f %10.2f %10llu %10llu %8llu\n", rate, double(run.accesses) / count,
+               double(run.interrupts) / count, double(run.event_runs) / count,
+               static_cast<unsigned long long>(MEIHostStat(harness.driver, "DrainStats", "WakeupsPerSecond", "Interrupt")),
+               static_cast<unsigned long long>(MEIHostStat(harness.driver, "DrainStats", "WakeupsPerSecond", "Polling")),
+               static_cast<unsigned long long>(MEIHostStat(harness.driver, "DrainStats", "PollPeriodUs")));
+    }
+}
+
+static void bench_loopback() {
+    MEIHostHarness harness;
+    if (!harness.start())
+        return;
+    SurfaceManagementEngineClient *ipts = harness.client();
+    harness.sink->echo = true;
+    MEIHostMessage msg = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, 2);
+
+    MEIBenchSample start = MEIBenchSample::take(harness);
+    for (int i = 0; i < BENCH_MESSAGES; i++) {
+        ipts->sendMessage(msg.data(), msg.size(), true);
+        IOShimAdvance(BENCH_GAP_NS);
+    }
+    MEIBenchSample run = MEIBenchSample::take(harness) - start;
+    printf("\nloopback, %u bytes\n", MEI_MODEL_IPTS_MSG_LENGTH);
+    printf("  round trips %zu, %.1f accesses, %.2f irqs, %.2f events each\n", harness.sink->host_rx.size(),
+           double(run.accesses) / BENCH_MESSAGES, double(run.interrupts) / BENCH_MESSAGES, double(run.event_runs) / BENCH_MESSAGES);
+}
+
+static void print_cost(const char *name, const MEIBenchSample &cost) {
+    printf("  %-28s %8llu %8llu %8llu %8llu %8llu %10.3f\n", name, cost.accesses, cost.interrupts, cost.event_runs,
+           cost.host_messages, cost.nested_sleeps, cost.time / 1000000.0);
+}
+
+static void bench_reset_resume() {
+    MEIHostHarness harness;
+    if (!harness.start())
+        return;
+    SurfaceManagementEngineClient *ipts = harness.client();
+    MEIHostMessage msg = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, 3);
+
+    printf("\nreset and resume\n");
+    printf("  %-28s %8s %8s %8s %8s %8s %10s\n", "", "accesses", "irqs", "events", "bus msgs", "nested", "ms");
+
+    MEIBenchSample start = MEIBenchSample::take(harness);
+    harness.model()->requestReset();
+    IOShimRunPending();
+    print_cost("ME reset, idle", MEIBenchSample::take(harness) - start);
+
+    for (int i = 0; i < 4; i++)
+        ipts->sendMessage(msg.data(), msg.size(), false);
+    start = MEIBenchSample::take(harness);
+    harness.model()->requestReset();
+    IOShimRunPending();
+    print_cost("ME reset, 4 sends queued", MEIBenchSample::take(harness) - start);
+
+    start = MEIBenchSample::take(harness);
+    harness.driver->setPowerState(0, harness.driver);
+    IOShimRunPending();
+    print_cost("sleep", MEIBenchSample::take(harness) - start);
+    start = MEIBenchSample::take(harness);
+    harness.driver->setPowerState(1, harness.driver);
+    IOShimRunPending();
+    print_cost("wake", MEIBenchSample::take(harness) - start);
+
+    // idle until ME is gated, in 1ms steps so that the delay is measured to the millisecond
+    UInt64 entries = harness.model()->getStats()->pg_entries;
+    start = MEIBenchSample::take(harness);
+    while (harness.model()->getStats()->pg_entries == entries && IOShimNow() - start.time < 60000000000ULL)
+        IOShimAdvance(1000000);
+    print_cost("idle until gated", MEIBenchSample::take(harness) - start);
+
+    start = MEIBenchSample::take(harness);
+    ipts->sendMessage(msg.data(), msg.size(), true);
+    IOShimRunPending();
+    print_cost("host resume and send", MEIBenchSample::take(harness) - start);
+
+    entries = harness.model()->getStats()->pg_entries;
+    while (harness.model()->getStats()->pg_entries == entries)
+        IOShimAdvance(1000000);
+    start = MEIBenchSample::take(harness);
+    harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size());
+    IOShimRunPending();
+    print_cost("ME resume and receive", MEIBenchSample::take(harness) - start);
+}
+
+int main() {
+    bench_message_cost();
+    bench_stream();
+    bench_loopback();
+    bench_reset_resume();
+    return 0;
+}
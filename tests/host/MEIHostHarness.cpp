@@ -0,0 +1,110 @@
+//
+//  MEIHostHarness.cpp
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "MEIHostHarness.hpp"
+
+void MEIHostSink::hostHandler(OSObject *owner, SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len) {
+    MEIHostSink *that = static_cast<MEIHostSink *>(owner);
+    that->host_rx.emplace_back(msg, msg + msg_len);
+}
+
+bool MEIHostSink::ownerHandler(OSObject *owner, SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len) {
+    MEIHostSink *that = static_cast<MEIHostSink *>(owner);
+    that->host_rx.emplace_back(msg, msg + msg_len);
+    that->held.push_back(msg);
+    return true;
+}
+
+void MEIHostSink::meHandler(void *owner, MEIDeviceModel *model, UInt8 me_addr, const UInt8 *msg, UInt32 msg_len) {
+    MEIHostSink *that = static_cast<MEIHostSink *>(owner);
+    that->me_rx.emplace_back(msg, msg + msg_len);
+    if (that->echo)
+        model->sendClientMessage(me_addr, msg, msg_len);
+}
+
+MEIHostHarness::~MEIHostHarness() {
+    stop();
+}
+
+bool MEIHostHarness::start() {
+    SInt32 score = 0;
+    pci = new IOPCIDevice;
+    driver = OSTypeAlloc(SurfaceManagementEngineDriver);
+    if (!pci->init() || !driver->init(nullptr) || !driver->probe(pci, &score) || !driver->attach(pci))
+        return false;
+    // the driver releases the provider when start fails
+    pci->retain();
+    if (!driver->start(pci)) {
+        OSSafeReleaseNULL(driver);
+        return false;
+    }
+    pci->release();
+    // enumeration finishes on the work loop and publishes the clients from there
+    IOShimRunPending();
+
+    SurfaceManagementEngineClient *ipts = client();
+    if (!ipts)
+        return false;
+    sink = new MEIHostSink;
+    return ipts->registerMessageHandler(sink, &MEIHostSink::hostHandler) == kIOReturnSuccess &&
+        model()->setClientHandler(MEI_MODEL_IPTS_ADDR, &MEIHostSink::meHandler, sink);
+}
+
+void MEIHostHarness::stop() {
+    if (driver) {
+        SurfaceManagementEngineClient *ipts = client();
+        if (ipts)
+            ipts->unregisterMessageHandler(sink);
+        driver->stop(pci);
+        driver->detach(pci);
+        OSSafeReleaseNULL(driver);
+    }
+    OSSafeReleaseNULL(pci);
+    OSSafeReleaseNULL(sink);
+}
+
+SurfaceManagementEngineClient *MEIHostHarness::client(UInt32 me_addr) {
+    for (unsigned int i = 0; i < IOShimRegisteredCount(); i++) {
+        SurfaceManagementEngineClient *client = OSDynamicCast(SurfaceManagementEngineClient, IOShimRegisteredService(i));
+        if (!client)
+            continue;
+        OSNumber *addr = OSDynamicCast(OSNumber, client->getProperty("MEIClientAddress"));
+        if (addr && addr->unsigned32BitValue() == me_addr)
+            return client;
+    }
+    return nullptr;
+}
+
+unsigned int MEIHostHarness::clientCount() {
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < IOShimRegisteredCount(); i++) {
+        if (OSDynamicCast(SurfaceManagementEngineClient, IOShimRegisteredService(i)))
+            count++;
+    }
+    return count;
+}
+
+UInt64 MEIHostHarness::registerAccesses() {
+    const MEIDeviceModelStats *stats = model()->getStats();
+    return stats->register_reads + stats->register_writes;
+}
+
+MEIHostMessage MEIHostPattern(UInt32 len, UInt8 seed) {
+    MEIHostMessage msg(len);
+    for (UInt32 i = 0; i < len; i++)
+        msg[i] = static_cast<UInt8>(seed + i * 7 + (i >> 8));
+    return msg;
+}
+
+UInt64 MEIHostStat(IORegistryEntry *entry, const char *property, const char *key, const char *sub) {
+    OSDictionary *stats = OSDynamicCast(OSDictionary, entry->getProperty(property));
+    if (stats && sub)
+        stats = OSDynamicCast(OSDictionary, stats->getObject(sub));
+    OSNumber *num = stats ? OSDynamicCast(OSNumber, stats->getObject(key)) : nullptr;
+    return num ? num->unsigned64BitValue() : 0;
+}
@@ -0,0 +1,64 @@
+//
+//  MEIHostHarness.hpp
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef MEIHostHarness_hpp
+#define MEIHostHarness_hpp
+
+#include <vector>
+
+#include "SurfaceManagementEngineClient.hpp"
+
+typedef std::vector<UInt8> MEIHostMessage;
+
+/*
+ * Collects what reaches either end, messages for the IPTS client on the host and messages ME got from the host
+ */
+class MEIHostSink : public OSObject {
+public:
+    std::vector<MEIHostMessage> host_rx;
+    std::vector<MEIHostMessage> me_rx;
+    std::vector<UInt8 *> held;     // buffers ownerHandler kept
+    bool echo {false};  // ME sends every message back
+
+    static void hostHandler(OSObject *owner, SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len);
+    static bool ownerHandler(OSObject *owner, SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len);
+    static void meHandler(void *owner, MEIDeviceModel *model, UInt8 me_addr, const UInt8 *msg, UInt32 msg_len);
+};
+
+/*
+ * SurfaceManagementEngineDriver on an IOPCIDevice with the model standing in for the hardware
+ */
+class MEIHostHarness {
+public:
+    IOPCIDevice*                    pci {nullptr};
+    SurfaceManagementEngineDriver*  driver {nullptr};
+    MEIHostSink*                    sink {nullptr};
+
+    ~MEIHostHarness();
+
+    // starts the driver and its IPTS client, with the sink on both ends
+    bool start();
+
+    void stop();
+
+    MEIDeviceModel *model() { return driver->getDeviceModel(); }
+
+    SurfaceManagementEngineClient *client(UInt32 me_addr = MEI_MODEL_IPTS_ADDR);
+
+    unsigned int clientCount();
+
+    // sum of register reads and writes
+    UInt64 registerAccesses();
+};
+
+MEIHostMessage MEIHostPattern(UInt32 len, UInt8 seed);
+
+// number in a statistics dictionary the driver publishes, sub picks a nested dictionary, 0 when missing
+UInt64 MEIHostStat(IORegistryEntry *entry, const char *property, const char *key, const char *sub = nullptr);
+
+#endif /* MEIHostHarness_hpp */
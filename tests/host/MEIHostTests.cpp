@@ -0,0 +1,655 @@
+//
+//  MEIHostTests.cpp
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <cstdio>
+
+#include "MEIHostHarness.hpp"
+#include "SurfaceManagementEngineUserClient.hpp"
+#include "MEIUserRing.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("    %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+        return; \
+    } \
+} while (0)
+
+#define DUMMY_CLIENT_ADDR   3
+#define DYNAMIC_CLIENT_ADDR 7
+#define DYNAMIC_HOST_ADDR   1
+
+/*
+ * Host side written against the raw registers, for the parts of the protocol the driver does not use
+ * since its only client has a fixed address: connection and flow control of dynamic clients
+ */
+class MEIModelHost {
+public:
+    MEIDeviceModel model;
+    std::vector<MEIHostMessage> received;
+
+    // reset handshake and host start
+    bool start() {
+        model.setInterruptHandler(this, [](void *) {});
+        model.writeRegister(MEI_H_CSR_INT_ENABLE_MASK | MEI_H_CSR_RESET | MEI_H_CSR_INT_GEN, MEI_H_CSR);
+        if (!(model.readRegister(MEI_ME_CSR) & MEI_ME_CSR_READY))
+            return false;
+        model.writeRegister(MEI_H_CSR_INT_ENABLE_MASK | MEI_H_CSR_READY | MEI_H_CSR_INT_STA_MASK, MEI_H_CSR);
+        MEIBusHostVersionRequest req {MEI_HOST_START_REQ_CMD, 0, MEI_MODEL_HBM_MAJOR_VERSION, MEI_MODEL_HBM_MINOR_VERSION};
+        send(&req, sizeof(req), 0, 0);
+        MEIHostMessage res = receive();
+        return res.size() == sizeof(MEIBusHostVersionResponse) && res[0] == MEI_HOST_START_RES_CMD && res[1];
+    }
+
+    void send(const void *msg, UInt16 len, UInt8 me_addr, UInt8 host_addr) {
+        MEIBusMessageHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.me_addr = me_addr;
+        hdr.host_addr = host_addr;
+        hdr.length = len;
+        hdr.msg_complete = 1;
+        MEI_SLOT_TYPE slot;
+        memcpy(&slot, &hdr, sizeof(slot));
+        model.writeRegister(slot, MEI_H_CB_WW);
+        for (UInt16 pos = 0; pos < len; pos += MEI_SLOT_SIZE) {
+            slot = 0;
+            UInt16 left = len - pos;
+            memcpy(&slot, static_cast<const UInt8 *>(msg) + pos, left < MEI_SLOT_SIZE ? left : MEI_SLOT_SIZE);
+            model.writeRegister(slot, MEI_H_CB_WW);
+        }
+        model.writeRegister((model.readRegister(MEI_H_CSR) & ~MEI_H_CSR_INT_STA_MASK) | MEI_H_CSR_INT_GEN, MEI_H_CSR);
+    }
+
+    // one message from the ME buffer, empty when there is none
+    MEIHostMessage receive(MEIBusMessageHeader *hdr_out = nullptr) {
+        UInt32 me_csr = model.readRegister(MEI_ME_CSR);
+        UInt8 filled = static_cast<UInt8>((me_csr >> 16) - (me_csr >> 8));
+        if (!filled)
+            return MEIHostMessage();
+        MEI_SLOT_TYPE slot = model.readRegister(MEI_ME_CB_RW);
+        MEIBusMessageHeader hdr;
+        memcpy(&hdr, &slot, sizeof(hdr));
+        MEIHostMessage msg(hdr.length);
+        for (UInt32 pos = 0; pos < hdr.length; pos += MEI_SLOT_SIZE) {
+            slot = model.readRegister(MEI_ME_CB_RW);
+            memcpy(msg.data() + pos, &slot, hdr.length - pos < MEI_SLOT_SIZE ? hdr.length - pos : MEI_SLOT_SIZE);
+        }
+        model.writeRegister((model.readRegister(MEI_H_CSR) & ~MEI_H_CSR_INT_STA_MASK) | MEI_H_CSR_INT_GEN, MEI_H_CSR);
+        if (hdr_out)
+            *hdr_out = hdr;
+        return msg;
+    }
+
+    MEIHostMessage connect(UInt8 me_addr, bool connect = true) {
+        MEIBusClientCommand req {static_cast<UInt8>(connect ? MEI_CLIENT_CONNECT_REQ_CMD : MEI_CLIENT_DISCONNECT_REQ_CMD), me_addr, DYNAMIC_HOST_ADDR, 0};
+        send(&req, sizeof(req), 0, 0);
+        return receive();
+    }
+
+    void flowControl(UInt8 me_addr) {
+        MEIBusFlowControl fc;
+        memset(&fc, 0, sizeof(fc));
+        fc.cmd = MEI_FLOW_CONTROL_CMD;
+        fc.me_addr = me_addr;
+        fc.host_addr = DYNAMIC_HOST_ADDR;
+        send(&fc, sizeof(fc), 0, 0);
+    }
+
+    void addDynamicClient(MEIModelClientHandler handler, void *owner) {
+        MEIClientProperty props;
+        memset(&props, 0, sizeof(props));
+        memset(props.uuid, 0x22, sizeof(props.uuid));
+        props.max_msg_length = 256;
+        model.addClient(DYNAMIC_CLIENT_ADDR, &props, handler, owner);
+    }
+};
+
+static void test_handshake() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    // start, capabilities, DMA ring setup, enumeration and the properties of the one client
+    CHECK(harness.model()->getStats()->host_messages == 5);
+    CHECK(harness.model()->getStats()->resets == 1);
+    CHECK(harness.model()->getStats()->unknown_messages == 0);
+    CHECK(harness.driver->getProperty("DMARing") == kOSBooleanFalse);
+    CHECK(harness.pci->memory_enabled && harness.pci->bus_master);
+    CHECK(harness.clientCount() == 1);
+    OSNumber *max_len = OSDynamicCast(OSNumber, harness.client()->getProperty("MEIClientMaxMessageLength"));
+    CHECK(max_len && max_len->unsigned32BitValue() == MEI_MODEL_IPTS_MSG_LENGTH);
+}
+
+static void test_enumeration() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+
+    // clients the driver has no use for are skipped, ME only shows them after a reset
+    MEIClientProperty props;
+    memset(&props, 0, sizeof(props));
+    memset(props.uuid, 0x11, sizeof(props.uuid));
+    props.fixed_address = DUMMY_CLIENT_ADDR;
+    props.max_msg_length = 64;
+    CHECK(harness.model()->addClient(DUMMY_CLIENT_ADDR, &props, nullptr, nullptr));
+    UInt64 host_messages = harness.model()->getStats()->host_messages;
+    harness.model()->requestReset();
+    IOShimRunPending();
+
+    CHECK(harness.model()->getStats()->host_messages == host_messages + 6);
+    CHECK(harness.clientCount() == 1);
+    CHECK(harness.client() == ipts);
+    CHECK(!harness.client(DUMMY_CLIENT_ADDR));
+
+    MEIHostMessage msg = MEIHostPattern(100, 1);
+    CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+    CHECK(harness.sink->me_rx.size() == 1 && harness.sink->me_rx[0] == msg);
+}
+
+static void test_connect() {
+    MEIModelHost host;
+    host.addDynamicClient(nullptr, nullptr);
+    CHECK(host.start());
+
+    MEIHostMessage res = host.connect(DYNAMIC_CLIENT_ADDR);
+    CHECK(res.size() == sizeof(MEIBusClientConnectionResponse));
+    CHECK(res[0] == MEI_CLIENT_CONNECT_RES_CMD && res[3] == MEIClientConnectionSuccess);
+    // ME grants the first credit right away
+    MEIHostMessage fc = host.receive();
+    CHECK(fc.size() == sizeof(MEIBusFlowControl) && fc[0] == MEI_FLOW_CONTROL_CMD && fc[1] == DYNAMIC_CLIENT_ADDR);
+
+    res = host.connect(DYNAMIC_CLIENT_ADDR);
+    CHECK(res.size() == sizeof(MEIBusClientConnectionResponse) && res[3] == MEIClientConnectionAlreadyStarted);
+    res = host.connect(DYNAMIC_CLIENT_ADDR + 1);
+    CHECK(res.size() == sizeof(MEIBusClientConnectionResponse) && res[3] == MEIClientConnectionNotFound);
+    CHECK(host.receive().empty());
+
+    host.flowControl(DYNAMIC_CLIENT_ADDR);
+    res = host.connect(DYNAMIC_CLIENT_ADDR, false);
+    CHECK(res.size() == sizeof(MEIBusClientConnectionResponse));
+    CHECK(res[0] == MEI_CLIENT_DISCONNECT_RES_CMD && res[3] == MEIClientConnectionSuccess);
+    // the credit went with the connection
+    UInt8 data[4] = {1, 2, 3, 4};
+    CHECK(!host.model.sendClientMessage(DYNAMIC_CLIENT_ADDR, data, sizeof(data)));
+}
+
+static void test_flow_control_dynamic() {
+    MEIHostSink *sink = new MEIHostSink;
+    MEIModelHost host;
+    host.addDynamicClient(&MEIHostSink::meHandler, sink);
+    CHECK(host.start());
+    host.connect(DYNAMIC_CLIENT_ADDR);
+    host.receive();
+
+    UInt8 data[16] = {};
+    CHECK(!host.model.sendClientMessage(DYNAMIC_CLIENT_ADDR, data, sizeof(data)));
+    host.flowControl(DYNAMIC_CLIENT_ADDR);
+    CHECK(host.model.sendClientMessage(DYNAMIC_CLIENT_ADDR, data, sizeof(data)));
+    CHECK(!host.model.sendClientMessage(DYNAMIC_CLIENT_ADDR, data, sizeof(data)));
+    MEIBusMessageHeader hdr;
+    MEIHostMessage msg = host.receive(&hdr);
+    CHECK(msg.size() == sizeof(data) && hdr.me_addr == DYNAMIC_CLIENT_ADDR && hdr.host_addr == DYNAMIC_HOST_ADDR);
+
+    // every message the host sends costs it the credit ME hands back once the message is consumed
+    MEIHostMessage out = MEIHostPattern(200, 3);
+    host.send(out.data(), out.size(), DYNAMIC_CLIENT_ADDR, DYNAMIC_HOST_ADDR);
+    CHECK(sink->me_rx.size() == 1 && sink->me_rx[0] == out);
+    MEIHostMessage fc = host.receive();
+    CHECK(fc.size() == sizeof(MEIBusFlowControl) && fc[0] == MEI_FLOW_CONTROL_CMD && fc[1] == DYNAMIC_CLIENT_ADDR);
+    sink->release();
+}
+
+static void test_flow_control_driver() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+
+    // more than the host buffer and the transaction pool hold, queued without letting the work loop run
+    std::vector<MEIHostMessage> sent;
+    for (UInt8 i = 0; i < 24; i++) {
+        sent.push_back(MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, i));
+        CHECK(ipts->sendMessage(sent.back().data(), sent.back().size(), false) == kIOReturnSuccess);
+    }
+    IOShimRunPending();
+    CHECK(harness.sink->me_rx == sent);
+
+    // a blocking send is on the wire when it returns
+    MEIHostMessage msg = MEIHostPattern(1000, 9);
+    CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+    CHECK(harness.sink->me_rx.size() == sent.size() + 1 && harness.sink->me_rx.back() == msg);
+
+    // ME to host, as many as the client has receive buffers and the model backlog holds, before the host gets to read any
+    std::vector<MEIHostMessage> queued;
+    for (UInt8 i = 0; i < MEI_CLIENT_RX_POOL_SIZE; i++) {
+        queued.push_back(MEIHostPattern(900, 100 + i));
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, queued.back().data(), queued.back().size()));
+    }
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx == queued);
+    CHECK(harness.model()->getStats()->overruns == 0 && harness.model()->getStats()->dropped == 0);
+}
+
+static void test_message_handlers() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    MEIHostMessage msg = MEIHostPattern(300, 6);
+
+    // a plain handler never holds on to the pool, however many messages come in
+    for (int i = 0; i < 4 * MEI_CLIENT_RX_POOL_SIZE; i++) {
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+        IOShimAdvance(10000000);
+    }
+    CHECK(harness.sink->host_rx.size() == 4 * MEI_CLIENT_RX_POOL_SIZE);
+
+    // an owning handler keeps buffers until it returns them, messages are dropped while it holds all of them
+    ipts->unregisterMessageHandler(harness.sink);
+    CHECK(ipts->registerOwningMessageHandler(harness.sink, &MEIHostSink::ownerHandler) == kIOReturnSuccess);
+    CHECK(ipts->registerMessageHandler(harness.sink, &MEIHostSink::hostHandler) == kIOReturnNoResources);
+    harness.sink->host_rx.clear();
+    for (int i = 0; i < MEI_CLIENT_RX_POOL_SIZE + 4; i++) {
+        harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size());
+        IOShimAdvance(10000000);
+    }
+    CHECK(harness.sink->host_rx.size() == MEI_CLIENT_RX_POOL_SIZE);
+    for (UInt8 *held : harness.sink->held)
+        ipts->returnMessage(held);
+    harness.sink->held.clear();
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == MEI_CLIENT_RX_POOL_SIZE + 1 && harness.sink->host_rx.back() == msg);
+    for (UInt8 *held : harness.sink->held)
+        ipts->returnMessage(held);
+}
+
+static void test_rx_queue_counters() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    MEIHostMessage msg = MEIHostPattern(64, 8);
+    UInt32 accounted = 0;
+
+    // what ME buffered before the host drained comes out in one go and queues up for the client work loop
+    for (int i = 0; i < 6; i++)
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 6);
+    accounted += 6;
+
+    // an owning handler holding the whole pool makes the driver drop
+    ipts->unregisterMessageHandler(harness.sink);
+    CHECK(ipts->registerOwningMessageHandler(harness.sink, &MEIHostSink::ownerHandler) == kIOReturnSuccess);
+    for (int i = 0; i < MEI_CLIENT_RX_POOL_SIZE + 4; i++) {
+        harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size());
+        IOShimAdvance(10000000);
+    }
+    accounted += MEI_CLIENT_RX_POOL_SIZE;
+    for (UInt8 *held : harness.sink->held)
+        ipts->returnMessage(held);
+    harness.sink->held.clear();
+    ipts->unregisterMessageHandler(harness.sink);
+    CHECK(ipts->registerMessageHandler(harness.sink, &MEIHostSink::hostHandler) == kIOReturnSuccess);
+
+    // the counters go out with the statistics, every MEI_CLIENT_STATS_INTERVAL messages
+    for (; accounted < MEI_CLIENT_STATS_INTERVAL; accounted++) {
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+        IOShimAdvance(10000000);
+    }
+    CHECK(MEIHostStat(ipts, "RxStats", "Messages", "FIFO") == MEI_CLIENT_STATS_INTERVAL);
+    CHECK(MEIHostStat(ipts, "RxStats", "QueueDropped") == 4);
+    CHECK(MEIHostStat(ipts, "RxStats", "QueueHighWater") >= 6);
+    CHECK(MEIHostStat(ipts, "RxStats", "QueueHighWater") <= MEI_CLIENT_RX_POOL_SIZE);
+}
+
+static void test_fragmentation() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+
+    // around the 508 byte fragment both sides use, and the largest message
+    const UInt32 lengths[] = {1, 4, 5, 507, 508, 509, 1016, 1017, MEI_MODEL_IPTS_MSG_LENGTH};
+    for (UInt32 len : lengths) {
+        MEIHostMessage msg = MEIHostPattern(len, static_cast<UInt8>(len));
+        harness.sink->me_rx.clear();
+        harness.sink->host_rx.clear();
+
+        CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+        IOShimRunPending();
+        CHECK(harness.sink->me_rx.size() == 1 && harness.sink->me_rx[0] == msg);
+
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+        IOShimRunPending();
+        CHECK(harness.sink->host_rx.size() == 1 && harness.sink->host_rx[0] == msg);
+    }
+    CHECK(harness.model()->getStats()->unknown_messages == 0);
+
+    // ME refuses what does not fit the client
+    MEIHostMessage big = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH + 1, 0);
+    CHECK(ipts->sendMessage(big.data(), big.size(), true) != kIOReturnSuccess);
+}
+
+static void test_dma_ring() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    // granted from the next handshake on
+    harness.model()->allowDMARing(true);
+    harness.model()->requestReset();
+    IOShimRunPending();
+    CHECK(harness.driver->getProperty("DMARing") == kOSBooleanTrue);
+
+    // 1000 slots each, the 33rd message wraps around the end of the ring
+    const UInt32 count = MEI_DMA_RING_DEVICE_SIZE / 4000 + 8;
+    for (UInt32 i = 0; i < count; i++) {
+        MEIHostMessage msg = MEIHostPattern(4000, static_cast<UInt8>(i));
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+        IOShimAdvance(10000000);
+        CHECK(harness.sink->host_rx.size() == i + 1 && harness.sink->host_rx.back() == msg);
+    }
+    CHECK(harness.model()->getStats()->dma_ring_tx == count);
+
+    // what fits a fragment stays in the circular buffer
+    MEIHostMessage small = MEIHostPattern(100, 1);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, small.data(), small.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == count + 1 && harness.sink->host_rx.back() == small);
+    CHECK(harness.model()->getStats()->dma_ring_tx == count);
+    CHECK(harness.model()->getStats()->unknown_messages == 0);
+}
+
+static void test_client_dma() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    // ME refuses until it can reach host memory
+    CHECK(ipts->mapDMABuffer(1, MEI_MODEL_IPTS_MSG_LENGTH) != kIOReturnSuccess);
+
+    // offered from the next handshake on
+    harness.model()->allowClientDMA(true);
+    harness.model()->requestReset();
+    IOShimRunPending();
+    CHECK(ipts->mapDMABuffer(1, MEI_MODEL_IPTS_MSG_LENGTH) == kIOReturnSuccess);
+    for (UInt8 i = 0; i < 8; i++) {
+        MEIHostMessage msg = MEIHostPattern(3000 + i, i);
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+        IOShimAdvance(10000000);
+        CHECK(harness.sink->host_rx.size() == i + 1U && harness.sink->host_rx.back() == msg);
+    }
+    CHECK(harness.model()->getStats()->client_dma_tx == 8);
+
+    // ME resets keep the mapping
+    harness.model()->requestReset();
+    IOShimRunPending();
+    MEIHostMessage msg = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, 9);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 9 && harness.sink->host_rx.back() == msg);
+    CHECK(harness.model()->getStats()->client_dma_tx == 9);
+
+    // and the circular buffer takes over once unmapped
+    CHECK(ipts->unmapDMABuffer() == kIOReturnSuccess);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 10 && harness.sink->host_rx.back() == msg);
+    CHECK(harness.model()->getStats()->client_dma_tx == 9);
+    CHECK(harness.model()->getStats()->unknown_messages == 0);
+}
+
+static void test_reset() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    harness.sink->echo = true;
+
+    MEIHostMessage msg = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, 5);
+    CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 1);
+
+    harness.model()->requestReset();
+    IOShimRunPending();
+    CHECK(harness.model()->getStats()->resets == 2);
+    CHECK(harness.client() == ipts);
+    CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 2 && harness.sink->host_rx[1] == msg);
+
+    // half sent messages are dropped with the reset, the link comes back clean and at the first attempt
+    for (UInt8 i = 0; i < 4; i++)
+        CHECK(ipts->sendMessage(msg.data(), msg.size(), false) == kIOReturnSuccess);
+    UInt64 start = IOShimNow();
+    harness.model()->requestReset();
+    IOShimRunPending();
+    CHECK(harness.model()->getStats()->resets == 3);
+    CHECK(IOShimNow() - start < MEI_HW_READY_TIMEOUT * 1000000000ULL);
+    harness.sink->me_rx.clear();
+    harness.sink->echo = false;
+    MEIHostMessage after = MEIHostPattern(3000, 7);
+    CHECK(ipts->sendMessage(after.data(), after.size(), true) == kIOReturnSuccess);
+    IOShimRunPending();
+    CHECK(harness.sink->me_rx.size() == 1 && harness.sink->me_rx[0] == after);
+    CHECK(harness.model()->getStats()->unknown_messages == 0);
+}
+
+static void test_idle_resume() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+
+    IOShimAdvance((MEI_DEVICE_IDLE_TIMEOUT * 1000 + 100) * 1000000ULL);
+    CHECK(harness.model()->getStats()->pg_entries == 1);
+    CHECK(MEIHostStat(harness.driver, "PowerGatingStats", "Entries") == 1);
+
+    // the host wakes ME up for a message
+    MEIHostMessage msg = MEIHostPattern(600, 2);
+    CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+    IOShimRunPending();
+    CHECK(harness.model()->getStats()->pg_exits == 1);
+    CHECK(harness.sink->me_rx.size() == 1 && harness.sink->me_rx[0] == msg);
+
+    // and ME wakes the host side up
+    IOShimAdvance(2 * MEI_DEVICE_IDLE_TIMEOUT * 1000 * 1000000ULL);
+    CHECK(harness.model()->getStats()->pg_entries == 2);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+    IOShimRunPending();
+    CHECK(harness.model()->getStats()->pg_exits == 2);
+    CHECK(harness.sink->host_rx.size() == 1 && harness.sink->host_rx[0] == msg);
+    CHECK(MEIHostStat(harness.driver, "PowerGatingStats", "Exits") == 2);
+}
+
+static void test_idle_delay() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    MEIHostMessage msg = MEIHostPattern(64, 3);
+
+    // pauses of 6s between bursts, longer than the default delay, gate ME in every one of them at first
+    const UInt64 pause_ns = (MEI_DEVICE_IDLE_TIMEOUT * 1000 + 1000) * 1000000ULL;
+    for (int i = 0; i < MEI_IDLE_GAP_MIN_SAMPLES + 1; i++) {
+        CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+        IOShimAdvance(pause_ns);
+    }
+    UInt64 entries = harness.model()->getStats()->pg_entries;
+    CHECK(entries > 0);
+
+    // then the delay covers them and ME stays up through the same pauses
+    for (int i = 0; i < 4; i++) {
+        CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+        IOShimAdvance(pause_ns);
+    }
+    CHECK(harness.model()->getStats()->pg_entries == entries);
+
+    // a real idle period still ends in d0i3, within the longest delay
+    IOShimAdvance(MEI_IDLE_DELAY_MAX_MS * 1000000ULL);
+    CHECK(harness.model()->getStats()->pg_entries == entries + 1);
+    CHECK(MEIHostStat(harness.driver, "PowerGatingStats", "IdleDelayMs") > MEI_DEVICE_IDLE_TIMEOUT * 1000);
+    CHECK(MEIHostStat(harness.driver, "PowerGatingStats", "IdleDelayMs") <= MEI_IDLE_DELAY_MAX_MS);
+}
+
+static void test_sleep_wake() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+
+    harness.driver->setPowerState(0, harness.driver);
+    IOShimRunPending();
+    CHECK(harness.pci->power_state == kPCIPMCSPowerStateD3);
+    harness.driver->setPowerState(1, harness.driver);
+    IOShimRunPending();
+    CHECK(harness.pci->power_state == kPCIPMCSPowerStateD0);
+
+    MEIHostMessage msg = MEIHostPattern(2000, 4);
+    harness.sink->echo = true;
+    CHECK(ipts->sendMessage(msg.data(), msg.size(), true) == kIOReturnSuccess);
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 1 && harness.sink->host_rx[0] == msg);
+}
+
+static void test_user_client_teardown() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    SurfaceManagementEngineUserClient *user = OSTypeAlloc(SurfaceManagementEngineUserClient);
+    CHECK(user->initWithTask(nullptr, nullptr, 0, nullptr) && user->attach(ipts) && user->start(ipts));
+    IOExternalMethodArguments args = {};
+    CHECK(user->externalMethod(kMEIUserRingMethodSubmit, &args, nullptr, nullptr, nullptr) == kIOReturnSuccess);
+
+    // the driver goes away while the daemon still has the connection open
+    harness.stop();
+    IOOptionBits options;
+    IOMemoryDescriptor *memory;
+    CHECK(user->externalMethod(kMEIUserRingMethodSubmit, &args, nullptr, nullptr, nullptr) == kIOReturnNotAttached);
+    CHECK(user->externalMethod(kMEIUserRingMethodUnmapDMA, &args, nullptr, nullptr, nullptr) == kIOReturnNotAttached);
+    CHECK(user->clientMemoryForType(kMEIUserRingMemoryType, &options, &memory) == kIOReturnNotAttached);
+    CHECK(user->clientClose() == kIOReturnSuccess);
+    user->release();
+}
+
+static void test_user_ring() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    SurfaceManagementEngineClient *ipts = harness.client();
+    SurfaceManagementEngineUserClient *user = OSTypeAlloc(SurfaceManagementEngineUserClient);
+    CHECK(user->initWithTask(nullptr, nullptr, 0, nullptr) && user->attach(ipts) && user->start(ipts));
+    IOOptionBits options;
+    IOMemoryDescriptor *memory;
+    CHECK(user->clientMemoryForType(kMEIUserRingMemoryType, &options, &memory) == kIOReturnSuccess);
+    IOBufferMemoryDescriptor *ring = OSDynamicCast(IOBufferMemoryDescriptor, memory);
+    CHECK(ring);
+    UInt8 *base = static_cast<UInt8 *>(ring->getBytesNoCopy());
+    MEIUserRingHeader *hdr = reinterpret_cast<MEIUserRingHeader *>(base);
+    CHECK(hdr->rx_count == MEI_USER_RING_RX_COUNT && hdr->max_msg_length == MEI_MODEL_IPTS_MSG_LENGTH);
+
+    // ME messages land in the rx slots instead of the in-kernel handler, a full ring counts drops
+    for (UInt32 i = 0; i < MEI_USER_RING_RX_COUNT + 2; i++) {
+        MEIHostMessage msg = MEIHostPattern(500 + i, static_cast<UInt8>(i));
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+        IOShimAdvance(10000000);
+    }
+    CHECK(hdr->rx_head == MEI_USER_RING_RX_COUNT && hdr->rx_dropped == 2);
+    CHECK(harness.sink->host_rx.empty());
+    for (UInt32 i = 0; i < MEI_USER_RING_RX_COUNT; i++) {
+        MEIUserRingSlot *slot = reinterpret_cast<MEIUserRingSlot *>(base + hdr->rx_offset + i * hdr->slot_size);
+        MEIHostMessage msg = MEIHostPattern(500 + i, static_cast<UInt8>(i));
+        CHECK(slot->length == msg.size() && !memcmp(slot->data, msg.data(), msg.size()));
+    }
+
+    // the daemon frees slots by moving rx_tail
+    hdr->rx_tail = MEI_USER_RING_RX_COUNT;
+    MEIHostMessage msg = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, 1);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, msg.data(), msg.size()));
+    IOShimRunPending();
+    MEIUserRingSlot *slot = reinterpret_cast<MEIUserRingSlot *>(base + hdr->rx_offset);
+    CHECK(hdr->rx_head == MEI_USER_RING_RX_COUNT + 1);
+    CHECK(slot->length == msg.size() && !memcmp(slot->data, msg.data(), msg.size()));
+
+    // and queues feedback for ME in the tx slots, sent with one call
+    for (UInt32 i = 0; i < MEI_USER_RING_TX_COUNT; i++) {
+        slot = reinterpret_cast<MEIUserRingSlot *>(base + hdr->tx_offset + i * hdr->slot_size);
+        MEIHostMessage out = MEIHostPattern(100 + i, static_cast<UInt8>(i));
+        memcpy(slot->data, out.data(), out.size());
+        slot->length = static_cast<UInt32>(out.size());
+    }
+    hdr->tx_head = MEI_USER_RING_TX_COUNT;
+    IOExternalMethodArguments args = {};
+    CHECK(user->externalMethod(kMEIUserRingMethodSubmit, &args, nullptr, nullptr, nullptr) == kIOReturnSuccess);
+    IOShimRunPending();
+    CHECK(hdr->tx_tail == MEI_USER_RING_TX_COUNT);
+    CHECK(harness.sink->me_rx.size() == MEI_USER_RING_TX_COUNT);
+    for (UInt32 i = 0; i < harness.sink->me_rx.size(); i++)
+        CHECK(harness.sink->me_rx[i] == MEIHostPattern(100 + i, static_cast<UInt8>(i)));
+
+    memory->release();
+    CHECK(user->clientClose() == kIOReturnSuccess);
+    user->release();
+}
+
+static void test_drain_mode() {
+    MEIHostHarness harness;
+    CHECK(harness.start());
+    MEIHostMessage frame = MEIHostPattern(MEI_MODEL_IPTS_MSG_LENGTH, 6);
+    MEIHostMessage small = MEIHostPattern(64, 7);
+
+    // 100 frames a second of 9 fragments each stay on interrupts, the rate is counted in messages
+    for (int i = 0; i < 100; i++) {
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, frame.data(), frame.size()));
+        IOShimAdvance(10000000);
+    }
+    // statistics go out with the first drain after their interval
+    IOShimAdvance(MEI_POLL_STATS_INTERVAL_MS * 1000000ULL);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, small.data(), small.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 101);
+    CHECK(MEIHostStat(harness.driver, "DrainStats", "ModeSwitches") == 0);
+
+    // a burst over MEI_POLL_ENTER_MSGS per window polls, until the stream stops
+    for (int i = 0; i < 2 * MEI_POLL_ENTER_MSGS; i++) {
+        CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, small.data(), small.size()));
+        IOShimAdvance(1000000);
+    }
+    IOShimAdvance(MEI_POLL_STATS_INTERVAL_MS * 1000000ULL);
+    CHECK(harness.model()->sendClientMessage(MEI_MODEL_IPTS_ADDR, small.data(), small.size()));
+    IOShimRunPending();
+    CHECK(harness.sink->host_rx.size() == 102 + 2 * MEI_POLL_ENTER_MSGS);
+    CHECK(MEIHostStat(harness.driver, "DrainStats", "ModeSwitches") == 1);
+    CHECK(MEIHostStat(harness.driver, "DrainStats", "Messages", "Polling") > MEI_POLL_ENTER_MSGS);
+}
+
+int main() {
+    const struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"handshake", test_handshake},
+        {"enumeration", test_enumeration},
+        {"connect", test_connect},
+        {"flow control, dynamic client", test_flow_control_dynamic},
+        {"flow control, driver", test_flow_control_driver},
+        {"message handlers", test_message_handlers},
+        {"rx queue counters", test_rx_queue_counters},
+        {"fragmentation", test_fragmentation},
+        {"dma ring", test_dma_ring},
+        {"client dma", test_client_dma},
+        {"reset", test_reset},
+        {"idle and resume", test_idle_resume},
+        {"adaptive idle delay", test_idle_delay},
+        {"sleep and wake", test_sleep_wake},
+        {"user ring", test_user_ring},
+        {"user client teardown", test_user_client_teardown},
+        {"drain mode", test_drain_mode},
+    };
+    int failed = 0;
+    for (auto &test : tests) {
+        int before = failures;
+        test.run();
+        printf("%-32s %s\n", test.name, failures == before ? "ok" : "FAILED");
+        if (failures != before)
+            failed++;
+    }
+    printf("%d of %zu failed\n", failed, sizeof(tests) / sizeof(tests[0]));
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+//
+//  SSHRingBench.cpp
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "IOKitShim.h"
+#include "SerialRing.h"
+
+/*
+ * The UART ring of the serial hub driven from two real threads, the UART controller's and the work loop's.
+ * Unlike the MEI figures these are wall clock times and change from one machine to the other,
+ * both sides yield while waiting so that the figures still mean something on a single CPU.
+ */
+
+#define BENCH_FIFO_SIZE     64      // what the UART controller hands over at once
+#define BENCH_BUFFERS       1000000
+#define BENCH_ROUND_TRIPS   100000
+
+static SurfaceSerialRing *allocRing() {
+    SurfaceSerialRing *ring = reinterpret_cast<SurfaceSerialRing *>(IOMallocAligned(sizeof(SurfaceSerialRing), SSH_CACHE_LINE_SIZE));
+    if (!ring)
+        return nullptr;
+    memset(ring, 0, sizeof(SurfaceSerialRing));
+    ring->reset();
+    for (int i = 0; i < SSH_RING_BUFFER_SIZE; i++)
+        ring->slots[i].buffer = new UInt8[BENCH_FIFO_SIZE];
+    return ring;
+}
+
+static void freeRing(SurfaceSerialRing *ring) {
+    for (int i = 0; i < SSH_RING_BUFFER_SIZE; i++)
+        delete[] ring->slots[i].buffer;
+    IOFreeAligned(ring, sizeof(SurfaceSerialRing));
+}
+
+static double elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * The producer retries whenever the ring is full, like a UART controller that would hold on to its FIFO
+ */
+static void bench_stream() {
+    SurfaceSerialRing *ring = allocRing();
+    if (!ring)
+        return;
+    UInt32 corrupted = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([ring, &corrupted] {
+        for (UInt32 received = 0; received < BENCH_BUFFERS;) {
+            SurfaceSerialRing::Slot *slot = ring->front();
+            if (!slot) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (slot->filled_len != BENCH_FIFO_SIZE || slot->buffer[0] != static_cast<UInt8>(received) ||
+                slot->buffer[BENCH_FIFO_SIZE - 1] != static_cast<UInt8>(received))
+                corrupted++;
+            ring->pop();
+            received++;
+        }
+    });
+    UInt8 buffer[BENCH_FIFO_SIZE];
+    for (UInt32 i = 0; i < BENCH_BUFFERS; i++) {
+        memset(buffer, static_cast<UInt8>(i), sizeof(buffer));
+        while (!ring->push(buffer, sizeof(buffer), i))
+            std::this_thread::yield();
+    }
+    consumer.join();
+    double ns = elapsedNs(start);
+
+    printf("stream, %u buffers of %u bytes\n", BENCH_BUFFERS, BENCH_FIFO_SIZE);
+    printf("  %.1f ns per buffer, %.2f full ring retries per buffer, %u corrupted\n", ns / BENCH_BUFFERS,
+           double(ring->overrun_count) / BENCH_BUFFERS, corrupted);
+    freeRing(ring);
+}
+
+/*
+ * One buffer in flight at a time, the cost of handing a slot over and back
+ */
+static void bench_round_trip() {
+    SurfaceSerialRing *ring = allocRing();
+    if (!ring)
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([ring] {
+        for (UInt32 received = 0; received < BENCH_ROUND_TRIPS;) {
+            if (!ring->front()) {
+                std::this_thread::yield();
+                continue;
+            }
+            ring->pop();
+            received++;
+        }
+    });
+    UInt8 buffer[BENCH_FIFO_SIZE] = {};
+    for (UInt32 i = 0; i < BENCH_ROUND_TRIPS; i++) {
+        ring->push(buffer, sizeof(buffer), i);
+        while (ring->slots[ring->last].filled_len)
+            std::this_thread::yield();
+    }
+    consumer.join();
+    double ns = elapsedNs(start);
+
+    printf("\nround trip, %u buffers\n", BENCH_ROUND_TRIPS);
+    printf("  %.1f ns per round trip\n", ns / BENCH_ROUND_TRIPS);
+    freeRing(ring);
+}
+
+int main() {
+    printf("ring of %u slots, %zu bytes each, producer at %zu, consumer at %zu, slots at %zu\n\n", SSH_RING_BUFFER_SIZE,
+           sizeof(SurfaceSerialRing::Slot), offsetof(SurfaceSerialRing, last), offsetof(SurfaceSerialRing, current),
+           offsetof(SurfaceSerialRing, slots));
+    bench_stream();
+    bench_round_trip();
+    return 0;
+}
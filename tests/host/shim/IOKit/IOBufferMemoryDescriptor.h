@@ -0,0 +1,2 @@
+// Host build of IOKit/IOBufferMemoryDescriptor.h, see IOKitShim.h
+#include "../IOKitShim.h"
@@ -0,0 +1,2 @@
+// Host build of IOKit/IOCommandGate.h, see IOKitShim.h
+#include "../IOKitShim.h"
@@ -0,0 +1,2 @@
+// Host build of IOKit/IOFilterInterruptEventSource.h, see IOKitShim.h
+#include "../IOKitShim.h"
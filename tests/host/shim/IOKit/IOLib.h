@@ -0,0 +1,2 @@
+// Host build of IOKit/IOLib.h, see IOKitShim.h
+#include "../IOKitShim.h"
@@ -0,0 +1,2 @@
+// Host build of IOKit/IOTimerEventSource.h, see IOKitShim.h
+#include "../IOKitShim.h"
@@ -0,0 +1,2 @@
+// Host build of IOKit/pci/IOPCIDevice.h, see IOKitShim.h
+#include "../../IOKitShim.h"
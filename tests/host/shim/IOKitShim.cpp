@@ -0,0 +1,763 @@
+//
+//  IOKitShim.cpp
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "IOKitShim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cxxabi.h>
+#include <typeinfo>
+#include <vector>
+
+IOShimStats IOShimStatistics {};
+bool        IOShimVerbose {false};
+task_t      kernel_task {nullptr};
+
+static UInt64 shim_now {0};
+static std::vector<IOWorkLoop *> shim_work_loops;
+static std::vector<IOService *> shim_registered;
+static unsigned int shim_running {0};     // event source actions on the stack
+
+struct IOShimSleeper {
+    void*   event;
+    bool    woken;
+};
+static std::vector<IOShimSleeper *> shim_sleepers;
+
+static OSBoolean shim_true(true);
+static OSBoolean shim_false(false);
+OSBoolean * const kOSBooleanTrue = &shim_true;
+OSBoolean * const kOSBooleanFalse = &shim_false;
+
+/* scheduler */
+
+UInt64 IOShimNow() {
+    return shim_now;
+}
+
+static bool runOnePending() {
+    for (size_t i = 0; i < shim_work_loops.size(); i++) {
+        if (shim_work_loops[i]->runOne())
+            return true;
+    }
+    return false;
+}
+
+static UInt64 nextPendingDeadline() {
+    UInt64 next = 0;
+    for (auto work_loop : shim_work_loops) {
+        UInt64 deadline = work_loop->nextDeadline();
+        if (deadline && (!next || deadline < next))
+            next = deadline;
+    }
+    return next;
+}
+
+UInt64 IOShimRunPending() {
+    UInt64 ran = 0;
+    while (runOnePending())
+        ran++;
+    return ran;
+}
+
+void IOShimAdvance(UInt64 ns) {
+    UInt64 target = shim_now + ns;
+    for (;;) {
+        IOShimRunPending();
+        UInt64 next = nextPendingDeadline();
+        if (!next || next > target)
+            break;
+        shim_now = next;
+    }
+    shim_now = target;
+    IOShimRunPending();
+}
+
+unsigned int IOShimRegisteredCount() {
+    return static_cast<unsigned int>(shim_registered.size());
+}
+
+IOService *IOShimRegisteredService(unsigned int index) {
+    return index < shim_registered.size() ? shim_registered[index] : nullptr;
+}
+
+static void unregisterService(IOService *service) {
+    for (auto it = shim_registered.begin(); it != shim_registered.end(); it++) {
+        if (*it == service) {
+            shim_registered.erase(it);
+            return;
+        }
+    }
+}
+
+/* libkern */
+
+void IOLog(const char *format, ...) {
+    IOShimStatistics.log_lines++;
+    if (!IOShimVerbose)
+        return;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "[%10.3f ms] ", shim_now / 1000000.0);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void IOSleep(unsigned milliseconds) {
+    IOShimAdvance(milliseconds * 1000000ULL);
+}
+
+void *IOMallocAligned(vm_size_t size, vm_size_t alignment) {
+    void *address = nullptr;
+    if (posix_memalign(&address, alignment < sizeof(void *) ? sizeof(void *) : alignment, size))
+        return nullptr;
+    return address;
+}
+
+void IOFreeAligned(void *address, vm_size_t size) {
+    free(address);
+}
+
+void OSMemoryBarrier() {
+    __sync_synchronize();
+}
+
+UInt16 OSSwapInt16(UInt16 data) {
+    return __builtin_bswap16(data);
+}
+
+UInt32 OSSwapInt32(UInt32 data) {
+    return __builtin_bswap32(data);
+}
+
+UInt64 mach_absolute_time() {
+    return shim_now;
+}
+
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, AbsoluteTime *result) {
+    *result = nanoseconds;
+}
+
+void absolutetime_to_nanoseconds(AbsoluteTime abstime, UInt64 *result) {
+    *result = abstime;
+}
+
+void clock_absolutetime_interval_to_deadline(AbsoluteTime abstime, AbsoluteTime *result) {
+    *result = shim_now + abstime;
+}
+
+void uuid_copy(uuid_t dst, const uuid_t src) {
+    memcpy(dst, src, sizeof(uuid_t));
+}
+
+int uuid_compare(const uuid_t uu1, const uuid_t uu2) {
+    return memcmp(uu1, uu2, sizeof(uuid_t));
+}
+
+void uuid_unparse_lower(const uuid_t uu, char *out) {
+    snprintf(out, sizeof(uuid_string_t), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             uu[0], uu[1], uu[2], uu[3], uu[4], uu[5], uu[6], uu[7], uu[8], uu[9], uu[10], uu[11], uu[12], uu[13], uu[14], uu[15]);
+}
+
+void OSObject::retain() const {
+    retain_count++;
+}
+
+void OSObject::release() const {
+    if (--retain_count == 0)
+        const_cast<OSObject *>(this)->free();
+}
+
+void OSObject::free() {
+    delete this;
+}
+
+OSNumber *OSNumber::withNumber(UInt64 value, unsigned int numberOfBits) {
+    OSNumber *number = new OSNumber;
+    number->value = numberOfBits < 64 ? value & ((1ULL << numberOfBits) - 1) : value;
+    return number;
+}
+
+OSString *OSString::withCString(const char *cString) {
+    OSString *string = new OSString;
+    string->string = strdup(cString);
+    return string;
+}
+
+void OSString::free() {
+    ::free(string);
+    OSObject::free();
+}
+
+OSArray *OSArray::withCapacity(unsigned int capacity) {
+    OSArray *array = new OSArray;
+    array->capacity = capacity ? capacity : 1;
+    array->objects = new const OSObject *[array->capacity];
+    return array;
+}
+
+bool OSArray::setObject(const OSObject *anObject) {
+    if (!anObject)
+        return false;
+    if (count == capacity) {
+        const OSObject **grown = new const OSObject *[capacity * 2];
+        memcpy(grown, objects, count * sizeof(OSObject *));
+        delete[] objects;
+        objects = grown;
+        capacity *= 2;
+    }
+    anObject->retain();
+    objects[count++] = anObject;
+    return true;
+}
+
+OSObject *OSArray::getObject(unsigned int index) const {
+    return index < count ? const_cast<OSObject *>(objects[index]) : nullptr;
+}
+
+void OSArray::free() {
+    for (unsigned int i = 0; i < count; i++)
+        objects[i]->release();
+    delete[] objects;
+    OSObject::free();
+}
+
+OSDictionary *OSDictionary::withCapacity(unsigned int capacity) {
+    OSDictionary *dict = new OSDictionary;
+    dict->capacity = capacity ? capacity : 1;
+    dict->keys = new char *[dict->capacity];
+    dict->objects = new const OSObject *[dict->capacity];
+    return dict;
+}
+
+bool OSDictionary::setObject(const char *aKey, const OSObject *anObject) {
+    if (!aKey || !anObject)
+        return false;
+    anObject->retain();
+    for (unsigned int i = 0; i < count; i++) {
+        if (strcmp(keys[i], aKey) == 0) {
+            objects[i]->release();
+            objects[i] = anObject;
+            return true;
+        }
+    }
+    if (count == capacity) {
+        char **grown_keys = new char *[capacity * 2];
+        const OSObject **grown = new const OSObject *[capacity * 2];
+        memcpy(grown_keys, keys, count * sizeof(char *));
+        memcpy(grown, objects, count * sizeof(OSObject *));
+        delete[] keys;
+        delete[] objects;
+        keys = grown_keys;
+        objects = grown;
+        capacity *= 2;
+    }
+    keys[count] = strdup(aKey);
+    objects[count++] = anObject;
+    return true;
+}
+
+OSObject *OSDictionary::getObject(const char *aKey) const {
+    for (unsigned int i = 0; i < count; i++) {
+        if (strcmp(keys[i], aKey) == 0)
+            return const_cast<OSObject *>(objects[i]);
+    }
+    return nullptr;
+}
+
+void OSDictionary::removeObject(const char *aKey) {
+    for (unsigned int i = 0; i < count; i++) {
+        if (strcmp(keys[i], aKey) != 0)
+            continue;
+        ::free(keys[i]);
+        objects[i]->release();
+        count--;
+        keys[i] = keys[count];
+        objects[i] = objects[count];
+        return;
+    }
+}
+
+void OSDictionary::free() {
+    for (unsigned int i = 0; i < count; i++) {
+        ::free(keys[i]);
+        objects[i]->release();
+    }
+    delete[] keys;
+    delete[] objects;
+    OSObject::free();
+}
+
+/* registry */
+
+bool IORegistryEntry::setProperty(const char *aKey, OSObject *anObject) {
+    if (!properties)
+        properties = OSDictionary::withCapacity(8);
+    return properties->setObject(aKey, anObject);
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, const char *aString) {
+    OSString *string = OSString::withCString(aString);
+    bool ret = setProperty(aKey, string);
+    string->release();
+    return ret;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, bool aBoolean) {
+    return setProperty(aKey, aBoolean ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, unsigned long long aValue, unsigned int aNumberOfBits) {
+    OSNumber *number = OSNumber::withNumber(aValue, aNumberOfBits);
+    bool ret = setProperty(aKey, number);
+    number->release();
+    return ret;
+}
+
+OSObject *IORegistryEntry::getProperty(const char *aKey) const {
+    return properties ? properties->getObject(aKey) : nullptr;
+}
+
+void IORegistryEntry::removeProperty(const char *aKey) {
+    if (properties)
+        properties->removeObject(aKey);
+}
+
+const char *IORegistryEntry::getName() const {
+    if (!name) {
+        int status;
+        name = abi::__cxa_demangle(typeid(*this).name(), nullptr, nullptr, &status);
+        if (!name)
+            name = strdup(typeid(*this).name());
+    }
+    return name;
+}
+
+void IORegistryEntry::free() {
+    OSSafeReleaseNULL(properties);
+    ::free(name);
+    name = nullptr;
+    OSObject::free();
+}
+
+bool IOService::init(OSDictionary *dictionary) {
+    return true;
+}
+
+IOService *IOService::probe(IOService *provider, SInt32 *score) {
+    return this;
+}
+
+bool IOService::start(IOService *provider) {
+    return true;
+}
+
+void IOService::stop(IOService *provider) {
+    if (registered) {
+        registered = false;
+        unregisterService(this);
+    }
+}
+
+bool IOService::attach(IOService *provider) {
+    if (this->provider)
+        return this->provider == provider;
+    this->provider = provider;
+    return true;
+}
+
+void IOService::detach(IOService *provider) {
+    if (this->provider == provider)
+        this->provider = nullptr;
+}
+
+IOReturn IOService::setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice) {
+    return kIOPMAckImplied;
+}
+
+bool IOService::open(IOService *forClient, IOOptionBits options, void *arg) {
+    if (opened_by && opened_by != forClient)
+        return false;
+    opened_by = forClient;
+    return true;
+}
+
+void IOService::close(IOService *forClient, IOOptionBits options) {
+    if (opened_by == forClient)
+        opened_by = nullptr;
+}
+
+bool IOService::isOpen(const IOService *forClient) const {
+    return forClient ? opened_by == forClient : opened_by != nullptr;
+}
+
+void IOService::registerService(IOOptionBits options) {
+    if (registered)
+        return;
+    registered = true;
+    shim_registered.push_back(this);
+}
+
+bool IOService::terminate(IOOptionBits options) {
+    if (registered) {
+        registered = false;
+        unregisterService(this);
+    }
+    return true;
+}
+
+void IOService::PMinit() {
+}
+
+void IOService::PMstop() {
+}
+
+void IOService::joinPMtree(IOService *driver) {
+}
+
+IOReturn IOService::registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates) {
+    return kIOReturnSuccess;
+}
+
+void IOService::free() {
+    if (registered) {
+        registered = false;
+        unregisterService(this);
+    }
+    IORegistryEntry::free();
+}
+
+/* work loops */
+
+IOWorkLoop *IOWorkLoop::workLoop() {
+    IOWorkLoop *work_loop = new IOWorkLoop;
+    shim_work_loops.push_back(work_loop);
+    return work_loop;
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource *newEvent) {
+    if (count == capacity) {
+        unsigned int grown_capacity = capacity ? capacity * 2 : 8;
+        IOEventSource **grown = new IOEventSource *[grown_capacity];
+        if (sources)
+            memcpy(grown, sources, count * sizeof(IOEventSource *));
+        delete[] sources;
+        sources = grown;
+        capacity = grown_capacity;
+    }
+    newEvent->retain();
+    newEvent->work_loop = this;
+    sources[count++] = newEvent;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource *toRemove) {
+    for (unsigned int i = 0; i < count; i++) {
+        if (sources[i] != toRemove)
+            continue;
+        memmove(&sources[i], &sources[i + 1], (count - i - 1) * sizeof(IOEventSource *));
+        count--;
+        toRemove->work_loop = nullptr;
+        toRemove->release();
+        return kIOReturnSuccess;
+    }
+    return kIOReturnNotFound;
+}
+
+IOReturn IOWorkLoop::runAction(Action action, OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3) {
+    return action(target, arg0, arg1, arg2, arg3);
+}
+
+bool IOWorkLoop::runOne() {
+    for (unsigned int i = 0; i < count; i++) {
+        IOEventSource *source = sources[i];
+        if (!source->checkForWork())
+            continue;
+        // the action may remove the source
+        source->retain();
+        source->running = true;
+        shim_running++;
+        IOShimStatistics.event_runs++;
+        source->runWork();
+        shim_running--;
+        source->running = false;
+        source->release();
+        return true;
+    }
+    return false;
+}
+
+UInt64 IOWorkLoop::nextDeadline() {
+    UInt64 next = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (sources[i]->running || !sources[i]->enabled)
+            continue;
+        UInt64 deadline = sources[i]->nextDeadline();
+        if (deadline > shim_now && (!next || deadline < next))
+            next = deadline;
+    }
+    return next;
+}
+
+void IOWorkLoop::free() {
+    while (count)
+        removeEventSource(sources[count - 1]);
+    delete[] sources;
+    for (auto it = shim_work_loops.begin(); it != shim_work_loops.end(); it++) {
+        if (*it == this) {
+            shim_work_loops.erase(it);
+            break;
+        }
+    }
+    OSObject::free();
+}
+
+IOCommandGate *IOCommandGate::commandGate(OSObject *owner, Action action) {
+    IOCommandGate *gate = new IOCommandGate;
+    gate->owner = owner;
+    return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void *arg0, void *arg1, void *arg2, void *arg3) {
+    return action(owner, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::commandSleep(void *event, AbsoluteTime deadline, UInt32 interruptible) {
+    IOShimSleeper sleeper {event, false};
+    IOReturn ret = THREAD_AWAKENED;
+    IOShimStatistics.sleeps++;
+    if (shim_running)
+        IOShimStatistics.nested_sleeps++;
+    shim_sleepers.push_back(&sleeper);
+    while (!sleeper.woken) {
+        if (runOnePending())
+            continue;
+        UInt64 next = nextPendingDeadline();
+        if (next && next <= deadline) {
+            shim_now = next;
+            continue;
+        }
+        if (deadline > shim_now)
+            shim_now = deadline;
+        IOShimStatistics.sleep_timeouts++;
+        ret = THREAD_TIMED_OUT;
+        break;
+    }
+    for (auto it = shim_sleepers.begin(); it != shim_sleepers.end(); it++) {
+        if (*it == &sleeper) {
+            shim_sleepers.erase(it);
+            break;
+        }
+    }
+    return ret;
+}
+
+void IOCommandGate::commandWakeup(void *event, bool oneThread) {
+    for (auto sleeper : shim_sleepers) {
+        if (sleeper->event != event || sleeper->woken)
+            continue;
+        sleeper->woken = true;
+        if (oneThread)
+            break;
+    }
+}
+
+IOInterruptEventSource *IOInterruptEventSource::interruptEventSource(OSObject *owner, Action action, IOService *provider, int intIndex) {
+    IOInterruptEventSource *source = new IOInterruptEventSource;
+    source->owner = owner;
+    source->action = action;
+    return source;
+}
+
+void IOInterruptEventSource::interruptOccurred(void *nub, IOService *nub_provider, int ind) {
+    produced++;
+}
+
+bool IOInterruptEventSource::checkForWork() {
+    return enabled && !running && produced != consumed;
+}
+
+void IOInterruptEventSource::runWork() {
+    int pending = produced - consumed;
+    consumed = produced;
+    IOShimStatistics.interrupt_runs++;
+    action(owner, this, pending);
+}
+
+IOFilterInterruptEventSource *IOFilterInterruptEventSource::filterInterruptEventSource(OSObject *owner, IOInterruptEventSource::Action action, Filter filter, IOService *provider, int intIndex) {
+    IOFilterInterruptEventSource *source = new IOFilterInterruptEventSource;
+    source->owner = owner;
+    source->action = action;
+    source->filter = filter;
+    // enabled together with the provider's interrupt
+    source->enabled = false;
+    return source;
+}
+
+void IOFilterInterruptEventSource::signalInterrupt() {
+    produced++;
+}
+
+IOTimerEventSource *IOTimerEventSource::timerEventSource(OSObject *owner, Action action) {
+    IOTimerEventSource *timer = new IOTimerEventSource;
+    timer->owner = owner;
+    timer->action = action;
+    return timer;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms) {
+    return setTimeoutUS(ms * 1000);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us) {
+    deadline = shim_now + us * 1000ULL;
+    armed = true;
+    return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout() {
+    armed = false;
+}
+
+bool IOTimerEventSource::checkForWork() {
+    return enabled && armed && !running && deadline <= shim_now;
+}
+
+void IOTimerEventSource::runWork() {
+    armed = false;
+    IOShimStatistics.timer_runs++;
+    action(owner, this);
+}
+
+UInt64 IOTimerEventSource::nextDeadline() {
+    return armed ? deadline : 0;
+}
+
+/* memory */
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment) {
+    IOBufferMemoryDescriptor *md = new IOBufferMemoryDescriptor;
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+    IOByteCount size = (capacity + alignment - 1) & ~(alignment - 1);
+    md->buffer = aligned_alloc(alignment, size ? size : alignment);
+    if (!md->buffer) {
+        md->release();
+        return nullptr;
+    }
+    md->length = capacity;
+    return md;
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::inTaskWithPhysicalMask(task_t inTask, IOOptionBits options, IOByteCount capacity, UInt64 physicalMask) {
+    // the mask only asks for page alignment here
+    return inTaskWithOptions(inTask, options, capacity, PAGE_SIZE);
+}
+
+void IOBufferMemoryDescriptor::free() {
+    ::free(buffer);
+    IOMemoryDescriptor::free();
+}
+
+bool IODMACommand::OutputHost64(IODMACommand *target, Segment64 segment, void *segments, UInt32 segmentIndex) {
+    return true;
+}
+
+IODMACommand *IODMACommand::withSpecification(SegmentFunction outSegFunc, UInt8 numAddressBits, UInt64 maxSegmentSize, MappingOptions mappingOptions, UInt64 maxTransferSize, UInt32 alignment) {
+    return new IODMACommand;
+}
+
+IOReturn IODMACommand::setMemoryDescriptor(IOBufferMemoryDescriptor *mem) {
+    if (memory)
+        return kIOReturnBusy;
+    mem->retain();
+    memory = mem;
+    return kIOReturnSuccess;
+}
+
+IOReturn IODMACommand::clearMemoryDescriptor() {
+    OSSafeReleaseNULL(memory);
+    return kIOReturnSuccess;
+}
+
+IOReturn IODMACommand::genIOVMSegments(UInt64 *offset, Segment64 *segments, UInt32 *numSegments) {
+    if (!memory || *offset >= memory->getLength() || !*numSegments)
+        return kIOReturnBadArgument;
+    // host memory is its own bus address
+    segments[0].fIOVMAddr = reinterpret_cast<uintptr_t>(memory->getBytesNoCopy()) + *offset;
+    segments[0].fLength = memory->getLength() - *offset;
+    *offset = memory->getLength();
+    *numSegments = 1;
+    return kIOReturnSuccess;
+}
+
+void IODMACommand::free() {
+    OSSafeReleaseNULL(memory);
+    OSObject::free();
+}
+
+/* pci */
+
+bool IOPCIDevice::setMemoryEnable(bool enable) {
+    bool was = memory_enabled;
+    memory_enabled = enable;
+    return was;
+}
+
+bool IOPCIDevice::setBusMasterEnable(bool enable) {
+    bool was = bus_master;
+    bus_master = enable;
+    return was;
+}
+
+IOReturn IOPCIDevice::getInterruptType(int source, int *interruptType) {
+    // a legacy pin first, then the MSI
+    if (source == 0)
+        *interruptType = 0;
+    else if (source == 1)
+        *interruptType = kIOInterruptTypePCIMessaged;
+    else
+        return kIOReturnNoInterrupt;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOPCIDevice::enablePCIPowerManagement(IOOptionBits state) {
+    power_state = state;
+    return kIOReturnSuccess;
+}
+
+/* user clients */
+
+mach_msg_return_t mach_msg_send_from_kernel_with_options(mach_msg_header_t *msg, mach_msg_size_t send_size, mach_msg_option_t option, mach_msg_timeout_t timeout_val) {
+    IOShimStatistics.mach_notifications++;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUserClient::clientHasPrivilege(void *securityToken, const char *privilegeName) {
+    return kIOReturnSuccess;
+}
+
+bool IOUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+    return init(properties);
+}
+
+IOReturn IOUserClient::clientClose() {
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOUserClient::registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon) {
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOUserClient::externalMethod(UInt32 selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch, OSObject *target, void *reference) {
+    return kIOReturnUnsupported;
+}
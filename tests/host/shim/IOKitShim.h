@@ -0,0 +1,604 @@
+//
+//  IOKitShim.h
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef IOKitShim_h
+#define IOKitShim_h
+
+/*
+ * Just enough of IOKit and libkern to build SurfaceManagementEngine on a host, every IOKit/ header includes this one.
+ *
+ * Everything runs on the calling thread against a virtual clock. Work loops only collect pending event sources,
+ * IOShimRunPending runs them and IOShimAdvance moves the clock forward, firing timers on the way.
+ * commandSleep runs pending work itself until it is woken up or the deadline passes, so a sleep on the work loop
+ * gets its wakeup here while the same call would only time out on a real work loop.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "kern/queue.h"
+
+typedef uint8_t     UInt8;
+typedef int8_t      SInt8;
+typedef uint16_t    UInt16;
+typedef int16_t     SInt16;
+typedef uint32_t    UInt32;
+typedef int32_t     SInt32;
+typedef uint64_t    UInt64;
+typedef int64_t     SInt64;
+typedef unsigned int UInt;
+typedef unsigned char uuid_t[16];
+typedef char        uuid_string_t[37];
+
+typedef int         kern_return_t;
+typedef kern_return_t IOReturn;
+typedef UInt32      IOOptionBits;
+typedef UInt64      AbsoluteTime;
+typedef uintptr_t   IOVirtualAddress;
+typedef UInt64      IOByteCount;
+typedef uintptr_t   vm_size_t;
+typedef UInt64      IOPhysicalAddress64;
+typedef unsigned long IOPMPowerFlags;
+typedef void*       task_t;
+typedef UInt32      mach_port_t;
+
+#define EXPORT
+
+#define sys_iokit                   (0x38 << 26)
+#define iokit_common_err(return)    (sys_iokit | (return))
+#define kIOReturnSuccess            0
+#define kIOReturnError              iokit_common_err(0x2bc)
+#define kIOReturnNoMemory           iokit_common_err(0x2bd)
+#define kIOReturnNoResources        iokit_common_err(0x2be)
+#define kIOReturnNoDevice           iokit_common_err(0x2c0)
+#define kIOReturnNotPrivileged      iokit_common_err(0x2c1)
+#define kIOReturnBadArgument        iokit_common_err(0x2c2)
+#define kIOReturnExclusiveAccess    iokit_common_err(0x2c5)
+#define kIOReturnUnsupported        iokit_common_err(0x2c7)
+#define kIOReturnIOError            iokit_common_err(0x2ca)
+#define kIOReturnNotOpen            iokit_common_err(0x2cd)
+#define kIOReturnNotReadable        iokit_common_err(0x2ce)
+#define kIOReturnBusy               iokit_common_err(0x2d5)
+#define kIOReturnTimeout            iokit_common_err(0x2d6)
+#define kIOReturnNotReady           iokit_common_err(0x2d8)
+#define kIOReturnNotAttached        iokit_common_err(0x2d9)
+#define kIOReturnMessageTooLarge    iokit_common_err(0x2e1)
+#define kIOReturnNotPermitted       iokit_common_err(0x2e2)
+#define kIOReturnUnderrun           iokit_common_err(0x2e7)
+#define kIOReturnOverrun            iokit_common_err(0x2e8)
+#define kIOReturnDeviceError        iokit_common_err(0x2e9)
+#define kIOReturnAborted            iokit_common_err(0x2eb)
+#define kIOReturnNoInterrupt        iokit_common_err(0x2df)
+#define kIOReturnNotFound           iokit_common_err(0x2f0)
+#define kIOReturnInvalid            iokit_common_err(0x1)
+
+#define THREAD_AWAKENED         0
+#define THREAD_TIMED_OUT        1
+#define THREAD_INTERRUPTED      2
+#define THREAD_UNINT            0
+#define THREAD_INTERRUPTIBLE    1
+
+#define PAGE_SIZE               4096
+#define kIODirectionIn          0x1
+#define kIODirectionOut         0x2
+#define kIODirectionInOut       (kIODirectionIn | kIODirectionOut)
+#define kIOMemoryPhysicallyContiguous   0x00000010
+#define kIOMemoryKernelUserShared       0x00010000
+
+#define kIOPMPowerOn            0x00000002
+#define kIOPMAckImplied         0
+#define kIOInterruptTypePCIMessaged 0x00010000
+
+#define kIOClientPrivilegeAdministrator "root"
+
+extern task_t kernel_task;
+
+/* libkern */
+
+static inline unsigned int min(unsigned int a, unsigned int b) {
+    return a < b ? a : b;
+}
+
+static inline unsigned int max(unsigned int a, unsigned int b) {
+    return a > b ? a : b;
+}
+
+void IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned milliseconds);
+void *IOMallocAligned(vm_size_t size, vm_size_t alignment);
+void IOFreeAligned(void *address, vm_size_t size);
+void OSMemoryBarrier();
+UInt16 OSSwapInt16(UInt16 data);
+UInt32 OSSwapInt32(UInt32 data);
+
+UInt64 mach_absolute_time();
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, AbsoluteTime *result);
+void absolutetime_to_nanoseconds(AbsoluteTime abstime, UInt64 *result);
+void clock_absolutetime_interval_to_deadline(AbsoluteTime abstime, AbsoluteTime *result);
+
+#define UUID_DEFINE(name, u0, u1, u2, u3, u4, u5, u6, u7, u8, u9, u10, u11, u12, u13, u14, u15) \
+    static const uuid_t name __attribute__((unused)) = {u0, u1, u2, u3, u4, u5, u6, u7, u8, u9, u10, u11, u12, u13, u14, u15}
+void uuid_copy(uuid_t dst, const uuid_t src);
+int uuid_compare(const uuid_t uu1, const uuid_t uu2);
+void uuid_unparse_lower(const uuid_t uu, char *out);
+
+/*
+ * Itanium ABI member function pointers, the same resolution OSMemberFunctionCast does in the kernel
+ */
+struct IOShimMemberFunction {
+    uintptr_t   ptr;
+    ptrdiff_t   adj;
+};
+
+template <typename F>
+static inline void *IOShimResolveMember(const void *self, F func) {
+    static_assert(sizeof(F) == sizeof(IOShimMemberFunction), "not an Itanium member function pointer");
+    IOShimMemberFunction pmf;
+    memcpy(&pmf, &func, sizeof(pmf));
+#if defined(__arm__) || defined(__aarch64__)
+    bool is_virtual = pmf.adj & 1;
+#else
+    bool is_virtual = pmf.ptr & 1;
+#endif
+    if (!is_virtual)
+        return reinterpret_cast<void *>(pmf.ptr);
+#if defined(__arm__) || defined(__aarch64__)
+    uintptr_t offset = pmf.ptr;
+#else
+    uintptr_t offset = pmf.ptr - 1;
+#endif
+    const char *vtable = *reinterpret_cast<const char * const *>(self);
+    return *reinterpret_cast<void * const *>(vtable + offset);
+}
+
+#define OSMemberFunctionCast(cptrtype, self, func) \
+    reinterpret_cast<cptrtype>(IOShimResolveMember(self, func))
+
+class OSObject;
+
+#define OSDeclareDefaultStructors(className) \
+public: \
+    className(); \
+    virtual ~className(); \
+private:
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    className::className() {} \
+    className::~className() {}
+
+#define OSTypeAlloc(type)           (new type)
+#define OSDynamicCast(type, inst)   (dynamic_cast<type *>(inst))
+#define OSSafeReleaseNULL(inst)     do { if (inst) (inst)->release(); (inst) = nullptr; } while (0)
+
+class OSObject {
+public:
+    OSObject() {}
+    virtual ~OSObject() {}
+
+    virtual void retain() const;
+    virtual void release() const;
+    int getRetainCount() const { return retain_count; }
+
+protected:
+    virtual void free();
+
+private:
+    mutable int retain_count {1};
+};
+
+class OSNumber : public OSObject {
+public:
+    static OSNumber *withNumber(UInt64 value, unsigned int numberOfBits);
+    UInt64 unsigned64BitValue() const { return value; }
+    UInt32 unsigned32BitValue() const { return static_cast<UInt32>(value); }
+
+private:
+    UInt64 value {0};
+};
+
+class OSString : public OSObject {
+public:
+    static OSString *withCString(const char *cString);
+    const char *getCStringNoCopy() const { return string; }
+    bool isEqualTo(const char *cString) const { return strcmp(string, cString) == 0; }
+
+protected:
+    void free() override;
+
+private:
+    char *string {nullptr};
+};
+
+class OSBoolean : public OSObject {
+public:
+    explicit OSBoolean(bool value) : value(value) {}
+    bool isTrue() const { return value; }
+    bool isFalse() const { return !value; }
+    void retain() const override {}
+    void release() const override {}
+
+private:
+    bool value;
+};
+
+extern OSBoolean * const kOSBooleanTrue;
+extern OSBoolean * const kOSBooleanFalse;
+
+class OSArray : public OSObject {
+public:
+    static OSArray *withCapacity(unsigned int capacity);
+    bool setObject(const OSObject *anObject);
+    OSObject *getObject(unsigned int index) const;
+    unsigned int getCount() const { return count; }
+
+protected:
+    void free() override;
+
+private:
+    const OSObject **objects {nullptr};
+    unsigned int count {0};
+    unsigned int capacity {0};
+};
+
+class OSDictionary : public OSObject {
+public:
+    static OSDictionary *withCapacity(unsigned int capacity);
+    bool setObject(const char *aKey, const OSObject *anObject);
+    OSObject *getObject(const char *aKey) const;
+    void removeObject(const char *aKey);
+    unsigned int getCount() const { return count; }
+
+protected:
+    void free() override;
+
+private:
+    char **keys {nullptr};
+    const OSObject **objects {nullptr};
+    unsigned int count {0};
+    unsigned int capacity {0};
+};
+
+/* IOKit */
+
+struct IOPMPowerState {
+    unsigned long   version;
+    IOPMPowerFlags  capabilityFlags;
+    IOPMPowerFlags  outputPowerCharacter;
+    IOPMPowerFlags  inputPowerRequirement;
+    unsigned long   staticPower;
+    unsigned long   unbudgetedPower;
+    unsigned long   powerToAttain;
+    unsigned long   timeToAttain;
+    unsigned long   settleUpTime;
+    unsigned long   timeToLower;
+    unsigned long   settleDownTime;
+    unsigned long   powerDomainBudget;
+};
+
+class IOWorkLoop;
+
+class IORegistryEntry : public OSObject {
+public:
+    bool setProperty(const char *aKey, OSObject *anObject);
+    bool setProperty(const char *aKey, const char *aString);
+    bool setProperty(const char *aKey, bool aBoolean);
+    bool setProperty(const char *aKey, unsigned long long aValue, unsigned int aNumberOfBits);
+    OSObject *getProperty(const char *aKey) const;
+    void removeProperty(const char *aKey);
+    const char *getName() const;
+
+protected:
+    void free() override;
+
+private:
+    OSDictionary *properties {nullptr};
+    mutable char *name {nullptr};
+};
+
+class IOService : public IORegistryEntry {
+public:
+    virtual bool init(OSDictionary *dictionary = nullptr);
+    virtual IOService *probe(IOService *provider, SInt32 *score);
+    virtual bool start(IOService *provider);
+    virtual void stop(IOService *provider);
+    virtual bool attach(IOService *provider);
+    virtual void detach(IOService *provider);
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice);
+    virtual bool open(IOService *forClient, IOOptionBits options = 0, void *arg = nullptr);
+    virtual void close(IOService *forClient, IOOptionBits options = 0);
+    virtual bool isOpen(const IOService *forClient = nullptr) const;
+
+    void registerService(IOOptionBits options = 0);
+    bool terminate(IOOptionBits options = 0);
+    IOService *getProvider() const { return provider; }
+
+    void PMinit();
+    void PMstop();
+    void joinPMtree(IOService *driver);
+    IOReturn registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates);
+
+protected:
+    void free() override;
+
+private:
+    IOService *provider {nullptr};
+    const IOService *opened_by {nullptr};
+    bool registered {false};
+};
+
+class IOEventSource : public OSObject {
+    friend class IOWorkLoop;
+public:
+    virtual void enable() { enabled = true; }
+    virtual void disable() { enabled = false; }
+    bool isEnabled() const { return enabled; }
+
+protected:
+    OSObject*   owner {nullptr};
+    IOWorkLoop* work_loop {nullptr};
+    bool        enabled {true};
+    bool        running {false};
+
+    // true if there is work at the current virtual time
+    virtual bool checkForWork() { return false; }
+    // run the work found by checkForWork
+    virtual void runWork() {}
+    // deadline after the current virtual time this source waits for, 0 for none
+    virtual UInt64 nextDeadline() { return 0; }
+};
+
+class IOWorkLoop : public OSObject {
+public:
+    typedef IOReturn (*Action)(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+
+    static IOWorkLoop *workLoop();
+
+    IOReturn addEventSource(IOEventSource *newEvent);
+    IOReturn removeEventSource(IOEventSource *toRemove);
+    IOReturn runAction(Action action, OSObject *target, void *arg0 = nullptr, void *arg1 = nullptr, void *arg2 = nullptr, void *arg3 = nullptr);
+
+    // runs one source with work, false if there was none
+    bool runOne();
+    UInt64 nextDeadline();
+
+protected:
+    void free() override;
+
+private:
+    IOEventSource** sources {nullptr};
+    unsigned int    count {0};
+    unsigned int    capacity {0};
+};
+
+class IOCommandGate : public IOEventSource {
+public:
+    typedef IOReturn (*Action)(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+
+    static IOCommandGate *commandGate(OSObject *owner, Action action = nullptr);
+
+    IOReturn runAction(Action action, void *arg0 = nullptr, void *arg1 = nullptr, void *arg2 = nullptr, void *arg3 = nullptr);
+    IOReturn commandSleep(void *event, AbsoluteTime deadline, UInt32 interruptible);
+    void commandWakeup(void *event, bool oneThread = false);
+};
+
+class IOInterruptEventSource;
+typedef void (*IOInterruptEventAction)(OSObject *owner, IOInterruptEventSource *sender, int count);
+
+class IOInterruptEventSource : public IOEventSource {
+public:
+    typedef IOInterruptEventAction Action;
+
+    static IOInterruptEventSource *interruptEventSource(OSObject *owner, Action action, IOService *provider = nullptr, int intIndex = 0);
+
+    void interruptOccurred(void *nub, IOService *nub_provider, int ind);
+
+protected:
+    Action          action {nullptr};
+    unsigned int    produced {0};
+    unsigned int    consumed {0};
+
+    bool checkForWork() override;
+    void runWork() override;
+};
+
+class IOFilterInterruptEventSource;
+typedef bool (*IOFilterInterruptAction)(OSObject *owner, IOFilterInterruptEventSource *sender);
+
+class IOFilterInterruptEventSource : public IOInterruptEventSource {
+public:
+    typedef IOFilterInterruptAction Filter;
+
+    static IOFilterInterruptEventSource *filterInterruptEventSource(OSObject *owner, IOInterruptEventSource::Action action, Filter filter, IOService *provider, int intIndex = 0);
+
+    void signalInterrupt();
+
+private:
+    Filter filter {nullptr};
+};
+
+class IOTimerEventSource : public IOEventSource {
+public:
+    typedef void (*Action)(OSObject *owner, IOTimerEventSource *sender);
+
+    static IOTimerEventSource *timerEventSource(OSObject *owner, Action action = nullptr);
+
+    IOReturn setTimeoutMS(UInt32 ms);
+    IOReturn setTimeoutUS(UInt32 us);
+    void cancelTimeout();
+
+protected:
+    Action  action {nullptr};
+    UInt64  deadline {0};
+    bool    armed {false};
+
+    bool checkForWork() override;
+    void runWork() override;
+    UInt64 nextDeadline() override;
+};
+
+class IOMemoryDescriptor : public OSObject {
+public:
+    virtual IOByteCount getLength() const { return length; }
+
+protected:
+    IOByteCount length {0};
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor {
+public:
+    static IOBufferMemoryDescriptor *inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment = 1);
+    static IOBufferMemoryDescriptor *inTaskWithPhysicalMask(task_t inTask, IOOptionBits options, IOByteCount capacity, UInt64 physicalMask);
+
+    void *getBytesNoCopy() { return buffer; }
+
+protected:
+    void free() override;
+
+private:
+    void *buffer {nullptr};
+};
+
+class IOMemoryMap : public OSObject {
+public:
+    IOVirtualAddress getVirtualAddress() { return address; }
+
+private:
+    IOVirtualAddress address {0};
+};
+
+class IODMACommand : public OSObject {
+public:
+    struct Segment64 {
+        UInt64 fIOVMAddr;
+        UInt64 fLength;
+    };
+    typedef bool (*SegmentFunction)(IODMACommand *target, Segment64 segment, void *segments, UInt32 segmentIndex);
+    enum MappingOptions {
+        kMapped = 0x00000000,
+    };
+
+    static bool OutputHost64(IODMACommand *target, Segment64 segment, void *segments, UInt32 segmentIndex);
+    static IODMACommand *withSpecification(SegmentFunction outSegFunc, UInt8 numAddressBits, UInt64 maxSegmentSize, MappingOptions mappingOptions = kMapped, UInt64 maxTransferSize = 0, UInt32 alignment = 1);
+
+    IOReturn setMemoryDescriptor(IOBufferMemoryDescriptor *mem);
+    IOReturn clearMemoryDescriptor();
+    IOReturn genIOVMSegments(UInt64 *offset, Segment64 *segments, UInt32 *numSegments);
+
+protected:
+    void free() override;
+
+private:
+    IOBufferMemoryDescriptor *memory {nullptr};
+};
+
+#define kIODMACommandOutputHost64   (&IODMACommand::OutputHost64)
+
+/*
+ * Only the bus master and power bits are tracked, BAR0 is never mapped as the driver talks to MEIDeviceModel
+ */
+enum {
+    kPCIPMCSPowerStateD0 = 0x00,
+    kPCIPMCSPowerStateD3 = 0x03,
+};
+
+class IOPCIDevice : public IOService {
+public:
+    bool setMemoryEnable(bool enable);
+    bool setBusMasterEnable(bool enable);
+    IOReturn getInterruptType(int source, int *interruptType);
+    IOReturn enablePCIPowerManagement(IOOptionBits state);
+    UInt32 getDeviceMemoryCount() { return 0; }
+    IOMemoryMap *mapDeviceMemoryWithIndex(unsigned int index) { return nullptr; }
+
+    bool memory_enabled {false};
+    bool bus_master {false};
+    IOOptionBits power_state {kPCIPMCSPowerStateD0};
+};
+
+/* user clients */
+
+#define MACH_PORT_NULL              0
+#define MACH_MSG_TYPE_COPY_SEND     19
+#define MACH_SEND_TIMEOUT           0x00000010
+#define MACH_MSGH_BITS(remote, local)   ((remote) | ((local) << 8))
+
+typedef UInt32 mach_msg_bits_t;
+typedef UInt32 mach_msg_size_t;
+typedef SInt32 mach_msg_id_t;
+typedef UInt32 mach_msg_option_t;
+typedef UInt32 mach_msg_timeout_t;
+typedef kern_return_t mach_msg_return_t;
+
+struct mach_msg_header_t {
+    mach_msg_bits_t msgh_bits;
+    mach_msg_size_t msgh_size;
+    mach_port_t     msgh_remote_port;
+    mach_port_t     msgh_local_port;
+    mach_port_t     msgh_voucher_port;
+    mach_msg_id_t   msgh_id;
+};
+
+mach_msg_return_t mach_msg_send_from_kernel_with_options(mach_msg_header_t *msg, mach_msg_size_t send_size, mach_msg_option_t option, mach_msg_timeout_t timeout_val);
+
+struct IOExternalMethodArguments {
+    UInt32          version;
+    UInt32          selector;
+    const UInt64*   scalarInput;
+    UInt32          scalarInputCount;
+    const void*     structureInput;
+    UInt32          structureInputSize;
+    UInt64*         scalarOutput;
+    UInt32          scalarOutputCount;
+    void*           structureOutput;
+    UInt32          structureOutputSize;
+};
+
+struct IOExternalMethodDispatch;
+
+class IOUserClient : public IOService {
+public:
+    static IOReturn clientHasPrivilege(void *securityToken, const char *privilegeName);
+
+    virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties);
+    virtual IOReturn clientClose();
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+    virtual IOReturn registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon);
+    virtual IOReturn externalMethod(UInt32 selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch = nullptr, OSObject *target = nullptr, void *reference = nullptr);
+};
+
+/* host side control */
+
+struct IOShimStats {
+    UInt64  event_runs;         // event source actions run, the work loop wakeups
+    UInt64  interrupt_runs;
+    UInt64  timer_runs;
+    UInt64  sleeps;             // commandSleep calls
+    UInt64  sleep_timeouts;
+    UInt64  nested_sleeps;      // commandSleep from inside an event source action
+    UInt64  mach_notifications;
+    UInt64  log_lines;
+};
+
+extern IOShimStats  IOShimStatistics;
+extern bool         IOShimVerbose;
+
+UInt64 IOShimNow();
+
+// run event sources with pending work at the current virtual time, returns how many ran
+UInt64 IOShimRunPending();
+
+// move the clock forward by ns, running everything due on the way
+void IOShimAdvance(UInt64 ns);
+
+// services that called registerService and are not stopped, for the tests to find published clients
+unsigned int IOShimRegisteredCount();
+IOService *IOShimRegisteredService(unsigned int index);
+
+#endif /* IOKitShim_h */
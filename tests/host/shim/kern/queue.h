@@ -0,0 +1,66 @@
+//
+//  queue.h
+//  SurfaceTouchScreen host tests
+//
+//  Created by agent on 2026/10/19.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef kern_queue_h
+#define kern_queue_h
+
+/*
+ * The part of xnu's kern/queue.h the driver uses, circular doubly linked lists with the links embedded in the element
+ */
+
+struct queue_entry {
+    struct queue_entry *next;
+    struct queue_entry *prev;
+};
+
+typedef struct queue_entry  *queue_t;
+typedef struct queue_entry  queue_head_t;
+typedef struct queue_entry  queue_chain_t;
+typedef struct queue_entry  *queue_entry_t;
+
+#define queue_init(q)       ((q)->next = (q)->prev = (q))
+#define queue_empty(q)      ((q) == (q)->next)
+#define queue_first(q)      ((q)->next)
+
+static inline void enqueue_tail(queue_t que, queue_entry_t elt) {
+    elt->next = que;
+    elt->prev = que->prev;
+    que->prev->next = elt;
+    que->prev = elt;
+}
+
+static inline void enqueue(queue_t que, queue_entry_t elt) {
+    enqueue_tail(que, elt);
+}
+
+static inline void remqueue(queue_entry_t elt) {
+    elt->next->prev = elt->prev;
+    elt->prev->next = elt->next;
+    elt->next = elt->prev = nullptr;
+}
+
+#define qe_element(qe, type, field) \
+    ((type *)((char *)(qe) - __builtin_offsetof(type, field)))
+
+// elt may be removed from the queue inside the loop
+#define qe_foreach_element_safe(elt, head, field) \
+    for (queue_entry_t _qe_next = ((elt) = qe_element((head)->next, __typeof__(*(elt)), field))->field.next; \
+         &(elt)->field != (head); \
+         (elt) = qe_element(_qe_next, __typeof__(*(elt)), field), _qe_next = _qe_next->next)
+
+#define qe_dequeue_head(head, type, field) ({ \
+    queue_entry_t _qe_head = (head)->next; \
+    type *_qe_elt = nullptr; \
+    if (_qe_head != (head)) { \
+        remqueue(_qe_head); \
+        _qe_elt = qe_element(_qe_head, type, field); \
+    } \
+    _qe_elt; \
+})
+
+#endif /* kern_queue_h */